@@ -0,0 +1,31 @@
+// automatically generated, do not modify
+
+package mbtool.daemon.v2;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+public class CancelTransferRequest extends Table {
+  public static CancelTransferRequest getRootAsCancelTransferRequest(ByteBuffer _bb) { return getRootAsCancelTransferRequest(_bb, new CancelTransferRequest()); }
+  public static CancelTransferRequest getRootAsCancelTransferRequest(ByteBuffer _bb, CancelTransferRequest obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__init(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public CancelTransferRequest __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; return this; }
+
+  public long id() { int o = __offset(4); return o != 0 ? (long)bb.getInt(o + bb_pos) & 0xFFFFFFFFL : 0; }
+
+  public static int createCancelTransferRequest(FlatBufferBuilder builder,
+      long id) {
+    builder.startObject(1);
+    CancelTransferRequest.addId(builder, id);
+    return CancelTransferRequest.endCancelTransferRequest(builder);
+  }
+
+  public static void startCancelTransferRequest(FlatBufferBuilder builder) { builder.startObject(1); }
+  public static void addId(FlatBufferBuilder builder, long id) { builder.addInt(0, (int)(id & 0xFFFFFFFFL), 0); }
+  public static int endCancelTransferRequest(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+};
+
@@ -0,0 +1,31 @@
+// automatically generated, do not modify
+
+package mbtool.daemon.v2;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+public class CancelTransferResponse extends Table {
+  public static CancelTransferResponse getRootAsCancelTransferResponse(ByteBuffer _bb) { return getRootAsCancelTransferResponse(_bb, new CancelTransferResponse()); }
+  public static CancelTransferResponse getRootAsCancelTransferResponse(ByteBuffer _bb, CancelTransferResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__init(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public CancelTransferResponse __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; return this; }
+
+  public boolean success() { int o = __offset(4); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+
+  public static int createCancelTransferResponse(FlatBufferBuilder builder,
+      boolean success) {
+    builder.startObject(1);
+    CancelTransferResponse.addSuccess(builder, success);
+    return CancelTransferResponse.endCancelTransferResponse(builder);
+  }
+
+  public static void startCancelTransferResponse(FlatBufferBuilder builder) { builder.startObject(1); }
+  public static void addSuccess(FlatBufferBuilder builder, boolean success) { builder.addBoolean(0, success, false); }
+  public static int endCancelTransferResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+};
+
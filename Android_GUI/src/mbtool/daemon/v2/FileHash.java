@@ -0,0 +1,37 @@
+// automatically generated, do not modify
+
+package mbtool.daemon.v2;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+public class FileHash extends Table {
+  public static FileHash getRootAsFileHash(ByteBuffer _bb) { return getRootAsFileHash(_bb, new FileHash()); }
+  public static FileHash getRootAsFileHash(ByteBuffer _bb, FileHash obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__init(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public FileHash __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; return this; }
+
+  public String path() { int o = __offset(4); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer pathAsByteBuffer() { return __vector_as_bytebuffer(4, 1); }
+  public String sha512() { int o = __offset(6); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer sha512AsByteBuffer() { return __vector_as_bytebuffer(6, 1); }
+
+  public static int createFileHash(FlatBufferBuilder builder,
+      int path,
+      int sha512) {
+    builder.startObject(2);
+    FileHash.addSha512(builder, sha512);
+    FileHash.addPath(builder, path);
+    return FileHash.endFileHash(builder);
+  }
+
+  public static void startFileHash(FlatBufferBuilder builder) { builder.startObject(2); }
+  public static void addPath(FlatBufferBuilder builder, int pathOffset) { builder.addOffset(0, pathOffset, 0); }
+  public static void addSha512(FlatBufferBuilder builder, int sha512Offset) { builder.addOffset(1, sha512Offset, 0); }
+  public static int endFileHash(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+};
+
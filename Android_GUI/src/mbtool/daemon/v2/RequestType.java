@@ -15,8 +15,10 @@ public class RequestType {
   public static final short CHMOD = 9;
   public static final short LOKI_PATCH = 10;
   public static final short WIPE_ROM = 11;
+  public static final short TRANSFER = 12;
+  public static final short CANCEL_TRANSFER = 13;
 
-  private static final String[] names = { "GET_VERSION", "GET_ROMS_LIST", "GET_BUILTIN_ROM_IDS", "GET_CURRENT_ROM", "SWITCH_ROM", "SET_KERNEL", "REBOOT", "OPEN", "COPY", "CHMOD", "LOKI_PATCH", "WIPE_ROM", };
+  private static final String[] names = { "GET_VERSION", "GET_ROMS_LIST", "GET_BUILTIN_ROM_IDS", "GET_CURRENT_ROM", "SWITCH_ROM", "SET_KERNEL", "REBOOT", "OPEN", "COPY", "CHMOD", "LOKI_PATCH", "WIPE_ROM", "TRANSFER", "CANCEL_TRANSFER", };
 
   public static String name(int e) { return names[e]; }
 };
@@ -35,6 +35,10 @@ public class Response extends Table {
   public ChmodResponse chmodResponse(ChmodResponse obj) { int o = __offset(24); return o != 0 ? obj.__init(__indirect(o + bb_pos), bb) : null; }
   public WipeRomResponse wipeRomResponse() { return wipeRomResponse(new WipeRomResponse()); }
   public WipeRomResponse wipeRomResponse(WipeRomResponse obj) { int o = __offset(28); return o != 0 ? obj.__init(__indirect(o + bb_pos), bb) : null; }
+  public TransferResponse transferResponse() { return transferResponse(new TransferResponse()); }
+  public TransferResponse transferResponse(TransferResponse obj) { int o = __offset(30); return o != 0 ? obj.__init(__indirect(o + bb_pos), bb) : null; }
+  public CancelTransferResponse cancelTransferResponse() { return cancelTransferResponse(new CancelTransferResponse()); }
+  public CancelTransferResponse cancelTransferResponse(CancelTransferResponse obj) { int o = __offset(32); return o != 0 ? obj.__init(__indirect(o + bb_pos), bb) : null; }
 
   public static int createResponse(FlatBufferBuilder builder,
       short type,
@@ -48,8 +52,12 @@ public class Response extends Table {
       int open_response,
       int copy_response,
       int chmod_response,
-      int wipe_rom_response) {
-    builder.startObject(13);
+      int wipe_rom_response,
+      int transfer_response,
+      int cancel_transfer_response) {
+    builder.startObject(15);
+    Response.addCancelTransferResponse(builder, cancel_transfer_response);
+    Response.addTransferResponse(builder, transfer_response);
     Response.addWipeRomResponse(builder, wipe_rom_response);
     Response.addChmodResponse(builder, chmod_response);
     Response.addCopyResponse(builder, copy_response);
@@ -65,7 +73,7 @@ public class Response extends Table {
     return Response.endResponse(builder);
   }
 
-  public static void startResponse(FlatBufferBuilder builder) { builder.startObject(13); }
+  public static void startResponse(FlatBufferBuilder builder) { builder.startObject(15); }
   public static void addType(FlatBufferBuilder builder, short type) { builder.addShort(0, type, 0); }
   public static void addGetVersionResponse(FlatBufferBuilder builder, int getVersionResponseOffset) { builder.addOffset(1, getVersionResponseOffset, 0); }
   public static void addGetRomsListResponse(FlatBufferBuilder builder, int getRomsListResponseOffset) { builder.addOffset(2, getRomsListResponseOffset, 0); }
@@ -78,6 +86,8 @@ public class Response extends Table {
   public static void addCopyResponse(FlatBufferBuilder builder, int copyResponseOffset) { builder.addOffset(9, copyResponseOffset, 0); }
   public static void addChmodResponse(FlatBufferBuilder builder, int chmodResponseOffset) { builder.addOffset(10, chmodResponseOffset, 0); }
   public static void addWipeRomResponse(FlatBufferBuilder builder, int wipeRomResponseOffset) { builder.addOffset(12, wipeRomResponseOffset, 0); }
+  public static void addTransferResponse(FlatBufferBuilder builder, int transferResponseOffset) { builder.addOffset(13, transferResponseOffset, 0); }
+  public static void addCancelTransferResponse(FlatBufferBuilder builder, int cancelTransferResponseOffset) { builder.addOffset(14, cancelTransferResponseOffset, 0); }
   public static int endResponse(FlatBufferBuilder builder) {
     int o = builder.endObject();
     return o;
@@ -0,0 +1,14 @@
+// automatically generated, do not modify
+
+package mbtool.daemon.v2;
+
+public class TransferOperation {
+  public static final short COPY = 0;
+  public static final short HASH = 1;
+  public static final short ARCHIVE = 2;
+
+  private static final String[] names = { "COPY", "HASH", "ARCHIVE", };
+
+  public static String name(int e) { return names[e]; }
+};
+
@@ -0,0 +1,47 @@
+// automatically generated, do not modify
+
+package mbtool.daemon.v2;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+public class TransferProgress extends Table {
+  public static TransferProgress getRootAsTransferProgress(ByteBuffer _bb) { return getRootAsTransferProgress(_bb, new TransferProgress()); }
+  public static TransferProgress getRootAsTransferProgress(ByteBuffer _bb, TransferProgress obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__init(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public TransferProgress __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; return this; }
+
+  public long bytes() { int o = __offset(4); return o != 0 ? bb.getLong(o + bb_pos) : 0; }
+  public long totalBytes() { int o = __offset(6); return o != 0 ? bb.getLong(o + bb_pos) : 0; }
+  public long files() { int o = __offset(8); return o != 0 ? bb.getLong(o + bb_pos) : 0; }
+  public long totalFiles() { int o = __offset(10); return o != 0 ? bb.getLong(o + bb_pos) : 0; }
+  public long bytesPerSecond() { int o = __offset(12); return o != 0 ? bb.getLong(o + bb_pos) : 0; }
+
+  public static int createTransferProgress(FlatBufferBuilder builder,
+      long bytes,
+      long total_bytes,
+      long files,
+      long total_files,
+      long bytes_per_second) {
+    builder.startObject(5);
+    TransferProgress.addBytesPerSecond(builder, bytes_per_second);
+    TransferProgress.addTotalFiles(builder, total_files);
+    TransferProgress.addFiles(builder, files);
+    TransferProgress.addTotalBytes(builder, total_bytes);
+    TransferProgress.addBytes(builder, bytes);
+    return TransferProgress.endTransferProgress(builder);
+  }
+
+  public static void startTransferProgress(FlatBufferBuilder builder) { builder.startObject(5); }
+  public static void addBytes(FlatBufferBuilder builder, long bytes) { builder.addLong(0, bytes, 0); }
+  public static void addTotalBytes(FlatBufferBuilder builder, long totalBytes) { builder.addLong(1, totalBytes, 0); }
+  public static void addFiles(FlatBufferBuilder builder, long files) { builder.addLong(2, files, 0); }
+  public static void addTotalFiles(FlatBufferBuilder builder, long totalFiles) { builder.addLong(3, totalFiles, 0); }
+  public static void addBytesPerSecond(FlatBufferBuilder builder, long bytesPerSecond) { builder.addLong(4, bytesPerSecond, 0); }
+  public static int endTransferProgress(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+};
+
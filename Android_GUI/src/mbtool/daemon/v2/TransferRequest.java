@@ -0,0 +1,47 @@
+// automatically generated, do not modify
+
+package mbtool.daemon.v2;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+public class TransferRequest extends Table {
+  public static TransferRequest getRootAsTransferRequest(ByteBuffer _bb) { return getRootAsTransferRequest(_bb, new TransferRequest()); }
+  public static TransferRequest getRootAsTransferRequest(ByteBuffer _bb, TransferRequest obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__init(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public TransferRequest __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; return this; }
+
+  public short operation() { int o = __offset(4); return o != 0 ? bb.getShort(o + bb_pos) : 0; }
+  public String sources(int j) { int o = __offset(6); return o != 0 ? __string(__vector(o) + j * 4) : null; }
+  public int sourcesLength() { int o = __offset(6); return o != 0 ? __vector_len(o) : 0; }
+  public String target() { int o = __offset(8); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer targetAsByteBuffer() { return __vector_as_bytebuffer(8, 1); }
+  public long progressIntervalMs() { int o = __offset(10); return o != 0 ? (long)bb.getInt(o + bb_pos) & 0xFFFFFFFFL : 0; }
+
+  public static int createTransferRequest(FlatBufferBuilder builder,
+      short operation,
+      int sources,
+      int target,
+      long progress_interval_ms) {
+    builder.startObject(4);
+    TransferRequest.addProgressIntervalMs(builder, progress_interval_ms);
+    TransferRequest.addTarget(builder, target);
+    TransferRequest.addSources(builder, sources);
+    TransferRequest.addOperation(builder, operation);
+    return TransferRequest.endTransferRequest(builder);
+  }
+
+  public static void startTransferRequest(FlatBufferBuilder builder) { builder.startObject(4); }
+  public static void addOperation(FlatBufferBuilder builder, short operation) { builder.addShort(0, operation, 0); }
+  public static void addSources(FlatBufferBuilder builder, int sourcesOffset) { builder.addOffset(1, sourcesOffset, 0); }
+  public static int createSourcesVector(FlatBufferBuilder builder, int[] data) { builder.startVector(4, data.length, 4); for (int i = data.length - 1; i >= 0; i--) builder.addOffset(data[i]); return builder.endVector(); }
+  public static void startSourcesVector(FlatBufferBuilder builder, int numElems) { builder.startVector(4, numElems, 4); }
+  public static void addTarget(FlatBufferBuilder builder, int targetOffset) { builder.addOffset(2, targetOffset, 0); }
+  public static void addProgressIntervalMs(FlatBufferBuilder builder, long progressIntervalMs) { builder.addInt(3, (int)(progressIntervalMs & 0xFFFFFFFFL), 0); }
+  public static int endTransferRequest(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+};
+
@@ -0,0 +1,61 @@
+// automatically generated, do not modify
+
+package mbtool.daemon.v2;
+
+import java.nio.*;
+import java.lang.*;
+import java.util.*;
+import com.google.flatbuffers.*;
+
+public class TransferResponse extends Table {
+  public static TransferResponse getRootAsTransferResponse(ByteBuffer _bb) { return getRootAsTransferResponse(_bb, new TransferResponse()); }
+  public static TransferResponse getRootAsTransferResponse(ByteBuffer _bb, TransferResponse obj) { _bb.order(ByteOrder.LITTLE_ENDIAN); return (obj.__init(_bb.getInt(_bb.position()) + _bb.position(), _bb)); }
+  public TransferResponse __init(int _i, ByteBuffer _bb) { bb_pos = _i; bb = _bb; return this; }
+
+  public long id() { int o = __offset(4); return o != 0 ? (long)bb.getInt(o + bb_pos) & 0xFFFFFFFFL : 0; }
+  public boolean finished() { int o = __offset(6); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public boolean success() { int o = __offset(8); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public boolean cancelled() { int o = __offset(10); return o != 0 ? 0!=bb.get(o + bb_pos) : false; }
+  public String errorMsg() { int o = __offset(12); return o != 0 ? __string(o + bb_pos) : null; }
+  public ByteBuffer errorMsgAsByteBuffer() { return __vector_as_bytebuffer(12, 1); }
+  public TransferProgress progress() { return progress(new TransferProgress()); }
+  public TransferProgress progress(TransferProgress obj) { int o = __offset(14); return o != 0 ? obj.__init(__indirect(o + bb_pos), bb) : null; }
+  public FileHash hashes(int j) { return hashes(new FileHash(), j); }
+  public FileHash hashes(FileHash obj, int j) { int o = __offset(16); return o != 0 ? obj.__init(__indirect(__vector(o) + j * 4), bb) : null; }
+  public int hashesLength() { int o = __offset(16); return o != 0 ? __vector_len(o) : 0; }
+
+  public static int createTransferResponse(FlatBufferBuilder builder,
+      long id,
+      boolean finished,
+      boolean success,
+      boolean cancelled,
+      int error_msg,
+      int progress,
+      int hashes) {
+    builder.startObject(7);
+    TransferResponse.addHashes(builder, hashes);
+    TransferResponse.addProgress(builder, progress);
+    TransferResponse.addErrorMsg(builder, error_msg);
+    TransferResponse.addId(builder, id);
+    TransferResponse.addCancelled(builder, cancelled);
+    TransferResponse.addSuccess(builder, success);
+    TransferResponse.addFinished(builder, finished);
+    return TransferResponse.endTransferResponse(builder);
+  }
+
+  public static void startTransferResponse(FlatBufferBuilder builder) { builder.startObject(7); }
+  public static void addId(FlatBufferBuilder builder, long id) { builder.addInt(0, (int)(id & 0xFFFFFFFFL), 0); }
+  public static void addFinished(FlatBufferBuilder builder, boolean finished) { builder.addBoolean(1, finished, false); }
+  public static void addSuccess(FlatBufferBuilder builder, boolean success) { builder.addBoolean(2, success, false); }
+  public static void addCancelled(FlatBufferBuilder builder, boolean cancelled) { builder.addBoolean(3, cancelled, false); }
+  public static void addErrorMsg(FlatBufferBuilder builder, int errorMsgOffset) { builder.addOffset(4, errorMsgOffset, 0); }
+  public static void addProgress(FlatBufferBuilder builder, int progressOffset) { builder.addOffset(5, progressOffset, 0); }
+  public static void addHashes(FlatBufferBuilder builder, int hashesOffset) { builder.addOffset(6, hashesOffset, 0); }
+  public static int createHashesVector(FlatBufferBuilder builder, int[] data) { builder.startVector(4, data.length, 4); for (int i = data.length - 1; i >= 0; i--) builder.addOffset(data[i]); return builder.endVector(); }
+  public static void startHashesVector(FlatBufferBuilder builder, int numElems) { builder.startVector(4, numElems, 4); }
+  public static int endTransferResponse(FlatBufferBuilder builder) {
+    int o = builder.endObject();
+    return o;
+  }
+};
+
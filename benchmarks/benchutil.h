@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+
+#include <libmbp/cpiofile.h>
+#include <libmbp/logging.h>
+
+
+namespace bench
+{
+
+/*!
+ * \brief Run \a fn \a iterations times and print the fastest and mean times
+ *
+ * \param name Label for the result line
+ * \param iterations Number of timed runs (after one untimed warm-up run)
+ * \param bytes Bytes processed per run for computing the throughput (0 to
+ *              not print a throughput)
+ * \param fn Function to time
+ *
+ * \return Fastest run in milliseconds
+ */
+inline double run(const std::string &name, unsigned int iterations,
+                  double bytes, const std::function<void()> &fn)
+{
+    typedef std::chrono::steady_clock clock;
+
+    fn();
+
+    std::vector<double> times;
+    times.reserve(iterations);
+
+    for (unsigned int i = 0; i < iterations; ++i) {
+        auto start = clock::now();
+        fn();
+        auto end = clock::now();
+        times.push_back(std::chrono::duration<double, std::milli>(
+                end - start).count());
+    }
+
+    double min = *std::min_element(times.begin(), times.end());
+    double mean = 0;
+    for (double t : times) {
+        mean += t;
+    }
+    mean /= times.size();
+
+    std::printf("%-40s min %10.2f ms  mean %10.2f ms", name.c_str(), min, mean);
+    if (bytes > 0 && min > 0) {
+        std::printf("  %8.1f MiB/s", bytes / (1024.0 * 1024.0) / (min / 1000.0));
+    }
+    std::printf("\n");
+
+    return min;
+}
+
+/*!
+ * \brief Only print warnings and errors from libmbp
+ *
+ * Debug messages are logged for every boot image load and patched file,
+ * which would otherwise flood the output of timed loops.
+ */
+inline void quietLogs()
+{
+    mbp::setLogCallback([](mbp::LogLevel prio, const std::string &msg) {
+        if (prio == mbp::LogLevel::Warning || prio == mbp::LogLevel::Error) {
+            std::fprintf(stderr, "%s\n", msg.c_str());
+        }
+    });
+}
+
+inline bool readFile(const std::string &path, std::vector<unsigned char> *out)
+{
+    std::FILE *fp = std::fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+
+    out->clear();
+
+    unsigned char buf[65536];
+    std::size_t n;
+    while ((n = std::fread(buf, 1, sizeof(buf), fp)) > 0) {
+        out->insert(out->end(), buf, buf + n);
+    }
+
+    bool ret = !std::ferror(fp);
+    std::fclose(fp);
+    return ret;
+}
+
+/*!
+ * \brief Create an uncompressed ramdisk with \a entries files
+ *
+ * The files are spread over directories and have init script-like contents
+ * of varying sizes, so the archive compresses roughly like a real ramdisk.
+ */
+inline bool makeRamdisk(unsigned int entries, std::vector<unsigned char> *out)
+{
+    mbp::CpioFile cpio;
+
+    for (unsigned int i = 0; i < entries; ++i) {
+        char name[64];
+        std::snprintf(name, sizeof(name), "dir%03u/file%05u.rc", i % 100, i);
+
+        std::string contents;
+        unsigned int lines = 4 + (i * 7919) % 60;
+        for (unsigned int j = 0; j < lines; ++j) {
+            char line[128];
+            std::snprintf(line, sizeof(line),
+                          "service svc%u_%u /system/bin/daemon%u --flag=%u\n"
+                          "    class main\n",
+                          i, j, (i + j) % 37, (i * j) % 1009);
+            contents += line;
+        }
+
+        if (!cpio.addFileC(reinterpret_cast<const unsigned char *>(
+                contents.data()), contents.size(), name, 0644)) {
+            return false;
+        }
+    }
+
+    return cpio.createData(out);
+}
+
+}
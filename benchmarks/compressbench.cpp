@@ -0,0 +1,308 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares the parallel gzip and LZ4 legacy compressors used for ramdisks
+// with the single-threaded libarchive filters that CpioFile used before. The
+// output of the parallel compressors is decompressed and checked against the
+// input.
+
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include <archive.h>
+#include <archive_entry.h>
+#include <lz4.h>
+#include <zlib.h>
+
+#include <libmbp/private/compressutils.h>
+
+#include "benchutil.h"
+
+
+#define LZ4_LEGACY_MAGIC        0x184C2102
+#define LZ4_LEGACY_BLOCK_SIZE   (8 * 1024 * 1024)
+
+static const char Usage[] =
+    "Usage: compressbench [options] [uncompressed input file]\n"
+    "\n"
+    "Options:\n"
+    "  -n, --entries <count>     Entries in the generated ramdisk (default: 5000)\n"
+    "  -i, --iterations <count>  Timed runs per compressor (default: 5)\n"
+    "  -h, --help                Show this help\n"
+    "\n"
+    "If no input file is given, a ramdisk is generated.\n";
+
+
+static bool appendCb(const unsigned char *data, std::size_t size,
+                     void *userData)
+{
+    auto out = static_cast<std::vector<unsigned char> *>(userData);
+    out->insert(out->end(), data, data + size);
+    return true;
+}
+
+static la_ssize_t libarchiveWriteCb(archive *a, void *userData,
+                                    const void *buf, size_t size)
+{
+    (void) a;
+    auto out = static_cast<std::vector<unsigned char> *>(userData);
+    auto data = static_cast<const unsigned char *>(buf);
+    out->insert(out->end(), data, data + size);
+    return size;
+}
+
+/*!
+ * \brief Compress with a libarchive filter on a single thread
+ */
+static bool libarchiveCompress(const std::vector<unsigned char> &in, bool lz4,
+                               std::vector<unsigned char> *out)
+{
+    out->clear();
+
+    archive *a = archive_write_new();
+    archive_write_set_format_raw(a);
+    if (lz4) {
+        archive_write_add_filter_lz4(a);
+    } else {
+        archive_write_add_filter_gzip(a);
+        archive_write_set_filter_option(a, nullptr, "compression-level", "9");
+    }
+    archive_write_set_bytes_per_block(a, 512);
+
+    archive_entry *entry = archive_entry_new();
+    archive_entry_set_pathname(entry, "data");
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_size(entry, in.size());
+
+    bool ret = archive_write_open(a, out, nullptr, &libarchiveWriteCb,
+                                  nullptr) == ARCHIVE_OK
+            && archive_write_header(a, entry) == ARCHIVE_OK
+            && archive_write_data(a, in.data(), in.size())
+                    == static_cast<la_ssize_t>(in.size())
+            && archive_write_close(a) == ARCHIVE_OK;
+
+    archive_entry_free(entry);
+    archive_write_free(a);
+
+    return ret;
+}
+
+static bool gunzip(const std::vector<unsigned char> &in,
+                   std::vector<unsigned char> *out)
+{
+    out->clear();
+
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+        return false;
+    }
+
+    zs.next_in = const_cast<unsigned char *>(in.data());
+    zs.avail_in = in.size();
+
+    unsigned char buf[65536];
+    int ret;
+    do {
+        zs.next_out = buf;
+        zs.avail_out = sizeof(buf);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            inflateEnd(&zs);
+            return false;
+        }
+        out->insert(out->end(), buf, buf + sizeof(buf) - zs.avail_out);
+    } while (ret != Z_STREAM_END);
+
+    inflateEnd(&zs);
+    return true;
+}
+
+static uint32_t readLe32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16)
+            | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static bool lz4LegacyDecompress(const std::vector<unsigned char> &in,
+                                std::vector<unsigned char> *out)
+{
+    out->clear();
+
+    if (in.size() < 4 || readLe32(in.data()) != LZ4_LEGACY_MAGIC) {
+        return false;
+    }
+
+    std::vector<char> block(LZ4_LEGACY_BLOCK_SIZE);
+    std::size_t pos = 4;
+
+    // The output may be followed by padding
+    while (pos + 4 <= in.size()) {
+        uint32_t size = readLe32(in.data() + pos);
+        pos += 4;
+        if (size == 0 || size > in.size() - pos) {
+            break;
+        }
+
+        int n = LZ4_decompress_safe(
+                reinterpret_cast<const char *>(in.data() + pos), block.data(),
+                size, block.size());
+        if (n < 0) {
+            return false;
+        }
+
+        out->insert(out->end(), block.data(), block.data() + n);
+        pos += size;
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int entries = 5000;
+    unsigned int iterations = 5;
+
+    static struct option longOptions[] = {
+        {"entries",    required_argument, 0, 'n'},
+        {"iterations", required_argument, 0, 'i'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int longIndex = 0;
+
+    while ((opt = getopt_long(argc, argv, "n:i:h", longOptions,
+                              &longIndex)) != -1) {
+        switch (opt) {
+        case 'n':
+            entries = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'i':
+            iterations = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'h':
+            std::fputs(Usage, stdout);
+            return EXIT_SUCCESS;
+        default:
+            std::fputs(Usage, stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind > 1 || iterations == 0) {
+        std::fputs(Usage, stderr);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<unsigned char> data;
+
+    if (optind < argc) {
+        if (!bench::readFile(argv[optind], &data)) {
+            std::fprintf(stderr, "%s: Failed to read file\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+    } else if (!bench::makeRamdisk(entries, &data)) {
+        std::fprintf(stderr, "Failed to generate ramdisk\n");
+        return EXIT_FAILURE;
+    }
+
+    std::printf("Input: %zu bytes\n\n", data.size());
+
+    std::vector<unsigned int> threadCounts{ 1, 2, 4 };
+    unsigned int maxThreads = mbp::CompressUtils::defaultThreads();
+    if (maxThreads > 4) {
+        threadCounts.push_back(maxThreads);
+    }
+
+    std::vector<unsigned char> out;
+    std::vector<unsigned char> check;
+    bool ok = true;
+
+    auto ratio = [&]{
+        return 100.0 * out.size() / data.size();
+    };
+
+    // gzip
+
+    bench::run("libarchive gzip -9", iterations, data.size(), [&]{
+        ok &= libarchiveCompress(data, false, &out);
+    });
+    std::printf("%40s %.1f%%\n", "size:", ratio());
+
+    for (int level : { 9, 6, 1 }) {
+        for (unsigned int threads : threadCounts) {
+            std::string name = "parallel gzip -" + std::to_string(level)
+                    + ", " + std::to_string(threads) + " threads";
+
+            bench::run(name, iterations, data.size(), [&]{
+                out.clear();
+                ok &= mbp::CompressUtils::gzipParallel(
+                        data.data(), data.size(), level, threads,
+                        &appendCb, &out);
+            });
+            std::printf("%40s %.1f%%\n", "size:", ratio());
+
+            if (!gunzip(out, &check) || check != data) {
+                std::fprintf(stderr, "%s: Output does not decompress to the "
+                             "input\n", name.c_str());
+                ok = false;
+            }
+        }
+    }
+
+    // LZ4
+
+    bench::run("libarchive lz4", iterations, data.size(), [&]{
+        ok &= libarchiveCompress(data, true, &out);
+    });
+    std::printf("%40s %.1f%%\n", "size:", ratio());
+
+    for (unsigned int threads : threadCounts) {
+        std::string name = "parallel lz4 legacy, "
+                + std::to_string(threads) + " threads";
+
+        bench::run(name, iterations, data.size(), [&]{
+            out.clear();
+            ok &= mbp::CompressUtils::lz4LegacyParallel(
+                    data.data(), data.size(), 1, threads, &appendCb, &out);
+        });
+        std::printf("%40s %.1f%%\n", "size:", ratio());
+
+        if (!lz4LegacyDecompress(out, &check) || check != data) {
+            std::fprintf(stderr, "%s: Output does not decompress to the "
+                         "input\n", name.c_str());
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        std::fprintf(stderr, "A compressor failed\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
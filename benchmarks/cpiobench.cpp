@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Times loading, patching, and rebuilding a large ramdisk with CpioFile. The
+// patch step does what the ramdisk patchers do, but for every entry: it looks
+// up and reads each file, rewrites every tenth file, renames and removes a
+// few, and adds new files and symlinks.
+
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <getopt.h>
+
+#include <libmbp/cpiofile.h>
+
+#include "benchutil.h"
+
+
+static const char Usage[] =
+    "Usage: cpiobench [options] [uncompressed cpio file]\n"
+    "\n"
+    "Options:\n"
+    "  -n, --entries <count>     Entries in the generated ramdisk (default: 5000)\n"
+    "  -i, --iterations <count>  Timed runs per step (default: 10)\n"
+    "  -h, --help                Show this help\n"
+    "\n"
+    "If no cpio file is given, a ramdisk is generated.\n";
+
+
+static bool patch(mbp::CpioFile *cpio, const std::vector<std::string> &names)
+{
+    std::vector<unsigned char> contents;
+
+    for (std::size_t i = 0; i < names.size(); ++i) {
+        const std::string &name = names[i];
+
+        if (!cpio->exists(name)) {
+            return false;
+        }
+
+        if (i % 10 == 0) {
+            if (!cpio->contents(name, &contents)) {
+                return false;
+            }
+            static const char Extra[] = "\n# patched\n";
+            contents.insert(contents.end(), Extra, Extra + sizeof(Extra) - 1);
+            if (!cpio->setContents(name, std::move(contents))) {
+                return false;
+            }
+        } else {
+            const unsigned char *data;
+            std::size_t size;
+            if (!cpio->contentsC(name, &data, &size)) {
+                return false;
+            }
+        }
+
+        if (i % 100 == 1) {
+            cpio->rename(name, name + ".orig");
+        } else if (i % 100 == 2) {
+            cpio->remove(name);
+        }
+    }
+
+    static const unsigned char Data[] = "#!/sbin/sh\nexit 0\n";
+
+    for (std::size_t i = 0; i < names.size() / 100; ++i) {
+        std::string name("sbin/added" + std::to_string(i));
+        if (!cpio->addFileC(Data, sizeof(Data) - 1, name, 0750)
+                || !cpio->addSymlink(name, name + ".link")) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int entries = 5000;
+    unsigned int iterations = 10;
+
+    static struct option longOptions[] = {
+        {"entries",    required_argument, 0, 'n'},
+        {"iterations", required_argument, 0, 'i'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int longIndex = 0;
+
+    while ((opt = getopt_long(argc, argv, "n:i:h", longOptions,
+                              &longIndex)) != -1) {
+        switch (opt) {
+        case 'n':
+            entries = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'i':
+            iterations = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'h':
+            std::fputs(Usage, stdout);
+            return EXIT_SUCCESS;
+        default:
+            std::fputs(Usage, stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind > 1 || iterations == 0) {
+        std::fputs(Usage, stderr);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<unsigned char> data;
+
+    if (optind < argc) {
+        if (!bench::readFile(argv[optind], &data)) {
+            std::fprintf(stderr, "%s: Failed to read file\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+    } else if (!bench::makeRamdisk(entries, &data)) {
+        std::fprintf(stderr, "Failed to generate ramdisk\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> names;
+    {
+        mbp::CpioFile cpio;
+        if (!cpio.load(data)) {
+            std::fprintf(stderr, "Failed to load ramdisk\n");
+            return EXIT_FAILURE;
+        }
+        names = cpio.filenames();
+    }
+
+    std::printf("Ramdisk: %zu entries, %zu bytes\n\n", names.size(), data.size());
+
+    bool ok = true;
+
+    bench::run("load", iterations, data.size(), [&]{
+        mbp::CpioFile cpio;
+        ok &= cpio.load(data);
+    });
+
+    bench::run("load + patch", iterations, 0, [&]{
+        mbp::CpioFile cpio;
+        ok &= cpio.load(data) && patch(&cpio, names);
+    });
+
+    bench::run("load + patch + createData", iterations, data.size(), [&]{
+        mbp::CpioFile cpio;
+        std::vector<unsigned char> out;
+        ok &= cpio.load(data) && patch(&cpio, names) && cpio.createData(&out);
+    });
+
+    if (!ok) {
+        std::fprintf(stderr, "A CpioFile operation failed\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
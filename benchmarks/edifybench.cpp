@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Times tokenizing and patching a large updater-script with StandardPatcher.
+// The generated script mixes the calls that StandardPatcher rewrites
+// (mount(), unmount(), format(), run_program(), delete_recursive(),
+// package_extract_file(), ...) with ones that it leaves alone.
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include <libmbp/device.h>
+#include <libmbp/fileinfo.h>
+#include <libmbp/patcherconfig.h>
+#include <libmbp/autopatchers/standardpatcher.h>
+#include <libmbp/edify/tokenizer.h>
+
+#include "benchutil.h"
+
+
+static const char Usage[] =
+    "Usage: edifybench [options] [updater-script]\n"
+    "\n"
+    "Options:\n"
+    "  -s, --size <MiB>          Size of the generated script (default: 5)\n"
+    "  -i, --iterations <count>  Timed runs per step (default: 10)\n"
+    "  -h, --help                Show this help\n"
+    "\n"
+    "If no updater-script is given, one is generated.\n";
+
+#define SYSTEM_DEV "/dev/block/platform/msm_sdcc.1/by-name/system"
+
+static const char *ScriptLines[] = {
+    "mount(\"ext4\", \"EMMC\", \"" SYSTEM_DEV "\", \"/system\");",
+    "mount(\"ext4\", \"EMMC\", \"mmcblk0p23\", \"/cache\");",
+    "unmount(\"/system\");",
+    "unmount(\"/data\");",
+    "format(\"ext4\", \"EMMC\", \"/dev/block/mmcblk0p22\", \"0\", \"/system\");",
+    "run_program(\"/sbin/busybox\", \"mount\", \"/system\");",
+    "run_program(\"/sbin/busybox\", \"umount\", \"/cache\");",
+    "run_program(\"/tmp/mke2fs\", \"-t\", \"ext4\", \"/dev/block/mmcblk0p24\");",
+    "delete_recursive(\"/system\");",
+    "delete_recursive(\"/data/app\");",
+    "ifelse(is_mounted(\"/system\"), unmount(\"/system\"));",
+    "block_image_update(\"" SYSTEM_DEV "\", "
+        "package_extract_file(\"system.transfer.list\"), "
+        "\"system.new.dat\", \"system.patch.dat\");",
+    "package_extract_file(\"boot.img\", \"/dev/block/mmcblk0p7\");",
+    "ui_print(\"Installing \\\"system\\\" \\x41...\");",
+    "set_perm_recursive(0, 0, 0755, 0644, \"/system\");",
+    "assert(getprop(\"ro.product.device\") == \"hammerhead\" || "
+        "abort(\"This package is for hammerhead\"));",
+    "show_progress(0.500000, 0);",
+    "package_extract_dir(\"system\", \"/system\");",
+    "symlink(\"toolbox\", \"/system/bin/ls\", \"/system/bin/ps\");",
+    "# comment mentioning mount(\"/system\")",
+};
+
+static const std::size_t ScriptLineCount =
+        sizeof(ScriptLines) / sizeof(ScriptLines[0]);
+
+
+static void makeScript(std::size_t size, std::vector<unsigned char> *out)
+{
+    out->clear();
+
+    uint32_t state = 0x12345678;
+    while (out->size() < size) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+
+        const char *line = ScriptLines[state % ScriptLineCount];
+        out->insert(out->end(), line, line + std::strlen(line));
+        out->push_back('\n');
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::size_t sizeMiB = 5;
+    unsigned int iterations = 10;
+
+    static struct option longOptions[] = {
+        {"size",       required_argument, 0, 's'},
+        {"iterations", required_argument, 0, 'i'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int longIndex = 0;
+
+    while ((opt = getopt_long(argc, argv, "s:i:h", longOptions,
+                              &longIndex)) != -1) {
+        switch (opt) {
+        case 's':
+            sizeMiB = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'i':
+            iterations = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'h':
+            std::fputs(Usage, stdout);
+            return EXIT_SUCCESS;
+        default:
+            std::fputs(Usage, stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind > 1 || sizeMiB == 0 || iterations == 0) {
+        std::fputs(Usage, stderr);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<unsigned char> script;
+
+    if (optind < argc) {
+        if (!bench::readFile(argv[optind], &script)) {
+            std::fprintf(stderr, "%s: Failed to read file\n", argv[optind]);
+            return EXIT_FAILURE;
+        }
+    } else {
+        makeScript(sizeMiB * 1024 * 1024, &script);
+    }
+
+    bench::quietLogs();
+
+    mbp::Device device;
+    device.setSystemBlockDevs({ SYSTEM_DEV, "mmcblk0p22" });
+    device.setCacheBlockDevs({ "mmcblk0p23" });
+    device.setDataBlockDevs({ "mmcblk0p24" });
+
+    mbp::FileInfo info;
+    info.setDevice(&device);
+
+    mbp::PatcherConfig pc;
+    mbp::StandardPatcher patcher(&pc, &info);
+
+    const char *data = reinterpret_cast<const char *>(script.data());
+    std::vector<mbp::EdifyToken> tokens;
+    std::vector<std::size_t> pairs;
+
+    if (!mbp::EdifyTokenizer::tokenize(data, script.size(), &tokens)) {
+        std::fprintf(stderr, "Failed to tokenize script\n");
+        return EXIT_FAILURE;
+    }
+
+    std::printf("Script: %zu bytes, %zu tokens\n\n",
+                script.size(), tokens.size());
+
+    bool ok = true;
+
+    bench::run("tokenize", iterations, script.size(), [&]{
+        ok &= mbp::EdifyTokenizer::tokenize(data, script.size(), &tokens);
+    });
+
+    bench::run("tokenize + matchParens", iterations, script.size(), [&]{
+        ok &= mbp::EdifyTokenizer::tokenize(data, script.size(), &tokens);
+        mbp::EdifyTokenizer::matchParens(tokens, &pairs);
+    });
+
+    // patchFile() modifies the script in place, so each run patches a copy
+    bench::run("StandardPatcher::patchFile", iterations, script.size(), [&]{
+        std::vector<unsigned char> contents(script);
+        ok &= patcher.patchFile(mbp::StandardPatcher::UpdaterScript,
+                                &contents);
+    });
+
+    if (!ok) {
+        std::fprintf(stderr, "Failed to patch script\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
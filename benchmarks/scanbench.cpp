@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Times ByteScan against the per-offset memcmp() loops it replaced, and
+// BootImage::isValid() and load() over a corpus of boot images. The scans run
+// over a pseudo-random buffer with the pattern placed at the end, so the whole
+// buffer is searched, like the aboot signature search in LokiPatcher.
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <getopt.h>
+
+#include <libmbp/bootimage.h>
+#include <libmbp/private/bytescan.h>
+
+#include "benchutil.h"
+
+
+static const char Usage[] =
+    "Usage: scanbench [options] [boot image...]\n"
+    "\n"
+    "Options:\n"
+    "  -s, --size <MiB>          Size of the buffer to scan (default: 16)\n"
+    "  -i, --iterations <count>  Timed runs per step (default: 10)\n"
+    "  -h, --help                Show this help\n"
+    "\n"
+    "If no boot images are given, an Android and a Bump image are generated.\n";
+
+// The aboot signatures that LokiPatcher searches for
+static const mbp::ByteScan::Pattern AbootPatterns[] = {
+    { "\xf0\xb5\x8f\xb0\x06\x46\xf0\xf7", 8 },
+    { "\xf0\xb5\x8f\xb0\x07\x46\xf0\xf7", 8 },
+    { "\x2d\xe9\xf0\x41\x86\xb0\xf1\xf7", 8 },
+    { "\x2d\xe9\xf0\x4f\xad\xf5\xc6\x6d", 8 },
+    { "\x2d\xe9\xf0\x4f\xad\xf5\x21\x7d", 8 },
+};
+
+static const std::size_t AbootPatternCount =
+        sizeof(AbootPatterns) / sizeof(AbootPatterns[0]);
+
+
+/*!
+ * \brief Search by running memcmp() for every pattern at every offset
+ */
+static std::size_t naiveFindAny(const unsigned char *data, std::size_t size,
+                                const mbp::ByteScan::Pattern *patterns,
+                                std::size_t count)
+{
+    for (std::size_t offset = 0; offset < size; ++offset) {
+        for (std::size_t i = 0; i < count; ++i) {
+            if (patterns[i].size <= size - offset && std::memcmp(
+                    data + offset, patterns[i].data, patterns[i].size) == 0) {
+                return offset;
+            }
+        }
+    }
+    return mbp::ByteScan::npos;
+}
+
+static void fillRandom(std::vector<unsigned char> *data)
+{
+    uint32_t state = 0x12345678;
+    for (unsigned char &c : *data) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        c = state;
+    }
+}
+
+static bool makeBootImage(mbp::BootImage::Type type,
+                          std::vector<unsigned char> *out)
+{
+    std::vector<unsigned char> kernel(8 * 1024 * 1024);
+    std::vector<unsigned char> ramdisk(4 * 1024 * 1024);
+    fillRandom(&kernel);
+    fillRandom(&ramdisk);
+
+    mbp::BootImage bi;
+    bi.setTargetType(type);
+    bi.setPageSize(2048);
+    bi.setKernelImage(std::move(kernel));
+    bi.setRamdiskImage(std::move(ramdisk));
+    return bi.create(out);
+}
+
+int main(int argc, char *argv[])
+{
+    std::size_t sizeMiB = 16;
+    unsigned int iterations = 10;
+
+    static struct option longOptions[] = {
+        {"size",       required_argument, 0, 's'},
+        {"iterations", required_argument, 0, 'i'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int longIndex = 0;
+
+    while ((opt = getopt_long(argc, argv, "s:i:h", longOptions,
+                              &longIndex)) != -1) {
+        switch (opt) {
+        case 's':
+            sizeMiB = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'i':
+            iterations = std::strtoul(optarg, nullptr, 10);
+            break;
+        case 'h':
+            std::fputs(Usage, stdout);
+            return EXIT_SUCCESS;
+        default:
+            std::fputs(Usage, stderr);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (sizeMiB == 0 || iterations == 0) {
+        std::fputs(Usage, stderr);
+        return EXIT_FAILURE;
+    }
+
+    bench::quietLogs();
+
+    bool ok = true;
+
+    // Pattern scanning
+
+    std::vector<unsigned char> buf(sizeMiB * 1024 * 1024);
+    fillRandom(&buf);
+
+    const mbp::ByteScan::Pattern &last = AbootPatterns[AbootPatternCount - 1];
+    std::size_t expected = buf.size() - last.size;
+    std::memcpy(buf.data() + expected, last.data, last.size);
+
+    std::printf("Scan buffer: %zu bytes\n\n", buf.size());
+
+    bench::run("naive memcmp, 1 pattern", iterations, buf.size(), [&]{
+        ok &= naiveFindAny(buf.data(), buf.size(), &last, 1) == expected;
+    });
+
+    bench::run("ByteScan::find", iterations, buf.size(), [&]{
+        ok &= mbp::ByteScan::find(buf.data(), buf.size(), last.data,
+                                  last.size) == expected;
+    });
+
+    bench::run("naive memcmp, 5 patterns", iterations, buf.size(), [&]{
+        ok &= naiveFindAny(buf.data(), buf.size(), AbootPatterns,
+                           AbootPatternCount) == expected;
+    });
+
+    bench::run("ByteScan::findAny, 5 patterns", iterations, buf.size(), [&]{
+        std::size_t which;
+        ok &= mbp::ByteScan::findAny(buf.data(), buf.size(), AbootPatterns,
+                                     AbootPatternCount, &which) == expected
+                && which == AbootPatternCount - 1;
+    });
+
+    if (!ok) {
+        std::fprintf(stderr, "A scan returned the wrong offset\n");
+        return EXIT_FAILURE;
+    }
+
+    // Boot image detection and loading
+
+    std::vector<std::pair<std::string, std::vector<unsigned char>>> images;
+
+    for (int i = optind; i < argc; ++i) {
+        std::vector<unsigned char> data;
+        if (!bench::readFile(argv[i], &data)) {
+            std::fprintf(stderr, "%s: Failed to read file\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+        images.emplace_back(argv[i], std::move(data));
+    }
+
+    if (images.empty()) {
+        images.resize(2);
+        images[0].first = "generated android";
+        images[1].first = "generated bump";
+        if (!makeBootImage(mbp::BootImage::Type::Android, &images[0].second)
+                || !makeBootImage(mbp::BootImage::Type::Bump,
+                                  &images[1].second)) {
+            std::fprintf(stderr, "Failed to generate boot images\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::printf("\n");
+
+    for (auto const &image : images) {
+        const std::vector<unsigned char> &data = image.second;
+
+        if (!mbp::BootImage::isValid(data.data(), data.size())) {
+            std::fprintf(stderr, "%s: Not a boot image\n",
+                         image.first.c_str());
+            return EXIT_FAILURE;
+        }
+
+        // isValid() is fast enough that it needs to be run in batches to be
+        // measurable
+        bench::run(image.first + ": isValid x1000", iterations, 0, [&]{
+            for (int i = 0; i < 1000; ++i) {
+                ok &= mbp::BootImage::isValid(data.data(), data.size());
+            }
+        });
+
+        bench::run(image.first + ": load", iterations, data.size(), [&]{
+            mbp::BootImage bi;
+            ok &= bi.load(data);
+        });
+    }
+
+    if (!ok) {
+        std::fprintf(stderr, "A boot image failed to load\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
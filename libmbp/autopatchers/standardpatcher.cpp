@@ -88,11 +88,11 @@ std::vector<std::string> StandardPatcher::existingFiles() const
     return { UpdaterScript };
 }
 
-static bool findItemsInString(const std::string &haystack,
+static bool findItemsInString(const EdifyToken &haystack,
                               const std::vector<std::string> &needles)
 {
     for (auto const &needle : needles) {
-        if (haystack.find(needle) != std::string::npos) {
+        if (haystack.contains(needle)) {
             return true;
         }
     }
@@ -100,73 +100,64 @@ static bool findItemsInString(const std::string &haystack,
     return false;
 }
 
-static bool findFunction(const std::vector<EdifyToken *>::iterator begin,
-                         const std::vector<EdifyToken *>::iterator end,
-                         std::vector<EdifyToken *>::iterator *outFuncName,
-                         std::vector<EdifyToken *>::iterator *outLeftParen,
-                         std::vector<EdifyToken *>::iterator *outRightParen)
+/*!
+ * \brief Find the next function call
+ *
+ * \param tokens List of edify tokens
+ * \param pairs Indexes of matching parentheses from
+ *              EdifyTokenizer::matchParens()
+ * \param begin Index to start searching from
+ * \param outFuncName Index of the function name token
+ * \param outLeftParen Index of the left parenthesis token
+ * \param outRightParen Index of the right parenthesis token
+ *
+ * \return Whether a function call was found. Returns false if a function's
+ *         parentheses are unbalanced.
+ */
+static bool findFunction(const std::vector<EdifyToken> &tokens,
+                         const std::vector<std::size_t> &pairs,
+                         std::size_t begin,
+                         std::size_t *outFuncName,
+                         std::size_t *outLeftParen,
+                         std::size_t *outRightParen)
 {
-    std::vector<EdifyToken *>::iterator funcName;
-    std::vector<EdifyToken *>::iterator leftParen;
-    std::vector<EdifyToken *>::iterator rightParen;
-
-    for (auto it = begin; it != end; ++it) {
+    for (std::size_t i = begin; i < tokens.size(); ++i) {
         // Find string representing the function name
-        if ((*it)->type() != EdifyTokenType::String) {
+        if (tokens[i].type != EdifyTokenType::String) {
             continue;
         }
 
-        funcName = it;
-
-        bool foundLeftParen = false;
-        bool foundRightParen = false;
+        std::size_t leftParen = EdifyTokenizer::npos;
 
         // Barring any whitespace, newlines, or comments, the function name
         // should be followed by a left parenthesis
-        for (auto it2 = it + 1; it2 != end; ++it2) {
-            if ((*it2)->type() == EdifyTokenType::Whitespace
-                    || (*it2)->type() == EdifyTokenType::Newline
-                    || (*it2)->type() == EdifyTokenType::Comment) {
+        for (std::size_t j = i + 1; j < tokens.size(); ++j) {
+            if (tokens[j].type == EdifyTokenType::Whitespace
+                    || tokens[j].type == EdifyTokenType::Newline
+                    || tokens[j].type == EdifyTokenType::Comment) {
                 continue;
-            } else if ((*it2)->type() == EdifyTokenType::LeftParen) {
-                foundLeftParen = true;
-                leftParen = it2;
+            } else if (tokens[j].type == EdifyTokenType::LeftParen) {
+                leftParen = j;
             }
             break;
         }
 
         // If a left parenthesis was not found, then the string token was not
         // a function name
-        if (!foundLeftParen) {
+        if (leftParen == EdifyTokenizer::npos) {
             continue;
         }
 
-        // Left for matching right parenthesis
-        std::size_t depth = 0;
-
-        for (auto it2 = leftParen; it2 != end; ++it2) {
-            if ((*it2)->type() == EdifyTokenType::LeftParen) {
-                ++depth;
-            } else if ((*it2)->type() == EdifyTokenType::RightParen) {
-                --depth;
-            }
-            if (depth == 0) {
-                foundRightParen = true;
-                rightParen = it2;
-                break;
-            }
-        }
-
         // If a right parenthesis was not found, but the function name and left
         // parenthesis were found, then assume there's a syntax error and bail
         // out
-        if (!foundRightParen) {
+        if (pairs[leftParen] == EdifyTokenizer::npos) {
             return false;
         }
 
-        *outFuncName = funcName;
+        *outFuncName = i;
         *outLeftParen = leftParen;
-        *outRightParen = rightParen;
+        *outRightParen = pairs[leftParen];
 
         return true;
     }
@@ -175,162 +166,94 @@ static bool findFunction(const std::vector<EdifyToken *>::iterator begin,
 }
 
 /*!
- * \brief Replace edify function
- *
- * \param tokens List of edify tokens
- * \param funcName Function name token of the replaced function
- * \param leftParen Left parenthesis token of the replaced function
- * \param rightParen Right parenthesis token of the replaced function
- * \param replacement Replacement edify function (in string form)
- *
- * \return New iterator pointing to position *after* the right parenthesis of
- *         the replaced function. Returns tokens->end() if the replacement
- *         string could not be tokenized.
+ * \brief Partition referenced by a string token
  */
-static std::vector<EdifyToken *>::iterator
-replaceFunction(std::vector<EdifyToken *> *tokens,
-                std::vector<EdifyToken *>::iterator funcName,
-                std::vector<EdifyToken *>::iterator leftParen,
-                std::vector<EdifyToken *>::iterator rightParen,
-                const std::string &replacement)
+enum class Partition
 {
-    // Included for completeness' sake
-    (void) leftParen;
+    None,
+    System,
+    Cache,
+    Data
+};
 
-    std::vector<EdifyToken *> replacementTokens;
-    bool result = EdifyTokenizer::tokenize(
-            replacement.data(), replacement.size(), &replacementTokens);
-    if (!result) {
-        FLOGE("Failed to tokenize replacement function string: %s",
-              replacement.c_str());
-        return tokens->end();
-    }
+struct BlockDevs
+{
+    std::vector<std::string> system;
+    std::vector<std::string> cache;
+    std::vector<std::string> data;
+};
 
-    // Deallocate replaced tokens
-    for (auto it = funcName; it != rightParen; ++it) {
-        delete *it;
+static Partition findPartition(const EdifyToken &token, const BlockDevs &devs)
+{
+    if (token.contains("/system") || findItemsInString(token, devs.system)) {
+        return Partition::System;
+    } else if (token.contains("/cache")
+            || findItemsInString(token, devs.cache)) {
+        return Partition::Cache;
+    } else if (token.contains("/data") || token.contains("/userdata")
+            || findItemsInString(token, devs.data)) {
+        return Partition::Data;
     }
-    delete *rightParen;
-
-    // Remove replaced tokens
-    auto it = tokens->erase(funcName, rightParen);
-    it = tokens->erase(it);
-
-    // Add replacement tokens
-    it = tokens->insert(it, replacementTokens.begin(), replacementTokens.end());
-
-    // Move iterator to the end of the replaced tokens
-    it += replacementTokens.size();
+    return Partition::None;
+}
 
-    return it;
+static const char * partitionPath(Partition partition)
+{
+    switch (partition) {
+    case Partition::System: return "/system";
+    case Partition::Cache:  return "/cache";
+    case Partition::Data:   return "/data";
+    default:                return nullptr;
+    }
 }
 
 /*!
- * \brief Replace edify mount() command
+ * \brief Replace edify function
  *
  * \param tokens List of edify tokens
- * \param funcName Function name token
- * \param leftParen Left parenthesis token
- * \param rightParen Right parenthesis token
- * \param systemDevs List of system partition block devices
- * \param cacheDevs List of cache partition block devices
- * \param dataDevs List of data partition block devices
- *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \param funcName Function name token of the replaced function
+ * \param rightParen Right parenthesis token of the replaced function
+ * \param replacement Replacement edify function (in string form)
+ * \param splicer Splicer to record the edit in
  */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyMount(std::vector<EdifyToken *> *tokens,
-                  const std::vector<EdifyToken *>::iterator funcName,
-                  const std::vector<EdifyToken *>::iterator leftParen,
-                  const std::vector<EdifyToken *>::iterator rightParen,
-                  const std::vector<std::string> &systemDevs,
-                  const std::vector<std::string> &cacheDevs,
-                  const std::vector<std::string> &dataDevs)
+static void replaceFunction(const std::vector<EdifyToken> &tokens,
+                            std::size_t funcName,
+                            std::size_t rightParen,
+                            const std::string &replacement,
+                            EdifySplicer *splicer)
 {
-    // For the mount() edify function, replace with the corresponding
-    // update-binary-tool command
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
-            continue;
-        }
-
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
-
-        bool isSystem = str.find("/system") != std::string::npos
-                || findItemsInString(str, systemDevs);
-        bool isCache = str.find("/cache") != std::string::npos
-                || findItemsInString(str, cacheDevs);
-        bool isData = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || findItemsInString(str, dataDevs);
-
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/data"));
-        }
-    }
-    return rightParen + 1;
+    splicer->replace(tokens[funcName], tokens[rightParen], replacement);
 }
 
 /*!
- * \brief Replace edify unmount() command
+ * \brief Replace the function with an update-binary-tool command for the first
+ *        partition referenced in its arguments
  *
- * \param tokens List of edify tokens
- * \param funcName Function name token
- * \param leftParen Left parenthesis token
- * \param rightParen Right parenthesis token
- * \param systemDevs List of system partition block devices
- * \param cacheDevs List of cache partition block devices
- * \param dataDevs List of data partition block devices
+ * This is used for the mount(), unmount(), and format() edify functions.
  *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \param fmt Format string for the update-binary-tool command
  */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyUnmount(std::vector<EdifyToken *> *tokens,
-                    const std::vector<EdifyToken *>::iterator funcName,
-                    const std::vector<EdifyToken *>::iterator leftParen,
-                    const std::vector<EdifyToken *>::iterator rightParen,
-                    const std::vector<std::string> &systemDevs,
-                    const std::vector<std::string> &cacheDevs,
-                    const std::vector<std::string> &dataDevs)
+static void replaceWithPartitionCommand(const std::vector<EdifyToken> &tokens,
+                                        std::size_t funcName,
+                                        std::size_t leftParen,
+                                        std::size_t rightParen,
+                                        const char *fmt,
+                                        const BlockDevs &devs,
+                                        EdifySplicer *splicer)
 {
-    // For the unmount() edify function, replace with the corresponding
-    // update-binary-tool command
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    for (std::size_t i = leftParen + 1; i != rightParen; ++i) {
+        if (tokens[i].type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
-
-        bool isSystem = str.find("/system") != std::string::npos
-                || findItemsInString(str, systemDevs);
-        bool isCache = str.find("/cache") != std::string::npos
-                || findItemsInString(str, cacheDevs);
-        bool isData = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || findItemsInString(str, dataDevs);
-
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/data"));
+        Partition partition = findPartition(tokens[i], devs);
+        if (partition != Partition::None) {
+            replaceFunction(tokens, funcName, rightParen,
+                            StringUtils::format(fmt, partitionPath(partition)),
+                            splicer);
+            return;
         }
     }
-    return rightParen + 1;
 }
 
 /*!
@@ -340,91 +263,57 @@ replaceEdifyUnmount(std::vector<EdifyToken *> *tokens,
  * \param funcName Function name token
  * \param leftParen Left parenthesis token
  * \param rightParen Right parenthesis token
- * \param systemDevs List of system partition block devices
- * \param cacheDevs List of cache partition block devices
- * \param dataDevs List of data partition block devices
- *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \param devs Block devices of the system, cache, and data partitions
+ * \param splicer Splicer to record the edit in
  */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyRunProgram(std::vector<EdifyToken *> *tokens,
-                       const std::vector<EdifyToken *>::iterator funcName,
-                       const std::vector<EdifyToken *>::iterator leftParen,
-                       const std::vector<EdifyToken *>::iterator rightParen,
-                       const std::vector<std::string> &systemDevs,
-                       const std::vector<std::string> &cacheDevs,
-                       const std::vector<std::string> &dataDevs)
+static void replaceEdifyRunProgram(const std::vector<EdifyToken> &tokens,
+                                   std::size_t funcName,
+                                   std::size_t leftParen,
+                                   std::size_t rightParen,
+                                   const BlockDevs &devs,
+                                   EdifySplicer *splicer)
 {
     bool foundMount = false;
     bool foundUmount = false;
     bool foundFormatSh = false;
     bool foundMke2fs = false;
-    bool isSystem = false;
-    bool isCache = false;
-    bool isData = false;
+    Partition partition = Partition::None;
 
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    // The last string argument determines the command and partition
+    for (std::size_t i = leftParen + 1; i != rightParen; ++i) {
+        if (tokens[i].type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
-        const std::string unescaped = token->unescapedString();
+        const std::string unescaped = tokens[i].unescapedString();
 
         foundMount = StringUtils::ends_with(unescaped, "mount");
         foundUmount = StringUtils::ends_with(unescaped, "umount");
         foundFormatSh = StringUtils::ends_with(unescaped, "/format.sh");
         foundMke2fs = StringUtils::ends_with(unescaped, "/mke2fs");
 
-        isSystem = str.find("/system") != std::string::npos
-                || findItemsInString(str, systemDevs);
-        isCache = str.find("/cache") != std::string::npos
-                || findItemsInString(str, cacheDevs);
-        isData = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || findItemsInString(str, dataDevs);
+        partition = findPartition(tokens[i], devs);
     }
 
+    const char *fmt = nullptr;
+
     if (foundUmount) {
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(UNMOUNT_FMT, "/data"));
-        }
+        fmt = UNMOUNT_FMT;
     } else if (foundMount) {
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(MOUNT_FMT, "/data"));
-        }
+        fmt = MOUNT_FMT;
     } else if (foundFormatSh) {
-        return replaceFunction(tokens, funcName, leftParen, rightParen,
-                               StringUtils::format(FORMAT_FMT, "/system"));
+        replaceFunction(tokens, funcName, rightParen,
+                        StringUtils::format(FORMAT_FMT, "/system"), splicer);
+        return;
     } else if (foundMke2fs) {
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/data"));
-        }
+        fmt = FORMAT_FMT;
     }
 
-    return rightParen + 1;
+    if (fmt && partition != Partition::None) {
+        replaceFunction(tokens, funcName, rightParen,
+                        StringUtils::format(fmt, partitionPath(partition)),
+                        splicer);
+    }
 }
 
 /*!
@@ -434,191 +323,102 @@ replaceEdifyRunProgram(std::vector<EdifyToken *> *tokens,
  * \param funcName Function name token
  * \param leftParen Left parenthesis token
  * \param rightParen Right parenthesis token
- * \param systemDevs List of system partition block devices
- * \param cacheDevs List of cache partition block devices
- * \param dataDevs List of data partition block devices
- *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \param splicer Splicer to record the edit in
  */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyDeleteRecursive(std::vector<EdifyToken *> *tokens,
-                            const std::vector<EdifyToken *>::iterator funcName,
-                            const std::vector<EdifyToken *>::iterator leftParen,
-                            const std::vector<EdifyToken *>::iterator rightParen)
+static void replaceEdifyDeleteRecursive(const std::vector<EdifyToken> &tokens,
+                                        std::size_t funcName,
+                                        std::size_t leftParen,
+                                        std::size_t rightParen,
+                                        EdifySplicer *splicer)
 {
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    for (std::size_t i = leftParen + 1; i != rightParen; ++i) {
+        if (tokens[i].type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string unescaped = token->unescapedString();
+        const std::string unescaped = tokens[i].unescapedString();
 
         if (unescaped == "/system" || unescaped == "/system/") {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/system"));
+            replaceFunction(tokens, funcName, rightParen,
+                            StringUtils::format(FORMAT_FMT, "/system"),
+                            splicer);
+            return;
         } else if (unescaped == "/cache" || unescaped == "/cache/") {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/cache"));
+            replaceFunction(tokens, funcName, rightParen,
+                            StringUtils::format(FORMAT_FMT, "/cache"),
+                            splicer);
+            return;
         }
     }
-    return rightParen + 1;
 }
 
 /*!
- * \brief Replace edify format() command
+ * \brief Replace references to the system partition with /mb/system.img
  *
- * \param tokens List of edify tokens
- * \param funcName Function name token
- * \param leftParen Left parenthesis token
- * \param rightParen Right parenthesis token
- * \param systemDevs List of system partition block devices
- * \param cacheDevs List of cache partition block devices
- * \param dataDevs List of data partition block devices
- *
- * \return Iterator pointing to position immediately after the right parenthesis
- */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyFormat(std::vector<EdifyToken *> *tokens,
-                   const std::vector<EdifyToken *>::iterator funcName,
-                   const std::vector<EdifyToken *>::iterator leftParen,
-                   const std::vector<EdifyToken *>::iterator rightParen,
-                   const std::vector<std::string> &systemDevs,
-                   const std::vector<std::string> &cacheDevs,
-                   const std::vector<std::string> &dataDevs)
-{
-    // For the format() edify function, replace with the corresponding
-    // update-binary-tool command
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
-            continue;
-        }
-
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        const std::string str = token->string();
-
-        bool isSystem = str.find("/system") != std::string::npos
-                || findItemsInString(str, systemDevs);
-        bool isCache = str.find("/cache") != std::string::npos
-                || findItemsInString(str, cacheDevs);
-        bool isData = str.find("/data") != std::string::npos
-                || str.find("/userdata") != std::string::npos
-                || findItemsInString(str, dataDevs);
-
-        if (isSystem) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/system"));
-        } else if (isCache) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/cache"));
-        } else if (isData) {
-            return replaceFunction(tokens, funcName, leftParen, rightParen,
-                                   StringUtils::format(FORMAT_FMT, "/data"));
-        }
-    }
-    return rightParen + 1;
-}
-
-/*!
- * \brief Replace edify block_image_update() command
+ * This is used for the block_image_update() and package_extract_file() edify
+ * functions.
  *
  * \param tokens List of edify tokens
- * \param funcName Function name token
  * \param leftParen Left parenthesis token
  * \param rightParen Right parenthesis token
  * \param systemDevs List of system partition block devices
- *
- * \return Iterator pointing to position immediately after the right parenthesis
+ * \param splicer Splicer to record the edits in
  */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyBlockImageUpdate(std::vector<EdifyToken *> *tokens,
-                             const std::vector<EdifyToken *>::iterator funcName,
-                             const std::vector<EdifyToken *>::iterator leftParen,
-                             const std::vector<EdifyToken *>::iterator rightParen,
-                             const std::vector<std::string> &systemDevs)
+static void replaceSystemImagePaths(const std::vector<EdifyToken> &tokens,
+                                    std::size_t leftParen,
+                                    std::size_t rightParen,
+                                    const std::vector<std::string> &systemDevs,
+                                    EdifySplicer *splicer)
 {
-    (void) tokens;
-    (void) funcName;
-
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
+    for (std::size_t i = leftParen + 1; i != rightParen; ++i) {
+        if (tokens[i].type != EdifyTokenType::String) {
             continue;
         }
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        std::string unescaped = token->unescapedString();
+        std::string unescaped = tokens[i].unescapedString();
 
-        // References to the system partition should become /mb/system.img
         for (auto const &dev : systemDevs) {
             if (unescaped.find(dev) != std::string::npos) {
                 StringUtils::replace_all(&unescaped, dev, "/mb/system.img");
-                delete *it;
-                *it = new EdifyTokenString(
-                        std::move(unescaped), EdifyTokenString::MakeQuoted);
+                splicer->replace(tokens[i], tokens[i],
+                                 EdifyToken::quote(unescaped));
                 break;
             }
         }
     }
-    return rightParen + 1;
 }
 
-/*!
- * \brief Replace edify package_extract_file() command
- *
- * \param tokens List of edify tokens
- * \param funcName Function name token
- * \param leftParen Left parenthesis token
- * \param rightParen Right parenthesis token
- * \param systemDevs List of system partition block devices
- *
- * \return Iterator pointing to position immediately after the right parenthesis
- */
-static std::vector<EdifyToken *>::iterator
-replaceEdifyPackageExtractFile(std::vector<EdifyToken *> *tokens,
-                               const std::vector<EdifyToken *>::iterator funcName,
-                               const std::vector<EdifyToken *>::iterator leftParen,
-                               const std::vector<EdifyToken *>::iterator rightParen,
-                               const std::vector<std::string> &systemDevs)
+bool StandardPatcher::patchFiles(const std::string &directory)
 {
-    (void) tokens;
-    (void) funcName;
-
-    for (auto it = leftParen + 1; it != rightParen; ++it) {
-        if ((*it)->type() != EdifyTokenType::String) {
-            continue;
-        }
+    std::vector<unsigned char> contents;
 
-        EdifyTokenString *token = (EdifyTokenString *)(*it);
-        std::string unescaped = token->unescapedString();
+    FileUtils::readToMemory(directory + "/" + UpdaterScript, &contents);
 
-        // References to the system partition should become /mb/system.img
-        for (auto const &dev : systemDevs) {
-            if (unescaped.find(dev) != std::string::npos) {
-                StringUtils::replace_all(&unescaped, dev, "/mb/system.img");
-                delete *it;
-                *it = new EdifyTokenString(
-                        std::move(unescaped), EdifyTokenString::MakeQuoted);
-                break;
-            }
-        }
+    if (!patchFile(UpdaterScript, &contents)) {
+        return false;
     }
-    return rightParen + 1;
+
+    FileUtils::writeFromMemory(directory + "/" + UpdaterScript, contents);
+
+    return true;
 }
 
-bool StandardPatcher::patchFiles(const std::string &directory)
+bool StandardPatcher::patchFile(const std::string &file,
+                                std::vector<unsigned char> *contents)
 {
-    std::string contents;
-
-    FileUtils::readToString(directory + "/" + UpdaterScript, &contents);
+    if (file != UpdaterScript) {
+        return true;
+    }
 
-    if (contents.size() >= 2 && std::memcmp(contents.data(), "#!", 2) == 0) {
+    if (contents->size() >= 2 && std::memcmp(contents->data(), "#!", 2) == 0) {
         // Ignore any script with a shebang line
         return true;
     }
 
-    std::vector<EdifyToken *> tokens;
-    bool result = EdifyTokenizer::tokenize(
-            contents.data(), contents.size(), &tokens);
+    const char *data = reinterpret_cast<const char *>(contents->data());
+
+    std::vector<EdifyToken> tokens;
+    bool result = EdifyTokenizer::tokenize(data, contents->size(), &tokens);
     if (!result) {
         LOGE("Failed to tokenize updater-script");
         return false;
@@ -628,69 +428,70 @@ bool StandardPatcher::patchFiles(const std::string &directory)
     EdifyTokenizer::dump(tokens);
 #endif
 
-    Device *device = m_impl->info->device();
-    auto const systemDevs = device->systemBlockDevs();
-    auto const cacheDevs = device->cacheBlockDevs();
-    auto const dataDevs = device->dataBlockDevs();
-
-    std::vector<EdifyToken *>::iterator begin = tokens.begin();
-    std::vector<EdifyToken *>::iterator end;
-
-    // TODO: Catch errors
-    while (true) {
-        end = tokens.end();
-
-        // Need to find:
-        // 1. String containing function name
-        // 2. Left parenthesis for the function
-        // 3. Right parenthesis for the function
-        std::vector<EdifyToken *>::iterator funcName;
-        std::vector<EdifyToken *>::iterator leftParen;
-        std::vector<EdifyToken *>::iterator rightParen;
-
-        if (!findFunction(begin, end, &funcName, &leftParen, &rightParen)) {
-            break;
-        }
+    std::vector<std::size_t> pairs;
+    EdifyTokenizer::matchParens(tokens, &pairs);
 
-        // Tokens (types are checked by findFunction())
-        EdifyTokenString *tFuncName = (EdifyTokenString *)(*funcName);
-
-        if (tFuncName->unescapedString() == "mount") {
-            begin = replaceEdifyMount(&tokens, funcName, leftParen, rightParen,
-                                      systemDevs, cacheDevs, dataDevs);
-        } else if (tFuncName->unescapedString() == "unmount") {
-            begin = replaceEdifyUnmount(&tokens, funcName, leftParen, rightParen,
-                                        systemDevs, cacheDevs, dataDevs);
-        } else if (tFuncName->unescapedString() == "run_program") {
-            begin = replaceEdifyRunProgram(&tokens, funcName, leftParen, rightParen,
-                                           systemDevs, cacheDevs, dataDevs);
-        } else if (tFuncName->unescapedString() == "delete_recursive") {
-            begin = replaceEdifyDeleteRecursive(&tokens, funcName, leftParen, rightParen);
-        } else if (tFuncName->unescapedString() == "format") {
-            begin = replaceEdifyFormat(&tokens, funcName, leftParen, rightParen,
-                                       systemDevs, cacheDevs, dataDevs);
-        } else if (tFuncName->unescapedString() == "block_image_update") {
-            begin = replaceEdifyBlockImageUpdate(&tokens, funcName, leftParen, rightParen,
-                                                 systemDevs);
-        } else if (tFuncName->unescapedString() == "package_extract_file") {
-            begin = replaceEdifyPackageExtractFile(&tokens, funcName, leftParen, rightParen,
-                                                   systemDevs);
+    Device *device = m_impl->info->device();
+    BlockDevs devs;
+    devs.system = device->systemBlockDevs();
+    devs.cache = device->cacheBlockDevs();
+    devs.data = device->dataBlockDevs();
+
+    // Edits are recorded in order and applied in a single pass at the end
+    EdifySplicer splicer(data, contents->size());
+
+    std::size_t begin = 0;
+
+    // Need to find:
+    // 1. String containing function name
+    // 2. Left parenthesis for the function
+    // 3. Right parenthesis for the function
+    std::size_t funcName;
+    std::size_t leftParen;
+    std::size_t rightParen;
+
+    while (findFunction(tokens, pairs, begin,
+                        &funcName, &leftParen, &rightParen)) {
+        // Token types are checked by findFunction()
+        const std::string name = tokens[funcName].unescapedString();
+
+        // The arguments of replaced functions are not searched for nested
+        // function calls
+        begin = rightParen + 1;
+
+        if (name == "mount") {
+            replaceWithPartitionCommand(tokens, funcName, leftParen, rightParen,
+                                        MOUNT_FMT, devs, &splicer);
+        } else if (name == "unmount") {
+            replaceWithPartitionCommand(tokens, funcName, leftParen, rightParen,
+                                        UNMOUNT_FMT, devs, &splicer);
+        } else if (name == "run_program") {
+            replaceEdifyRunProgram(tokens, funcName, leftParen, rightParen,
+                                   devs, &splicer);
+        } else if (name == "delete_recursive") {
+            replaceEdifyDeleteRecursive(tokens, funcName, leftParen, rightParen,
+                                        &splicer);
+        } else if (name == "format") {
+            replaceWithPartitionCommand(tokens, funcName, leftParen, rightParen,
+                                        FORMAT_FMT, devs, &splicer);
+        } else if (name == "block_image_update"
+                || name == "package_extract_file") {
+            replaceSystemImagePaths(tokens, leftParen, rightParen,
+                                    devs.system, &splicer);
         } else {
             begin = funcName + 1;
         }
     }
 
+    if (splicer.edits() > 0) {
+        const std::string patched = splicer.apply();
+        contents->assign(patched.begin(), patched.end());
+    }
+
 #if DUMP_DEBUG
-    EdifyTokenizer::dump(tokens);
+    FLOGD("Applied %" PRIzu " edits to updater-script", splicer.edits());
 #endif
 
-    FileUtils::writeFromString(directory + "/" + UpdaterScript,
-                               EdifyTokenizer::untokenize(tokens));
-
-    for (EdifyToken *t : tokens) {
-        delete t;
-    }
-
     return true;
 }
 
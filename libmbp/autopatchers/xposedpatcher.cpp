@@ -19,11 +19,12 @@
 
 #include "autopatchers/xposedpatcher.h"
 
+#include <algorithm>
+
 #include <cstring>
 
 #include "private/fileutils.h"
 #include "private/logging.h"
-#include "private/stringutils.h"
 
 
 namespace mbp
@@ -79,30 +80,63 @@ std::vector<std::string> XposedPatcher::existingFiles() const
 
 bool XposedPatcher::patchFiles(const std::string &directory)
 {
-    std::string contents;
+    std::vector<unsigned char> contents;
 
-    ErrorCode ret = FileUtils::readToString(
+    ErrorCode ret = FileUtils::readToMemory(
             directory + "/" + FlashScript, &contents);
     if (ret != ErrorCode::NoError) {
         // Don't fail if it doesn't exist
         return true;
     }
 
-    std::vector<std::string> lines = StringUtils::split(contents, '\n');
+    if (!patchFile(FlashScript, &contents)) {
+        return false;
+    }
+
+    FileUtils::writeFromMemory(directory + "/" + FlashScript, contents);
 
-    for (std::string &line : lines) {
-        const char *ptr = line.data();
+    return true;
+}
+
+bool XposedPatcher::patchFile(const std::string &file,
+                              std::vector<unsigned char> *contents)
+{
+    if (file != FlashScript) {
+        return true;
+    }
+
+    static const char Sbin[] = "/sbin/";
+
+    std::vector<unsigned char> patched;
+    patched.reserve(contents->size() + 64);
+
+    auto begin = contents->begin();
+    auto end = contents->end();
+
+    while (begin != end) {
+        auto eol = std::find(begin, end, '\n');
 
         // Skip whitespace
-        for (; *ptr && isspace(*ptr); ++ptr);
+        auto ptr = begin;
+        for (; ptr != eol && isspace(*ptr); ++ptr);
 
-        if (strncmp(ptr, "mount", 5) == 0 || strncmp(ptr, "umount", 6) == 0) {
-            line.insert(ptr - line.data(), "/sbin/");
+        patched.insert(patched.end(), begin, ptr);
+
+        std::size_t left = eol - ptr;
+        if ((left >= 5 && std::memcmp(&*ptr, "mount", 5) == 0)
+                || (left >= 6 && std::memcmp(&*ptr, "umount", 6) == 0)) {
+            patched.insert(patched.end(), Sbin, Sbin + sizeof(Sbin) - 1);
+        }
+
+        if (eol != end) {
+            ++eol;
         }
+        patched.insert(patched.end(), ptr, eol);
+
+        begin = eol;
     }
 
-    contents = StringUtils::join(lines, "\n");
-    FileUtils::writeFromString(directory + "/" + FlashScript, contents);
+    contents->swap(patched);
 
     return true;
 }
@@ -46,6 +46,8 @@ public:
     virtual std::vector<std::string> existingFiles() const override;
 
     virtual bool patchFiles(const std::string &directory) override;
+    virtual bool patchFile(const std::string &file,
+                           std::vector<unsigned char> *contents) override;
 
 private:
     class Impl;
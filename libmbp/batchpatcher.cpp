@@ -0,0 +1,571 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "batchpatcher.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cassert>
+#include <cinttypes>
+
+#include "libmbpio/file.h"
+
+#include "patcherinterface.h"
+#include "patchers/mbtoolupdater.h"
+#include "patchers/multibootpatcher.h"
+#include "private/fileutils.h"
+#include "private/logging.h"
+#include "private/threadbudget.h"
+
+
+namespace mbp
+{
+
+/*! \cond INTERNAL */
+class BatchPatcher::Impl
+{
+public:
+    struct Job
+    {
+        unsigned int id;
+        const FileInfo *info;
+        std::string patcherId;
+        uint64_t memory;
+
+        JobState state = JobState::Queued;
+        ErrorCode error = ErrorCode::NoError;
+        std::string newFilePath;
+
+        // Only set while the job is running
+        Patcher *patcher = nullptr;
+        bool cancelRequested = false;
+
+        uint64_t bytes = 0;
+        uint64_t maxBytes = 0;
+
+        Impl *impl;
+    };
+
+    PatcherConfig *pc;
+
+    unsigned int maxThreads = 0;
+    uint64_t memoryLimit = 0;
+
+    JobProgressCallback progressCb = nullptr;
+    void *progressUserData = nullptr;
+    JobFinishedCallback finishedCb = nullptr;
+    void *finishedUserData = nullptr;
+
+    std::vector<std::unique_ptr<Job>> jobs;
+
+    // Protects the jobs and the fields below
+    mutable std::mutex mutex;
+    std::condition_variable cv;
+    uint64_t memoryInUse = 0;
+    bool running = false;
+    std::chrono::steady_clock::time_point startTime;
+    std::chrono::steady_clock::time_point endTime;
+
+    uint64_t estimateMemory(const Job *job);
+    Job * takeJob(std::unique_lock<std::mutex> &lock);
+    void runJob(Job *job);
+    void workerThread();
+    void finishJob(Job *job);
+
+    static void laProgressCb(uint64_t bytes, uint64_t maxBytes, void *userData);
+};
+/*! \endcond */
+
+/*!
+ * \class BatchPatcher
+ * \brief Patches many files using a shared pool of threads
+ *
+ * Jobs are added with addJob() and then patched by run(), which blocks until
+ * all of the jobs have finished. At most maxThreads() jobs run at the same
+ * time. If a memory limit is set, a job is only started if the memory
+ * estimates of the running jobs plus its own do not exceed the limit. A job
+ * that exceeds the limit by itself is run when no other jobs are running.
+ *
+ * The callbacks are called from the worker threads. cancelJob(), cancelAll(),
+ * and the job status functions can be called from any thread, including from
+ * the callbacks.
+ */
+
+BatchPatcher::BatchPatcher(PatcherConfig * const pc) : m_impl(new Impl())
+{
+    m_impl->pc = pc;
+}
+
+BatchPatcher::~BatchPatcher()
+{
+}
+
+/*!
+ * \brief Maximum number of jobs to run at the same time
+ *
+ * \return Number of threads or 0 to use PatcherConfig::maxThreads()
+ */
+unsigned int BatchPatcher::maxThreads() const
+{
+    return m_impl->maxThreads;
+}
+
+/*!
+ * \brief Set the maximum number of jobs to run at the same time
+ *
+ * \param threads Number of threads or 0 to use PatcherConfig::maxThreads()
+ */
+void BatchPatcher::setMaxThreads(unsigned int threads)
+{
+    m_impl->maxThreads = threads;
+}
+
+/*!
+ * \brief Memory limit for admitting jobs
+ *
+ * \return Limit in bytes or 0 if there is no limit
+ */
+uint64_t BatchPatcher::memoryLimit() const
+{
+    return m_impl->memoryLimit;
+}
+
+/*!
+ * \brief Set the memory limit for admitting jobs
+ *
+ * \param bytes Limit in bytes or 0 for no limit
+ */
+void BatchPatcher::setMemoryLimit(uint64_t bytes)
+{
+    m_impl->memoryLimit = bytes;
+}
+
+/*!
+ * \brief Set callback for per-job progress
+ *
+ * The callback receives the job ID, the bytes processed, and the total bytes.
+ */
+void BatchPatcher::setJobProgressCallback(JobProgressCallback cb,
+                                          void *userData)
+{
+    m_impl->progressCb = cb;
+    m_impl->progressUserData = userData;
+}
+
+/*!
+ * \brief Set callback for when a job succeeds, fails, or is cancelled
+ *
+ * The callback receives the job ID, the final state, and the error.
+ */
+void BatchPatcher::setJobFinishedCallback(JobFinishedCallback cb,
+                                          void *userData)
+{
+    m_impl->finishedCb = cb;
+    m_impl->finishedUserData = userData;
+}
+
+/*!
+ * \brief Add a file to be patched
+ *
+ * \note \a info must remain valid until run() returns
+ *
+ * \param info FileInfo describing the file to patch
+ * \param patcherId ID of the Patcher to use (eg. MultiBootPatcher::Id)
+ *
+ * \return Job ID
+ */
+unsigned int BatchPatcher::addJob(const FileInfo * const info,
+                                  const std::string &patcherId)
+{
+    std::unique_ptr<Impl::Job> job(new Impl::Job());
+    job->info = info;
+    job->patcherId = patcherId;
+    job->impl = m_impl.get();
+    job->memory = m_impl->estimateMemory(job.get());
+
+    std::lock_guard<std::mutex> lock(m_impl->mutex);
+    assert(!m_impl->running);
+
+    job->id = m_impl->jobs.size();
+    m_impl->jobs.push_back(std::move(job));
+
+    return m_impl->jobs.back()->id;
+}
+
+/*!
+ * \brief Patch all of the queued jobs
+ *
+ * This blocks until every job has succeeded, failed, or been cancelled.
+ *
+ * \return Whether all of the jobs succeeded
+ */
+bool BatchPatcher::run()
+{
+    std::size_t nJobs;
+    {
+        std::lock_guard<std::mutex> lock(m_impl->mutex);
+        m_impl->running = true;
+        m_impl->startTime = std::chrono::steady_clock::now();
+        nJobs = m_impl->jobs.size();
+    }
+
+    unsigned int nThreads = m_impl->maxThreads;
+    if (nThreads == 0) {
+        nThreads = m_impl->pc->maxThreads();
+    }
+    nThreads = std::min<std::size_t>(nThreads, nJobs);
+
+    // The first worker runs in place of this thread. The others take slots
+    // from the thread budget that the patchers also use for their own worker
+    // and compression threads.
+    ThreadLease lease(ThreadBudget::forConfig(m_impl->pc),
+                      nThreads > 1 ? nThreads - 1 : 0);
+    nThreads = std::min(nThreads, 1 + lease.count());
+
+    std::vector<std::thread> threads;
+    threads.reserve(nThreads);
+    for (unsigned int i = 0; i < nThreads; ++i) {
+        threads.emplace_back(&Impl::workerThread, m_impl.get());
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    std::lock_guard<std::mutex> lock(m_impl->mutex);
+    m_impl->running = false;
+    m_impl->endTime = std::chrono::steady_clock::now();
+
+    return std::all_of(m_impl->jobs.begin(), m_impl->jobs.end(),
+                       [](const std::unique_ptr<Impl::Job> &job) {
+        return job->state == JobState::Succeeded;
+    });
+}
+
+/*!
+ * \brief Cancel a job
+ *
+ * If the job is queued, it will not be started. If it is running, the patcher
+ * is asked to stop.
+ */
+void BatchPatcher::cancelJob(unsigned int id)
+{
+    std::unique_lock<std::mutex> lock(m_impl->mutex);
+    assert(id < m_impl->jobs.size());
+
+    Impl::Job *job = m_impl->jobs[id].get();
+    job->cancelRequested = true;
+
+    if (job->state == JobState::Queued) {
+        job->state = JobState::Cancelled;
+        job->error = ErrorCode::PatchingCancelled;
+        // Let waiting workers re-check the queue
+        m_impl->cv.notify_all();
+        lock.unlock();
+        m_impl->finishJob(job);
+    } else if (job->state == JobState::Running && job->patcher) {
+        job->patcher->cancelPatching();
+    }
+}
+
+/*!
+ * \brief Cancel all queued and running jobs
+ */
+void BatchPatcher::cancelAll()
+{
+    std::size_t count;
+    {
+        std::lock_guard<std::mutex> lock(m_impl->mutex);
+        count = m_impl->jobs.size();
+    }
+
+    for (std::size_t i = 0; i < count; ++i) {
+        cancelJob(i);
+    }
+}
+
+BatchPatcher::JobState BatchPatcher::jobState(unsigned int id) const
+{
+    std::lock_guard<std::mutex> lock(m_impl->mutex);
+    assert(id < m_impl->jobs.size());
+    return m_impl->jobs[id]->state;
+}
+
+/*!
+ * \brief Error of a failed job
+ */
+ErrorCode BatchPatcher::jobError(unsigned int id) const
+{
+    std::lock_guard<std::mutex> lock(m_impl->mutex);
+    assert(id < m_impl->jobs.size());
+    return m_impl->jobs[id]->error;
+}
+
+/*!
+ * \brief Path of the patched file
+ *
+ * \return Path or an empty string if the job has not been started
+ */
+std::string BatchPatcher::jobNewFilePath(unsigned int id) const
+{
+    std::lock_guard<std::mutex> lock(m_impl->mutex);
+    assert(id < m_impl->jobs.size());
+    return m_impl->jobs[id]->newFilePath;
+}
+
+/*!
+ * \brief Estimated peak memory usage of a job
+ */
+uint64_t BatchPatcher::jobMemoryEstimate(unsigned int id) const
+{
+    std::lock_guard<std::mutex> lock(m_impl->mutex);
+    assert(id < m_impl->jobs.size());
+    return m_impl->jobs[id]->memory;
+}
+
+/*!
+ * \brief Get job counts and aggregate throughput
+ */
+BatchPatcher::Stats BatchPatcher::stats() const
+{
+    std::lock_guard<std::mutex> lock(m_impl->mutex);
+
+    Stats stats = {};
+
+    for (auto const &job : m_impl->jobs) {
+        switch (job->state) {
+        case JobState::Queued:    ++stats.queued;    break;
+        case JobState::Running:   ++stats.running;   break;
+        case JobState::Succeeded: ++stats.succeeded; break;
+        case JobState::Failed:    ++stats.failed;    break;
+        case JobState::Cancelled: ++stats.cancelled; break;
+        }
+        stats.bytes += job->bytes;
+    }
+
+    if (m_impl->startTime != std::chrono::steady_clock::time_point()) {
+        auto end = m_impl->running
+                ? std::chrono::steady_clock::now() : m_impl->endTime;
+        stats.seconds = std::chrono::duration<double>(
+                end - m_impl->startTime).count();
+    }
+    if (stats.seconds > 0) {
+        stats.bytesPerSecond = stats.bytes / stats.seconds;
+    }
+
+    return stats;
+}
+
+/*!
+ * \brief Estimate the peak memory usage of a job
+ *
+ * Only the boot images and ramdisks are loaded into memory. Everything else is
+ * streamed.
+ */
+uint64_t BatchPatcher::Impl::estimateMemory(const Job *job)
+{
+    const std::string path = job->info->filename();
+
+    if (job->patcherId == MultiBootPatcher::Id) {
+        unzFile uf = FileUtils::mzOpenInputFile(path);
+        if (!uf) {
+            return 0;
+        }
+
+        // MultiBootPatcher patches the boot images in parallel, but limits
+        // the memory held by the ones that have not been written yet
+        uint64_t total = 0;
+        uint64_t largest = 0;
+        int ret = unzGoToFirstFile(uf);
+        while (ret == UNZ_OK) {
+            unz_file_info64 fi;
+            std::string name;
+            if (!FileUtils::mzGetInfo(uf, &fi, &name)) {
+                break;
+            }
+            if (MultiBootPatcher::isPatchCandidate(
+                    name, fi.uncompressed_size)) {
+                total += fi.uncompressed_size;
+                largest = std::max<uint64_t>(largest, fi.uncompressed_size);
+            }
+            ret = unzGoToNextFile(uf);
+        }
+
+        FileUtils::mzCloseInputFile(uf);
+
+        return std::min(total * MultiBootPatcher::BootImageCopies,
+                        MultiBootPatcher::MaxQueuedBytes
+                        + largest * MultiBootPatcher::BootImageCopies);
+    } else if (job->patcherId == MbtoolUpdater::Id) {
+        io::File file;
+        uint64_t size;
+        if (!file.open(path, io::File::OpenRead)
+                || !file.seek(0, io::File::SeekEnd)
+                || !file.tell(&size)) {
+            return 0;
+        }
+
+        return size * MultiBootPatcher::BootImageCopies;
+    }
+
+    return 0;
+}
+
+/*!
+ * \brief Wait for a job that can be started
+ *
+ * \return Next job or nullptr if there are no more queued jobs
+ */
+BatchPatcher::Impl::Job * BatchPatcher::Impl::takeJob(std::unique_lock<std::mutex> &lock)
+{
+    while (true) {
+        bool haveQueued = false;
+
+        for (auto const &job : jobs) {
+            if (job->state != JobState::Queued) {
+                continue;
+            }
+            haveQueued = true;
+
+            // A job that does not fit by itself still runs when nothing else
+            // is running
+            if (memoryLimit == 0 || memoryInUse == 0
+                    || memoryInUse + job->memory <= memoryLimit) {
+                job->state = JobState::Running;
+                memoryInUse += job->memory;
+                return job.get();
+            }
+        }
+
+        if (!haveQueued) {
+            return nullptr;
+        }
+
+        FLOGD("Waiting for memory (%" PRIu64 " bytes in use)", memoryInUse);
+        cv.wait(lock);
+    }
+}
+
+void BatchPatcher::Impl::runJob(Job *job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (job->cancelRequested) {
+            job->state = JobState::Cancelled;
+            job->error = ErrorCode::PatchingCancelled;
+            return;
+        }
+    }
+
+    Patcher *patcher = pc->createPatcher(job->patcherId);
+    if (!patcher) {
+        std::lock_guard<std::mutex> lock(mutex);
+        job->state = JobState::Failed;
+        job->error = ErrorCode::PatcherCreateError;
+        return;
+    }
+
+    patcher->setFileInfo(job->info);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job->newFilePath = patcher->newFilePath();
+        // Once job->patcher is set, cancelJob() forwards the cancellation to
+        // the patcher, which keeps it until patchFile() runs
+        if (job->cancelRequested) {
+            job->state = JobState::Cancelled;
+            job->error = ErrorCode::PatchingCancelled;
+            pc->destroyPatcher(patcher);
+            return;
+        }
+        job->patcher = patcher;
+    }
+
+    FLOGD("Job %u: Patching %s", job->id, job->info->filename().c_str());
+
+    bool ret = patcher->patchFile(&laProgressCb, nullptr, nullptr, job);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job->patcher = nullptr;
+        if (ret) {
+            job->state = JobState::Succeeded;
+        } else {
+            job->error = patcher->error();
+            job->state = job->error == ErrorCode::PatchingCancelled
+                    ? JobState::Cancelled : JobState::Failed;
+        }
+    }
+
+    pc->destroyPatcher(patcher);
+}
+
+void BatchPatcher::Impl::workerThread()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    Job *job;
+    while ((job = takeJob(lock))) {
+        lock.unlock();
+
+        runJob(job);
+        finishJob(job);
+
+        lock.lock();
+        memoryInUse -= job->memory;
+        cv.notify_all();
+    }
+}
+
+void BatchPatcher::Impl::finishJob(Job *job)
+{
+    if (finishedCb) {
+        JobState state;
+        ErrorCode error;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            state = job->state;
+            error = job->error;
+        }
+        finishedCb(job->id, state, error, finishedUserData);
+    }
+}
+
+void BatchPatcher::Impl::laProgressCb(uint64_t bytes, uint64_t maxBytes,
+                                      void *userData)
+{
+    Job *job = static_cast<Job *>(userData);
+    Impl *impl = job->impl;
+
+    {
+        std::lock_guard<std::mutex> lock(impl->mutex);
+        job->bytes = bytes;
+        job->maxBytes = maxBytes;
+    }
+
+    if (impl->progressCb) {
+        impl->progressCb(job->id, bytes, maxBytes, impl->progressUserData);
+    }
+}
+
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "libmbp_global.h"
+
+#include "errors.h"
+#include "fileinfo.h"
+#include "patcherconfig.h"
+
+
+namespace mbp
+{
+
+class MBP_EXPORT BatchPatcher
+{
+public:
+    enum class JobState : int
+    {
+        Queued,
+        Running,
+        Succeeded,
+        Failed,
+        Cancelled
+    };
+
+    struct Stats
+    {
+        unsigned int queued;
+        unsigned int running;
+        unsigned int succeeded;
+        unsigned int failed;
+        unsigned int cancelled;
+        // Bytes processed by all jobs so far
+        uint64_t bytes;
+        // Time since run() was called
+        double seconds;
+        // Average throughput of all jobs
+        double bytesPerSecond;
+    };
+
+    typedef void (*JobProgressCallback) (unsigned int, uint64_t, uint64_t,
+                                         void *);
+    typedef void (*JobFinishedCallback) (unsigned int, JobState, ErrorCode,
+                                         void *);
+
+    explicit BatchPatcher(PatcherConfig * const pc);
+    ~BatchPatcher();
+
+    unsigned int maxThreads() const;
+    void setMaxThreads(unsigned int threads);
+    uint64_t memoryLimit() const;
+    void setMemoryLimit(uint64_t bytes);
+
+    void setJobProgressCallback(JobProgressCallback cb, void *userData);
+    void setJobFinishedCallback(JobFinishedCallback cb, void *userData);
+
+    unsigned int addJob(const FileInfo * const info,
+                        const std::string &patcherId);
+
+    bool run();
+
+    void cancelJob(unsigned int id);
+    void cancelAll();
+
+    JobState jobState(unsigned int id) const;
+    ErrorCode jobError(unsigned int id) const;
+    std::string jobNewFilePath(unsigned int id) const;
+    uint64_t jobMemoryEstimate(unsigned int id) const;
+
+    Stats stats() const;
+
+    BatchPatcher(const BatchPatcher &) = delete;
+    BatchPatcher & operator=(const BatchPatcher &) = delete;
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+}
@@ -21,18 +21,29 @@
 
 #include <algorithm>
 
+#include <cerrno>
 #include <cstring>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "libmbpio/file.h"
 
 #include "bootimage/androidformat.h"
 #include "bootimage/bumpformat.h"
+#include "bootimage/bumppatcher.h"
 #include "bootimage/lokiformat.h"
+#include "bootimage/segments.h"
+#include "bootimage/sonyelf.h"
 #include "bootimage/sonyelfformat.h"
 
 #include "external/sha.h"
+#include "private/bytescan.h"
 #include "private/fileutils.h"
 #include "private/logging.h"
+#include "private/mappedfile.h"
 
 
 namespace mbp
@@ -74,8 +85,15 @@ public:
     BootImage::Type type = Type::Android;
     BootImage::Type sourceType;
 
+    // Mapped source file that unmodified sections reference
+    std::unique_ptr<MappedFile> source;
+
     ErrorCode error;
 
+    bool loadData(const unsigned char *data, std::size_t size);
+    void releaseSource();
+    bool createSegments(BootImageSegments *segments);
+
 private:
     BootImage *m_parent;
 };
@@ -151,52 +169,127 @@ ErrorCode BootImage::error() const
     return m_impl->error;
 }
 
+/*!
+ * \brief Detect the format of a boot image
+ *
+ * The Android header magic is searched for once and the result is shared by
+ * the Loki, Bump, and Android checks. The remaining magics are at fixed
+ * offsets. The checks are equivalent to the formats' isValid() functions.
+ *
+ * \return Whether the format was detected
+ */
+static bool detectType(const unsigned char *data, std::size_t size,
+                       BootImage::Type *type)
+{
+    // Offset of the Android header within the first 512 bytes
+    std::size_t androidIndex = ByteScan::npos;
+    if (size >= sizeof(BootImageHeader)) {
+        std::size_t range = std::min<std::size_t>(
+                512, size - sizeof(BootImageHeader));
+        androidIndex = ByteScan::find(data, range + BOOT_MAGIC_SIZE,
+                                      BOOT_MAGIC, BOOT_MAGIC_SIZE);
+    }
+
+    bool haveLoki = size >= 0x400 + LOKI_MAGIC_SIZE
+            && std::memcmp(data + 0x400, LOKI_MAGIC, LOKI_MAGIC_SIZE) == 0;
+    bool haveBump = size >= BUMP_MAGIC_SIZE
+            && std::memcmp(data + size - BUMP_MAGIC_SIZE,
+                           BUMP_MAGIC, BUMP_MAGIC_SIZE) == 0;
+    bool haveSony = size >= sizeof(Sony_Elf32_Ehdr)
+            && std::memcmp(data, SONY_E_IDENT, SONY_EI_NIDENT) == 0;
+
+    if (haveLoki && androidIndex != ByteScan::npos && androidIndex <= 32
+            && size >= 32 + sizeof(BootImageHeader)) {
+        *type = BootImage::Type::Loki;
+    } else if (haveBump) {
+        *type = BootImage::Type::Bump;
+    } else if (androidIndex != ByteScan::npos
+            && size >= 512 + sizeof(BootImageHeader)) {
+        *type = BootImage::Type::Android;
+    } else if (haveSony) {
+        *type = BootImage::Type::SonyElf;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
 bool BootImage::isValid(const unsigned char *data, std::size_t size)
 {
-    return LokiFormat::isValid(data, size)
-            || BumpFormat::isValid(data, size)
-            || AndroidFormat::isValid(data, size)
-            || SonyElfFormat::isValid(data, size);
+    Type type;
+    return detectType(data, size, &type);
 }
 
-bool BootImage::load(const unsigned char *data, std::size_t size)
+bool BootImage::Impl::loadData(const unsigned char *data, std::size_t size)
 {
     bool ret = false;
+    Type detected;
 
-    if (LokiFormat::isValid(data, size)) {
+    if (!detectType(data, size, &detected)) {
+        LOGD("Unknown boot image type");
+    } else if (detected == Type::Loki) {
         LOGD("Boot image is a loki'd Android boot image");
-        m_impl->sourceType = Type::Loki;
+        sourceType = Type::Loki;
         // We can't repatch with Loki until we have access to the aboot
         // partition
-        m_impl->type = Type::Android;
-        ret = LokiFormat(&m_impl->i10e).loadImage(data, size);
-    } else if (BumpFormat::isValid(data, size)) {
+        type = Type::Android;
+        ret = LokiFormat(&i10e).loadImage(data, size);
+    } else if (detected == Type::Bump) {
         LOGD("Boot image is a bump'd Android boot image");
-        m_impl->sourceType = Type::Bump;
-        m_impl->type = Type::Bump;
-        ret = BumpFormat(&m_impl->i10e).loadImage(data, size);
-    } else if (AndroidFormat::isValid(data, size)) {
+        sourceType = Type::Bump;
+        type = Type::Bump;
+        ret = BumpFormat(&i10e).loadImage(data, size);
+    } else if (detected == Type::Android) {
         LOGD("Boot image is a plain boot image");
-        m_impl->sourceType = Type::Android;
-        m_impl->type = Type::Android;
-        ret = AndroidFormat(&m_impl->i10e).loadImage(data, size);
-    } else if (SonyElfFormat::isValid(data, size)) {
+        sourceType = Type::Android;
+        type = Type::Android;
+        ret = AndroidFormat(&i10e).loadImage(data, size);
+    } else if (detected == Type::SonyElf) {
         LOGD("Boot image is a Sony ELF32 boot image");
-        m_impl->sourceType = Type::SonyElf;
-        m_impl->type = Type::SonyElf;
-        ret = SonyElfFormat(&m_impl->i10e).loadImage(data, size);
-    } else {
-        LOGD("Unknown boot image type");
+        sourceType = Type::SonyElf;
+        type = Type::SonyElf;
+        ret = SonyElfFormat(&i10e).loadImage(data, size);
     }
 
     if (!ret) {
-        m_impl->error = ErrorCode::BootImageParseError;
+        error = ErrorCode::BootImageParseError;
         return false;
     }
 
     return true;
 }
 
+/*!
+ * \brief Stop referencing the mapped source file
+ *
+ * Sections that still reference the source file are copied before it is
+ * unmapped.
+ */
+void BootImage::Impl::releaseSource()
+{
+    if (!source) {
+        return;
+    }
+
+    for (BootImageSection *s : {
+            &i10e.kernelImage, &i10e.ramdiskImage, &i10e.secondImage,
+            &i10e.dtImage, &i10e.abootImage, &i10e.iplImage, &i10e.rpmImage,
+            &i10e.appsblImage, &i10e.sonySinImage }) {
+        s->vector();
+    }
+
+    i10e.sourceData = nullptr;
+    i10e.sourceSize = 0;
+    source.reset();
+}
+
+bool BootImage::load(const unsigned char *data, std::size_t size)
+{
+    m_impl->releaseSource();
+    return m_impl->loadData(data, size);
+}
+
 /*!
  * \brief Load a boot image from binary data
  *
@@ -218,8 +311,11 @@ bool BootImage::load(const std::vector<unsigned char> &data)
 /*!
  * \brief Load a boot image file
  *
- * This function reads a boot image file and then calls
- * BootImage::load(const std::vector<unsigned char> &)
+ * This function maps a boot image file into memory and then parses it like
+ * BootImage::load(const std::vector<unsigned char> &). The kernel, ramdisk,
+ * and other images are not copied. They reference the mapped file until they
+ * are replaced or requested as a vector (eg. with ramdiskImage()). Use the C
+ * accessors (eg. ramdiskImageC()) to avoid copying them.
  *
  * \warning If the boot image cannot be loaded, do not use the same BootImage
  *          object to load another boot image as it may contain partially
@@ -231,44 +327,42 @@ bool BootImage::load(const std::vector<unsigned char> &data)
  */
 bool BootImage::loadFile(const std::string &filename)
 {
-    std::vector<unsigned char> data;
-    auto ret = FileUtils::readToMemory(filename, &data);
+    m_impl->releaseSource();
+
+    std::unique_ptr<MappedFile> source(new MappedFile());
+    auto ret = source->open(filename);
     if (ret != ErrorCode::NoError) {
         m_impl->error = ret;
         return false;
     }
 
-    return load(data);
+    m_impl->source = std::move(source);
+    m_impl->i10e.sourceData = m_impl->source->data();
+    m_impl->i10e.sourceSize = m_impl->source->size();
+
+    return m_impl->loadData(m_impl->source->data(), m_impl->source->size());
 }
 
-/*!
- * \brief Constructs the boot image binary data
- *
- * This function builds the bootable boot image binary data that the BootImage
- * represents. This is equivalent to AOSP's \a mkbootimg tool.
- *
- * \return Boot image binary data
- */
-bool BootImage::create(std::vector<unsigned char> *data) const
+bool BootImage::Impl::createSegments(BootImageSegments *segments)
 {
     bool ret = false;
 
-    switch (m_impl->type) {
+    switch (type) {
     case Type::Android:
         LOGD("Creating Android boot image");
-        ret = AndroidFormat(&m_impl->i10e).createImage(data);
+        ret = AndroidFormat(&i10e).createImage(segments);
         break;
     case Type::Bump:
         LOGD("Creating bump'd Android boot image");
-        ret = BumpFormat(&m_impl->i10e).createImage(data);
+        ret = BumpFormat(&i10e).createImage(segments);
         break;
     case Type::Loki:
         LOGD("Creating loki'd Android boot image");
-        ret = LokiFormat(&m_impl->i10e).createImage(data);
+        ret = LokiFormat(&i10e).createImage(segments);
         break;
     case Type::SonyElf:
         LOGD("Creating Sony ELF32 boot image");
-        ret = SonyElfFormat(&m_impl->i10e).createImage(data);
+        ret = SonyElfFormat(&i10e).createImage(segments);
         break;
     default:
         LOGE("Unknown boot image type");
@@ -278,11 +372,35 @@ bool BootImage::create(std::vector<unsigned char> *data) const
     return ret;
 }
 
+/*!
+ * \brief Constructs the boot image binary data
+ *
+ * This function builds the bootable boot image binary data that the BootImage
+ * represents. This is equivalent to AOSP's \a mkbootimg tool.
+ *
+ * \note If the boot image only needs to be written to a file or a block
+ *       device, use createFile() instead, which avoids assembling the image
+ *       in memory.
+ *
+ * \return Boot image binary data
+ */
+bool BootImage::create(std::vector<unsigned char> *data) const
+{
+    BootImageSegments segments;
+    if (!m_impl->createSegments(&segments)) {
+        return false;
+    }
+
+    segments.copyTo(data);
+    return true;
+}
+
 /*!
  * \brief Constructs boot image and writes it to a file
  *
- * This is a convenience function that calls BootImage::create() and writes the
- * data to the specified file.
+ * The headers, images, and padding are written directly from the BootImage
+ * with a single writev() call (on systems that support it) instead of first
+ * building the complete boot image in memory. \a path may be a block device.
  *
  * \return Whether the file was successfully written
  *
@@ -290,6 +408,42 @@ bool BootImage::create(std::vector<unsigned char> *data) const
  */
 bool BootImage::createFile(const std::string &path)
 {
+    // Sections that reference the mapped source file would be corrupted if it
+    // were overwritten
+    if (m_impl->source && m_impl->source->isSameFile(path)) {
+        m_impl->releaseSource();
+    }
+
+    BootImageSegments segments;
+    if (!m_impl->createSegments(&segments)) {
+        return false;
+    }
+
+#ifndef _WIN32
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        FLOGE("%s: Failed to open for writing: %s",
+              path.c_str(), strerror(errno));
+
+        m_impl->error = ErrorCode::FileOpenError;
+        return false;
+    }
+
+    if (!segments.writeTo(fd)) {
+        FLOGE("%s: Failed to write file: %s", path.c_str(), strerror(errno));
+
+        close(fd);
+        m_impl->error = ErrorCode::FileWriteError;
+        return false;
+    }
+
+    if (close(fd) < 0) {
+        FLOGE("%s: Failed to close file: %s", path.c_str(), strerror(errno));
+
+        m_impl->error = ErrorCode::FileWriteError;
+        return false;
+    }
+#else
     io::File file;
     if (!file.open(path, io::File::OpenWrite)) {
         FLOGE("%s: Failed to open for writing: %s",
@@ -300,9 +454,7 @@ bool BootImage::createFile(const std::string &path)
     }
 
     std::vector<unsigned char> data;
-    if (!create(&data)) {
-        return false;
-    }
+    segments.copyTo(&data);
 
     uint64_t bytesWritten;
     if (!file.write(data.data(), data.size(), &bytesWritten)) {
@@ -312,6 +464,7 @@ bool BootImage::createFile(const std::string &path)
         m_impl->error = ErrorCode::FileWriteError;
         return false;
     }
+#endif
 
     return true;
 }
@@ -582,7 +735,7 @@ void BootImage::setEntrypointAddress(uint32_t address)
  */
 const std::vector<unsigned char> & BootImage::kernelImage() const
 {
-    return m_impl->i10e.kernelImage;
+    return m_impl->i10e.kernelImage.vector();
 }
 
 /*!
@@ -605,10 +758,7 @@ void BootImage::kernelImageC(const unsigned char **data, std::size_t *size) cons
 
 void BootImage::setKernelImageC(const unsigned char *data, std::size_t size)
 {
-    m_impl->i10e.kernelImage.clear();
-    m_impl->i10e.kernelImage.shrink_to_fit();
-    m_impl->i10e.kernelImage.resize(size);
-    std::memcpy(m_impl->i10e.kernelImage.data(), data, size);
+    m_impl->i10e.kernelImage.assign(data, data + size);
     m_impl->i10e.hdrKernelSize = size;
 }
 
@@ -623,7 +773,7 @@ void BootImage::setKernelImageC(const unsigned char *data, std::size_t size)
  */
 const std::vector<unsigned char> & BootImage::ramdiskImage() const
 {
-    return m_impl->i10e.ramdiskImage;
+    return m_impl->i10e.ramdiskImage.vector();
 }
 
 /*!
@@ -646,10 +796,7 @@ void BootImage::ramdiskImageC(const unsigned char **data, std::size_t *size) con
 
 void BootImage::setRamdiskImageC(const unsigned char *data, std::size_t size)
 {
-    m_impl->i10e.ramdiskImage.clear();
-    m_impl->i10e.ramdiskImage.shrink_to_fit();
-    m_impl->i10e.ramdiskImage.resize(size);
-    std::memcpy(m_impl->i10e.ramdiskImage.data(), data, size);
+    m_impl->i10e.ramdiskImage.assign(data, data + size);
     m_impl->i10e.hdrRamdiskSize = size;
 }
 
@@ -664,7 +811,7 @@ void BootImage::setRamdiskImageC(const unsigned char *data, std::size_t size)
  */
 const std::vector<unsigned char> & BootImage::secondBootloaderImage() const
 {
-    return m_impl->i10e.secondImage;
+    return m_impl->i10e.secondImage.vector();
 }
 
 /*!
@@ -687,10 +834,7 @@ void BootImage::secondBootloaderImageC(const unsigned char **data, std::size_t *
 
 void BootImage::setSecondBootloaderImageC(const unsigned char *data, std::size_t size)
 {
-    m_impl->i10e.secondImage.clear();
-    m_impl->i10e.secondImage.shrink_to_fit();
-    m_impl->i10e.secondImage.resize(size);
-    std::memcpy(m_impl->i10e.secondImage.data(), data, size);
+    m_impl->i10e.secondImage.assign(data, data + size);
     m_impl->i10e.hdrSecondSize = size;
 }
 
@@ -705,7 +849,7 @@ void BootImage::setSecondBootloaderImageC(const unsigned char *data, std::size_t
  */
 const std::vector<unsigned char> & BootImage::deviceTreeImage() const
 {
-    return m_impl->i10e.dtImage;
+    return m_impl->i10e.dtImage.vector();
 }
 
 /*!
@@ -728,10 +872,7 @@ void BootImage::deviceTreeImageC(const unsigned char **data, std::size_t *size)
 
 void BootImage::setDeviceTreeImageC(const unsigned char *data, std::size_t size)
 {
-    m_impl->i10e.dtImage.clear();
-    m_impl->i10e.dtImage.shrink_to_fit();
-    m_impl->i10e.dtImage.resize(size);
-    std::memcpy(m_impl->i10e.dtImage.data(), data, size);
+    m_impl->i10e.dtImage.assign(data, data + size);
     m_impl->i10e.hdrDtSize = size;
 }
 
@@ -741,7 +882,7 @@ void BootImage::setDeviceTreeImageC(const unsigned char *data, std::size_t size)
 
 const std::vector<unsigned char> & BootImage::abootImage() const
 {
-    return m_impl->i10e.abootImage;
+    return m_impl->i10e.abootImage.vector();
 }
 
 void BootImage::setAbootImage(std::vector<unsigned char> data)
@@ -757,10 +898,7 @@ void BootImage::abootImageC(const unsigned char **data, std::size_t *size) const
 
 void BootImage::setAbootImageC(const unsigned char *data, std::size_t size)
 {
-    m_impl->i10e.abootImage.clear();
-    m_impl->i10e.abootImage.shrink_to_fit();
-    m_impl->i10e.abootImage.resize(size);
-    std::memcpy(m_impl->i10e.abootImage.data(), data, size);
+    m_impl->i10e.abootImage.assign(data, data + size);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -769,7 +907,7 @@ void BootImage::setAbootImageC(const unsigned char *data, std::size_t size)
 
 const std::vector<unsigned char> & BootImage::iplImage() const
 {
-    return m_impl->i10e.iplImage;
+    return m_impl->i10e.iplImage.vector();
 }
 
 void BootImage::setIplImage(std::vector<unsigned char> data)
@@ -785,10 +923,7 @@ void BootImage::iplImageC(const unsigned char **data, std::size_t *size) const
 
 void BootImage::setIplImageC(const unsigned char *data, std::size_t size)
 {
-    m_impl->i10e.iplImage.clear();
-    m_impl->i10e.iplImage.shrink_to_fit();
-    m_impl->i10e.iplImage.resize(size);
-    std::memcpy(m_impl->i10e.iplImage.data(), data, size);
+    m_impl->i10e.iplImage.assign(data, data + size);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -797,7 +932,7 @@ void BootImage::setIplImageC(const unsigned char *data, std::size_t size)
 
 const std::vector<unsigned char> & BootImage::rpmImage() const
 {
-    return m_impl->i10e.rpmImage;
+    return m_impl->i10e.rpmImage.vector();
 }
 
 void BootImage::setRpmImage(std::vector<unsigned char> data)
@@ -813,10 +948,7 @@ void BootImage::rpmImageC(const unsigned char **data, std::size_t *size) const
 
 void BootImage::setRpmImageC(const unsigned char *data, std::size_t size)
 {
-    m_impl->i10e.rpmImage.clear();
-    m_impl->i10e.rpmImage.shrink_to_fit();
-    m_impl->i10e.rpmImage.resize(size);
-    std::memcpy(m_impl->i10e.rpmImage.data(), data, size);
+    m_impl->i10e.rpmImage.assign(data, data + size);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -825,7 +957,7 @@ void BootImage::setRpmImageC(const unsigned char *data, std::size_t size)
 
 const std::vector<unsigned char> & BootImage::appsblImage() const
 {
-    return m_impl->i10e.appsblImage;
+    return m_impl->i10e.appsblImage.vector();
 }
 
 void BootImage::setAppsblImage(std::vector<unsigned char> data)
@@ -841,10 +973,7 @@ void BootImage::appsblImageC(const unsigned char **data, std::size_t *size) cons
 
 void BootImage::setAppsblImageC(const unsigned char *data, std::size_t size)
 {
-    m_impl->i10e.appsblImage.clear();
-    m_impl->i10e.appsblImage.shrink_to_fit();
-    m_impl->i10e.appsblImage.resize(size);
-    std::memcpy(m_impl->i10e.appsblImage.data(), data, size);
+    m_impl->i10e.appsblImage.assign(data, data + size);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -853,7 +982,7 @@ void BootImage::setAppsblImageC(const unsigned char *data, std::size_t size)
 
 const std::vector<unsigned char> & BootImage::sinImage() const
 {
-    return m_impl->i10e.sonySinImage;
+    return m_impl->i10e.sonySinImage.vector();
 }
 
 void BootImage::setSinImage(std::vector<unsigned char> data)
@@ -869,10 +998,7 @@ void BootImage::sinImageC(const unsigned char **data, std::size_t *size) const
 
 void BootImage::setSinImageC(const unsigned char *data, std::size_t size)
 {
-    m_impl->i10e.sonySinImage.clear();
-    m_impl->i10e.sonySinImage.shrink_to_fit();
-    m_impl->i10e.sonySinImage.resize(size);
-    std::memcpy(m_impl->i10e.sonySinImage.data(), data, size);
+    m_impl->i10e.sonySinImage.assign(data, data + size);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -23,6 +23,7 @@
 
 #include "bootimage-common.h"
 #include "external/sha.h"
+#include "private/bytescan.h"
 #include "private/logging.h"
 
 namespace mbp
@@ -83,7 +84,9 @@ bool AndroidFormat::loadImage(const unsigned char *data, std::size_t size)
         return false;
     }
 
-    mI10e->kernelImage.assign(data + pos, data + pos + mI10e->hdrKernelSize);
+    loadSection(&mI10e->kernelImage,
+                data + pos,
+                data + pos + mI10e->hdrKernelSize);
 
     // Save ramdisk image
     pos += mI10e->hdrKernelSize;
@@ -94,7 +97,9 @@ bool AndroidFormat::loadImage(const unsigned char *data, std::size_t size)
         return false;
     }
 
-    mI10e->ramdiskImage.assign(data + pos, data + pos + mI10e->hdrRamdiskSize);
+    loadSection(&mI10e->ramdiskImage,
+                data + pos,
+                data + pos + mI10e->hdrRamdiskSize);
 
     // Save second bootloader image
     pos += mI10e->hdrRamdiskSize;
@@ -107,7 +112,9 @@ bool AndroidFormat::loadImage(const unsigned char *data, std::size_t size)
 
     // The second bootloader may not exist
     if (mI10e->hdrSecondSize > 0) {
-        mI10e->secondImage.assign(data + pos, data + pos + mI10e->hdrSecondSize);
+        loadSection(&mI10e->secondImage,
+                    data + pos,
+                    data + pos + mI10e->hdrSecondSize);
     } else {
         mI10e->secondImage.clear();
     }
@@ -124,9 +131,13 @@ bool AndroidFormat::loadImage(const unsigned char *data, std::size_t size)
               " bytes and HAS BEEN TRUNCATED", diff);
         FLOGE("WARNING WARNING WARNING WARNING WARNING WARNING WARNING WARNING");
 
-        mI10e->dtImage.assign(data + pos, data + pos + mI10e->hdrDtSize - diff);
+        loadSection(&mI10e->dtImage,
+                    data + pos,
+                    data + pos + mI10e->hdrDtSize - diff);
     } else {
-        mI10e->dtImage.assign(data + pos, data + pos + mI10e->hdrDtSize);
+        loadSection(&mI10e->dtImage,
+                    data + pos,
+                    data + pos + mI10e->hdrDtSize);
     }
 
     // The device tree image may not exist as well
@@ -140,34 +151,67 @@ bool AndroidFormat::loadImage(const unsigned char *data, std::size_t size)
     return true;
 }
 
-bool AndroidFormat::createImage(std::vector<unsigned char> *dataOut)
+bool AndroidFormat::createImage(BootImageSegments *segments)
 {
     BootImageHeader hdr;
-    std::vector<unsigned char> data;
+    if (!createHeader(&hdr)) {
+        return false;
+    }
+
+    // Header and padding
+    unsigned char *hdrPage = segments->addOwned(hdr.page_size);
+    std::memcpy(hdrPage, &hdr, sizeof(BootImageHeader));
+
+    // Kernel image
+    segments->add(mI10e->kernelImage);
+    segments->pad(hdr.page_size);
+
+    // Ramdisk image
+    segments->add(mI10e->ramdiskImage);
+    segments->pad(hdr.page_size);
+
+    // Second bootloader image
+    if (!mI10e->secondImage.empty()) {
+        segments->add(mI10e->secondImage);
+        segments->pad(hdr.page_size);
+    }
 
-    memset(&hdr, 0, sizeof(BootImageHeader));
+    // Device tree image
+    if (!mI10e->dtImage.empty()) {
+        segments->add(mI10e->dtImage);
+        segments->pad(hdr.page_size);
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Fill in an Android boot image header from the intermediate data
+ *
+ * \return Whether the header is valid
+ */
+bool AndroidFormat::createHeader(BootImageHeader *hdr)
+{
+    std::memset(hdr, 0, sizeof(BootImageHeader));
 
     // Set header metadata fields
-    memcpy(hdr.magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
-    hdr.kernel_size = mI10e->hdrKernelSize;
-    hdr.kernel_addr = mI10e->kernelAddr;
-    hdr.ramdisk_size = mI10e->hdrRamdiskSize;
-    hdr.ramdisk_addr = mI10e->ramdiskAddr;
-    hdr.second_size = mI10e->hdrSecondSize;
-    hdr.second_addr = mI10e->secondAddr;
-    hdr.tags_addr = mI10e->tagsAddr;
-    hdr.page_size = mI10e->pageSize;
-    hdr.dt_size = mI10e->hdrDtSize;
-    hdr.unused = mI10e->hdrUnused;
+    std::memcpy(hdr->magic, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+    hdr->kernel_size = mI10e->hdrKernelSize;
+    hdr->kernel_addr = mI10e->kernelAddr;
+    hdr->ramdisk_size = mI10e->hdrRamdiskSize;
+    hdr->ramdisk_addr = mI10e->ramdiskAddr;
+    hdr->second_size = mI10e->hdrSecondSize;
+    hdr->second_addr = mI10e->secondAddr;
+    hdr->tags_addr = mI10e->tagsAddr;
+    hdr->page_size = mI10e->pageSize;
+    hdr->dt_size = mI10e->hdrDtSize;
+    hdr->unused = mI10e->hdrUnused;
     // -1 for null byte
-    std::strcpy(reinterpret_cast<char *>(hdr.name),
+    std::strcpy(reinterpret_cast<char *>(hdr->name),
                 mI10e->boardName.substr(0, BOOT_NAME_SIZE - 1).c_str());
-    std::strcpy(reinterpret_cast<char *>(hdr.cmdline),
+    std::strcpy(reinterpret_cast<char *>(hdr->cmdline),
                 mI10e->cmdline.substr(0, BOOT_ARGS_SIZE - 1).c_str());
 
-    // Update SHA1
-    updateSha1Hash(&hdr);
-
     switch (mI10e->pageSize) {
     case 2048:
     case 4096:
@@ -182,55 +226,9 @@ bool AndroidFormat::createImage(std::vector<unsigned char> *dataOut)
         return false;
     }
 
-    // Header
-    unsigned char *hdrBegin = reinterpret_cast<unsigned char *>(&hdr);
-    data.insert(data.end(), hdrBegin, hdrBegin + sizeof(BootImageHeader));
-
-    // Padding
-    uint32_t paddingSize = skipPadding(sizeof(BootImageHeader), hdr.page_size);
-    data.insert(data.end(), paddingSize, 0);
-
-    // Kernel image
-    data.insert(data.end(),
-                mI10e->kernelImage.begin(),
-                mI10e->kernelImage.end());
-
-    // More padding
-    paddingSize = skipPadding(mI10e->kernelImage.size(), hdr.page_size);
-    data.insert(data.end(), paddingSize, 0);
-
-    // Ramdisk image
-    data.insert(data.end(),
-                mI10e->ramdiskImage.begin(),
-                mI10e->ramdiskImage.end());
-
-    // Even more padding
-    paddingSize = skipPadding(mI10e->ramdiskImage.size(), hdr.page_size);
-    data.insert(data.end(), paddingSize, 0);
-
-    // Second bootloader image
-    if (!mI10e->secondImage.empty()) {
-        data.insert(data.end(),
-                    mI10e->secondImage.begin(),
-                    mI10e->secondImage.end());
-
-        // Enough padding already!
-        paddingSize = skipPadding(mI10e->secondImage.size(), hdr.page_size);
-        data.insert(data.end(), paddingSize, 0);
-    }
-
-    // Device tree image
-    if (!mI10e->dtImage.empty()) {
-        data.insert(data.end(),
-                    mI10e->dtImage.begin(),
-                    mI10e->dtImage.end());
-
-        // Last bit of padding (I hope)
-        paddingSize = skipPadding(mI10e->dtImage.size(), hdr.page_size);
-        data.insert(data.end(), paddingSize, 0);
-    }
+    // Update SHA1
+    updateSha1Hash(hdr);
 
-    dataOut->swap(data);
     return true;
 }
 
@@ -244,14 +242,14 @@ bool AndroidFormat::findHeader(const unsigned char *data, std::size_t size,
     }
 
     // Find the Android magic string
-    for (std::size_t i = 0; i <= searchRange; ++i) {
-        if (std::memcmp(data + i, BOOT_MAGIC, BOOT_MAGIC_SIZE) == 0) {
-            *headerIndex = i;
-            return true;
-        }
+    std::size_t index = ByteScan::find(data, searchRange + BOOT_MAGIC_SIZE,
+                                       BOOT_MAGIC, BOOT_MAGIC_SIZE);
+    if (index == ByteScan::npos) {
+        return false;
     }
 
-    return false;
+    *headerIndex = index;
+    return true;
 }
 
 void AndroidFormat::updateSha1Hash(BootImageHeader *hdr)
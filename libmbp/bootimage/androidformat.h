@@ -37,10 +37,12 @@ public:
 
     virtual bool loadImage(const unsigned char *data, std::size_t size) override;
 
-    virtual bool createImage(std::vector<unsigned char> *dataOut) override;
+    virtual bool createImage(BootImageSegments *segments) override;
 
     ///
 
+    bool createHeader(BootImageHeader *hdr);
+
     void updateSha1Hash(BootImageHeader *hdr);
 
     static uint32_t skipPadding(const uint32_t itemSize,
@@ -42,18 +42,16 @@ bool BumpFormat::isValid(const unsigned char *data, std::size_t size)
                            BUMP_MAGIC, BUMP_MAGIC_SIZE) == 0;
 }
 
-bool BumpFormat::createImage(std::vector<unsigned char> *dataOut)
+bool BumpFormat::createImage(BootImageSegments *segments)
 {
-    std::vector<unsigned char> data;
-    if (!AndroidFormat::createImage(&data)) {
+    if (!AndroidFormat::createImage(segments)) {
         return false;
     }
 
-    if (!BumpPatcher::patchImage(&data)) {
-        return false;
-    }
-
-    dataOut->swap(data);
+    // The Android image is already padded, so the magic can be appended
+    // directly (same as BumpPatcher::patchImage())
+    segments->add(reinterpret_cast<const unsigned char *>(BUMP_MAGIC),
+                  BUMP_MAGIC_SIZE);
     return true;
 }
 
@@ -32,4 +32,24 @@ BootImageFormat::~BootImageFormat()
 {
 }
 
+/*!
+ * \brief Load a section from the source boot image
+ *
+ * If the range is within BootImageIntermediate::sourceData, the section will
+ * reference the source instead of copying the data.
+ */
+void BootImageFormat::loadSection(BootImageSection *section,
+                                  const unsigned char *begin,
+                                  const unsigned char *end)
+{
+    const unsigned char *srcBegin = mI10e->sourceData;
+    const unsigned char *srcEnd = srcBegin + mI10e->sourceSize;
+
+    if (srcBegin && begin >= srcBegin && end <= srcEnd && begin < end) {
+        section->setView(begin, end - begin);
+    } else {
+        section->assign(begin, end);
+    }
+}
+
 }
@@ -22,6 +22,7 @@
 #include <vector>
 
 #include "bootimage/intermediate.h"
+#include "bootimage/segments.h"
 
 namespace mbp
 {
@@ -36,9 +37,12 @@ public:
 
     virtual bool loadImage(const unsigned char *data, std::size_t size) = 0;
 
-    virtual bool createImage(std::vector<unsigned char> *dataOut) = 0;
+    virtual bool createImage(BootImageSegments *segments) = 0;
 
 protected:
+    void loadSection(BootImageSection *section,
+                     const unsigned char *begin, const unsigned char *end);
+
     BootImageIntermediate *mI10e;
 };
 
@@ -17,9 +17,14 @@
  * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string>
 #include <unordered_map>
 #include <vector>
 
+#include <cstdint>
+
+#include "bootimage/section.h"
+
 class BootImageFormat;
 
 struct BootImageIntermediate
@@ -35,15 +40,15 @@ struct BootImageIntermediate
     uint32_t pageSize = 0;                   // | X       | X    | X    |      |
     std::string boardName;                   // | X       | X    | X    |      |
     std::string cmdline;                     // | X       | X    | X    |      |
-    std::vector<unsigned char> kernelImage;  // | X       | X    | X    | X    |
-    std::vector<unsigned char> ramdiskImage; // | X       | X    | X    | X    |
-    std::vector<unsigned char> secondImage;  // | X       | X    | X    |      |
-    std::vector<unsigned char> dtImage;      // | X       | X    | X    |      |
-    std::vector<unsigned char> abootImage;   // |         | X    |      |      |
-    std::vector<unsigned char> iplImage;     // |         |      |      | X    |
-    std::vector<unsigned char> rpmImage;     // |         |      |      | X    |
-    std::vector<unsigned char> appsblImage;  // |         |      |      | X    |
-    std::vector<unsigned char> sonySinImage; // |         |      |      | X    |
+    BootImageSection kernelImage;            // | X       | X    | X    | X    |
+    BootImageSection ramdiskImage;           // | X       | X    | X    | X    |
+    BootImageSection secondImage;            // | X       | X    | X    |      |
+    BootImageSection dtImage;                // | X       | X    | X    |      |
+    BootImageSection abootImage;             // |         | X    |      |      |
+    BootImageSection iplImage;               // |         |      |      | X    |
+    BootImageSection rpmImage;               // |         |      |      | X    |
+    BootImageSection appsblImage;            // |         |      |      | X    |
+    BootImageSection sonySinImage;           // |         |      |      | X    |
     std::vector<unsigned char> sonySinHdr;   // |         |      |      | X    |
     // Raw header values                        |---------|------|------|------|
     uint32_t hdrKernelSize = 0;              // | X       | X    | X    |      |
@@ -53,4 +58,9 @@ struct BootImageIntermediate
     uint32_t hdrUnused = 0;                  // | X       | X    | X    |      |
     uint32_t hdrId[8] = { 0 };               // | X       | X    | X    |      |
     uint32_t hdrEntrypoint = 0;              // |         |      |      | X    |
+
+    // Source data that sections may reference instead of copying. This is set
+    // only when the source outlives the intermediate (eg. a mapped file).
+    const unsigned char *sourceData = nullptr;
+    std::size_t sourceSize = 0;
 };
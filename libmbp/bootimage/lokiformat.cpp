@@ -24,6 +24,7 @@
 #include <cstring>
 
 #include "bootimage.h"
+#include "private/bytescan.h"
 #include "private/logging.h"
 
 namespace mbp
@@ -95,18 +96,70 @@ bool LokiFormat::loadImage(const unsigned char *data, std::size_t size)
     }
 }
 
-bool LokiFormat::createImage(std::vector<unsigned char> *dataOut)
+/*!
+ * \brief Add the first \a size bytes that follow the ramdisk in an Android
+ *        boot image
+ *
+ * These are the second bootloader image and the device tree image, each
+ * padded to a page, followed by zeros.
+ */
+static void addAfterRamdisk(BootImageSegments *segments,
+                            const BootImageIntermediate *i10e,
+                            std::size_t size)
+{
+    for (const BootImageSection *section
+            : { &i10e->secondImage, &i10e->dtImage }) {
+        if (section->empty()) {
+            continue;
+        }
+
+        std::size_t n = std::min(size, section->size());
+        segments->add(section->data(), n);
+        size -= n;
+
+        n = std::min<std::size_t>(size, AndroidFormat::skipPadding(
+                section->size(), i10e->pageSize));
+        segments->addPadding(n);
+        size -= n;
+    }
+
+    segments->addPadding(size);
+}
+
+bool LokiFormat::createImage(BootImageSegments *segments)
 {
-    std::vector<unsigned char> data;
-    if (!AndroidFormat::createImage(&data)) {
+    BootImageHeader hdr;
+    if (!createHeader(&hdr)) {
         return false;
     }
 
-    if (!LokiPatcher::patchImage(&data, mI10e->abootImage)) {
+    // Header page (patched in place)
+    unsigned char *hdrPage = segments->addOwned(hdr.page_size);
+    std::memcpy(hdrPage, &hdr, sizeof(BootImageHeader));
+
+    std::vector<unsigned char> code;
+    if (!LokiPatcher::patchImage(hdrPage, hdr.page_size,
+                                 mI10e->abootImage.vector(), &code)) {
         return false;
     }
 
-    dataOut->swap(data);
+    // Kernel image
+    segments->add(mI10e->kernelImage);
+    segments->pad(hdr.page_size);
+
+    // Ramdisk image
+    segments->add(mI10e->ramdiskImage);
+    segments->pad(hdr.page_size);
+
+    // Original aboot code with the shellcode
+    segments->addOwned(std::move(code));
+
+    // Device tree image (not padded). Like loki_patch, this is the dt_size
+    // bytes that come after the ramdisk in the unpatched image.
+    if (hdr.dt_size != 0) {
+        addAfterRamdisk(segments, mI10e, hdr.dt_size);
+    }
+
     return true;
 }
 
@@ -141,14 +194,14 @@ bool LokiFormat::loadLokiNewImage(const unsigned char *data, std::size_t size,
     uint32_t pageRamdiskSize = (loki->orig_ramdisk_size + pageMask) & ~pageMask;
 
     // Kernel image
-    mI10e->kernelImage.assign(
-            data + mI10e->pageSize,
-            data + mI10e->pageSize + loki->orig_kernel_size);
+    loadSection(&mI10e->kernelImage,
+                data + mI10e->pageSize,
+                data + mI10e->pageSize + loki->orig_kernel_size);
 
     // Ramdisk image
-    mI10e->ramdiskImage.assign(
-            data + mI10e->pageSize + pageKernelSize,
-            data + mI10e->pageSize + pageKernelSize + loki->orig_ramdisk_size);
+    loadSection(&mI10e->ramdiskImage,
+                data + mI10e->pageSize + pageKernelSize,
+                data + mI10e->pageSize + pageKernelSize + loki->orig_ramdisk_size);
 
     // No second bootloader image
     mI10e->secondImage.clear();
@@ -157,7 +210,7 @@ bool LokiFormat::loadLokiNewImage(const unsigned char *data, std::size_t size,
     if (mI10e->hdrDtSize != 0) {
         auto startPtr = data + mI10e->pageSize
                 + pageKernelSize + pageRamdiskSize + fakeSize;
-        mI10e->dtImage.assign(startPtr, startPtr + mI10e->hdrDtSize);
+        loadSection(&mI10e->dtImage, startPtr, startPtr + mI10e->hdrDtSize);
     } else {
         mI10e->dtImage.clear();
     }
@@ -215,14 +268,14 @@ bool LokiFormat::loadLokiOldImage(const unsigned char *data, std::size_t size,
     mI10e->ramdiskAddr = ramdiskAddr;
 
     // Kernel image
-    mI10e->kernelImage.assign(
-            data + mI10e->pageSize,
-            data + mI10e->pageSize + kernelSize);
+    loadSection(&mI10e->kernelImage,
+                data + mI10e->pageSize,
+                data + mI10e->pageSize + kernelSize);
 
     // Ramdisk image
-    mI10e->ramdiskImage.assign(
-            data + gzipOffset,
-            data + gzipOffset + ramdiskSize);
+    loadSection(&mI10e->ramdiskImage,
+                data + gzipOffset,
+                data + gzipOffset + ramdiskSize);
 
     // No second bootloader image
     mI10e->secondImage.clear();
@@ -251,16 +304,17 @@ uint32_t LokiFormat::lokiOldFindGzipOffset(const unsigned char *data, std::size_
 
     uint32_t curOffset = startOffset - 1;
 
-    while (true) {
+    while (curOffset + 1 < size) {
         // Try to find gzip header
-        auto it = std::search(data + curOffset + 1, data + size,
-                              gzipDeflate, gzipDeflate + 3);
+        std::size_t index = ByteScan::find(data + curOffset + 1,
+                                           size - curOffset - 1,
+                                           gzipDeflate, sizeof(gzipDeflate));
 
-        if (it == data + size) {
+        if (index == ByteScan::npos) {
             break;
         }
 
-        curOffset = it - data;
+        curOffset += 1 + index;
 
         // We're checking 1 more byte so make sure it's within bounds
         if (curOffset + 1 >= size) {
@@ -355,12 +409,16 @@ uint32_t LokiFormat::lokiFindRamdiskAddress(const unsigned char *data, std::size
     uint32_t ramdiskAddr = 0;
 
     if (loki->ramdisk_addr != 0) {
-        for (uint32_t i = 0; i < size - (LOKI_SHELLCODE_SIZE - 9); ++i) {
-            if (std::memcmp(&data[i], LOKI_SHELLCODE, LOKI_SHELLCODE_SIZE - 9) == 0) {
-                ramdiskAddr = *(reinterpret_cast<const uint32_t *>(
-                        &data[i] + LOKI_SHELLCODE_SIZE - 5));
-                break;
-            }
+        // Leave room for the ramdisk address stored near the end of the
+        // shellcode
+        std::size_t index = ByteScan::npos;
+        if (size >= LOKI_SHELLCODE_SIZE - 1) {
+            index = ByteScan::find(data, size - 8, LOKI_SHELLCODE,
+                                   LOKI_SHELLCODE_SIZE - 9);
+        }
+        if (index != ByteScan::npos) {
+            ramdiskAddr = *(reinterpret_cast<const uint32_t *>(
+                    &data[index] + LOKI_SHELLCODE_SIZE - 5));
         }
 
         if (ramdiskAddr == 0) {
@@ -38,6 +38,7 @@
 #include <cstring>
 
 #include "bootimage/header.h"
+#include "private/bytescan.h"
 #include "private/logging.h"
 
 struct LokiTarget {
@@ -131,32 +132,50 @@ static bool patchShellcode(uint32_t header, uint32_t ramdisk,
     return foundHeader && foundRamdisk;
 }
 
-bool LokiPatcher::patchImage(std::vector<unsigned char> *data,
-                             std::vector<unsigned char> aboot)
+/*
+ * The first page of the boot image is patched in place. The original code of
+ * aboot's signature checking function, with the shellcode applied, is returned
+ * in codeOut and must be written directly after the (page-aligned) ramdisk.
+ * The device tree image, if any, follows it.
+ */
+bool LokiPatcher::patchImage(unsigned char *header, std::size_t headerSize,
+                             std::vector<unsigned char> aboot,
+                             std::vector<unsigned char> *codeOut)
 {
     if (aboot.empty()) {
         FLOGE("[Loki] Aboot image cannot be empty");
         return false;
     }
 
+    if (headerSize < 0x400 + sizeof(LokiHeader)) {
+        FLOGE("[Loki] Header page must be at least %" PRIzu " bytes",
+              0x400 + sizeof(LokiHeader));
+        return false;
+    }
+
     // Prevent reading out of bounds
-    data->resize((data->size() + 0x2000 + 0xfff) & ~0xfff);
     aboot.resize((aboot.size() + 0xfff) & ~0xfff);
 
     uint32_t target = 0;
     uint32_t abootBase = *reinterpret_cast<uint32_t *>(aboot.data() + 12) - 0x28;
 
+    // Only search the offsets that the original loki_patch checks
+    std::size_t searchSize = aboot.size() - 0x1000 + 8 - 1;
+
     // Find the signature checking function via pattern matching
-    for (const unsigned char *ptr = aboot.data();
-            ptr < aboot.data() + aboot.size() - 0x1000; ++ptr) {
-        if (!memcmp(ptr, PATTERN1, 8) ||
-                !memcmp(ptr, PATTERN2, 8) ||
-                !memcmp(ptr, PATTERN3, 8) ||
-                !memcmp(ptr, PATTERN4, 8) ||
-                !memcmp(ptr, PATTERN5, 8)) {
-            target = static_cast<uint32_t>(ptr - aboot.data() + abootBase);
-            break;
-        }
+    static const mbp::ByteScan::Pattern patterns[] = {
+        { PATTERN1, 8 },
+        { PATTERN2, 8 },
+        { PATTERN3, 8 },
+        { PATTERN4, 8 },
+        { PATTERN5, 8 },
+    };
+    std::size_t which;
+    std::size_t index = mbp::ByteScan::findAny(
+            aboot.data(), searchSize, patterns,
+            sizeof(patterns) / sizeof(patterns[0]), &which);
+    if (index != mbp::ByteScan::npos) {
+        target = static_cast<uint32_t>(index + abootBase);
     }
 
     // Do a second pass for the second LG pattern. This is necessary because
@@ -164,12 +183,9 @@ bool LokiPatcher::patchImage(std::vector<unsigned char> *data,
     // fingerprinting.
 
     if (!target) {
-        for (const unsigned char *ptr = aboot.data();
-                ptr < aboot.data() + aboot.size() - 0x1000; ++ptr) {
-            if (memcmp(ptr, PATTERN6, 8) == 0) {
-                target = static_cast<uint32_t>(ptr - aboot.data() + abootBase);
-                break;
-            }
+        index = mbp::ByteScan::find(aboot.data(), searchSize, PATTERN6, 8);
+        if (index != mbp::ByteScan::npos) {
+            target = static_cast<uint32_t>(index + abootBase);
         }
     }
 
@@ -195,8 +211,8 @@ bool LokiPatcher::patchImage(std::vector<unsigned char> *data,
     FLOGD("[Loki] Detected target %s %s build %s",
           tgt->vendor, tgt->device, tgt->build);
 
-    BootImageHeader *hdr = reinterpret_cast<BootImageHeader *>(data->data());
-    LokiHeader *lokiHdr = reinterpret_cast<LokiHeader *>(data->data() + 0x400);
+    BootImageHeader *hdr = reinterpret_cast<BootImageHeader *>(header);
+    LokiHeader *lokiHdr = reinterpret_cast<LokiHeader *>(header + 0x400);
 
     // Set the Loki header
     memcpy(lokiHdr->magic, LOKI_MAGIC, LOKI_MAGIC_SIZE);
@@ -243,79 +259,20 @@ bool LokiPatcher::patchImage(std::vector<unsigned char> *data,
         hdr->ramdisk_size = 0;
     }
 
-    std::vector<unsigned char> newImage;
-
-    if (pageSize > data->size()) {
-        FLOGE("[Loki] Header exceeds boot image size by %" PRIzu " bytes",
-              pageSize - data->size());
-        return false;
-    }
-
-    // Write the image header
-    newImage.insert(newImage.end(),
-                    data->data(),
-                    data->data() + pageSize);
-
-    uint32_t pageKernelSize = (origKernelSize + pageMask) & ~pageMask;
-
-    if (pageSize + pageKernelSize > data->size()) {
-        FLOGE("[Loki] Kernel exceeds boot image size by %" PRIzu " bytes",
-              pageSize + pageKernelSize - data->size());
-        return false;
-    }
-
-    // Write the kernel
-    newImage.insert(newImage.end(),
-                    data->data() + pageSize,
-                    data->data() + pageSize + pageKernelSize);
-
-    uint32_t pageRamdiskSize = (origRamdiskSize + pageMask) & ~pageMask;
-
-    if (pageSize + pageKernelSize + pageRamdiskSize > data->size()) {
-        FLOGE("[Loki] Ramdisk exceeds boot image size by %" PRIzu " bytes",
-              pageSize + pageKernelSize + pageRamdiskSize - data->size());
-        return false;
-    }
-
-    // Write the ramdisk
-    newImage.insert(newImage.end(),
-                    data->data() + pageSize + pageKernelSize,
-                    data->data() + pageSize + pageKernelSize + pageRamdiskSize);
-
     if (tgt->check_sigs - abootBase - offset + fakeSize > aboot.size()) {
         FLOGE("[Loki] Requested aboot segment exceeds aboot size by %" PRIzu " bytes",
               tgt->check_sigs - abootBase - offset + fakeSize - aboot.size());
         return false;
     }
 
-    // Write fake size bytes of original code to the output
-    newImage.insert(newImage.end(),
-                    aboot.data() + tgt->check_sigs - abootBase - offset,
+    // Fake size bytes of original code
+    codeOut->assign(aboot.data() + tgt->check_sigs - abootBase - offset,
                     aboot.data() + tgt->check_sigs - abootBase - offset + fakeSize);
 
-    // Save this position for later
-    uint32_t pos = newImage.size();
-
-    if (hdr->dt_size) {
-        LOGD("[Loki] Writing device tree");
-
-        if (pageSize + pageKernelSize + pageRamdiskSize + hdr->dt_size > data->size()) {
-            FLOGE("[Loki] Device tree image exceeds boot image size by %" PRIzu " bytes",
-                  pageSize + pageKernelSize + pageRamdiskSize + hdr->dt_size - data->size());
-            return false;
-        }
-
-        newImage.insert(newImage.end(),
-                        data->data() + pageSize + pageKernelSize + pageRamdiskSize,
-                        data->data() + pageSize + pageKernelSize + pageRamdiskSize + hdr->dt_size);
-    }
-
     // Write the patch
-    memcpy(newImage.data() + pos - (fakeSize - offset), patch, sizeof(patch));
+    memcpy(codeOut->data() + offset, patch, sizeof(patch));
 
     LOGD("[Loki] Patching completed");
 
-    data->swap(newImage);
-
     return true;
 }
@@ -36,6 +36,7 @@
 #pragma once
 
 #include <vector>
+#include <cstddef>
 #include <cstdint>
 
 
@@ -90,6 +91,7 @@ struct LokiHeader {
 class LokiPatcher
 {
 public:
-    static bool patchImage(std::vector<unsigned char> *data,
-                           std::vector<unsigned char> aboot);
+    static bool patchImage(unsigned char *header, std::size_t headerSize,
+                           std::vector<unsigned char> aboot,
+                           std::vector<unsigned char> *codeOut);
 };
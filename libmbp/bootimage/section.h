@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <vector>
+
+#include <cstring>
+
+/*!
+ * \brief Image (kernel, ramdisk, etc.) stored in a boot image
+ *
+ * A section either owns its data or references a range of the source boot
+ * image (eg. a memory-mapped file). A referenced section is only copied if
+ * vector() is called or if the section is replaced.
+ *
+ * Only vector() may be called concurrently on the same section. The other
+ * functions must not be called while another thread is using the section.
+ */
+class BootImageSection
+{
+public:
+    BootImageSection() = default;
+
+    BootImageSection(std::vector<unsigned char> data)
+        : m_data(std::move(data))
+    {
+    }
+
+    BootImageSection(const BootImageSection &other)
+        : m_data(other.m_data), m_view(other.m_view),
+        m_viewSize(other.m_viewSize)
+    {
+    }
+
+    BootImageSection(BootImageSection &&other)
+        : m_data(std::move(other.m_data)), m_view(other.m_view),
+        m_viewSize(other.m_viewSize)
+    {
+        other.m_view = nullptr;
+        other.m_viewSize = 0;
+    }
+
+    BootImageSection & operator=(const BootImageSection &other)
+    {
+        if (this != &other) {
+            m_data = other.m_data;
+            m_view = other.m_view;
+            m_viewSize = other.m_viewSize;
+        }
+        return *this;
+    }
+
+    BootImageSection & operator=(BootImageSection &&other)
+    {
+        if (this != &other) {
+            m_data = std::move(other.m_data);
+            m_view = other.m_view;
+            m_viewSize = other.m_viewSize;
+            other.m_view = nullptr;
+            other.m_viewSize = 0;
+        }
+        return *this;
+    }
+
+    BootImageSection & operator=(std::vector<unsigned char> data)
+    {
+        m_data = std::move(data);
+        m_view = nullptr;
+        m_viewSize = 0;
+        return *this;
+    }
+
+    void assign(const unsigned char *begin, const unsigned char *end)
+    {
+        m_data.assign(begin, end);
+        m_view = nullptr;
+        m_viewSize = 0;
+    }
+
+    void setView(const unsigned char *data, std::size_t size)
+    {
+        std::vector<unsigned char>().swap(m_data);
+        m_view = data;
+        m_viewSize = size;
+    }
+
+    void clear()
+    {
+        std::vector<unsigned char>().swap(m_data);
+        m_view = nullptr;
+        m_viewSize = 0;
+    }
+
+    bool isView() const
+    {
+        return m_view != nullptr;
+    }
+
+    const unsigned char * data() const
+    {
+        return m_view ? m_view : m_data.data();
+    }
+
+    std::size_t size() const
+    {
+        return m_view ? m_viewSize : m_data.size();
+    }
+
+    bool empty() const
+    {
+        return size() == 0;
+    }
+
+    const unsigned char * begin() const
+    {
+        return data();
+    }
+
+    const unsigned char * end() const
+    {
+        return data() + size();
+    }
+
+    /*!
+     * \brief Get the section as a vector
+     *
+     * A section that references the source data is copied into the section
+     * first. This does not change the contents of the section, so it is done
+     * under a lock in this const function. Pointers previously returned by
+     * data() still reference the source data, which remains valid for as long
+     * as its owner keeps it alive.
+     */
+    const std::vector<unsigned char> & vector() const
+    {
+        std::lock_guard<std::mutex> lock(m_copyMutex);
+        if (m_view) {
+            m_data.assign(m_view, m_view + m_viewSize);
+            m_view = nullptr;
+            m_viewSize = 0;
+        }
+        return m_data;
+    }
+
+    bool operator==(const BootImageSection &other) const
+    {
+        return size() == other.size()
+                && (size() == 0
+                        || std::memcmp(data(), other.data(), size()) == 0);
+    }
+
+    bool operator!=(const BootImageSection &other) const
+    {
+        return !(*this == other);
+    }
+
+private:
+    // Mutable so that vector() can copy a referenced section
+    mutable std::vector<unsigned char> m_data;
+    mutable const unsigned char *m_view = nullptr;
+    mutable std::size_t m_viewSize = 0;
+    mutable std::mutex m_copyMutex;
+};
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bootimage/segments.h"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+
+#ifndef _WIN32
+#include <climits>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+
+namespace mbp
+{
+
+#ifndef _WIN32
+// Zero page used for the padding segments when writing
+static const unsigned char Zeros[4096] = {};
+
+#ifdef IOV_MAX
+static const int MaxIovecs = IOV_MAX < 1024 ? IOV_MAX : 1024;
+#else
+static const int MaxIovecs = 16;
+#endif
+#endif
+
+BootImageSegments::BootImageSegments() : m_size(0)
+{
+}
+
+/*!
+ * \brief Add a segment referencing existing data
+ *
+ * \note The data is not copied and must outlive this object
+ */
+void BootImageSegments::add(const unsigned char *data, std::size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    m_segments.push_back({ data, size });
+    m_size += size;
+}
+
+void BootImageSegments::add(const BootImageSection &section)
+{
+    add(section.data(), section.size());
+}
+
+void BootImageSegments::add(const std::string &str)
+{
+    add(reinterpret_cast<const unsigned char *>(str.data()), str.size());
+}
+
+/*!
+ * \brief Add a zero-initialized segment owned by this object
+ *
+ * \return Pointer to the segment's data, which the caller can fill in
+ */
+unsigned char * BootImageSegments::addOwned(std::size_t size)
+{
+    m_owned.emplace_back(size);
+    unsigned char *data = m_owned.back().data();
+    add(data, size);
+    return data;
+}
+
+/*!
+ * \brief Add a segment owned by this object
+ */
+void BootImageSegments::addOwned(std::vector<unsigned char> data)
+{
+    m_owned.push_back(std::move(data));
+    add(m_owned.back().data(), m_owned.back().size());
+}
+
+/*!
+ * \brief Add \a size bytes of zero padding
+ */
+void BootImageSegments::addPadding(std::size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    // Merge adjacent padding
+    if (!m_segments.empty() && !m_segments.back().data) {
+        m_segments.back().size += size;
+    } else {
+        m_segments.push_back({ nullptr, size });
+    }
+    m_size += size;
+}
+
+/*!
+ * \brief Pad the output with zeros to a multiple of \a alignment
+ */
+void BootImageSegments::pad(std::size_t alignment)
+{
+    std::size_t remainder = m_size % alignment;
+    if (remainder != 0) {
+        addPadding(alignment - remainder);
+    }
+}
+
+const std::vector<BootImageSegments::Segment> &
+BootImageSegments::segments() const
+{
+    return m_segments;
+}
+
+/*!
+ * \brief Total size of the output
+ */
+std::size_t BootImageSegments::size() const
+{
+    return m_size;
+}
+
+/*!
+ * \brief Assemble the segments into a single buffer
+ */
+void BootImageSegments::copyTo(std::vector<unsigned char> *out) const
+{
+    out->clear();
+    out->resize(m_size);
+
+    unsigned char *ptr = out->data();
+    for (const Segment &s : m_segments) {
+        // Padding is already zeroed by resize()
+        if (s.data) {
+            std::memcpy(ptr, s.data, s.size);
+        }
+        ptr += s.size;
+    }
+}
+
+#ifndef _WIN32
+
+/*!
+ * \brief Write the segments to a file descriptor with writev()
+ *
+ * Short writes and EINTR are handled. The segments are written at the current
+ * file offset.
+ *
+ * \return Whether all of the data was written. errno is set on failure.
+ */
+bool BootImageSegments::writeTo(int fd) const
+{
+    std::vector<struct iovec> iov;
+    iov.reserve(m_segments.size());
+
+    // Split the padding into chunks of the zero page
+    for (const Segment &s : m_segments) {
+        if (s.data) {
+            iov.push_back({ const_cast<unsigned char *>(s.data), s.size });
+        } else {
+            for (std::size_t n = 0; n < s.size; n += sizeof(Zeros)) {
+                std::size_t len = std::min(s.size - n, sizeof(Zeros));
+                iov.push_back({ const_cast<unsigned char *>(Zeros), len });
+            }
+        }
+    }
+
+    std::size_t i = 0;
+    while (i < iov.size()) {
+        int count = static_cast<int>(std::min<std::size_t>(
+                iov.size() - i, MaxIovecs));
+
+        ssize_t n = writev(fd, &iov[i], count);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+
+        // Skip past fully written iovecs and adjust the partial one
+        std::size_t written = n;
+        while (i < iov.size() && written >= iov[i].iov_len) {
+            written -= iov[i].iov_len;
+            ++i;
+        }
+        if (written > 0) {
+            iov[i].iov_base = static_cast<char *>(iov[i].iov_base) + written;
+            iov[i].iov_len -= written;
+        }
+    }
+
+    return true;
+}
+
+#endif
+
+}
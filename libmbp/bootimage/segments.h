@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <cstddef>
+
+#include "bootimage/section.h"
+
+namespace mbp
+{
+
+/*!
+ * \brief Boot image output described as a list of memory ranges
+ *
+ * The formats describe the boot image they create as a sequence of segments
+ * that point to the headers and to the images stored in BootImageIntermediate.
+ * Zero padding is stored as a segment without data. This allows the boot
+ * image to be written with writev() without assembling it in memory first.
+ *
+ * \note The segments reference the intermediate data, so they are only valid
+ *       until the BootImage is modified.
+ */
+class BootImageSegments
+{
+public:
+    struct Segment
+    {
+        // nullptr for zero padding
+        const unsigned char *data;
+        std::size_t size;
+    };
+
+    BootImageSegments();
+
+    void add(const unsigned char *data, std::size_t size);
+    void add(const BootImageSection &section);
+    void add(const std::string &str);
+    unsigned char * addOwned(std::size_t size);
+    void addOwned(std::vector<unsigned char> data);
+    void addPadding(std::size_t size);
+    void pad(std::size_t alignment);
+
+    const std::vector<Segment> & segments() const;
+    std::size_t size() const;
+
+    void copyTo(std::vector<unsigned char> *out) const;
+#ifndef _WIN32
+    bool writeTo(int fd) const;
+#endif
+
+private:
+    std::vector<Segment> m_segments;
+    // Buffers for generated data (eg. headers). A deque never moves the
+    // vectors, so the pointers in m_segments remain valid.
+    std::deque<std::vector<unsigned char>> m_owned;
+    std::size_t m_size;
+};
+
+}
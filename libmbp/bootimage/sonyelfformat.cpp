@@ -19,6 +19,8 @@
 
 #include "bootimage/sonyelfformat.h"
 
+#include <algorithm>
+
 #define __STDC_FORMAT_MACROS
 #include <cinttypes>
 #include <cstring>
@@ -174,26 +176,26 @@ bool SonyElfFormat::loadImage(const unsigned char *data, std::size_t size)
 
         if (phdr->p_type == SONY_E_TYPE_KERNEL
                 && phdr->p_flags == SONY_E_FLAGS_KERNEL) {
-            mI10e->kernelImage.assign(begin, end);
+            loadSection(&mI10e->kernelImage, begin, end);
             mI10e->kernelAddr = phdr->p_vaddr;
         } else if (phdr->p_type == SONY_E_TYPE_RAMDISK
                 && phdr->p_flags == SONY_E_FLAGS_RAMDISK) {
-            mI10e->ramdiskImage.assign(begin, end);
+            loadSection(&mI10e->ramdiskImage, begin, end);
             mI10e->ramdiskAddr = phdr->p_vaddr;
         } else if (phdr->p_type == SONY_E_TYPE_IPL
                 && phdr->p_flags == SONY_E_FLAGS_IPL) {
-            mI10e->iplImage.assign(begin, end);
+            loadSection(&mI10e->iplImage, begin, end);
             mI10e->iplAddr = phdr->p_vaddr;
         } else if (phdr->p_type == SONY_E_TYPE_CMDLINE
                 && phdr->p_flags == SONY_E_FLAGS_CMDLINE) {
             mI10e->cmdline.assign(begin, end);
         } else if (phdr->p_type == SONY_E_TYPE_RPM
                 && phdr->p_flags == SONY_E_FLAGS_RPM) {
-            mI10e->rpmImage.assign(begin, end);
+            loadSection(&mI10e->rpmImage, begin, end);
             mI10e->rpmAddr = phdr->p_vaddr;
         } else if (phdr->p_type == SONY_E_TYPE_APPSBL
                 && phdr->p_flags == SONY_E_FLAGS_APPSBL) {
-            mI10e->appsblImage.assign(begin, end);
+            loadSection(&mI10e->appsblImage, begin, end);
             mI10e->appsblAddr = phdr->p_vaddr;
         } else if (phdr->p_type == SONY_E_TYPE_SIN) {
             // There are two extra bytes unaccounted for by p_filesz and
@@ -208,7 +210,7 @@ bool SonyElfFormat::loadImage(const unsigned char *data, std::size_t size)
                 end += 2;
             }
 
-            mI10e->sonySinImage.assign(begin, end);
+            loadSection(&mI10e->sonySinImage, begin, end);
 
             // Save header
             mI10e->sonySinHdr.resize(sizeof(Sony_Elf32_Phdr));
@@ -228,9 +230,18 @@ bool SonyElfFormat::loadImage(const unsigned char *data, std::size_t size)
     return true;
 }
 
-bool SonyElfFormat::createImage(std::vector<unsigned char> *dataOut)
+bool SonyElfFormat::createImage(BootImageSegments *segments)
 {
-    std::vector<unsigned char> data;
+    // ELF32 program segment data starts at 4096 bytes. The headers and the sin
+    // image are written to the first page.
+    unsigned char *hdrPage = segments->addOwned(4096);
+    std::size_t hdrPos = 0;
+
+    auto write = [&](const unsigned char *data, std::size_t size) {
+        size = std::min(size, 4096 - hdrPos);
+        std::memcpy(hdrPage + hdrPos, data, size);
+        hdrPos += size;
+    };
 
     // Figure out which images we have
     Elf32_Half phnum = 0;
@@ -273,10 +284,8 @@ bool SonyElfFormat::createImage(std::vector<unsigned char> *dataOut)
     hdr.e_shstrndx = 0;
 
     // Write ELF32 header
-    unsigned char *hdrPtr = reinterpret_cast<unsigned char *>(&hdr);
-    data.insert(data.end(), hdrPtr, hdrPtr + sizeof(Sony_Elf32_Ehdr));
+    write(reinterpret_cast<unsigned char *>(&hdr), sizeof(Sony_Elf32_Ehdr));
 
-    // ELF32 program segment data starts at 4096 bytes
     std::size_t offset = 4096;
 
     // Write kernel header
@@ -294,8 +303,8 @@ bool SonyElfFormat::createImage(std::vector<unsigned char> *dataOut)
 
         offset += mI10e->kernelImage.size();
 
-        unsigned char *phdrPtr = reinterpret_cast<unsigned char *>(&phdr);
-        data.insert(data.end(), phdrPtr, phdrPtr + sizeof(Sony_Elf32_Phdr));
+        write(reinterpret_cast<unsigned char *>(&phdr),
+              sizeof(Sony_Elf32_Phdr));
     }
 
     // Write ramdisk header
@@ -313,8 +322,8 @@ bool SonyElfFormat::createImage(std::vector<unsigned char> *dataOut)
 
         offset += mI10e->ramdiskImage.size();
 
-        unsigned char *phdrPtr = reinterpret_cast<unsigned char *>(&phdr);
-        data.insert(data.end(), phdrPtr, phdrPtr + sizeof(Sony_Elf32_Phdr));
+        write(reinterpret_cast<unsigned char *>(&phdr),
+              sizeof(Sony_Elf32_Phdr));
     }
 
     // Write cmdline header
@@ -332,8 +341,8 @@ bool SonyElfFormat::createImage(std::vector<unsigned char> *dataOut)
 
         offset += mI10e->cmdline.size();
 
-        unsigned char *phdrPtr = reinterpret_cast<unsigned char *>(&phdr);
-        data.insert(data.end(), phdrPtr, phdrPtr + sizeof(Sony_Elf32_Phdr));
+        write(reinterpret_cast<unsigned char *>(&phdr),
+              sizeof(Sony_Elf32_Phdr));
     }
 
     // Write ipl header
@@ -351,8 +360,8 @@ bool SonyElfFormat::createImage(std::vector<unsigned char> *dataOut)
 
         offset += mI10e->iplImage.size();
 
-        unsigned char *phdrPtr = reinterpret_cast<unsigned char *>(&phdr);
-        data.insert(data.end(), phdrPtr, phdrPtr + sizeof(Sony_Elf32_Phdr));
+        write(reinterpret_cast<unsigned char *>(&phdr),
+              sizeof(Sony_Elf32_Phdr));
     }
 
     // Write rpm header
@@ -370,8 +379,8 @@ bool SonyElfFormat::createImage(std::vector<unsigned char> *dataOut)
 
         offset += mI10e->rpmImage.size();
 
-        unsigned char *phdrPtr = reinterpret_cast<unsigned char *>(&phdr);
-        data.insert(data.end(), phdrPtr, phdrPtr + sizeof(Sony_Elf32_Phdr));
+        write(reinterpret_cast<unsigned char *>(&phdr),
+              sizeof(Sony_Elf32_Phdr));
     }
 
     // Write appsbl header
@@ -389,8 +398,8 @@ bool SonyElfFormat::createImage(std::vector<unsigned char> *dataOut)
 
         offset += mI10e->appsblImage.size();
 
-        unsigned char *phdrPtr = reinterpret_cast<unsigned char *>(&phdr);
-        data.insert(data.end(), phdrPtr, phdrPtr + sizeof(Sony_Elf32_Phdr));
+        write(reinterpret_cast<unsigned char *>(&phdr),
+              sizeof(Sony_Elf32_Phdr));
     }
 
     // Write sin header and image
@@ -420,44 +429,32 @@ bool SonyElfFormat::createImage(std::vector<unsigned char> *dataOut)
         }
 
         // Write header
-        unsigned char *phdrPtr = reinterpret_cast<unsigned char *>(&phdr);
-        data.insert(data.end(), phdrPtr, phdrPtr + sizeof(Sony_Elf32_Phdr));
+        write(reinterpret_cast<unsigned char *>(&phdr),
+              sizeof(Sony_Elf32_Phdr));
 
         // Write data
-        data.insert(data.end(),
-                    mI10e->sonySinImage.begin(), mI10e->sonySinImage.end());
+        write(mI10e->sonySinImage.data(), mI10e->sonySinImage.size());
     }
 
-    // Pad to 4096 bytes
-    data.resize(4096);
-
     if (haveKernel) {
-        data.insert(data.end(),
-                    mI10e->kernelImage.begin(), mI10e->kernelImage.end());
+        segments->add(mI10e->kernelImage);
     }
     if (haveRamdisk) {
-        data.insert(data.end(),
-                    mI10e->ramdiskImage.begin(), mI10e->ramdiskImage.end());
+        segments->add(mI10e->ramdiskImage);
     }
     if (haveCmdline) {
-        data.insert(data.end(),
-                    mI10e->cmdline.begin(), mI10e->cmdline.end());
+        segments->add(mI10e->cmdline);
     }
     if (haveIpl) {
-        data.insert(data.end(),
-                    mI10e->iplImage.begin(), mI10e->iplImage.end());
+        segments->add(mI10e->iplImage);
     }
     if (haveRpm) {
-        data.insert(data.end(),
-                    mI10e->rpmImage.begin(), mI10e->rpmImage.end());
+        segments->add(mI10e->rpmImage);
     }
     if (haveAppsbl) {
-        data.insert(data.end(),
-                    mI10e->appsblImage.begin(), mI10e->appsblImage.end());
+        segments->add(mI10e->appsblImage);
     }
 
-    dataOut->swap(data);
-
     return true;
 }
 
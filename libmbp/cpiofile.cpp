@@ -22,12 +22,16 @@
 #include <cstring>
 
 #include <algorithm>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include <archive.h>
 #include <archive_entry.h>
 
+#include "libmbpio/file.h"
+
+#include "private/compressutils.h"
 #include "private/fileutils.h"
 #include "private/logging.h"
 
@@ -35,8 +39,6 @@
 namespace mbp
 {
 
-typedef std::pair<archive_entry *, std::vector<unsigned char>> FilePair;
-
 enum Compression {
     NONE,
     GZIP,
@@ -45,26 +47,236 @@ enum Compression {
     LZMA
 };
 
+// Default compression levels. These match what libarchive used to produce:
+// gzip at level 9 and LZ4 with the fast (non-HC) compressor.
+static const int DefaultGzipLevel = 9;
+static const int DefaultLz4Level = 1;
+
+/*!
+ * \brief Entry in the cpio archive
+ *
+ * Until an entry's contents are modified, its payload is a view into the
+ * decompressed archive held by CpioFile::Impl::source. Once modified, the
+ * entry owns its data in \a data.
+ */
+struct CpioEntry
+{
+    archive_entry *entry = nullptr;
+    // View into CpioFile::Impl::source (if not owned)
+    const unsigned char *view = nullptr;
+    std::size_t viewSize = 0;
+    // Owned data (if modified)
+    std::vector<unsigned char> data;
+    bool owned = true;
+    // Entry was removed, but not yet compacted
+    bool removed = false;
+
+    ~CpioEntry()
+    {
+        if (entry) {
+            archive_entry_free(entry);
+        }
+    }
+
+    const unsigned char * payload() const
+    {
+        return owned ? data.data() : view;
+    }
+
+    std::size_t payloadSize() const
+    {
+        return owned ? data.size() : viewSize;
+    }
+
+    void setData(std::vector<unsigned char> newData)
+    {
+        data = std::move(newData);
+        owned = true;
+        view = nullptr;
+        viewSize = 0;
+        archive_entry_set_size(entry, data.size());
+    }
+};
+
 /*! \cond INTERNAL */
 class CpioFile::Impl
 {
 public:
-    ~Impl();
-
-    std::vector<FilePair> files;
-
-    Compression compression;
+    // Decompressed archive data. Unmodified entries point into this buffer.
+    std::vector<unsigned char> source;
+
+    // Entries in archive order. Removed entries are compacted lazily.
+    std::vector<std::unique_ptr<CpioEntry>> files;
+    // Pathname -> entry
+    std::unordered_map<std::string, CpioEntry *> index;
+    // Whether files needs to be sorted before being written
+    bool needsSort = false;
+    // Whether files contains removed entries
+    bool needsCompact = false;
+
+    Compression compression = NONE;
+    // Compression level (-1 for default) and number of threads (0 for auto)
+    int compressionLevel = -1;
+    unsigned int compressionThreads = 0;
+    // Size of the loaded (compressed) and decompressed archives
+    std::size_t loadedSize = 0;
+    std::size_t loadedRawSize = 0;
 
     ErrorCode error;
+
+    CpioEntry * find(const std::string &name) const;
+    CpioEntry * addEntry(archive_entry *entry);
+    void normalize();
+    void detachFromSource();
+    bool decompress(const unsigned char *data, std::size_t size);
+    std::size_t rawArchiveSize() const;
+    bool writeArchive(Compression filter, int blockSize,
+                      WriteCallback cb, void *userData);
+    bool writeArchiveParallel(WriteCallback cb, void *userData);
 };
 /*! \endcond */
 
 
-CpioFile::Impl::~Impl()
+CpioEntry * CpioFile::Impl::find(const std::string &name) const
+{
+    auto it = index.find(name);
+    if (it == index.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+CpioEntry * CpioFile::Impl::addEntry(archive_entry *entry)
+{
+    CpioEntry *ptr = new CpioEntry();
+    ptr->entry = entry;
+    files.emplace_back(ptr);
+    index[archive_entry_pathname(entry)] = ptr;
+    return ptr;
+}
+
+static bool sortByName(const std::unique_ptr<CpioEntry> &e1,
+                       const std::unique_ptr<CpioEntry> &e2)
+{
+    const char *cname1 = archive_entry_pathname(e1->entry);
+    const char *cname2 = archive_entry_pathname(e2->entry);
+
+    return std::strcmp(cname1, cname2) < 0;
+}
+
+/*!
+ * \brief Drop removed entries and sort the entries if needed
+ *
+ * Sorting is deferred until the archive is written or listed so that adding
+ * many files does not re-sort the whole archive each time.
+ */
+void CpioFile::Impl::normalize()
+{
+    if (needsCompact) {
+        files.erase(std::remove_if(files.begin(), files.end(),
+                [](const std::unique_ptr<CpioEntry> &e) {
+                    return e->removed;
+                }), files.end());
+        needsCompact = false;
+    }
+
+    if (needsSort) {
+        std::stable_sort(files.begin(), files.end(), sortByName);
+        needsSort = false;
+    }
+}
+
+/*!
+ * \brief Make all entries own their data so that \a source can be replaced
+ */
+void CpioFile::Impl::detachFromSource()
+{
+    for (auto const &e : files) {
+        if (!e->owned) {
+            e->data.assign(e->view, e->view + e->viewSize);
+            e->owned = true;
+            e->view = nullptr;
+            e->viewSize = 0;
+        }
+    }
+
+    std::vector<unsigned char>().swap(source);
+}
+
+/*!
+ * \brief Decompress the archive into \a source
+ *
+ * libarchive's raw format is used to run only the decompression filters so
+ * that the cpio entries can later be referenced in place.
+ */
+bool CpioFile::Impl::decompress(const unsigned char *data, std::size_t size)
 {
-    for (auto &p : files) {
-        archive_entry_free(p.first);
+    source.clear();
+
+    if (compression == NONE) {
+        source.assign(data, data + size);
+        return true;
+    }
+
+    archive *a;
+    archive_entry *entry;
+
+    a = archive_read_new();
+
+    archive_read_support_filter_gzip(a);
+    archive_read_support_filter_lzop(a);
+    archive_read_support_filter_lz4(a);
+    archive_read_support_filter_lzma(a);
+    archive_read_support_format_raw(a);
+
+    int ret = archive_read_open_memory(a,
+            const_cast<unsigned char *>(data), size);
+    if (ret != ARCHIVE_OK) {
+        FLOGW("libarchive: %s", archive_error_string(a));
+        archive_read_free(a);
+
+        error = ErrorCode::ArchiveReadOpenError;
+        return false;
+    }
+
+    ret = archive_read_next_header(a, &entry);
+    if (ret != ARCHIVE_OK) {
+        FLOGW("libarchive: %s", archive_error_string(a));
+        archive_read_free(a);
+
+        error = ErrorCode::ArchiveReadHeaderError;
+        return false;
+    }
+
+    // Ramdisks usually compress at around 2:1 or better
+    source.reserve(size * 3);
+
+    int r;
+    __LA_INT64_T offset;
+    const void *buff;
+    size_t bytes_read;
+
+    while ((r = archive_read_data_block(a, &buff,
+            &bytes_read, &offset)) == ARCHIVE_OK) {
+        source.insert(source.end(),
+                      reinterpret_cast<const unsigned char *>(buff),
+                      reinterpret_cast<const unsigned char *>(buff)
+                              + bytes_read);
+    }
+
+    if (r < ARCHIVE_WARN) {
+        FLOGW("libarchive: %s", archive_error_string(a));
+        archive_read_free(a);
+
+        error = ErrorCode::ArchiveReadDataError;
+        return false;
     }
+
+    archive_read_free(a);
+
+    source.shrink_to_fit();
+
+    return true;
 }
 
 
@@ -80,6 +292,10 @@ CpioFile::Impl::~Impl()
  * - Adding symlinks
  * - Checking existence of files
  * - Removing files
+ *
+ * Files are indexed by pathname, so lookups take constant time. The contents
+ * of loaded files are not copied out of the decompressed archive until they
+ * are modified.
  */
 
 
@@ -108,7 +324,12 @@ ErrorCode CpioFile::error() const
  * \brief Load a cpio archive from binary data
  *
  * This function loads a cpio archive from a vector containing the binary data.
- * Each file's metadata and contents will be copied and stored.
+ * The archive is decompressed once and each file's metadata is stored. The
+ * contents of each file reference the decompressed archive and are only copied
+ * when they are modified.
+ *
+ * If an archive was already loaded, its files are kept and now own copies of
+ * their contents. Pointers previously returned by contentsC() are invalidated.
  *
  * \warning If the cpio archive cannot be loaded, this CpioFile object may be
  *          left in an inconsistent state. Create a new CpioFile to load another
@@ -118,6 +339,10 @@ ErrorCode CpioFile::error() const
  */
 bool CpioFile::load(const unsigned char *data, std::size_t size)
 {
+    // Entries from a previously loaded archive are kept, so they must stop
+    // referencing the old decompressed data before it is freed
+    m_impl->detachFromSource();
+
     if (size >= 2 && std::memcmp(data, "\x1f\x8b", 2) == 0) {
         m_impl->compression = GZIP;
     } else if (size >= 9 && std::memcmp(data, "\x89LZO\x00\r\n\x1a\n", 9) == 0) {
@@ -132,21 +357,25 @@ bool CpioFile::load(const unsigned char *data, std::size_t size)
         m_impl->compression = NONE;
     }
 
+    if (!m_impl->decompress(data, size)) {
+        return false;
+    }
+
+    m_impl->loadedSize = size;
+    m_impl->loadedRawSize = m_impl->source.size();
+
+    const unsigned char *begin = m_impl->source.data();
+    const unsigned char *end = begin + m_impl->source.size();
+
     archive *a;
     archive_entry *entry;
 
     a = archive_read_new();
 
-    // Allow gzip-compressed cpio files to work as well
-    // (libarchive is awesome)
-    archive_read_support_filter_gzip(a);
-    archive_read_support_filter_lzop(a);
-    archive_read_support_filter_lz4(a);
-    archive_read_support_filter_lzma(a);
     archive_read_support_format_cpio(a);
 
     int ret = archive_read_open_memory(a,
-            const_cast<unsigned char *>(data), size);
+            const_cast<unsigned char *>(begin), m_impl->source.size());
     if (ret != ARCHIVE_OK) {
         FLOGW("libarchive: %s", archive_error_string(a));
         archive_read_free(a);
@@ -156,9 +385,7 @@ bool CpioFile::load(const unsigned char *data, std::size_t size)
     }
 
     while ((ret = archive_read_next_header(a, &entry)) == ARCHIVE_OK) {
-        // Read the data for the entry
-        std::vector<unsigned char> entryData;
-        entryData.reserve(archive_entry_size(entry));
+        CpioEntry *e = m_impl->addEntry(archive_entry_clone(entry));
 
         int r;
         __LA_INT64_T offset;
@@ -167,9 +394,26 @@ bool CpioFile::load(const unsigned char *data, std::size_t size)
 
         while ((r = archive_read_data_block(a, &buff,
                 &bytes_read, &offset)) == ARCHIVE_OK) {
-            entryData.insert(entryData.end(),
-                             reinterpret_cast<const char *>(buff),
-                             reinterpret_cast<const char *>(buff) + bytes_read);
+            auto ptr = reinterpret_cast<const unsigned char *>(buff);
+
+            if (e->owned && e->data.empty() && offset == 0
+                    && ptr >= begin && ptr + bytes_read <= end) {
+                // Payload is contiguous in the decompressed buffer. Keep a
+                // view instead of copying it.
+                e->owned = false;
+                e->view = ptr;
+                e->viewSize = bytes_read;
+            } else {
+                // Not contiguous (shouldn't happen with the memory reader).
+                // Fall back to copying the data.
+                if (!e->owned) {
+                    e->data.assign(e->view, e->view + e->viewSize);
+                    e->owned = true;
+                    e->view = nullptr;
+                    e->viewSize = 0;
+                }
+                e->data.insert(e->data.end(), ptr, ptr + bytes_read);
+            }
         }
 
         if (r < ARCHIVE_WARN) {
@@ -179,10 +423,6 @@ bool CpioFile::load(const unsigned char *data, std::size_t size)
             archive_read_free(a);
             return false;
         }
-
-        // Save the header and data
-        archive_entry *cloned = archive_entry_clone(entry);
-        m_impl->files.push_back(std::make_pair(cloned, std::move(entryData)));
     }
 
     if (ret < ARCHIVE_WARN) {
@@ -209,6 +449,12 @@ bool CpioFile::load(const std::vector<unsigned char> &data)
     return load(data.data(), data.size());
 }
 
+struct WriteContext
+{
+    CpioFile::WriteCallback cb;
+    void *userData;
+};
+
 static int archiveOpenCallback(archive *a, void *clientData)
 {
     (void) a;
@@ -216,13 +462,15 @@ static int archiveOpenCallback(archive *a, void *clientData)
     return ARCHIVE_OK;
 }
 
-static __LA_SSIZE_T archiveWriteCallback(archive *, void *clientData,
+static __LA_SSIZE_T archiveWriteCallback(archive *a, void *clientData,
                                          const void *buffer, size_t length)
 {
-    auto data = reinterpret_cast<std::vector<unsigned char> *>(clientData);
-    data->insert(data->end(),
-                 reinterpret_cast<const char *>(buffer),
-                 reinterpret_cast<const char *>(buffer) + length);
+    auto ctx = reinterpret_cast<WriteContext *>(clientData);
+    if (!ctx->cb(reinterpret_cast<const unsigned char *>(buffer), length,
+                 ctx->userData)) {
+        archive_set_error(a, -1, "Write callback failed");
+        return -1;
+    }
     return length;
 }
 
@@ -233,77 +481,269 @@ static int archiveCloseCallback(archive *a, void *clientData)
     return ARCHIVE_OK;
 }
 
-static bool sortByName(const FilePair &p1, const FilePair &p2)
+static inline std::size_t alignTo4(std::size_t n)
 {
-    const char *cname1 = archive_entry_pathname(p1.first);
-    const char *cname2 = archive_entry_pathname(p2.first);
+    return (n + 3) & ~static_cast<std::size_t>(3);
+}
 
-    return std::strcmp(cname1, cname2) < 0;
+/*!
+ * \brief Exact size of the uncompressed `newc` archive without block padding
+ */
+std::size_t CpioFile::Impl::rawArchiveSize() const
+{
+    // newc header is 110 bytes. The name (with NULL terminator) and the data
+    // are each padded to a multiple of 4 bytes.
+    std::size_t rawSize = 0;
+
+    for (auto const &e : files) {
+        if (e->removed) {
+            continue;
+        }
+
+        rawSize += alignTo4(110 + std::strlen(
+                archive_entry_pathname(e->entry)) + 1);
+
+        const char *symlink = archive_entry_symlink(e->entry);
+        if (symlink) {
+            rawSize += alignTo4(std::strlen(symlink));
+        } else {
+            rawSize += alignTo4(e->payloadSize());
+        }
+    }
+
+    // Trailer ("TRAILER!!!")
+    rawSize += alignTo4(110 + 11);
+
+    return rawSize;
+}
+
+/*!
+ * \brief Estimate the size of the archive that createData() will produce
+ *
+ * For uncompressed archives, this is the exact size of the `newc` archive,
+ * including the trailer and the padding to 512 byte blocks. For compressed
+ * archives, this is the loaded archive size scaled by how much the
+ * uncompressed contents have grown. It is only meant to be used for
+ * preallocating output buffers.
+ *
+ * \return Estimated size of the archive in bytes
+ */
+std::size_t CpioFile::estimatedSize() const
+{
+    std::size_t rawSize = m_impl->rawArchiveSize();
+    std::size_t size = rawSize;
+
+    if (m_impl->compression != NONE) {
+        if (m_impl->loadedRawSize > 0) {
+            size = static_cast<std::size_t>(
+                    static_cast<double>(m_impl->loadedSize) * rawSize
+                    / m_impl->loadedRawSize);
+        }
+        // Leave some room for worse compression of the modified files
+        size += size / 16 + 512;
+    }
+
+    // Output is padded to 512 byte blocks
+    return (size + 511) & ~static_cast<std::size_t>(511);
+}
+
+static bool vectorWriteCb(const unsigned char *data, std::size_t size,
+                          void *userData)
+{
+    auto vec = reinterpret_cast<std::vector<unsigned char> *>(userData);
+    vec->insert(vec->end(), data, data + size);
+    return true;
 }
 
 /*!
  * \brief Constructs the cpio archive
  *
- * This function builds the `.cpio` file, compressing it in either gzip or LZ4.
- * The archive uses the `newc` format and files are written in lexographical
- * order.
+ * The output vector is preallocated with estimatedSize() to avoid repeated
+ * reallocations while the archive is being written.
  *
- * \return Cpio archive binary data
+ * \sa createData(WriteCallback, void *)
+ *
+ * \return Whether the archive was successfully created
  */
 bool CpioFile::createData(std::vector<unsigned char> *dataOut)
 {
     std::vector<unsigned char> data;
+    data.reserve(estimatedSize());
+
+    if (!createData(&vectorWriteCb, &data)) {
+        return false;
+    }
+
+    dataOut->swap(data);
+
+    return true;
+}
+
+struct BufferWriteCtx
+{
+    unsigned char *buf;
+    std::size_t size;
+    std::size_t pos;
+};
+
+static bool bufferWriteCb(const unsigned char *data, std::size_t size,
+                          void *userData)
+{
+    auto ctx = reinterpret_cast<BufferWriteCtx *>(userData);
+    if (size > ctx->size - ctx->pos) {
+        FLOGE("Archive does not fit in buffer of size %" PRIzu, ctx->size);
+        return false;
+    }
+    std::memcpy(ctx->buf + ctx->pos, data, size);
+    ctx->pos += size;
+    return true;
+}
+
+/*!
+ * \brief Constructs the cpio archive into a caller-supplied buffer
+ *
+ * Use estimatedSize() to determine an appropriate buffer size. If the archive
+ * does not fit in the buffer, the function fails with
+ * ErrorCode::ArchiveWriteDataError.
+ *
+ * \param buf Output buffer
+ * \param size Size of output buffer
+ * \param sizeOut Number of bytes written to \a buf (output parameter)
+ *
+ * \return Whether the archive was successfully created
+ */
+bool CpioFile::createData(unsigned char *buf, std::size_t size,
+                          std::size_t *sizeOut)
+{
+    BufferWriteCtx ctx;
+    ctx.buf = buf;
+    ctx.size = size;
+    ctx.pos = 0;
+
+    if (!createData(&bufferWriteCb, &ctx)) {
+        return false;
+    }
+
+    *sizeOut = ctx.pos;
+
+    return true;
+}
+
+static bool fileWriteCb(const unsigned char *data, std::size_t size,
+                        void *userData)
+{
+    auto file = reinterpret_cast<io::File *>(userData);
+    uint64_t bytesWritten;
+    if (!file->write(data, size, &bytesWritten) || bytesWritten != size) {
+        FLOGE("Failed to write file: %s", file->errorString().c_str());
+        return false;
+    }
+    return true;
+}
+
+/*!
+ * \brief Constructs the cpio archive and writes it to a file
+ *
+ * The archive is streamed to the file as it is being compressed, so the full
+ * archive is never held in memory.
+ *
+ * \param path Output path
+ *
+ * \return Whether the archive was successfully written
+ */
+bool CpioFile::createFile(const std::string &path)
+{
+    io::File file;
+    if (!file.open(path, io::File::OpenWrite)) {
+        FLOGE("%s: Failed to open for writing: %s",
+              path.c_str(), file.errorString().c_str());
+
+        m_impl->error = ErrorCode::FileOpenError;
+        return false;
+    }
+
+    if (!createData(&fileWriteCb, &file)) {
+        return false;
+    }
+
+    if (!file.close()) {
+        FLOGE("%s: Failed to close file: %s",
+              path.c_str(), file.errorString().c_str());
+
+        m_impl->error = ErrorCode::FileWriteError;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Write the archive with libarchive
+ *
+ * \param filter Compression filter to use
+ * \param blockSize Block size to pad the output to (0 for no padding)
+ */
+bool CpioFile::Impl::writeArchive(Compression filter, int blockSize,
+                                  WriteCallback cb, void *userData)
+{
+    WriteContext ctx;
+    ctx.cb = cb;
+    ctx.userData = userData;
+
     archive *a = archive_write_new();
 
     archive_write_set_format_cpio_newc(a);
 
-    // Use same compression as before
-    if (m_impl->compression == GZIP) {
+    std::string level = std::to_string(compressionLevel);
+
+    if (filter == GZIP) {
         archive_write_add_filter_gzip(a);
-        archive_write_set_filter_option(a, nullptr, "compression-level", "9");
-    } else if (m_impl->compression == LZOP) {
+        archive_write_set_filter_option(a, nullptr, "compression-level",
+                                        compressionLevel < 0
+                                                ? "9" : level.c_str());
+    } else if (filter == LZOP) {
         archive_write_add_filter_lzop(a);
-    } else if (m_impl->compression == LZ4) {
+    } else if (filter == LZ4) {
         archive_write_add_filter_lz4(a);
-    } else if (m_impl->compression == LZMA) {
+    } else if (filter == LZMA) {
         archive_write_add_filter_lzma(a);
     } else {
         archive_write_add_filter_none(a);
     }
 
-    archive_write_set_bytes_per_block(a, 512);
+    archive_write_set_bytes_per_block(a, blockSize);
 
-    int ret = archive_write_open(a, reinterpret_cast<void *>(&data),
+    int ret = archive_write_open(a, reinterpret_cast<void *>(&ctx),
                                  &archiveOpenCallback,
                                  &archiveWriteCallback,
                                  &archiveCloseCallback);
     if (ret != ARCHIVE_OK) {
         FLOGW("libarchive: %s", archive_error_string(a));
-        m_impl->error = ErrorCode::ArchiveWriteOpenError;
+        error = ErrorCode::ArchiveWriteOpenError;
 
         archive_write_fail(a);
         archive_write_free(a);
         return false;
     }
 
-    for (auto const &p : m_impl->files) {
-        if (archive_write_header(a, p.first) != ARCHIVE_OK) {
+    for (auto const &e : files) {
+        if (archive_write_header(a, e->entry) != ARCHIVE_OK) {
             FLOGW("libarchive: %s : %s",
                   archive_error_string(a),
-                  archive_entry_pathname(p.first));
-            m_impl->error = ErrorCode::ArchiveWriteHeaderError;
+                  archive_entry_pathname(e->entry));
+            error = ErrorCode::ArchiveWriteHeaderError;
 
             archive_write_fail(a);
             archive_write_free(a);
             return false;
         }
 
-        if (archive_write_data(a, p.second.data(), p.second.size())
-                != int(p.second.size())) {
+        std::size_t size = e->payloadSize();
+        if (archive_write_data(a, e->payload(), size) != int(size)) {
             archive_write_fail(a);
             archive_write_free(a);
 
-            m_impl->error = ErrorCode::ArchiveWriteDataError;
+            error = ErrorCode::ArchiveWriteDataError;
             return false;
         }
     }
@@ -315,17 +755,146 @@ bool CpioFile::createData(std::vector<unsigned char> *dataOut)
         archive_write_fail(a);
         archive_write_free(a);
 
-        m_impl->error = ErrorCode::ArchiveCloseError;
+        error = ErrorCode::ArchiveCloseError;
         return false;
     }
 
     archive_write_free(a);
 
-    dataOut->swap(data);
+    return true;
+}
+
+struct CountingWriteCtx
+{
+    CpioFile::WriteCallback cb;
+    void *userData;
+    std::size_t written;
+};
+
+static bool countingWriteCb(const unsigned char *data, std::size_t size,
+                            void *userData)
+{
+    auto ctx = reinterpret_cast<CountingWriteCtx *>(userData);
+    if (!ctx->cb(data, size, ctx->userData)) {
+        return false;
+    }
+    ctx->written += size;
+    return true;
+}
+
+static bool compressorWriteCb(const unsigned char *data, std::size_t size,
+                              void *userData)
+{
+    auto compressor = reinterpret_cast<ParallelCompressor *>(userData);
+    return compressor->write(data, size);
+}
+
+/*!
+ * \brief Write the archive with the parallel gzip or LZ4 compressor
+ *
+ * The uncompressed archive is passed to the compressor as libarchive
+ * produces it. The compressor splits it into fixed-size chunks that are
+ * compressed on multiple threads and written out in order, so only a few
+ * chunks are held in memory. Like the libarchive path, the output is padded
+ * to 512 byte blocks.
+ */
+bool CpioFile::Impl::writeArchiveParallel(WriteCallback cb, void *userData)
+{
+    CountingWriteCtx ctx;
+    ctx.cb = cb;
+    ctx.userData = userData;
+    ctx.written = 0;
+
+    ParallelCompressor compressor(
+            compression == GZIP
+                    ? ParallelCompressor::Format::Gzip
+                    : ParallelCompressor::Format::Lz4Legacy,
+            compressionLevel >= 0 ? compressionLevel
+                    : compression == GZIP ? DefaultGzipLevel : DefaultLz4Level,
+            compressionThreads, &countingWriteCb, &ctx);
+
+    if (!writeArchive(NONE, 0, &compressorWriteCb, &compressor)) {
+        return false;
+    }
+
+    if (!compressor.finish()) {
+        error = ErrorCode::ArchiveWriteDataError;
+        return false;
+    }
+
+    static const unsigned char zeros[512] = {};
+    std::size_t padding = (512 - ctx.written % 512) % 512;
+    if (padding > 0 && !cb(zeros, padding, userData)) {
+        error = ErrorCode::ArchiveWriteDataError;
+        return false;
+    }
 
     return true;
 }
 
+/*!
+ * \brief Constructs the cpio archive and streams it to a callback
+ *
+ * This function builds the `.cpio` file, compressing it with the same
+ * compression as the loaded archive. The archive uses the `newc` format and
+ * files are written in lexographical order. The output is passed to \a cb in
+ * blocks as soon as it is produced.
+ *
+ * gzip and LZ4 archives are compressed on multiple threads (see
+ * setCompressionThreads()). LZ4 archives are written in the legacy format
+ * expected by the kernel.
+ *
+ * \param cb Callback receiving each block of the archive. Returning false
+ *           aborts the write.
+ * \param userData Pointer passed to \a cb
+ *
+ * \return Whether the archive was successfully created
+ */
+bool CpioFile::createData(WriteCallback cb, void *userData)
+{
+    m_impl->normalize();
+
+    if (m_impl->compression == GZIP || m_impl->compression == LZ4) {
+        return m_impl->writeArchiveParallel(cb, userData);
+    } else {
+        return m_impl->writeArchive(m_impl->compression, 512, cb, userData);
+    }
+}
+
+/*!
+ * \brief Set compression level used by createData()
+ *
+ * Levels are passed to zlib for gzip archives. For LZ4 archives, levels below 3
+ * use the fast compressor and higher levels use LZ4HC.
+ *
+ * \param level Compression level or -1 to use the default (9 for gzip and 1
+ *              for LZ4)
+ */
+void CpioFile::setCompressionLevel(int level)
+{
+    m_impl->compressionLevel = level;
+}
+
+int CpioFile::compressionLevel() const
+{
+    return m_impl->compressionLevel;
+}
+
+/*!
+ * \brief Set number of threads used for compressing gzip and LZ4 archives
+ *
+ * \param threads Number of threads or 0 to use all hardware threads
+ */
+void CpioFile::setCompressionThreads(unsigned int threads)
+{
+    m_impl->compressionThreads = threads;
+}
+
+unsigned int CpioFile::compressionThreads() const
+{
+    return m_impl->compressionThreads;
+}
+
 /*!
  * \brief Check if a file exists in the cpio archive
  *
@@ -337,13 +906,7 @@ bool CpioFile::createData(std::vector<unsigned char> *dataOut)
  */
 bool CpioFile::exists(const std::string &name) const
 {
-    for (auto const &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            return true;
-        }
-    }
-
-    return false;
+    return m_impl->find(name) != nullptr;
 }
 
 /*!
@@ -359,16 +922,16 @@ bool CpioFile::exists(const std::string &name) const
  */
 bool CpioFile::remove(const std::string &name)
 {
-    for (auto it = m_impl->files.begin(); it != m_impl->files.end(); ++it) {
-        archive_entry *entry = (*it).first;
-        if (name == archive_entry_pathname(entry)) {
-            archive_entry_free(entry);
-            m_impl->files.erase(it);
-            return true;
-        }
+    auto it = m_impl->index.find(name);
+    if (it == m_impl->index.end()) {
+        return false;
     }
 
-    return false;
+    it->second->removed = true;
+    m_impl->index.erase(it);
+    m_impl->needsCompact = true;
+
+    return true;
 }
 
 /*!
@@ -378,10 +941,19 @@ bool CpioFile::remove(const std::string &name)
  */
 std::vector<std::string> CpioFile::filenames() const
 {
+    // The entries themselves are only sorted and compacted when the archive is
+    // written, so sort the list instead
     std::vector<std::string> list;
+    list.reserve(m_impl->files.size());
+
+    for (auto const &e : m_impl->files) {
+        if (!e->removed) {
+            list.push_back(archive_entry_pathname(e->entry));
+        }
+    }
 
-    for (auto const &p : m_impl->files) {
-        list.push_back(archive_entry_pathname(p.first));
+    if (m_impl->needsSort) {
+        std::stable_sort(list.begin(), list.end());
     }
 
     return list;
@@ -395,15 +967,14 @@ std::vector<std::string> CpioFile::filenames() const
 bool CpioFile::contents(const std::string &name,
                         std::vector<unsigned char> *dataOut) const
 {
-    for (auto const &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            *dataOut = p.second;
-            return true;
-        }
+    CpioEntry *e = m_impl->find(name);
+    if (!e) {
+        m_impl->error = ErrorCode::CpioFileNotExistError;
+        return false;
     }
 
-    m_impl->error = ErrorCode::CpioFileNotExistError;
-    return false;
+    dataOut->assign(e->payload(), e->payload() + e->payloadSize());
+    return true;
 }
 
 /*!
@@ -417,49 +988,65 @@ bool CpioFile::contents(const std::string &name,
 bool CpioFile::setContents(const std::string &name,
                            std::vector<unsigned char> data)
 {
-    for (auto &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            archive_entry_set_size(p.first, data.size());
-            p.second = std::move(data);
-            return true;
-        }
+    CpioEntry *e = m_impl->find(name);
+    if (!e) {
+        m_impl->error = ErrorCode::CpioFileNotExistError;
+        return false;
     }
 
-    m_impl->error = ErrorCode::CpioFileNotExistError;
-    return false;
+    e->setData(std::move(data));
+    return true;
 }
 
+/*!
+ * \brief Get contents of a file in the archive without copying it
+ *
+ * \note The returned pointer is only valid until the file's contents are
+ *       changed or another archive is loaded.
+ */
 bool CpioFile::contentsC(const std::string &name,
                          const unsigned char **data, std::size_t *size) const
 {
-    for (auto const &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            *data = p.second.data();
-            *size = p.second.size();
-            return true;
-        }
+    CpioEntry *e = m_impl->find(name);
+    if (!e) {
+        m_impl->error = ErrorCode::CpioFileNotExistError;
+        return false;
     }
 
-    m_impl->error = ErrorCode::CpioFileNotExistError;
-    return false;
+    *data = e->payload();
+    *size = e->payloadSize();
+    return true;
 }
 
 bool CpioFile::setContentsC(const std::string &name,
                             const unsigned char *data, std::size_t size)
 {
-    for (auto &p : m_impl->files) {
-        if (name == archive_entry_pathname(p.first)) {
-            archive_entry_set_size(p.first, size);
-            p.second.clear();
-            p.second.shrink_to_fit();
-            p.second.resize(size);
-            std::memcpy(p.second.data(), data, size);
-            return true;
-        }
+    CpioEntry *e = m_impl->find(name);
+    if (!e) {
+        m_impl->error = ErrorCode::CpioFileNotExistError;
+        return false;
     }
 
-    m_impl->error = ErrorCode::CpioFileNotExistError;
-    return false;
+    e->setData(std::vector<unsigned char>(data, data + size));
+    return true;
+}
+
+static archive_entry * newEntry(const std::string &name)
+{
+    archive_entry *entry = archive_entry_new();
+
+    archive_entry_set_uid(entry, 0);
+    archive_entry_set_gid(entry, 0);
+    archive_entry_set_nlink(entry, 1);
+    archive_entry_set_mtime(entry, 0, 0);
+    archive_entry_set_devmajor(entry, 0);
+    archive_entry_set_devminor(entry, 0);
+    archive_entry_set_rdevmajor(entry, 0);
+    archive_entry_set_rdevminor(entry, 0);
+
+    archive_entry_set_pathname(entry, name.c_str());
+
+    return entry;
 }
 
 /*!
@@ -479,27 +1066,16 @@ bool CpioFile::addSymlink(const std::string &source, const std::string &target)
         return false;
     }
 
-    archive_entry *entry = archive_entry_new();
-
-    archive_entry_set_uid(entry, 0);
-    archive_entry_set_gid(entry, 0);
-    archive_entry_set_nlink(entry, 1);
-    archive_entry_set_mtime(entry, 0, 0);
-    archive_entry_set_devmajor(entry, 0);
-    archive_entry_set_devminor(entry, 0);
-    archive_entry_set_rdevmajor(entry, 0);
-    archive_entry_set_rdevminor(entry, 0);
+    archive_entry *entry = newEntry(target);
 
-    archive_entry_set_pathname(entry, target.c_str());
     archive_entry_set_size(entry, 0);
     archive_entry_set_symlink(entry, source.c_str());
 
     archive_entry_set_filetype(entry, AE_IFLNK);
     archive_entry_set_perm(entry, 0777);
 
-    m_impl->files.push_back(std::make_pair(entry, std::vector<unsigned char>()));
-
-    std::sort(m_impl->files.begin(), m_impl->files.end(), sortByName);
+    m_impl->addEntry(entry);
+    m_impl->needsSort = true;
 
     return true;
 }
@@ -552,26 +1128,14 @@ bool CpioFile::addFile(std::vector<unsigned char> contents,
         return false;
     }
 
-    archive_entry *entry = archive_entry_new();
-
-    archive_entry_set_uid(entry, 0);
-    archive_entry_set_gid(entry, 0);
-    archive_entry_set_nlink(entry, 1);
-    archive_entry_set_mtime(entry, 0, 0);
-    archive_entry_set_devmajor(entry, 0);
-    archive_entry_set_devminor(entry, 0);
-    archive_entry_set_rdevmajor(entry, 0);
-    archive_entry_set_rdevminor(entry, 0);
-
-    archive_entry_set_pathname(entry, name.c_str());
-    archive_entry_set_size(entry, contents.size());
+    archive_entry *entry = newEntry(name);
 
     archive_entry_set_filetype(entry, AE_IFREG);
     archive_entry_set_perm(entry, perms);
 
-    m_impl->files.push_back(std::make_pair(entry, std::move(contents)));
-
-    std::sort(m_impl->files.begin(), m_impl->files.end(), sortByName);
+    CpioEntry *e = m_impl->addEntry(entry);
+    e->setData(std::move(contents));
+    m_impl->needsSort = true;
 
     return true;
 }
@@ -579,34 +1143,7 @@ bool CpioFile::addFile(std::vector<unsigned char> contents,
 bool CpioFile::addFileC(const unsigned char *data, std::size_t size,
                         const std::string &name, unsigned int perms)
 {
-    if (exists(name)) {
-        m_impl->error = ErrorCode::CpioFileAlreadyExistsError;
-        return false;
-    }
-
-    archive_entry *entry = archive_entry_new();
-
-    archive_entry_set_uid(entry, 0);
-    archive_entry_set_gid(entry, 0);
-    archive_entry_set_nlink(entry, 1);
-    archive_entry_set_mtime(entry, 0, 0);
-    archive_entry_set_devmajor(entry, 0);
-    archive_entry_set_devminor(entry, 0);
-    archive_entry_set_rdevmajor(entry, 0);
-    archive_entry_set_rdevminor(entry, 0);
-
-    archive_entry_set_pathname(entry, name.c_str());
-    archive_entry_set_size(entry, size);
-
-    archive_entry_set_filetype(entry, AE_IFREG);
-    archive_entry_set_perm(entry, perms);
-
-    m_impl->files.push_back(std::make_pair(
-            entry, std::vector<unsigned char>(data, data + size)));
-
-    std::sort(m_impl->files.begin(), m_impl->files.end(), sortByName);
-
-    return true;
+    return addFile(std::vector<unsigned char>(data, data + size), name, perms);
 }
 
 bool CpioFile::rename(const std::string &source, const std::string &target)
@@ -616,15 +1153,19 @@ bool CpioFile::rename(const std::string &source, const std::string &target)
         return false;
     }
 
-    for (auto &p : m_impl->files) {
-        if (source == archive_entry_pathname(p.first)) {
-            archive_entry_set_pathname(p.first, target.c_str());
-            return true;
-        }
+    auto it = m_impl->index.find(source);
+    if (it == m_impl->index.end()) {
+        m_impl->error = ErrorCode::CpioFileNotExistError;
+        return false;
     }
 
-    m_impl->error = ErrorCode::CpioFileNotExistError;
-    return false;
+    CpioEntry *e = it->second;
+    m_impl->index.erase(it);
+
+    archive_entry_set_pathname(e->entry, target.c_str());
+    m_impl->index[target] = e;
+
+    return true;
 }
 
 }
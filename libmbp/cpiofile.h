@@ -39,7 +39,20 @@ public:
 
     bool load(const unsigned char *data, std::size_t size);
     bool load(const std::vector<unsigned char> &data);
+    typedef bool (*WriteCallback)(const unsigned char *data, std::size_t size,
+                                  void *userData);
+
     bool createData(std::vector<unsigned char> *dataOut);
+    bool createData(unsigned char *buf, std::size_t size,
+                    std::size_t *sizeOut);
+    bool createData(WriteCallback cb, void *userData);
+    bool createFile(const std::string &path);
+    std::size_t estimatedSize() const;
+
+    int compressionLevel() const;
+    void setCompressionLevel(int level);
+    unsigned int compressionThreads() const;
+    void setCompressionThreads(unsigned int threads);
 
     bool exists(const std::string &name) const;
     bool remove(const std::string &name);
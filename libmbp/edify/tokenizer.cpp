@@ -20,230 +20,87 @@
 #include "edify/tokenizer.h"
 
 #include <cassert>
+#include <cctype>
 #include <cstring>
 
 #include "private/logging.h"
+#include "private/stringutils.h"
 
 namespace mbp
 {
 
-EdifyToken::~EdifyToken()
-{
-}
-
-EdifyToken::EdifyToken(EdifyTokenType type) : m_type(type)
-{
-}
-
-EdifyTokenType EdifyToken::type() const
-{
-    return m_type;
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyKeywordToken::EdifyKeywordToken(EdifyTokenType type, std::string keyword)
-    : EdifyToken(type), m_keyword(std::move(keyword))
-{
-}
-
-std::string EdifyKeywordToken::generate()
-{
-    return m_keyword;
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenIf::EdifyTokenIf()
-    : EdifyKeywordToken(EdifyTokenType::If, "if")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenThen::EdifyTokenThen()
-    : EdifyKeywordToken(EdifyTokenType::Then, "then")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenElse::EdifyTokenElse()
-    : EdifyKeywordToken(EdifyTokenType::Else, "else")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenEndif::EdifyTokenEndif()
-    : EdifyKeywordToken(EdifyTokenType::Endif, "endif")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenAnd::EdifyTokenAnd()
-    : EdifyKeywordToken(EdifyTokenType::And, "&&")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
+const std::size_t EdifyTokenizer::npos;
 
-EdifyTokenOr::EdifyTokenOr()
-    : EdifyKeywordToken(EdifyTokenType::Or, "||")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenEquals::EdifyTokenEquals()
-    : EdifyKeywordToken(EdifyTokenType::Equals, "==")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenNotEquals::EdifyTokenNotEquals()
-    : EdifyKeywordToken(EdifyTokenType::NotEquals, "!=")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenNot::EdifyTokenNot()
-    : EdifyKeywordToken(EdifyTokenType::Not, "!")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenLeftParen::EdifyTokenLeftParen()
-    : EdifyKeywordToken(EdifyTokenType::LeftParen, "(")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenRightParen::EdifyTokenRightParen()
-    : EdifyKeywordToken(EdifyTokenType::RightParen, ")")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenSemicolon::EdifyTokenSemicolon()
-    : EdifyKeywordToken(EdifyTokenType::Semicolon, ";")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenComma::EdifyTokenComma()
-    : EdifyKeywordToken(EdifyTokenType::Comma, ",")
-{
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenConcat::EdifyTokenConcat()
-    : EdifyKeywordToken(EdifyTokenType::Concat, "+")
+/*!
+ * \brief Raw text of the token
+ */
+std::string EdifyToken::text() const
 {
+    return std::string(data, size);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenNewline::EdifyTokenNewline()
-    : EdifyKeywordToken(EdifyTokenType::Newline, "\n")
+/*!
+ * \brief Check if the raw text of the token is \a str
+ */
+bool EdifyToken::equals(const char *str) const
 {
+    return std::strlen(str) == size && std::memcmp(data, str, size) == 0;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenWhitespace::EdifyTokenWhitespace(std::string str)
-    : EdifyToken(EdifyTokenType::Whitespace)
+/*!
+ * \brief Check if the raw text of the token contains \a str
+ */
+bool EdifyToken::contains(const std::string &str) const
 {
-    assert(!str.empty());
-
-    for (char c __attribute__((unused)) : str) {
-        // Should never fail
-        assert(std::isspace(c));
+    if (str.empty()) {
+        return true;
     }
-
-    m_str = std::move(str);
-}
-
-std::string EdifyTokenWhitespace::generate()
-{
-    return m_str;
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenComment::EdifyTokenComment(std::string str)
-    : EdifyToken(EdifyTokenType::Comment), m_str(std::move(str))
-{
-}
-
-std::string EdifyTokenComment::generate()
-{
-    return '#' + m_str;
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-EdifyTokenString::EdifyTokenString(std::string str, Type type)
-    : EdifyToken(EdifyTokenType::String), m_type(type)
-{
-    switch (type) {
-    case AlreadyQuoted:
-        m_quoted = true;
-        assert(str.size() >= 2);
-        assert(str.front() == '"');
-        assert(str.back() == '"');
-        m_str = std::move(str);
-        break;
-    case NotQuoted:
-        m_quoted = false;
-        m_str = std::move(str);
-        break;
-    case MakeQuoted:
-        m_quoted = true;
-        std::string temp;
-        escape(str, &temp);
-        temp.insert(temp.begin(), '"');
-        temp.push_back('"');
-        m_str = std::move(str);
-        break;
+    if (str.size() > size) {
+        return false;
+    }
+    const char *end = data + size - str.size();
+    for (const char *ptr = data; ptr <= end; ++ptr) {
+        ptr = static_cast<const char *>(
+                std::memchr(ptr, str[0], end - ptr + 1));
+        if (!ptr) {
+            break;
+        }
+        if (std::memcmp(ptr, str.data(), str.size()) == 0) {
+            return true;
+        }
     }
+    return false;
 }
 
-std::string EdifyTokenString::generate()
+bool EdifyToken::isQuoted() const
 {
-    return m_str;
+    return type == EdifyTokenType::String && size >= 2 && data[0] == '"';
 }
 
-std::string EdifyTokenString::unescapedString()
+/*!
+ * \brief Value of a string token with the quotes removed and the escape
+ *        sequences decoded
+ *
+ * \return Unescaped string or an empty string if the token contains an invalid
+ *         escape sequence
+ */
+std::string EdifyToken::unescapedString() const
 {
     std::string out;
-    // TODO: Check return value
-    unescape(m_str, &out);
-    if (m_quoted && out.size() >= 2) {
-        out.pop_back();
-        out.erase(out.begin());
+    if (isQuoted()) {
+        unescape(data + 1, size - 2, &out);
+    } else {
+        unescape(data, size, &out);
     }
     return out;
 }
 
-std::string EdifyTokenString::string()
-{
-    return m_str;
-}
-
-void EdifyTokenString::escape(const std::string &str, std::string *out)
+void EdifyToken::escape(const std::string &str, std::string *out)
 {
     static const char digits[] = "0123456789abcdef";
 
     std::string output;
+    output.reserve(str.size());
 
     for (char c : str) {
         if (c == '\a') {
@@ -260,7 +117,11 @@ void EdifyTokenString::escape(const std::string &str, std::string *out)
             output += "\\t";
         } else if (c == '\v') {
             output += "\\v";
-        } else if (std::isprint(c)) {
+        } else if (c == '\\') {
+            output += "\\\\";
+        } else if (c == '"') {
+            output += "\\\"";
+        } else if (std::isprint(static_cast<unsigned char>(c))) {
             output += c;
         } else {
             output += "\\x";
@@ -277,59 +138,62 @@ static int hexCharToInt(char c)
     if (c >= '0' && c <= '9') {
         return c - '0';
     } else if (c >= 'a' && c <= 'f') {
-        return c - 'a';
+        return c - 'a' + 10;
     } else if (c >= 'A' && c <= 'F') {
-        return c - 'A';
+        return c - 'A' + 10;
     } else {
         return -1;
     }
 }
 
-bool EdifyTokenString::unescape(const std::string &str, std::string *out)
+bool EdifyToken::unescape(const char *data, std::size_t size,
+                          std::string *out)
 {
     std::string output;
+    output.reserve(size);
 
-    for (std::size_t i = 0; i < str.size();) {
-        char c = str[i];
+    for (std::size_t i = 0; i < size;) {
+        char c = data[i];
 
         if (c == '\\') {
-            if (i == str.size() - 1) {
+            if (i == size - 1) {
                 // Escape character is last character
                 return false;
             }
 
             std::size_t new_i = i + 2;
 
-            if (str[i + 1] == 'a') {
+            if (data[i + 1] == 'a') {
                 output += '\a';
-            } else if (str[i + 1] == 'b') {
+            } else if (data[i + 1] == 'b') {
                 output += '\b';
-            } else if (str[i + 1] == 'f') {
+            } else if (data[i + 1] == 'f') {
                 output += '\f';
-            } else if (str[i + 1] == 'n') {
+            } else if (data[i + 1] == 'n') {
                 output += '\n';
-            } else if (str[i + 1] == 'r') {
+            } else if (data[i + 1] == 'r') {
                 output += '\r';
-            } else if (str[i + 1] == 't') {
+            } else if (data[i + 1] == 't') {
                 output += '\t';
-            } else if (str[i + 1] == 'v') {
+            } else if (data[i + 1] == 'v') {
                 output += '\v';
-            } else if (str[i + 1] == '\\') {
+            } else if (data[i + 1] == '\\') {
                 output += '\\';
-            } else if (str[i + 1] == 'x') {
-                if (str.size() - i < 4) {
+            } else if (data[i + 1] == '"') {
+                output += '"';
+            } else if (data[i + 1] == 'x') {
+                if (size - i < 4) {
                     // Need 4 chars: \xYY
                     return false;
                 }
-                int digit1 = hexCharToInt(str[i + 2]);
-                int digit2 = hexCharToInt(str[i + 3]);
+                int digit1 = hexCharToInt(data[i + 2]);
+                int digit2 = hexCharToInt(data[i + 3]);
                 if (digit1 < 0 || digit2 < 0) {
                     // One of the chars is not a valid hex character
                     return false;
                 }
 
-                char val = (digit1 << 4) & digit2;
-                output += val;
+                output += static_cast<char>((digit1 << 4) | digit2);
 
                 new_i += 2;
             } else {
@@ -349,201 +213,275 @@ bool EdifyTokenString::unescape(const std::string &str, std::string *out)
     return true;
 }
 
+/*!
+ * \brief Escape and quote a string for use as a string token
+ */
+std::string EdifyToken::quote(const std::string &str)
+{
+    std::string out;
+    escape(str, &out);
+    out.insert(out.begin(), '"');
+    out.push_back('"');
+    return out;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 
-EdifyTokenUnknown::EdifyTokenUnknown(char c) : EdifyToken(EdifyTokenType::Unknown), m_char(c)
+EdifySplicer::EdifySplicer(const char *data, std::size_t size)
+    : m_data(data), m_size(size)
 {
 }
 
-std::string EdifyTokenUnknown::generate()
+/*!
+ * \brief Replace the tokens from \a first to \a last (inclusive)
+ *
+ * \note The tokens must come after the ones replaced by the previous edit
+ */
+void EdifySplicer::replace(const EdifyToken &first, const EdifyToken &last,
+                           const std::string &replacement)
 {
-    return std::string(1, m_char);
+    Edit edit;
+    edit.offset = first.data - m_data;
+    edit.size = last.data + last.size - first.data;
+    edit.textOffset = m_text.size();
+    edit.textSize = replacement.size();
+
+    assert(edit.offset + edit.size <= m_size);
+    assert(m_edits.empty() || edit.offset
+            >= m_edits.back().offset + m_edits.back().size);
+
+    m_text += replacement;
+    m_edits.push_back(edit);
+}
+
+std::size_t EdifySplicer::edits() const
+{
+    return m_edits.size();
+}
+
+/*!
+ * \brief Build the new buffer with all of the edits applied
+ */
+std::string EdifySplicer::apply() const
+{
+    std::size_t newSize = m_size + m_text.size();
+    for (const Edit &edit : m_edits) {
+        newSize -= edit.size;
+    }
+
+    std::string output;
+    output.reserve(newSize);
+
+    std::size_t pos = 0;
+    for (const Edit &edit : m_edits) {
+        output.append(m_data + pos, edit.offset - pos);
+        output.append(m_text, edit.textOffset, edit.textSize);
+        pos = edit.offset + edit.size;
+    }
+    output.append(m_data + pos, m_size - pos);
+
+    return output;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
 bool EdifyTokenizer::isValidUnquoted(char c)
 {
-    return std::isalnum(c)
+    return std::isalnum(static_cast<unsigned char>(c))
             || c == '_'
             || c == ':'
             || c == '/'
             || c == '.';
 }
 
+static inline bool isSpaceNotNewline(char c)
+{
+    return c != '\n' && std::isspace(static_cast<unsigned char>(c));
+}
+
 bool EdifyTokenizer::nextToken(const char *data, std::size_t size,
-                               std::size_t *pos, EdifyToken **token)
+                               std::size_t *pos, EdifyToken *token)
 {
     std::size_t p = *pos;
     assert(p < size);
 
+    EdifyTokenType type;
+
     if (size - p >= 2 && std::memcmp(data + p, "if", 2) == 0) {
-        *token = new EdifyTokenIf();
+        type = EdifyTokenType::If;
         p += 2;
     } else if (size - p >= 4 && std::memcmp(data + p, "then", 4) == 0) {
-        *token = new EdifyTokenThen();
+        type = EdifyTokenType::Then;
         p += 4;
     } else if (size - p >= 4 && std::memcmp(data + p, "else", 4) == 0) {
-        *token = new EdifyTokenElse();
+        type = EdifyTokenType::Else;
         p += 4;
     } else if (size - p >= 5 && std::memcmp(data + p, "endif", 5) == 0) {
-        *token = new EdifyTokenEndif();
+        type = EdifyTokenType::Endif;
         p += 5;
     } else if (size - p >= 2 && std::memcmp(data + p, "&&", 2) == 0) {
-        *token = new EdifyTokenAnd();
+        type = EdifyTokenType::And;
         p += 2;
     } else if (size - p >= 2 && std::memcmp(data + p, "||", 2) == 0) {
-        *token = new EdifyTokenOr();
+        type = EdifyTokenType::Or;
         p += 2;
     } else if (size - p >= 2 && std::memcmp(data + p, "==", 2) == 0) {
-        *token = new EdifyTokenEquals();
+        type = EdifyTokenType::Equals;
         p += 2;
     } else if (size - p >= 2 && std::memcmp(data + p, "!=", 2) == 0) {
-        *token = new EdifyTokenNotEquals();
+        type = EdifyTokenType::NotEquals;
         p += 2;
     } else if (data[p] == '!') {
-        *token = new EdifyTokenNot();
+        type = EdifyTokenType::Not;
         p += 1;
     } else if (data[p] == '(') {
-        *token = new EdifyTokenLeftParen();
+        type = EdifyTokenType::LeftParen;
         p += 1;
     } else if (data[p] == ')') {
-        *token = new EdifyTokenRightParen();
+        type = EdifyTokenType::RightParen;
         p += 1;
     } else if (data[p] == ';') {
-        *token = new EdifyTokenSemicolon();
+        type = EdifyTokenType::Semicolon;
         p += 1;
     } else if (data[p] == ',') {
-        *token = new EdifyTokenComma();
+        type = EdifyTokenType::Comma;
         p += 1;
     } else if (data[p] == '+') {
-        *token = new EdifyTokenConcat();
+        type = EdifyTokenType::Concat;
         p += 1;
     } else if (data[p] == '\n') {
-        *token = new EdifyTokenNewline();
+        type = EdifyTokenType::Newline;
         p += 1;
-    } else if (data[p] != '\n' && std::isspace(data[p])) {
-        std::string buf;
-        buf += data[p];
+    } else if (isSpaceNotNewline(data[p])) {
+        type = EdifyTokenType::Whitespace;
         p += 1;
-        while (size - p >= 1 && data[p] != '\n' && std::isspace(data[p])) {
-            buf += data[p];
+        while (p < size && isSpaceNotNewline(data[p])) {
             p += 1;
         }
-        *token = new EdifyTokenWhitespace(std::move(buf));
     } else if (data[p] == '#') {
-        std::string buf;
-        // Omit '#' character
+        type = EdifyTokenType::Comment;
         p += 1;
-        while (size - p >= 1 && data[p] != '\n') {
-            buf += data[p];
+        while (p < size && data[p] != '\n') {
             p += 1;
         }
-        *token = new EdifyTokenComment(std::move(buf));
     } else if (isValidUnquoted(data[p])) {
-        std::string buf;
-        buf += data[p];
+        type = EdifyTokenType::String;
         p += 1;
-        while (size - p >= 1 && isValidUnquoted(data[p])) {
-            buf += data[p];
+        while (p < size && isValidUnquoted(data[p])) {
             p += 1;
         }
-        *token = new EdifyTokenString(std::move(buf), EdifyTokenString::NotQuoted);
     } else if (data[p] == '"') {
+        type = EdifyTokenType::String;
         std::size_t curPos = p;
-        std::string buf;
-        buf += data[p];
         p += 1;
         bool escaped = false;
         bool terminated = false;
-        while (size - p >= 1) {
+        while (p < size) {
             if (data[p] == '\\' || escaped) {
                 escaped = !escaped;
-            } else if (!escaped && data[p] == '"') {
-                buf += data[p];
+            } else if (data[p] == '"') {
                 p += 1;
                 terminated = true;
                 break;
             }
-            buf += data[p];
             p += 1;
         }
         if (!terminated) {
-            FLOGE("Unterminated quote at position %zu", curPos);
+            FLOGE("Unterminated quote at position %" PRIzu, curPos);
             return false;
         }
-        *token = new EdifyTokenString(std::move(buf), EdifyTokenString::AlreadyQuoted);
     } else {
-        *token = new EdifyTokenUnknown(data[p]);
+        type = EdifyTokenType::Unknown;
         p += 1;
     }
 
+    token->type = type;
+    token->data = data + *pos;
+    token->size = p - *pos;
+
     *pos = p;
 
     return true;
 }
 
+/*!
+ * \brief Split a buffer into tokens
+ *
+ * The tokens are stored contiguously and reference \a data, which must outlive
+ * them.
+ */
 bool EdifyTokenizer::tokenize(const char *data, std::size_t size,
-                              std::vector<EdifyToken *> *tokens)
+                              std::vector<EdifyToken> *tokens)
 {
-    std::vector<EdifyToken *> temp;
-    EdifyToken *token;
+    std::vector<EdifyToken> temp;
+    // Scripts average a few bytes per token
+    temp.reserve(size / 4 + 1);
+
+    EdifyToken token;
     std::size_t pos = 0;
-    bool fail = false;
 
-    while (true) {
-        if (pos > size) {
-            LOGE("Tokenizer position exceeded data size!");
-            fail = true;
-            break;
-        } else if (pos == size) {
-            break;
-        } else if (!nextToken(data, size, &pos, &token)) {
-            fail = true;
-            break;
+    while (pos < size) {
+        if (!nextToken(data, size, &pos, &token)) {
+            return false;
         }
         temp.push_back(token);
     }
 
-    if (fail) {
-        for (EdifyToken *t : temp) {
-            delete t;
-        }
-        temp.clear();
-        return false;
-    }
-
     tokens->swap(temp);
     return true;
 }
 
-std::string EdifyTokenizer::untokenize(const std::vector<EdifyToken *> &tokens)
+std::string EdifyTokenizer::untokenize(const std::vector<EdifyToken> &tokens)
 {
+    std::size_t size = 0;
+    for (const EdifyToken &token : tokens) {
+        size += token.size;
+    }
+
     std::string output;
-    for (EdifyToken *token : tokens) {
-        output += token->generate();
+    output.reserve(size);
+    for (const EdifyToken &token : tokens) {
+        output.append(token.data, token.size);
     }
     return output;
 }
 
-std::string EdifyTokenizer::untokenize(const std::vector<EdifyToken *>::iterator &begin,
-                                       const std::vector<EdifyToken *>::iterator &end)
+/*!
+ * \brief Find the matching parenthesis of every parenthesis token
+ *
+ * \param tokens List of tokens
+ * \param pairs Output list where the element at the index of each parenthesis
+ *              is the index of the matching parenthesis. All other elements
+ *              (and unmatched parentheses) are EdifyTokenizer::npos.
+ */
+void EdifyTokenizer::matchParens(const std::vector<EdifyToken> &tokens,
+                                 std::vector<std::size_t> *pairs)
 {
-    std::string output;
-    for (auto it = begin; it != end; ++it) {
-        output += (*it)->generate();
+    std::vector<std::size_t> result(tokens.size(), npos);
+    std::vector<std::size_t> stack;
+
+    for (std::size_t i = 0; i < tokens.size(); ++i) {
+        if (tokens[i].type == EdifyTokenType::LeftParen) {
+            stack.push_back(i);
+        } else if (tokens[i].type == EdifyTokenType::RightParen
+                && !stack.empty()) {
+            result[stack.back()] = i;
+            result[i] = stack.back();
+            stack.pop_back();
+        }
     }
-    return output;
+
+    pairs->swap(result);
 }
 
-void EdifyTokenizer::dump(const std::vector<EdifyToken *> &tokens)
+void EdifyTokenizer::dump(const std::vector<EdifyToken> &tokens)
 {
     const char *tokenName = nullptr;
 
     for (std::size_t i = 0; i < tokens.size(); ++i) {
-        EdifyToken *t = tokens[i];
+        const EdifyToken &t = tokens[i];
 
-        switch (t->type()) {
+        switch (t.type) {
         case EdifyTokenType::If:         tokenName = "If";         break;
         case EdifyTokenType::Then:       tokenName = "Then";       break;
         case EdifyTokenType::Else:       tokenName = "Else";       break;
@@ -565,7 +503,7 @@ void EdifyTokenizer::dump(const std::vector<EdifyToken *> &tokens)
         case EdifyTokenType::Unknown:    tokenName = "Unknown";    break;
         }
 
-        FLOGD("%" PRIzu ": %-20s: %s", i, tokenName, t->generate().c_str());
+        FLOGD("%" PRIzu ": %-20s: %s", i, tokenName, t.text().c_str());
     }
 }
 
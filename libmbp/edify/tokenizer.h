@@ -51,216 +51,66 @@ enum class EdifyTokenType
     Unknown
 };
 
-class EdifyToken
-{
-public:
-    virtual ~EdifyToken();
-
-    EdifyTokenType type() const;
-    virtual std::string generate() = 0;
-
-protected:
-    EdifyToken(EdifyTokenType type);
-
-private:
-    EdifyTokenType m_type;
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-// Keyword token base class
-class EdifyKeywordToken : public EdifyToken
-{
-public:
-    virtual std::string generate() override;
-
-protected:
-    EdifyKeywordToken(EdifyTokenType type, std::string keyword);
-
-private:
-    std::string m_keyword;
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenIf : public EdifyKeywordToken
-{
-public:
-    EdifyTokenIf();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenThen : public EdifyKeywordToken
-{
-public:
-    EdifyTokenThen();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenElse : public EdifyKeywordToken
-{
-public:
-    EdifyTokenElse();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenEndif : public EdifyKeywordToken
-{
-public:
-    EdifyTokenEndif();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenAnd : public EdifyKeywordToken
-{
-public:
-    EdifyTokenAnd();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenOr : public EdifyKeywordToken
-{
-public:
-    EdifyTokenOr();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenEquals : public EdifyKeywordToken
-{
-public:
-    EdifyTokenEquals();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenNotEquals : public EdifyKeywordToken
-{
-public:
-    EdifyTokenNotEquals();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenNot : public EdifyKeywordToken
-{
-public:
-    EdifyTokenNot();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenLeftParen : public EdifyKeywordToken
-{
-public:
-    EdifyTokenLeftParen();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenRightParen : public EdifyKeywordToken
-{
-public:
-    EdifyTokenRightParen();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenSemicolon : public EdifyKeywordToken
-{
-public:
-    EdifyTokenSemicolon();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenComma : public EdifyKeywordToken
-{
-public:
-    EdifyTokenComma();
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenConcat : public EdifyKeywordToken
+/*!
+ * \brief Token referencing a range of the tokenized buffer
+ *
+ * Tokens do not own any memory. The buffer passed to
+ * EdifyTokenizer::tokenize() must outlive them.
+ */
+struct EdifyToken
 {
-public:
-    EdifyTokenConcat();
-};
+    EdifyTokenType type;
+    // Raw text of the token, including the quotes of quoted strings and the
+    // '#' of comments
+    const char *data;
+    std::size_t size;
 
-////////////////////////////////////////////////////////////////////////////////
+    std::string text() const;
+    bool equals(const char *str) const;
+    bool contains(const std::string &str) const;
+    bool isQuoted() const;
+    std::string unescapedString() const;
 
-class EdifyTokenNewline : public EdifyKeywordToken
-{
-public:
-    EdifyTokenNewline();
+    static void escape(const std::string &str, std::string *out);
+    static bool unescape(const char *data, std::size_t size, std::string *out);
+    static std::string quote(const std::string &str);
 };
 
 ////////////////////////////////////////////////////////////////////////////////
 
-class EdifyTokenWhitespace : public EdifyToken
+/*!
+ * \brief Records replacements of token ranges and applies them in one pass
+ *
+ * Edits must be added in order and must not overlap. The replacement text is
+ * appended to a single buffer, so adding an edit does not allocate per token.
+ */
+class EdifySplicer
 {
 public:
-    EdifyTokenWhitespace(std::string str);
-    virtual std::string generate() override;
+    EdifySplicer(const char *data, std::size_t size);
 
-private:
-    std::string m_str;
-};
+    void replace(const EdifyToken &first, const EdifyToken &last,
+                 const std::string &replacement);
 
-////////////////////////////////////////////////////////////////////////////////
+    std::size_t edits() const;
 
-class EdifyTokenComment : public EdifyToken
-{
-public:
-    EdifyTokenComment(std::string str);
-    virtual std::string generate() override;
+    std::string apply() const;
 
 private:
-    std::string m_str;
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenString : public EdifyToken
-{
-public:
-    enum Type {
-        NotQuoted,
-        MakeQuoted,
-        AlreadyQuoted
+    struct Edit
+    {
+        // Range of the original buffer to replace
+        std::size_t offset;
+        std::size_t size;
+        // Range of m_text to replace it with
+        std::size_t textOffset;
+        std::size_t textSize;
     };
 
-    EdifyTokenString(std::string str, Type type);
-    virtual std::string generate() override;
-
-    std::string unescapedString();
-    std::string string();
-
-protected:
-    std::string m_str;
-    Type m_type;
-    bool m_quoted;
-
-    static void escape(const std::string &str, std::string *out);
-    static bool unescape(const std::string &str, std::string *out);
-};
-
-////////////////////////////////////////////////////////////////////////////////
-
-class EdifyTokenUnknown : public EdifyToken
-{
-public:
-    EdifyTokenUnknown(char c);
-    virtual std::string generate() override;
-
-private:
-    char m_char;
+    const char *m_data;
+    std::size_t m_size;
+    std::vector<Edit> m_edits;
+    std::string m_text;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -269,18 +119,21 @@ class EdifyTokenizer
 {
 public:
     static bool tokenize(const char *data, std::size_t size,
-                         std::vector<EdifyToken *> *tokens);
-    static std::string untokenize(const std::vector<EdifyToken *> &tokens);
-    static std::string untokenize(const std::vector<EdifyToken *>::iterator &begin,
-                                  const std::vector<EdifyToken *>::iterator &end);
+                         std::vector<EdifyToken> *tokens);
+    static std::string untokenize(const std::vector<EdifyToken> &tokens);
+
+    static void matchParens(const std::vector<EdifyToken> &tokens,
+                            std::vector<std::size_t> *pairs);
+
+    static void dump(const std::vector<EdifyToken> &tokens);
 
-    static void dump(const std::vector<EdifyToken *> &tokens);
+    static const std::size_t npos = static_cast<std::size_t>(-1);
 
 private:
     static bool isValidUnquoted(char c);
 
     static bool nextToken(const char *data, std::size_t size, std::size_t *pos,
-                          EdifyToken **token);
+                          EdifyToken *token);
 
     EdifyTokenizer() = delete;
     EdifyTokenizer(const EdifyTokenizer &) = delete;
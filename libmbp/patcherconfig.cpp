@@ -20,6 +20,9 @@
 #include "patcherconfig.h"
 
 #include <algorithm>
+#ifndef LIBMBP_MINI
+#include <mutex>
+#endif
 
 #include <cassert>
 
@@ -35,6 +38,7 @@
 #ifndef LIBMBP_MINI
 #include "patchers/mbtoolupdater.h"
 #include "patchers/multibootpatcher.h"
+#include "private/threadbudget.h"
 #include "autopatchers/standardpatcher.h"
 #include "autopatchers/xposedpatcher.h"
 #include "ramdiskpatchers/default.h"
@@ -56,14 +60,23 @@ public:
     std::string version;
     std::vector<Device *> devices;
 
+    // Ramdisk compression
+    int ramdiskCompressionLevel = -1;
+    unsigned int ramdiskCompressionThreads = 0;
+
     // Errors
     ErrorCode error;
 
 #ifndef LIBMBP_MINI
-    // Created patchers
+    // Created patchers (the lists are shared by all threads that use this
+    // PatcherConfig)
+    std::mutex allocMutex;
     std::vector<Patcher *> allocPatchers;
     std::vector<AutoPatcher *> allocAutoPatchers;
     std::vector<RamdiskPatcher *> allocRamdiskPatchers;
+
+    // Worker threads shared by all patchers created from this PatcherConfig
+    ThreadBudget threadBudget;
 #endif
 
     void loadDefaultDevices();
@@ -172,6 +185,86 @@ void PatcherConfig::setTempDirectory(std::string path)
     m_impl->tempDir = std::move(path);
 }
 
+/*!
+ * \brief Get compression level used when repacking ramdisks
+ *
+ * \return Compression level or -1 if the default level is used
+ */
+int PatcherConfig::ramdiskCompressionLevel() const
+{
+    return m_impl->ramdiskCompressionLevel;
+}
+
+/*!
+ * \brief Set compression level used when repacking ramdisks
+ *
+ * \param level Compression level or -1 to use the default level
+ *
+ * \sa CpioFile::setCompressionLevel()
+ */
+void PatcherConfig::setRamdiskCompressionLevel(int level)
+{
+    m_impl->ramdiskCompressionLevel = level;
+}
+
+/*!
+ * \brief Get number of threads used when compressing ramdisks
+ *
+ * \return Number of threads or 0 if all hardware threads are used
+ */
+unsigned int PatcherConfig::ramdiskCompressionThreads() const
+{
+    return m_impl->ramdiskCompressionThreads;
+}
+
+/*!
+ * \brief Set number of threads used when compressing ramdisks
+ *
+ * \param threads Number of threads or 0 to use all hardware threads
+ *
+ * \sa CpioFile::setCompressionThreads()
+ */
+void PatcherConfig::setRamdiskCompressionThreads(unsigned int threads)
+{
+    m_impl->ramdiskCompressionThreads = threads;
+}
+
+#ifndef LIBMBP_MINI
+
+/*!
+ * \brief Get maximum number of worker threads used for patching
+ *
+ * \return Number of threads
+ */
+unsigned int PatcherConfig::maxThreads() const
+{
+    return m_impl->threadBudget.threads();
+}
+
+/*!
+ * \brief Set maximum number of worker threads used for patching
+ *
+ * The limit is shared by everything created from this PatcherConfig: the
+ * BatchPatcher workers, the boot image patch jobs of each patcher, and the
+ * ramdisk compression threads. A thread only takes a slot while it is running,
+ * so a single patcher can use the whole budget when nothing else is running.
+ *
+ * \param threads Number of threads or 0 to use the number of CPUs
+ */
+void PatcherConfig::setMaxThreads(unsigned int threads)
+{
+    m_impl->threadBudget.setThreads(threads);
+}
+
+/*! \cond INTERNAL */
+ThreadBudget * ThreadBudget::forConfig(PatcherConfig *pc)
+{
+    return &pc->m_impl->threadBudget;
+}
+/*! \endcond */
+
+#endif
+
 /*!
  * \brief Get version number of the patcher
  *
@@ -644,6 +737,7 @@ Patcher * PatcherConfig::createPatcher(const std::string &id)
     }
 
     if (p != nullptr) {
+        std::lock_guard<std::mutex> lock(m_impl->allocMutex);
         m_impl->allocPatchers.push_back(p);
     }
 
@@ -670,6 +764,7 @@ AutoPatcher * PatcherConfig::createAutoPatcher(const std::string &id,
     }
 
     if (ap != nullptr) {
+        std::lock_guard<std::mutex> lock(m_impl->allocMutex);
         m_impl->allocAutoPatchers.push_back(ap);
     }
 
@@ -698,6 +793,7 @@ RamdiskPatcher * PatcherConfig::createRamdiskPatcher(const std::string &id,
     }
 
     if (rp != nullptr) {
+        std::lock_guard<std::mutex> lock(m_impl->allocMutex);
         m_impl->allocRamdiskPatchers.push_back(rp);
     }
 
@@ -711,6 +807,8 @@ RamdiskPatcher * PatcherConfig::createRamdiskPatcher(const std::string &id,
  */
 void PatcherConfig::destroyPatcher(Patcher *patcher)
 {
+    std::lock_guard<std::mutex> lock(m_impl->allocMutex);
+
     auto it = std::find(m_impl->allocPatchers.begin(),
                         m_impl->allocPatchers.end(),
                         patcher);
@@ -728,6 +826,8 @@ void PatcherConfig::destroyPatcher(Patcher *patcher)
  */
 void PatcherConfig::destroyAutoPatcher(AutoPatcher *patcher)
 {
+    std::lock_guard<std::mutex> lock(m_impl->allocMutex);
+
     auto it = std::find(m_impl->allocAutoPatchers.begin(),
                         m_impl->allocAutoPatchers.end(),
                         patcher);
@@ -745,6 +845,8 @@ void PatcherConfig::destroyAutoPatcher(AutoPatcher *patcher)
  */
 void PatcherConfig::destroyRamdiskPatcher(RamdiskPatcher *patcher)
 {
+    std::lock_guard<std::mutex> lock(m_impl->allocMutex);
+
     auto it = std::find(m_impl->allocRamdiskPatchers.begin(),
                         m_impl->allocRamdiskPatchers.end(),
                         patcher);
@@ -38,6 +38,7 @@ namespace mbp
 class Patcher;
 class AutoPatcher;
 class RamdiskPatcher;
+class ThreadBudget;
 #endif
 
 class MBP_EXPORT PatcherConfig
@@ -56,7 +57,15 @@ public:
 
     std::string version() const;
     std::vector<Device *> devices() const;
+
+    int ramdiskCompressionLevel() const;
+    void setRamdiskCompressionLevel(int level);
+    unsigned int ramdiskCompressionThreads() const;
+    void setRamdiskCompressionThreads(unsigned int threads);
 #ifndef LIBMBP_MINI
+    unsigned int maxThreads() const;
+    void setMaxThreads(unsigned int threads);
+
     std::vector<std::string> patchers() const;
     std::vector<std::string> autoPatchers() const;
     std::vector<std::string> ramdiskPatchers() const;
@@ -81,6 +90,10 @@ public:
 private:
     class Impl;
     std::unique_ptr<Impl> m_impl;
+
+#ifndef LIBMBP_MINI
+    friend class ThreadBudget;
+#endif
 };
 
 }
@@ -89,7 +89,9 @@ public:
      * \brief Cancel the patching of a file
      *
      * This method allows the patching process to be cancelled. This is only
-     * useful if the patching operation is being done on a thread.
+     * useful if the patching operation is being done on a thread. It is safe
+     * to call from any thread. If it is called before patchFile() starts, the
+     * next patchFile() call fails with ErrorCode::PatchingCancelled.
      */
     virtual void cancelPatching() = 0;
 };
@@ -143,6 +145,19 @@ public:
      * \param directory Directory containing the files to be patched
      */
     virtual bool patchFiles(const std::string &directory) = 0;
+
+    /*!
+     * \brief Patch a single file in memory
+     *
+     * This allows a Patcher to run the autopatcher on a file read directly
+     * from the zip without extracting it first.
+     *
+     * \param file Path of the file in the zip (one of existingFiles())
+     * \param contents Contents of the file, which will be replaced with the
+     *                 patched contents
+     */
+    virtual bool patchFile(const std::string &file,
+                           std::vector<unsigned char> *contents) = 0;
 };
 
 
@@ -19,6 +19,8 @@
 
 #include "patchers/mbtoolupdater.h"
 
+#include <atomic>
+
 #include <cassert>
 
 #include "bootimage.h"
@@ -27,6 +29,7 @@
 #include "ramdiskpatchers/core.h"
 
 #include "private/stringutils.h"
+#include "private/threadbudget.h"
 
 
 namespace mbp
@@ -41,6 +44,8 @@ public:
     PatcherConfig *pc;
     const FileInfo *info;
 
+    std::atomic<bool> cancelled{false};
+
     ErrorCode error;
 
     bool patchImage();
@@ -93,7 +98,7 @@ std::string MbtoolUpdater::newFilePath()
 
 void MbtoolUpdater::cancelPatching()
 {
-    // Ignore. This runs fast enough that canceling is not needed
+    m_impl->cancelled = true;
 }
 
 bool MbtoolUpdater::patchFile(ProgressUpdatedCallback progressCb,
@@ -116,11 +121,21 @@ bool MbtoolUpdater::patchFile(ProgressUpdatedCallback progressCb,
         return false;
     }
 
-    return m_impl->patchImage();
+    bool ret = m_impl->patchImage();
+
+    // Consume the cancellation so the patcher can be reused
+    if (m_impl->cancelled.exchange(false)) {
+        m_impl->error = ErrorCode::PatchingCancelled;
+        return false;
+    }
+
+    return ret;
 }
 
 bool MbtoolUpdater::Impl::patchImage()
 {
+    if (cancelled) return false;
+
     BootImage bi;
     if (!bi.loadFile(info->filename())) {
         error = bi.error();
@@ -137,6 +152,8 @@ bool MbtoolUpdater::Impl::patchImage()
         return false;
     }
 
+    mainCpio.setCompressionLevel(pc->ramdiskCompressionLevel());
+
     const unsigned char *data;
     std::size_t size;
     if (mainCpio.contentsC("sbin/ramdisk.cpio", &data, &size)) {
@@ -152,6 +169,8 @@ bool MbtoolUpdater::Impl::patchImage()
         target = &mainCpio;
     }
 
+    if (cancelled) return false;
+
     // Make sure init.rc has the mbtooldaemon service
     patchInitRc(target);
 
@@ -165,6 +184,17 @@ bool MbtoolUpdater::Impl::patchImage()
         mainCpio.setContents("sbin/ramdisk.cpio", std::move(newContents));
     }
 
+    // Only use the compression threads that are free in the thread budget
+    unsigned int wanted = pc->ramdiskCompressionThreads();
+    if (wanted == 0) {
+        wanted = pc->maxThreads();
+    }
+    ThreadLease lease(ThreadBudget::forConfig(pc),
+                      wanted > 1 ? wanted - 1 : 0);
+    mainCpio.setCompressionThreads(1 + lease.count());
+
+    if (cancelled) return false;
+
     std::vector<unsigned char> newRamdisk;
     if (!mainCpio.createData(&newRamdisk)) {
         error = mainCpio.error();
@@ -172,6 +202,8 @@ bool MbtoolUpdater::Impl::patchImage()
     }
     bi.setRamdiskImage(std::move(newRamdisk));
 
+    if (cancelled) return false;
+
     if (!bi.createFile(m_parent->newFilePath())) {
         error = bi.error();
         return false;
@@ -20,17 +20,22 @@
 #include "patchers/multibootpatcher.h"
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_set>
 
 #include <cassert>
 
-#include "libmbpio/delete.h"
-
 #include "bootimage.h"
 #include "cpiofile.h"
 #include "patcherconfig.h"
+#include "private/compressutils.h"
 #include "private/fileutils.h"
 #include "private/logging.h"
+#include "private/threadbudget.h"
 
 // minizip
 #include "external/minizip/unzip.h"
@@ -41,6 +46,39 @@ namespace mbp
 {
 
 /*! \cond INTERNAL */
+
+/*!
+ * \brief Boot image or ramdisk in the input zip that is patched on a worker
+ *        thread during the first pass
+ */
+struct PatchJob
+{
+    std::string name;
+    unz64_file_pos pos;
+    uint64_t origSize;
+    // Bytes counted against MultiBootPatcher::MaxQueuedBytes
+    uint64_t queuedBytes = 0;
+    bool isRamdisk;
+
+    // Patched data, valid once done is true
+    std::vector<unsigned char> data;
+    bool done = false;
+    bool ok = false;
+    ErrorCode error;
+};
+
+/*!
+ * \brief File in the input zip that is patched by the AutoPatchers in the
+ *        second pass
+ */
+struct AutoPatchFile
+{
+    std::string name;
+    // Header from the input zip, which is kept when writing the patched file
+    unz_file_info64 header;
+    std::vector<unsigned char> data;
+};
+
 class MultiBootPatcher::Impl
 {
 public:
@@ -54,7 +92,7 @@ public:
     uint64_t files;
     uint64_t maxFiles;
 
-    volatile bool cancelled;
+    std::atomic<bool> cancelled{false};
 
     ErrorCode error;
 
@@ -69,16 +107,37 @@ public:
     zipFile zOutput = nullptr;
     std::vector<AutoPatcher *> autoPatchers;
 
-    bool patchRamdisk(std::vector<unsigned char> *data);
-    bool patchBootImage(std::vector<unsigned char> *data);
+    // Pipelined boot image patching in pass 1
+    std::vector<std::unique_ptr<PatchJob>> jobs;
+    std::mutex jobsMutex;
+    std::condition_variable jobsCv;
+    std::size_t nextJob;
+    // Index of the job that pass1Commit() is waiting for or will wait for next
+    std::size_t commitJob;
+    // Memory held by running and uncommitted jobs
+    uint64_t queuedBytes;
+    std::atomic<bool> stopJobs;
+
+    // Files read in pass 1 and patched in pass 2
+    std::vector<AutoPatchFile> autoPatchFiles;
+
+    bool patchCpio(CpioFile *cpio, ErrorCode *errorOut);
+    bool patchRamdisk(std::vector<unsigned char> *data, ErrorCode *errorOut);
+    bool patchBootImage(std::vector<unsigned char> *data, ErrorCode *errorOut);
+    bool createRamdisk(CpioFile *cpio, std::vector<unsigned char> *data,
+                       ErrorCode *errorOut);
     bool patchZip();
 
+    bool findPatchJobs(const std::unordered_set<std::string> &exclude);
+    void runPatchJob(unzFile uf, PatchJob *job);
+    void patchJobsThread();
+    PatchJob * waitForPatchJob(std::size_t index);
+
     bool pass1(zipFile const aOutput,
-               const std::string &temporaryDir,
                const std::unordered_set<std::string> &exclude);
-    bool pass2(zipFile const aOutput,
-               const std::string &temporaryDir,
-               const std::unordered_set<std::string> &files);
+    bool pass1Commit(zipFile const aOutput,
+                     const std::unordered_set<std::string> &exclude);
+    bool pass2(zipFile const aOutput);
     bool openInputArchive();
     void closeInputArchive();
     bool openOutputArchive();
@@ -101,6 +160,13 @@ private:
 
 const std::string MultiBootPatcher::Id("MultiBootPatcher");
 
+// Each boot image being patched is held in memory several times: the
+// original, the decompressed ramdisk, the new ramdisk, and the new boot image
+const uint64_t MultiBootPatcher::BootImageCopies = 4;
+// Limit on the memory held by boot images and ramdisks that have been read,
+// but not yet written to the output zip
+const uint64_t MultiBootPatcher::MaxQueuedBytes = 256 * 1024 * 1024;
+
 
 MultiBootPatcher::MultiBootPatcher(PatcherConfig * const pc)
     : m_impl(new Impl(this))
@@ -142,6 +208,30 @@ std::string MultiBootPatcher::newFilePath()
 void MultiBootPatcher::cancelPatching()
 {
     m_impl->cancelled = true;
+
+    // Wake up the patch job workers and the commit loop. The lock ensures
+    // that a thread that just checked the flag is already waiting.
+    std::lock_guard<std::mutex> lock(m_impl->jobsMutex);
+    m_impl->jobsCv.notify_all();
+}
+
+/*!
+ * \brief Whether a file in the zip is patched as a boot image or ramdisk
+ *
+ * \param name Path of the file in the zip
+ * \param size Uncompressed size of the file
+ */
+bool MultiBootPatcher::isPatchCandidate(const std::string &name, uint64_t size)
+{
+    // Try to patch files that end in a common boot image extension
+    bool isExtImg = StringUtils::ends_with(name, ".img");
+    bool isExtLok = StringUtils::ends_with(name, ".lok");
+    bool isExtGz = StringUtils::ends_with(name, ".gz");
+    // Boot images should be over about 30 MiB. This check is here so the
+    // patcher won't try to read a multi-gigabyte system image into RAM
+    bool isSizeOK = size <= 30 * 1024 * 1024;
+
+    return (isExtImg || isExtLok || isExtGz) && isSizeOK;
 }
 
 bool MultiBootPatcher::patchFile(ProgressUpdatedCallback progressCb,
@@ -149,8 +239,6 @@ bool MultiBootPatcher::patchFile(ProgressUpdatedCallback progressCb,
                                  DetailsUpdatedCallback detailsCb,
                                  void *userData)
 {
-    m_impl->cancelled = false;
-
     assert(m_impl->info != nullptr);
 
     if (!StringUtils::iends_with(m_impl->info->filename(), ".zip")) {
@@ -187,7 +275,8 @@ bool MultiBootPatcher::patchFile(ProgressUpdatedCallback progressCb,
         m_impl->closeOutputArchive();
     }
 
-    if (m_impl->cancelled) {
+    // Consume the cancellation so the patcher can be reused
+    if (m_impl->cancelled.exchange(false)) {
         m_impl->error = ErrorCode::PatchingCancelled;
         return false;
     }
@@ -195,75 +284,136 @@ bool MultiBootPatcher::patchFile(ProgressUpdatedCallback progressCb,
     return ret;
 }
 
-bool MultiBootPatcher::Impl::patchRamdisk(std::vector<unsigned char> *data)
+bool MultiBootPatcher::Impl::patchCpio(CpioFile *cpio, ErrorCode *errorOut)
 {
-    // Load the ramdisk cpio
-    CpioFile cpio;
-    if (!cpio.load(*data)) {
-        error = cpio.error();
-        return false;
-    }
-
-    if (cancelled) return false;
+    cpio->setCompressionLevel(pc->ramdiskCompressionLevel());
 
     std::string rpId = info->device()->id() + "/default";
-    auto *rp = pc->createRamdiskPatcher(rpId, info, &cpio);
+    auto *rp = pc->createRamdiskPatcher(rpId, info, cpio);
     if (!rp) {
         rpId = "default";
-        rp = pc->createRamdiskPatcher(rpId, info, &cpio);
+        rp = pc->createRamdiskPatcher(rpId, info, cpio);
     }
     if (!rp) {
-        error = ErrorCode::RamdiskPatcherCreateError;
+        *errorOut = ErrorCode::RamdiskPatcherCreateError;
         return false;
     }
 
     if (!rp->patchRamdisk()) {
-        error = rp->error();
+        *errorOut = rp->error();
         pc->destroyRamdiskPatcher(rp);
         return false;
     }
 
     pc->destroyRamdiskPatcher(rp);
 
+    return true;
+}
+
+/*!
+ * \brief Compress the ramdisk using the threads that are free in the
+ *        PatcherConfig's thread budget
+ *
+ * The calling thread always compresses. Additional threads are only used if
+ * they are available in the budget (up to ramdiskCompressionThreads()).
+ */
+bool MultiBootPatcher::Impl::createRamdisk(CpioFile *cpio,
+                                           std::vector<unsigned char> *data,
+                                           ErrorCode *errorOut)
+{
+    unsigned int wanted = pc->ramdiskCompressionThreads();
+    if (wanted == 0) {
+        wanted = pc->maxThreads();
+    }
+
+    ThreadLease lease(ThreadBudget::forConfig(pc),
+                      wanted > 1 ? wanted - 1 : 0);
+    cpio->setCompressionThreads(1 + lease.count());
+
+    if (!cpio->createData(data)) {
+        *errorOut = cpio->error();
+        return false;
+    }
+
+    return true;
+}
+
+bool MultiBootPatcher::Impl::patchRamdisk(std::vector<unsigned char> *data,
+                                           ErrorCode *errorOut)
+{
+    // Load the ramdisk cpio
+    CpioFile cpio;
+    if (!cpio.load(*data)) {
+        *errorOut = cpio.error();
+        return false;
+    }
+
     if (cancelled) return false;
 
-    std::vector<unsigned char> newRamdisk;
-    if (!cpio.createData(&newRamdisk)) {
-        error = cpio.error();
+    if (!patchCpio(&cpio, errorOut)) {
         return false;
     }
 
-    data->swap(newRamdisk);
+    if (cancelled) return false;
+
+    // The original ramdisk is kept until the new one has been created
+    // successfully since the caller may fall back to it on failure
+    if (!createRamdisk(&cpio, data, errorOut)) {
+        return false;
+    }
 
     if (cancelled) return false;
 
     return true;
 }
 
-bool MultiBootPatcher::Impl::patchBootImage(std::vector<unsigned char> *data)
+bool MultiBootPatcher::Impl::patchBootImage(std::vector<unsigned char> *data,
+                                             ErrorCode *errorOut)
 {
     BootImage bi;
     if (!bi.load(*data)) {
-        error = bi.error();
+        *errorOut = bi.error();
         return false;
     }
 
-    // Release memory since BootImage keeps a copy of the separate components
-    data->clear();
-    data->shrink_to_fit();
+    // Load the ramdisk cpio directly from the boot image
+    CpioFile cpio;
+    if (!cpio.load(bi.ramdiskImage())) {
+        *errorOut = cpio.error();
+        return false;
+    }
+
+    // Release the old ramdisk since CpioFile keeps a decompressed copy
+    bi.setRamdiskImage(std::vector<unsigned char>());
+
+    if (cancelled) return false;
 
-    std::vector<unsigned char> ramdiskImage = bi.ramdiskImage();
-    if (!patchRamdisk(&ramdiskImage)) {
+    if (!patchCpio(&cpio, errorOut)) {
+        return false;
+    }
+
+    if (cancelled) return false;
+
+    // The new ramdisk is written into a preallocated buffer and then moved
+    // into the boot image without any further copies
+    std::vector<unsigned char> ramdiskImage;
+    if (!createRamdisk(&cpio, &ramdiskImage, errorOut)) {
         return false;
     }
 
     bi.setRamdiskImage(std::move(ramdiskImage));
 
-    if (!bi.create(data)) {
-        error = bi.error();
+    if (cancelled) return false;
+
+    // Only replace the original boot image once the new one has been created
+    std::vector<unsigned char> newData;
+    if (!bi.create(&newData)) {
+        *errorOut = bi.error();
         return false;
     }
 
+    data->swap(newData);
+
     if (cancelled) return false;
 
     return true;
@@ -324,11 +474,8 @@ bool MultiBootPatcher::Impl::patchZip()
         return false;
     }
 
-    // Create temporary dir for extracted files for autopatchers
-    std::string tempDir = FileUtils::createTemporaryDir(pc->tempDirectory());
-
-    if (!pass1(zOutput, tempDir, excludeFromPass1)) {
-        io::deleteRecursively(tempDir);
+    if (!pass1(zOutput, excludeFromPass1)) {
+        autoPatchFiles.clear();
         return false;
     }
 
@@ -336,13 +483,12 @@ bool MultiBootPatcher::Impl::patchZip()
 
     // On the second pass, run the autopatchers on the rest of the files
 
-    if (!pass2(zOutput, tempDir, excludeFromPass1)) {
-        io::deleteRecursively(tempDir);
+    bool ret = pass2(zOutput);
+    autoPatchFiles.clear();
+    if (!ret) {
         return false;
     }
 
-    io::deleteRecursively(tempDir);
-
     if (cancelled) return false;
 
     updateFiles(++files, maxFiles);
@@ -391,19 +537,239 @@ bool MultiBootPatcher::Impl::patchZip()
     return true;
 }
 
+/*!
+ * \brief Find the boot images and ramdisks to patch during the first pass
+ *
+ * This only reads the zip's central directory.
+ */
+bool MultiBootPatcher::Impl::findPatchJobs(
+        const std::unordered_set<std::string> &exclude)
+{
+    jobs.clear();
+
+    int ret = unzGoToFirstFile(zInput);
+    if (ret != UNZ_OK) {
+        error = ErrorCode::ArchiveReadHeaderError;
+        return false;
+    }
+
+    do {
+        unz_file_info64 fi;
+        std::string curFile;
+
+        if (!FileUtils::mzGetInfo(zInput, &fi, &curFile)) {
+            error = ErrorCode::ArchiveReadHeaderError;
+            return false;
+        }
+
+        if (exclude.find(curFile) != exclude.end()
+                || !isPatchCandidate(curFile, fi.uncompressed_size)) {
+            continue;
+        }
+
+        std::unique_ptr<PatchJob> job(new PatchJob());
+        job->name = curFile;
+        job->origSize = fi.uncompressed_size;
+        job->isRamdisk = StringUtils::ends_with(curFile, ".gz");
+
+        if (unzGetFilePos64(zInput, &job->pos) != UNZ_OK) {
+            error = ErrorCode::ArchiveReadHeaderError;
+            return false;
+        }
+
+        jobs.push_back(std::move(job));
+    } while ((ret = unzGoToNextFile(zInput)) == UNZ_OK);
+
+    if (ret != UNZ_END_OF_LIST_OF_FILE) {
+        error = ErrorCode::ArchiveReadHeaderError;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read and patch a boot image or ramdisk
+ *
+ * \param uf Input zip handle owned by the calling thread
+ * \param job Job to run
+ */
+void MultiBootPatcher::Impl::runPatchJob(unzFile uf, PatchJob *job)
+{
+    job->ok = false;
+
+    if (!uf || unzGoToFilePos64(uf, &job->pos) != UNZ_OK) {
+        job->error = ErrorCode::ArchiveReadHeaderError;
+        return;
+    }
+
+    // Load the file into memory
+    if (!FileUtils::mzReadToMemory(uf, &job->data, nullptr, nullptr)) {
+        job->error = ErrorCode::ArchiveReadDataError;
+        return;
+    }
+
+    if (job->isRamdisk) {
+        // Some zips build the boot image at install time and the zip
+        // just includes the split out parts of the boot image
+        if (!patchRamdisk(&job->data, &job->error)) {
+            // Just ignore for now
+        }
+    } else {
+        // If the file contains the boot image magic string, then
+        // assume it really is a boot image and patch it
+        if (BootImage::isValid(job->data.data(), job->data.size())) {
+            if (!patchBootImage(&job->data, &job->error)) {
+                return;
+            }
+        }
+    }
+
+    job->ok = true;
+}
+
+/*!
+ * \brief Worker thread for patching boot images and ramdisks
+ *
+ * Each worker opens its own handle to the input zip since minizip handles
+ * cannot be shared between threads.
+ */
+void MultiBootPatcher::Impl::patchJobsThread()
+{
+    unzFile uf = FileUtils::mzOpenInputFile(info->filename());
+    if (!uf) {
+        FLOGE("minizip: Failed to open for reading: %s",
+              info->filename().c_str());
+    }
+
+    std::unique_lock<std::mutex> lock(jobsMutex);
+
+    while (nextJob < jobs.size()) {
+        std::size_t i = nextJob++;
+        PatchJob *job = jobs[i].get();
+        uint64_t cost = job->origSize * BootImageCopies;
+
+        // Don't get too far ahead of the commit loop. The job it is waiting
+        // for is always allowed to run.
+        jobsCv.wait(lock, [&]{
+            return cancelled || stopJobs || i == commitJob
+                    || queuedBytes + cost <= MaxQueuedBytes;
+        });
+
+        queuedBytes += cost;
+        job->queuedBytes = cost;
+
+        lock.unlock();
+
+        if (cancelled || stopJobs) {
+            job->error = ErrorCode::PatchingCancelled;
+        } else {
+            runPatchJob(uf, job);
+        }
+
+        lock.lock();
+
+        // Only the patched data is held until the job is committed
+        queuedBytes -= job->queuedBytes;
+        job->queuedBytes = job->data.size();
+        queuedBytes += job->queuedBytes;
+
+        job->done = true;
+        jobsCv.notify_all();
+    }
+
+    lock.unlock();
+
+    if (uf) {
+        FileUtils::mzCloseInputFile(uf);
+    }
+}
+
+/*!
+ * \brief Wait for a patch job to complete
+ *
+ * \return Completed job or nullptr if patching was cancelled while waiting
+ */
+PatchJob * MultiBootPatcher::Impl::waitForPatchJob(std::size_t index)
+{
+    PatchJob *job = jobs[index].get();
+
+    std::unique_lock<std::mutex> lock(jobsMutex);
+
+    commitJob = index;
+    jobsCv.notify_all();
+
+    jobsCv.wait(lock, [&]{
+        return job->done || cancelled;
+    });
+
+    return job->done ? job : nullptr;
+}
+
 /*!
  * \brief First pass of patching operation
  *
  * This performs the following operations:
  *
  * - Patch boot images and copy them to the output zip.
- * - Files needed by an AutoPatcher are extracted to the temporary directory.
+ * - Files needed by an AutoPatcher are read into memory.
  * - Otherwise, the file is copied directly to the output zip.
+ *
+ * The boot images and ramdisks are read and patched on worker threads while
+ * the other files are copied. The patched files are added to the output zip
+ * in their original order once the copying reaches them.
  */
 bool MultiBootPatcher::Impl::pass1(zipFile const zOutput,
-                                   const std::string &temporaryDir,
                                    const std::unordered_set<std::string> &exclude)
 {
+    if (!findPatchJobs(exclude)) {
+        return false;
+    }
+
+    nextJob = 0;
+    commitJob = 0;
+    queuedBytes = 0;
+    stopJobs = false;
+
+    // One worker always runs so the commit loop can make progress. Any others
+    // have to fit in the PatcherConfig's thread budget.
+    ThreadLease lease(ThreadBudget::forConfig(pc),
+                      jobs.size() > 1 ? jobs.size() - 1 : 0);
+    std::size_t nThreads = std::min<std::size_t>(jobs.size(),
+                                                 1 + lease.count());
+    std::vector<std::thread> threads;
+    threads.reserve(nThreads);
+    for (std::size_t i = 0; i < nThreads; ++i) {
+        threads.emplace_back(&Impl::patchJobsThread, this);
+    }
+
+    bool ret = pass1Commit(zOutput, exclude);
+
+    // Make the workers skip the remaining jobs if copying failed
+    {
+        std::lock_guard<std::mutex> lock(jobsMutex);
+        stopJobs = true;
+        jobsCv.notify_all();
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    jobs.clear();
+
+    return ret;
+}
+
+/*!
+ * \brief Copy files to the output zip in order, adding the patched files as
+ *        they are reached
+ */
+bool MultiBootPatcher::Impl::pass1Commit(zipFile const zOutput,
+                                         const std::unordered_set<std::string> &exclude)
+{
+    std::size_t jobIndex = 0;
+
     int ret = unzGoToFirstFile(zInput);
     if (ret != UNZ_OK) {
         error = ErrorCode::ArchiveReadHeaderError;
@@ -426,58 +792,53 @@ bool MultiBootPatcher::Impl::pass1(zipFile const zOutput,
 
         // Skip files that should be patched and added in pass 2
         if (exclude.find(curFile) != exclude.end()) {
-            if (!FileUtils::mzExtractFile(zInput, temporaryDir)) {
+            AutoPatchFile apFile;
+            apFile.name = curFile;
+            apFile.header = fi;
+            if (!FileUtils::mzReadToMemory(zInput, &apFile.data,
+                                           nullptr, nullptr)) {
                 error = ErrorCode::ArchiveReadDataError;
                 return false;
             }
+            autoPatchFiles.push_back(std::move(apFile));
             continue;
         }
 
-        // Try to patch files that end in a common boot image extension
-
-        bool isExtImg = StringUtils::ends_with(curFile, ".img");
-        bool isExtLok = StringUtils::ends_with(curFile, ".lok");
-        bool isExtGz = StringUtils::ends_with(curFile, ".gz");
-        // Boot images should be over about 30 MiB. This check is here so the
-        // patcher won't try to read a multi-gigabyte system image into RAM
-        bool isSizeOK = fi.uncompressed_size <= 30 * 1024 * 1024;
+        if (isPatchCandidate(curFile, fi.uncompressed_size)) {
+            assert(jobIndex < jobs.size()
+                    && jobs[jobIndex]->name == curFile);
 
-        if ((isExtImg || isExtLok || isExtGz) && isSizeOK) {
-            // Load the file into memory
-            std::vector<unsigned char> data;
-
-            if (!FileUtils::mzReadToMemory(zInput, &data,
-                                           &laProgressCb, this)) {
-                error = ErrorCode::ArchiveReadDataError;
+            PatchJob *job = waitForPatchJob(jobIndex++);
+            if (!job) {
                 return false;
             }
 
-            if (isExtGz) {
-                // Some zips build the boot image at install time and the zip
-                // just includes the split out parts of the boot image
-                if (!patchRamdisk(&data)) {
-                    // Just ignore for now
-                }
-            } else {
-                // If the file contains the boot image magic string, then
-                // assume it really is a boot image and patch it
-                if (BootImage::isValid(data.data(), data.size())) {
-                    if (!patchBootImage(&data)) {
-                        return false;
-                    }
-                }
+            if (!job->ok) {
+                error = job->error;
+                return false;
             }
 
             // Update total size
-            maxBytes += (data.size() - fi.uncompressed_size);
+            maxBytes += (job->data.size() - fi.uncompressed_size);
 
-            auto ret2 = FileUtils::mzAddFile(zOutput, curFile, data);
+            auto ret2 = FileUtils::mzAddFile(zOutput, curFile, job->data, &fi);
             if (ret2 != ErrorCode::NoError) {
                 error = ret2;
                 return false;
             }
 
-            bytes += data.size();
+            bytes += job->data.size();
+            updateProgress(bytes, maxBytes);
+
+            // Release memory as soon as the file is written
+            std::vector<unsigned char>().swap(job->data);
+
+            {
+                std::lock_guard<std::mutex> lock(jobsMutex);
+                queuedBytes -= job->queuedBytes;
+                job->queuedBytes = 0;
+                jobsCv.notify_all();
+            }
         } else {
             // Directly copy other files to the output zip
 
@@ -512,46 +873,44 @@ bool MultiBootPatcher::Impl::pass1(zipFile const zOutput,
  *
  * This performs the following operations:
  *
- * - Patch files in the temporary directory using the AutoPatchers and add the
- *   resulting files to the output zip
+ * - Patch the files read during the first pass using the AutoPatchers and add
+ *   the resulting files to the output zip. The original timestamps, attributes,
+ *   and compression method are kept.
  */
-bool MultiBootPatcher::Impl::pass2(zipFile const zOutput,
-                                   const std::string &temporaryDir,
-                                   const std::unordered_set<std::string> &files)
+bool MultiBootPatcher::Impl::pass2(zipFile const zOutput)
 {
-    for (auto *ap : autoPatchers) {
-        if (cancelled) return false;
-        if (!ap->patchFiles(temporaryDir)) {
-            error = ap->error();
-            return false;
-        }
-    }
+    for (AutoPatchFile &apFile : autoPatchFiles) {
+        for (auto *ap : autoPatchers) {
+            if (cancelled) return false;
+
+            auto const files = ap->existingFiles();
+            if (std::find(files.begin(), files.end(), apFile.name)
+                    == files.end()) {
+                continue;
+            }
 
-    // TODO Headers are being discarded
+            if (!ap->patchFile(apFile.name, &apFile.data)) {
+                error = ap->error();
+                return false;
+            }
+        }
 
-    for (auto const &file : files) {
         if (cancelled) return false;
 
-        ErrorCode ret;
-
-        if (file == "META-INF/com/google/android/update-binary") {
-            ret = FileUtils::mzAddFile(
-                    zOutput,
-                    "META-INF/com/google/android/update-binary.orig",
-                    temporaryDir + "/" + file);
-        } else {
-            ret = FileUtils::mzAddFile(
-                    zOutput,
-                    file,
-                    temporaryDir + "/" + file);
+        std::string name = apFile.name;
+        if (name == "META-INF/com/google/android/update-binary") {
+            name = "META-INF/com/google/android/update-binary.orig";
         }
 
-        if (ret == ErrorCode::FileOpenError) {
-            FLOGW("File does not exist in temporary directory: %s", file.c_str());
-        } else if (ret != ErrorCode::NoError) {
+        auto ret = FileUtils::mzAddFile(zOutput, name, apFile.data,
+                                        &apFile.header);
+        if (ret != ErrorCode::NoError) {
             error = ret;
             return false;
         }
+
+        // Release memory as soon as the file is written
+        std::vector<unsigned char>().swap(apFile.data);
     }
 
     if (cancelled) return false;
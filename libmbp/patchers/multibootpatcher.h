@@ -35,6 +35,8 @@ public:
     ~MultiBootPatcher();
 
     static const std::string Id;
+    static const uint64_t BootImageCopies;
+    static const uint64_t MaxQueuedBytes;
 
     virtual ErrorCode error() const override;
 
@@ -53,6 +55,8 @@ public:
 
     virtual void cancelPatching() override;
 
+    static bool isPatchCandidate(const std::string &name, uint64_t size);
+
 private:
     class Impl;
     std::unique_ptr<Impl> m_impl;
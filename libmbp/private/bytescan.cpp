@@ -0,0 +1,271 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "private/bytescan.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) \
+        || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BYTESCAN_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define BYTESCAN_NEON
+#endif
+
+
+namespace mbp
+{
+
+const std::size_t ByteScan::npos;
+
+// Maximum number of patterns checked in a single SIMD pass
+static const std::size_t MaxSimdPatterns = 8;
+
+#if defined(BYTESCAN_SSE2)
+
+// One bit per byte (_mm_movemask_epi8)
+typedef uint32_t BlockMask;
+static const unsigned int BitsPerByte = 1;
+static const std::size_t BlockSize = 16;
+
+typedef __m128i Vector;
+
+static inline Vector vecLoad(const unsigned char *ptr)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+}
+
+static inline Vector vecSplat(unsigned char c)
+{
+    return _mm_set1_epi8(static_cast<char>(c));
+}
+
+static inline BlockMask vecMatch(Vector a, Vector first, Vector b, Vector last)
+{
+    return static_cast<BlockMask>(_mm_movemask_epi8(_mm_and_si128(
+            _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last))));
+}
+
+#elif defined(BYTESCAN_NEON)
+
+// Four bits per byte (NEON has no movemask, so narrow each 0x00/0xff byte to
+// a nibble instead)
+typedef uint64_t BlockMask;
+static const unsigned int BitsPerByte = 4;
+static const std::size_t BlockSize = 16;
+
+typedef uint8x16_t Vector;
+
+static inline Vector vecLoad(const unsigned char *ptr)
+{
+    return vld1q_u8(ptr);
+}
+
+static inline Vector vecSplat(unsigned char c)
+{
+    return vdupq_n_u8(c);
+}
+
+static inline BlockMask vecMatch(Vector a, Vector first, Vector b, Vector last)
+{
+    uint8x16_t eq = vandq_u8(vceqq_u8(a, first), vceqq_u8(b, last));
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0);
+}
+
+#endif
+
+#if defined(BYTESCAN_SSE2) || defined(BYTESCAN_NEON)
+
+static inline unsigned int lowestBit(BlockMask mask)
+{
+#if defined(__GNUC__)
+    return sizeof(BlockMask) > sizeof(unsigned int)
+            ? __builtin_ctzll(mask) : __builtin_ctz(mask);
+#else
+    unsigned int n = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+#endif
+
+/*!
+ * \brief Check which pattern, if any, matches at \a offset
+ *
+ * \return Index of the first matching pattern or ByteScan::npos
+ */
+static inline std::size_t matchAt(const unsigned char *data, std::size_t size,
+                                  std::size_t offset,
+                                  const ByteScan::Pattern *patterns,
+                                  std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i) {
+        if (patterns[i].size <= size - offset && std::memcmp(
+                data + offset, patterns[i].data, patterns[i].size) == 0) {
+            return i;
+        }
+    }
+    return ByteScan::npos;
+}
+
+/*!
+ * \brief Find the first occurrence of a byte pattern
+ *
+ * \param data Data to search
+ * \param size Size of data
+ * \param pattern Pattern to search for
+ * \param patternSize Size of pattern
+ *
+ * \return Offset of the first match or ByteScan::npos if the pattern was not
+ *         found
+ */
+std::size_t ByteScan::find(const unsigned char *data, std::size_t size,
+                           const void *pattern, std::size_t patternSize)
+{
+    Pattern p = { pattern, patternSize };
+    std::size_t which;
+    return findAny(data, size, &p, 1, &which);
+}
+
+/*!
+ * \brief Find the first occurrence of any of several byte patterns
+ *
+ * All of the patterns are searched for in a single pass over the data. If
+ * SSE2 or NEON is available, 16 candidate offsets are checked at once by
+ * comparing the first and last byte of each pattern. Only offsets where both
+ * bytes match are compared in full. Otherwise, a scalar search is used.
+ *
+ * If multiple patterns match at the same offset, the one that appears first
+ * in \a patterns is reported.
+ *
+ * \param data Data to search
+ * \param size Size of data
+ * \param patterns Array of patterns to search for
+ * \param count Number of patterns
+ * \param which Index of the matched pattern (only set if a match is found)
+ *
+ * \return Offset of the first match or ByteScan::npos if none of the patterns
+ *         were found
+ */
+std::size_t ByteScan::findAny(const unsigned char *data, std::size_t size,
+                              const Pattern *patterns, std::size_t count,
+                              std::size_t *which)
+{
+    std::size_t maxSize = 0;
+
+    for (std::size_t i = 0; i < count; ++i) {
+        // An empty pattern matches immediately
+        if (patterns[i].size == 0) {
+            *which = i;
+            return 0;
+        }
+        if (patterns[i].size > maxSize) {
+            maxSize = patterns[i].size;
+        }
+    }
+
+    if (count == 0) {
+        return npos;
+    }
+
+    std::size_t pos = 0;
+
+#if defined(BYTESCAN_SSE2) || defined(BYTESCAN_NEON)
+    if (count <= MaxSimdPatterns && size >= maxSize - 1 + BlockSize) {
+        Vector first[MaxSimdPatterns];
+        Vector last[MaxSimdPatterns];
+
+        for (std::size_t i = 0; i < count; ++i) {
+            auto p = static_cast<const unsigned char *>(patterns[i].data);
+            first[i] = vecSplat(p[0]);
+            last[i] = vecSplat(p[patterns[i].size - 1]);
+        }
+
+        // The loads at the pattern's last byte must stay in bounds
+        std::size_t end = size - (maxSize - 1) - BlockSize;
+
+        for (; pos <= end; pos += BlockSize) {
+            Vector a = vecLoad(data + pos);
+            BlockMask mask = 0;
+
+            for (std::size_t i = 0; i < count; ++i) {
+                Vector b = vecLoad(data + pos + patterns[i].size - 1);
+                mask |= vecMatch(a, first[i], b, last[i]);
+            }
+
+            while (mask) {
+                unsigned int bit = lowestBit(mask);
+                std::size_t offset = pos + bit / BitsPerByte;
+
+                std::size_t index = matchAt(data, size, offset,
+                                            patterns, count);
+                if (index != npos) {
+                    *which = index;
+                    return offset;
+                }
+
+                // Clear all bits belonging to this byte
+                mask &= ~(((static_cast<BlockMask>(1) << BitsPerByte) - 1)
+                        << (bit - bit % BitsPerByte));
+            }
+        }
+    }
+#endif
+
+    if (count == 1) {
+        // memchr() is usually vectorized by the C library
+        auto p = static_cast<const unsigned char *>(patterns[0].data);
+
+        while (pos < size) {
+            auto ptr = static_cast<const unsigned char *>(
+                    std::memchr(data + pos, p[0], size - pos));
+            if (!ptr) {
+                break;
+            }
+            pos = ptr - data;
+            if (matchAt(data, size, pos, patterns, count) != npos) {
+                *which = 0;
+                return pos;
+            }
+            ++pos;
+        }
+
+        return npos;
+    }
+
+    for (; pos < size; ++pos) {
+        std::size_t index = matchAt(data, size, pos, patterns, count);
+        if (index != npos) {
+            *which = index;
+            return pos;
+        }
+    }
+
+    return npos;
+}
+
+}
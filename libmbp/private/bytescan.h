@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+
+namespace mbp
+{
+
+class ByteScan
+{
+public:
+    struct Pattern
+    {
+        const void *data;
+        std::size_t size;
+    };
+
+    static const std::size_t npos = static_cast<std::size_t>(-1);
+
+    static std::size_t find(const unsigned char *data, std::size_t size,
+                            const void *pattern, std::size_t patternSize);
+
+    static std::size_t findAny(const unsigned char *data, std::size_t size,
+                               const Pattern *patterns, std::size_t count,
+                               std::size_t *which);
+};
+
+}
@@ -0,0 +1,511 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "private/compressutils.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <cstdint>
+#include <cstring>
+
+#include <lz4.h>
+#include <lz4hc.h>
+#include <zlib.h>
+
+#include "private/logging.h"
+
+
+namespace mbp
+{
+
+// Size of the independently compressed gzip chunks (same as pigz)
+static const std::size_t GzipChunkSize = 128 * 1024;
+// Size of the deflate window used as the dictionary for the next chunk
+static const std::size_t GzipDictSize = 32 * 1024;
+// The kernel's unlz4 expects legacy blocks of at most 8 MiB
+static const std::size_t Lz4LegacyChunkSize = 8 * 1024 * 1024;
+static const uint32_t Lz4LegacyMagic = 0x184c2102;
+
+struct Chunk
+{
+    // Tail of the previous chunk's input (gzip only)
+    std::vector<unsigned char> dict;
+    std::vector<unsigned char> in;
+    std::vector<unsigned char> out;
+    uint32_t crc = 0;
+    bool last = false;
+    bool ok = false;
+    bool done = false;
+};
+
+static inline void putLe32(unsigned char *buf, uint32_t n)
+{
+    buf[0] = n & 0xff;
+    buf[1] = (n >> 8) & 0xff;
+    buf[2] = (n >> 16) & 0xff;
+    buf[3] = (n >> 24) & 0xff;
+}
+
+/*!
+ * \brief Get the default number of compression threads
+ *
+ * \return Number of hardware threads or 1 if it cannot be determined
+ */
+unsigned int CompressUtils::defaultThreads()
+{
+    unsigned int n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : n;
+}
+
+/*!
+ * \brief Compress a chunk as part of a larger raw deflate stream
+ *
+ * The last 32 KiB of the previous chunk is used as the dictionary so the
+ * compression ratio is nearly the same as a single threaded compressor. All
+ * but the last chunk are terminated with a sync flush, which byte-aligns the
+ * output without ending the deflate stream.
+ */
+static void deflateChunk(Chunk &c, int level)
+{
+    z_stream strm;
+    std::memset(&strm, 0, sizeof(strm));
+
+    c.crc = crc32(crc32(0L, Z_NULL, 0), c.in.data(), c.in.size());
+
+    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return;
+    }
+
+    if (!c.dict.empty() && deflateSetDictionary(
+            &strm, c.dict.data(), static_cast<uInt>(c.dict.size())) != Z_OK) {
+        deflateEnd(&strm);
+        return;
+    }
+
+    // Extra space for the sync flush marker
+    c.out.resize(deflateBound(&strm, c.in.size()) + 16);
+
+    strm.next_in = c.in.data();
+    strm.avail_in = static_cast<uInt>(c.in.size());
+
+    int flush = c.last ? Z_FINISH : Z_SYNC_FLUSH;
+    int ret;
+
+    do {
+        std::size_t have = strm.total_out;
+        if (have == c.out.size()) {
+            c.out.resize(c.out.size() * 2);
+        }
+        strm.next_out = c.out.data() + have;
+        strm.avail_out = static_cast<uInt>(c.out.size() - have);
+
+        ret = deflate(&strm, flush);
+    } while (ret == Z_OK && (strm.avail_out == 0 || c.last));
+
+    c.out.resize(strm.total_out);
+    c.ok = c.last ? ret == Z_STREAM_END : ret == Z_OK || ret == Z_BUF_ERROR;
+
+    deflateEnd(&strm);
+}
+
+static void lz4Chunk(Chunk &c, int level)
+{
+    int bound = LZ4_compressBound(static_cast<int>(c.in.size()));
+    c.out.resize(4 + bound);
+
+    auto src = reinterpret_cast<const char *>(c.in.data());
+    auto dst = reinterpret_cast<char *>(c.out.data() + 4);
+    int srcSize = static_cast<int>(c.in.size());
+    int n;
+
+#if defined(LZ4_VERSION_NUMBER) && LZ4_VERSION_NUMBER >= 10700
+    if (level < 3) {
+        n = LZ4_compress_default(src, dst, srcSize, bound);
+    } else {
+        n = LZ4_compress_HC(src, dst, srcSize, bound, level);
+    }
+#else
+    if (level < 3) {
+        n = LZ4_compress_limitedOutput(src, dst, srcSize, bound);
+    } else {
+        n = LZ4_compressHC2_limitedOutput(src, dst, srcSize, bound, level);
+    }
+#endif
+
+    if (n <= 0) {
+        return;
+    }
+
+    putLe32(c.out.data(), static_cast<uint32_t>(n));
+    c.out.resize(4 + n);
+    c.ok = true;
+}
+
+class ParallelCompressor::Impl
+{
+public:
+    Format format;
+    int level;
+    unsigned int threads;
+    CompressUtils::WriteCallback cb;
+    void *userData;
+
+    std::size_t chunkSize;
+    // Chunk currently being filled by write()
+    std::unique_ptr<Chunk> current;
+    // Submitted chunks that have not been written yet, in order
+    std::deque<std::unique_ptr<Chunk>> pending;
+    // Submitted chunks that no worker has picked up yet
+    std::deque<Chunk *> jobs;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable jobsCv;
+    std::condition_variable doneCv;
+    bool stopping = false;
+
+    bool headerWritten = false;
+    bool failed = false;
+    uLong crc = 0;
+    uint64_t totalSize = 0;
+
+    void compress(Chunk &c);
+    void worker();
+    bool submit(bool last);
+    bool writeChunks(std::size_t maxPending);
+};
+
+void ParallelCompressor::Impl::compress(Chunk &c)
+{
+    if (format == Format::Gzip) {
+        deflateChunk(c, level);
+    } else {
+        lz4Chunk(c, level);
+    }
+}
+
+void ParallelCompressor::Impl::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        jobsCv.wait(lock, [&]{
+            return stopping || !jobs.empty();
+        });
+        if (stopping) {
+            break;
+        }
+
+        Chunk *c = jobs.front();
+        jobs.pop_front();
+
+        lock.unlock();
+        compress(*c);
+        lock.lock();
+
+        c->done = true;
+        doneCv.notify_all();
+    }
+}
+
+/*!
+ * \brief Hand the current chunk to the workers and start a new one
+ *
+ * \param last Whether this is the last chunk of the stream
+ */
+bool ParallelCompressor::Impl::submit(bool last)
+{
+    std::unique_ptr<Chunk> c(std::move(current));
+    c->last = last;
+
+    if (!last) {
+        current.reset(new Chunk());
+        current->in.reserve(chunkSize);
+
+        if (format == Format::Gzip) {
+            std::size_t dictSize = std::min(GzipDictSize, c->in.size());
+            current->dict.assign(c->in.end() - dictSize, c->in.end());
+        }
+    }
+
+    if (workers.empty()) {
+        compress(*c);
+        c->done = true;
+        pending.push_back(std::move(c));
+    } else {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(c.get());
+        pending.push_back(std::move(c));
+        jobsCv.notify_one();
+    }
+
+    // Keep every worker busy while the next chunks are being filled
+    return writeChunks(last ? 0 : 2 * workers.size());
+}
+
+/*!
+ * \brief Write finished chunks in order until at most \a maxPending remain
+ *
+ * This blocks until the oldest chunk is done if there are too many pending
+ * chunks.
+ */
+bool ParallelCompressor::Impl::writeChunks(std::size_t maxPending)
+{
+    if (!headerWritten) {
+        headerWritten = true;
+
+        if (format == Format::Gzip) {
+            // Header: magic, deflate, no flags, no mtime, extra flags, Unix.
+            // Like zlib, the extra flags are 2 for maximum compression and 4
+            // for the fastest levels.
+            unsigned char header[10] = {
+                0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03
+            };
+            if (level == 9) {
+                header[8] = 0x02;
+            } else if (level >= 0 && level < 2) {
+                header[8] = 0x04;
+            }
+            if (!cb(header, sizeof(header), userData)) {
+                return false;
+            }
+        } else {
+            unsigned char magic[4];
+            putLe32(magic, Lz4LegacyMagic);
+            if (!cb(magic, sizeof(magic), userData)) {
+                return false;
+            }
+        }
+    }
+
+    while (!pending.empty()) {
+        Chunk *c = pending.front().get();
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (!c->done) {
+                if (pending.size() <= maxPending) {
+                    break;
+                }
+                doneCv.wait(lock, [&]{
+                    return c->done;
+                });
+            }
+        }
+
+        if (!c->ok) {
+            if (format == Format::Gzip) {
+                LOGE("Failed to deflate chunk");
+            } else {
+                LOGE("Failed to compress LZ4 block");
+            }
+            return false;
+        }
+        if (!cb(c->out.data(), c->out.size(), userData)) {
+            return false;
+        }
+
+        if (format == Format::Gzip) {
+            crc = crc32_combine(crc, c->crc,
+                                static_cast<z_off_t>(c->in.size()));
+        }
+
+        pending.pop_front();
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Create a streaming compressor
+ *
+ * \param format Output format
+ * \param level Compression level (see CompressUtils::gzipParallel() and
+ *              CompressUtils::lz4LegacyParallel())
+ * \param threads Number of threads or 0 to use defaultThreads(). If 1, the
+ *                chunks are compressed on the calling thread.
+ * \param cb Callback receiving the compressed output in order
+ * \param userData Pointer passed to \a cb
+ */
+ParallelCompressor::ParallelCompressor(Format format, int level,
+                                       unsigned int threads,
+                                       CompressUtils::WriteCallback cb,
+                                       void *userData)
+    : m_impl(new Impl())
+{
+    m_impl->format = format;
+    m_impl->level = level;
+    m_impl->cb = cb;
+    m_impl->userData = userData;
+    m_impl->chunkSize = format == Format::Gzip
+            ? GzipChunkSize : Lz4LegacyChunkSize;
+    m_impl->crc = crc32(0L, Z_NULL, 0);
+
+    m_impl->current.reset(new Chunk());
+    m_impl->current->in.reserve(m_impl->chunkSize);
+
+    if (threads == 0) {
+        threads = CompressUtils::defaultThreads();
+    }
+    if (threads > 1) {
+        m_impl->workers.reserve(threads);
+        for (unsigned int i = 0; i < threads; ++i) {
+            m_impl->workers.emplace_back(&Impl::worker, m_impl.get());
+        }
+    }
+}
+
+ParallelCompressor::~ParallelCompressor()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_impl->mutex);
+        m_impl->stopping = true;
+    }
+    m_impl->jobsCv.notify_all();
+
+    for (auto &t : m_impl->workers) {
+        t.join();
+    }
+}
+
+/*!
+ * \brief Add data to the stream
+ *
+ * \return Whether all chunks completed so far were compressed and written
+ */
+bool ParallelCompressor::write(const unsigned char *data, std::size_t size)
+{
+    if (m_impl->failed || !m_impl->current) {
+        return false;
+    }
+
+    m_impl->totalSize += size;
+
+    while (size > 0) {
+        Chunk &c = *m_impl->current;
+
+        // A full chunk is only submitted once more data arrives, since the
+        // last chunk is compressed differently
+        if (c.in.size() == m_impl->chunkSize) {
+            if (!m_impl->submit(false)) {
+                m_impl->failed = true;
+                return false;
+            }
+            continue;
+        }
+
+        std::size_t n = std::min(size, m_impl->chunkSize - c.in.size());
+        c.in.insert(c.in.end(), data, data + n);
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compress and write the remaining data and end the stream
+ *
+ * \return Whether the whole stream was compressed and written
+ */
+bool ParallelCompressor::finish()
+{
+    if (m_impl->failed || !m_impl->current) {
+        return false;
+    }
+
+    if (!m_impl->submit(true)) {
+        m_impl->failed = true;
+        return false;
+    }
+
+    if (m_impl->format == Format::Gzip) {
+        unsigned char trailer[8];
+        putLe32(trailer, static_cast<uint32_t>(m_impl->crc));
+        putLe32(trailer + 4, static_cast<uint32_t>(m_impl->totalSize));
+
+        if (!m_impl->cb(trailer, sizeof(trailer), m_impl->userData)) {
+            m_impl->failed = true;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Compress data to a gzip stream using multiple threads
+ *
+ * This works like pigz: the input is split into 128 KiB chunks that are
+ * compressed in parallel and concatenated into a single deflate stream. The
+ * result is a standard single-member gzip file that any gzip decompressor,
+ * including the kernel's, can read.
+ *
+ * \param data Input data
+ * \param size Size of input data
+ * \param level zlib compression level (0-9)
+ * \param threads Number of threads or 0 to use defaultThreads()
+ * \param cb Callback receiving the compressed output in order
+ * \param userData Pointer passed to \a cb
+ *
+ * \return Whether the data was successfully compressed and written
+ */
+bool CompressUtils::gzipParallel(const unsigned char *data, std::size_t size,
+                                 int level, unsigned int threads,
+                                 WriteCallback cb, void *userData)
+{
+    ParallelCompressor pc(ParallelCompressor::Format::Gzip, level, threads,
+                          cb, userData);
+    return pc.write(data, size) && pc.finish();
+}
+
+/*!
+ * \brief Compress data to an LZ4 legacy stream using multiple threads
+ *
+ * The LZ4 legacy format (used by `lz4 -l` and the kernel's unlz4) consists of
+ * independent 8 MiB blocks, so the blocks can be compressed in parallel
+ * without affecting the output.
+ *
+ * \param data Input data
+ * \param size Size of input data
+ * \param level Compression level. Levels below 3 use the fast compressor and
+ *              higher levels use LZ4HC.
+ * \param threads Number of threads or 0 to use defaultThreads()
+ * \param cb Callback receiving the compressed output in order
+ * \param userData Pointer passed to \a cb
+ *
+ * \return Whether the data was successfully compressed and written
+ */
+bool CompressUtils::lz4LegacyParallel(const unsigned char *data,
+                                      std::size_t size,
+                                      int level, unsigned int threads,
+                                      WriteCallback cb, void *userData)
+{
+    ParallelCompressor pc(ParallelCompressor::Format::Lz4Legacy, level,
+                          threads, cb, userData);
+    return pc.write(data, size) && pc.finish();
+}
+
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+
+#include <cstddef>
+
+
+namespace mbp
+{
+
+class CompressUtils
+{
+public:
+    typedef bool (*WriteCallback)(const unsigned char *data, std::size_t size,
+                                  void *userData);
+
+    static unsigned int defaultThreads();
+
+    static bool gzipParallel(const unsigned char *data, std::size_t size,
+                             int level, unsigned int threads,
+                             WriteCallback cb, void *userData);
+
+    static bool lz4LegacyParallel(const unsigned char *data, std::size_t size,
+                                  int level, unsigned int threads,
+                                  WriteCallback cb, void *userData);
+};
+
+/*!
+ * \brief Streaming version of CompressUtils::gzipParallel() and
+ *        CompressUtils::lz4LegacyParallel()
+ *
+ * Input passed to write() is split into fixed-size chunks as it arrives. Full
+ * chunks are compressed on a pool of worker threads and the results are
+ * passed to the callback in order on the calling thread. Only a few chunks
+ * per thread are kept in memory at a time.
+ */
+class ParallelCompressor
+{
+public:
+    enum class Format
+    {
+        Gzip,
+        Lz4Legacy
+    };
+
+    ParallelCompressor(Format format, int level, unsigned int threads,
+                       CompressUtils::WriteCallback cb, void *userData);
+    ~ParallelCompressor();
+
+    bool write(const unsigned char *data, std::size_t size);
+    bool finish();
+
+private:
+    class Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+}
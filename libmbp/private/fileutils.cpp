@@ -489,6 +489,25 @@ bool FileUtils::mzGetInfo(unzFile uf,
     return true;
 }
 
+/*!
+ * \brief Fill in a zip_fileinfo with the timestamps and attributes of an
+ *        existing zip entry
+ */
+static void mzCopyHeader(const unz_file_info64 &ufi, zip_fileinfo *zfi)
+{
+    memset(zfi, 0, sizeof(*zfi));
+
+    zfi->dosDate = ufi.dosDate;
+    zfi->tmz_date.tm_sec = ufi.tmu_date.tm_sec;
+    zfi->tmz_date.tm_min = ufi.tmu_date.tm_min;
+    zfi->tmz_date.tm_hour = ufi.tmu_date.tm_hour;
+    zfi->tmz_date.tm_mday = ufi.tmu_date.tm_mday;
+    zfi->tmz_date.tm_mon = ufi.tmu_date.tm_mon;
+    zfi->tmz_date.tm_year = ufi.tmu_date.tm_year;
+    zfi->internal_fa = ufi.internal_fa;
+    zfi->external_fa = ufi.external_fa;
+}
+
 bool FileUtils::mzCopyFileRaw(unzFile uf,
                               zipFile zf,
                               const std::string &name,
@@ -503,17 +522,7 @@ bool FileUtils::mzCopyFileRaw(unzFile uf,
     bool zip64 = ufi.uncompressed_size >= ((1ull << 32) - 1);
 
     zip_fileinfo zfi;
-    memset(&zfi, 0, sizeof(zfi));
-
-    zfi.dosDate = ufi.dosDate;
-    zfi.tmz_date.tm_sec = ufi.tmu_date.tm_sec;
-    zfi.tmz_date.tm_min = ufi.tmu_date.tm_min;
-    zfi.tmz_date.tm_hour = ufi.tmu_date.tm_hour;
-    zfi.tmz_date.tm_mday = ufi.tmu_date.tm_mday;
-    zfi.tmz_date.tm_mon = ufi.tmu_date.tm_mon;
-    zfi.tmz_date.tm_year = ufi.tmu_date.tm_year;
-    zfi.internal_fa = ufi.internal_fa;
-    zfi.external_fa = ufi.external_fa;
+    mzCopyHeader(ufi, &zfi);
 
     int method;
     int level;
@@ -711,15 +720,37 @@ static bool mzGetFileTime(const std::string &filename,
     return false;
 }
 
+/*!
+ * \brief Add a file to a zip from memory
+ *
+ * \param zf Output zip
+ * \param name Name of the file in the zip
+ * \param contents Contents of the file
+ * \param header If not nullptr, the timestamps, attributes, and compression
+ *               method (stored or deflated) of this entry from the input zip
+ *               are kept
+ */
 ErrorCode FileUtils::mzAddFile(zipFile zf,
                                const std::string &name,
-                               const std::vector<unsigned char> &contents)
+                               const std::vector<unsigned char> &contents,
+                               const unz_file_info64 *header)
 {
     // Obviously never true, but we'll keep it here just in case
     bool zip64 = (uint64_t) contents.size() >= ((1ull << 32) - 1);
 
     zip_fileinfo zi;
-    memset(&zi, 0, sizeof(zi));
+    int method = Z_DEFLATED;
+    int level = Z_DEFAULT_COMPRESSION;
+
+    if (header) {
+        mzCopyHeader(*header, &zi);
+        if (header->compression_method == 0) {
+            method = 0;
+            level = 0;
+        }
+    } else {
+        memset(&zi, 0, sizeof(zi));
+    }
 
     int ret = zipOpenNewFileInZip2_64(
         zf,                     // file
@@ -730,8 +761,8 @@ ErrorCode FileUtils::mzAddFile(zipFile zf,
         nullptr,                // extrafield_global
         0,                      // size_extrafield_global
         nullptr,                // comment
-        Z_DEFLATED,             // method
-        Z_DEFAULT_COMPRESSION,  // level
+        method,                 // method
+        level,                  // level
         0,                      // raw
         zip64                   // zip64
     );
@@ -83,7 +83,8 @@ public:
 
     static ErrorCode mzAddFile(zipFile zf,
                                const std::string &name,
-                               const std::vector<unsigned char> &contents);
+                               const std::vector<unsigned char> &contents,
+                               const unz_file_info64 *header = nullptr);
 
     static ErrorCode mzAddFile(zipFile zf,
                                const std::string &name,
@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "private/mappedfile.h"
+
+#include <cerrno>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "private/fileutils.h"
+#include "private/logging.h"
+
+
+namespace mbp
+{
+
+MappedFile::MappedFile()
+    : m_data(nullptr), m_size(0), m_mapped(false), m_dev(0), m_ino(0)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+/*!
+ * \brief Map a file into memory
+ *
+ * \note Block devices are supported. Their size is determined by seeking to
+ *       the end of the device.
+ *
+ * \param path Path to file
+ *
+ * \return ErrorCode::NoError on success or the error on failure
+ */
+ErrorCode MappedFile::open(const std::string &path)
+{
+    close();
+
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        FLOGE("%s: Failed to open for reading: %s",
+              path.c_str(), strerror(errno));
+        return ErrorCode::FileOpenError;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == 0) {
+        m_dev = sb.st_dev;
+        m_ino = sb.st_ino;
+    }
+
+    // fstat() reports a size of 0 for block devices
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < 0) {
+        FLOGE("%s: Failed to seek: %s", path.c_str(), strerror(errno));
+        ::close(fd);
+        return ErrorCode::FileReadError;
+    }
+
+    if (size == 0) {
+        ::close(fd);
+        return ErrorCode::NoError;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (map != MAP_FAILED) {
+        m_data = static_cast<const unsigned char *>(map);
+        m_size = size;
+        m_mapped = true;
+        return ErrorCode::NoError;
+    }
+
+    FLOGW("%s: Failed to mmap, reading into memory instead: %s",
+          path.c_str(), strerror(errno));
+#endif
+
+    auto ret = FileUtils::readToMemory(path, &m_buf);
+    if (ret != ErrorCode::NoError) {
+        return ret;
+    }
+
+    m_data = m_buf.data();
+    m_size = m_buf.size();
+
+    return ErrorCode::NoError;
+}
+
+/*!
+ * \brief Unmap the file
+ */
+void MappedFile::close()
+{
+#ifndef _WIN32
+    if (m_mapped) {
+        munmap(const_cast<unsigned char *>(m_data), m_size);
+    }
+#endif
+
+    std::vector<unsigned char>().swap(m_buf);
+    m_data = nullptr;
+    m_size = 0;
+    m_mapped = false;
+    m_dev = 0;
+    m_ino = 0;
+}
+
+const unsigned char * MappedFile::data() const
+{
+    return m_data;
+}
+
+std::size_t MappedFile::size() const
+{
+    return m_size;
+}
+
+/*!
+ * \brief Check whether \a path refers to the mapped file
+ *
+ * This is used to avoid overwriting a file while it is still mapped.
+ *
+ * \return Whether the file is mapped and \a path is the same file
+ */
+bool MappedFile::isSameFile(const std::string &path) const
+{
+#ifndef _WIN32
+    struct stat sb;
+    return m_mapped && stat(path.c_str(), &sb) == 0
+            && static_cast<uint64_t>(sb.st_dev) == m_dev
+            && static_cast<uint64_t>(sb.st_ino) == m_ino;
+#else
+    (void) path;
+    return false;
+#endif
+}
+
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include "errors.h"
+
+
+namespace mbp
+{
+
+/*!
+ * \brief Read-only view of a file's contents
+ *
+ * On POSIX systems, the file is memory-mapped so that pages are only read
+ * when they are accessed. On other systems, the file is read into memory.
+ */
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    ErrorCode open(const std::string &path);
+    void close();
+
+    const unsigned char * data() const;
+    std::size_t size() const;
+
+    bool isSameFile(const std::string &path) const;
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+private:
+    const unsigned char *m_data;
+    std::size_t m_size;
+    bool m_mapped;
+    // Identity of the mapped file
+    uint64_t m_dev;
+    uint64_t m_ino;
+    std::vector<unsigned char> m_buf;
+};
+
+}
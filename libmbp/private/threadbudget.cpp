@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "private/threadbudget.h"
+
+#include <algorithm>
+
+#include "private/compressutils.h"
+
+
+namespace mbp
+{
+
+/*!
+ * \param threads Number of threads or 0 to use the number of CPUs
+ */
+ThreadBudget::ThreadBudget(unsigned int threads) : m_threads(0), m_inUse(0)
+{
+    setThreads(threads);
+}
+
+unsigned int ThreadBudget::threads() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_threads;
+}
+
+/*!
+ * \brief Set the number of threads
+ *
+ * Slots that are currently in use are not revoked if the budget shrinks.
+ *
+ * \param threads Number of threads or 0 to use the number of CPUs
+ */
+void ThreadBudget::setThreads(unsigned int threads)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_threads = threads == 0 ? CompressUtils::defaultThreads() : threads;
+}
+
+/*!
+ * \brief Take up to \a max free slots without blocking
+ *
+ * \return Number of slots taken (possibly 0)
+ */
+unsigned int ThreadBudget::tryAcquire(unsigned int max)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    unsigned int available = m_inUse < m_threads ? m_threads - m_inUse : 0;
+    unsigned int count = std::min(max, available);
+    m_inUse += count;
+    return count;
+}
+
+/*!
+ * \brief Return slots taken with tryAcquire()
+ */
+void ThreadBudget::release(unsigned int count)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_inUse -= std::min(count, m_inUse);
+}
+
+/*!
+ * \param budget Budget to take slots from (may be nullptr, in which case no
+ *               slots are taken)
+ * \param max Maximum number of slots to take
+ */
+ThreadLease::ThreadLease(ThreadBudget *budget, unsigned int max)
+    : m_budget(budget), m_count(budget ? budget->tryAcquire(max) : 0)
+{
+}
+
+ThreadLease::~ThreadLease()
+{
+    if (m_budget) {
+        m_budget->release(m_count);
+    }
+}
+
+unsigned int ThreadLease::count() const
+{
+    return m_count;
+}
+
+}
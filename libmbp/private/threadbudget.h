@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <mutex>
+
+
+namespace mbp
+{
+
+class PatcherConfig;
+
+/*!
+ * \brief Number of worker threads that may be running at once
+ *
+ * Every thread that libmbp creates for patching (batch jobs, boot image patch
+ * jobs, and compression threads) takes a slot from the PatcherConfig's budget
+ * while it is running, so nesting these does not multiply the thread count.
+ */
+class ThreadBudget
+{
+public:
+    explicit ThreadBudget(unsigned int threads = 0);
+
+    // Defined in patcherconfig.cpp
+    static ThreadBudget * forConfig(PatcherConfig *pc);
+
+    unsigned int threads() const;
+    void setThreads(unsigned int threads);
+
+    unsigned int tryAcquire(unsigned int max);
+    void release(unsigned int count);
+
+    ThreadBudget(const ThreadBudget &) = delete;
+    ThreadBudget & operator=(const ThreadBudget &) = delete;
+
+private:
+    mutable std::mutex m_mutex;
+    unsigned int m_threads;
+    unsigned int m_inUse;
+};
+
+/*!
+ * \brief Slots taken from a ThreadBudget for the lifetime of the object
+ */
+class ThreadLease
+{
+public:
+    ThreadLease(ThreadBudget *budget, unsigned int max);
+    ~ThreadLease();
+
+    unsigned int count() const;
+
+    ThreadLease(const ThreadLease &) = delete;
+    ThreadLease & operator=(const ThreadLease &) = delete;
+
+private:
+    ThreadBudget *m_budget;
+    unsigned int m_count;
+};
+
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Load generator for the mbtool daemon. Each client thread connects to the
+// daemon's socket, performs the version 2 handshake, and then keeps a fixed
+// number of requests in flight on the connection. The request rate and the
+// latency distribution (time from sending a request to receiving its
+// response) are printed at the end.
+//
+// The daemon must already be running and must allow the caller's UID.
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <getopt.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "util/finally.h"
+#include "util/socket.h"
+
+// flatbuffers
+#include "protocol/get_builtin_rom_ids_generated.h"
+#include "protocol/get_current_rom_generated.h"
+#include "protocol/get_roms_list_generated.h"
+#include "protocol/get_version_generated.h"
+#include "protocol/request_generated.h"
+#include "protocol/response_generated.h"
+
+#define RESPONSE_ALLOW "ALLOW"
+#define RESPONSE_OK "OK"
+
+// Keep the requests in flight well within the socket buffers. The daemon
+// stops reading from a client while its responses are not being received, so
+// a client that writes too far ahead without reading would deadlock.
+#define MAX_PIPELINE_DEPTH 256
+
+namespace v2 = mbtool::daemon::v2;
+namespace fb = flatbuffers;
+
+using namespace mb;
+
+struct RequestInfo
+{
+    const char *name;
+    v2::RequestType type;
+};
+
+static RequestInfo request_types[] = {
+    { "get-version",         v2::RequestType_GET_VERSION },
+    { "get-builtin-rom-ids", v2::RequestType_GET_BUILTIN_ROM_IDS },
+    { "get-current-rom",     v2::RequestType_GET_CURRENT_ROM },
+    { "get-roms-list",       v2::RequestType_GET_ROMS_LIST },
+    { nullptr,               v2::RequestType_GET_VERSION }
+};
+
+struct ClientCtx
+{
+    pthread_t thread;
+    const std::vector<uint8_t> *request;
+    unsigned int requests;
+    unsigned int depth;
+    // Results
+    bool ok;
+    std::vector<uint64_t> latencies;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+static int daemon_connect()
+{
+    int fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    char abs_name[] = "\0mbtool.daemon";
+    size_t abs_name_len = sizeof(abs_name) - 1;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_LOCAL;
+    memcpy(addr.sun_path, abs_name, abs_name_len);
+
+    socklen_t addr_len = offsetof(struct sockaddr_un, sun_path) + abs_name_len;
+
+    if (connect(fd, (struct sockaddr *) &addr, addr_len) < 0) {
+        fprintf(stderr, "Failed to connect to daemon: %s\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    std::string response;
+
+    if (!util::socket_read_string(fd, &response)) {
+        fprintf(stderr, "Failed to receive credentials response\n");
+        close(fd);
+        return -1;
+    } else if (response != RESPONSE_ALLOW) {
+        fprintf(stderr, "Daemon denied credentials: %s\n", response.c_str());
+        close(fd);
+        return -1;
+    }
+
+    if (!util::socket_write_int32(fd, 2)
+            || !util::socket_read_string(fd, &response)) {
+        fprintf(stderr, "Failed to negotiate interface version\n");
+        close(fd);
+        return -1;
+    } else if (response != RESPONSE_OK) {
+        fprintf(stderr, "Daemon rejected interface version 2: %s\n",
+                response.c_str());
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool check_response(const std::vector<uint8_t> &buf)
+{
+    fb::Verifier verifier(buf.data(), buf.size());
+    if (!v2::VerifyResponseBuffer(verifier)) {
+        fprintf(stderr, "Received invalid response\n");
+        return false;
+    }
+
+    auto response = v2::GetResponse(buf.data());
+    if (response->type() == v2::ResponseType_INVALID
+            || response->type() == v2::ResponseType_UNSUPPORTED) {
+        fprintf(stderr, "Daemon did not handle request: %s\n",
+                v2::EnumNameResponseType(response->type()));
+        return false;
+    }
+
+    return true;
+}
+
+static void * client_thread(void *userdata)
+{
+    ClientCtx *ctx = static_cast<ClientCtx *>(userdata);
+    ctx->ok = false;
+    ctx->latencies.reserve(ctx->requests);
+
+    int fd = daemon_connect();
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    // Send times of the requests in flight. Responses arrive in order.
+    std::vector<uint64_t> sent(ctx->depth);
+    std::vector<uint8_t> buf;
+    unsigned int n_sent = 0;
+    unsigned int n_received = 0;
+
+    while (n_received < ctx->requests) {
+        while (n_sent < ctx->requests && n_sent - n_received < ctx->depth) {
+            sent[n_sent % ctx->depth] = now_ns();
+            if (!util::socket_write_bytes(fd, ctx->request->data(),
+                                          ctx->request->size())) {
+                fprintf(stderr, "Failed to send request: %s\n",
+                        strerror(errno));
+                return nullptr;
+            }
+            ++n_sent;
+        }
+
+        if (!util::socket_read_bytes(fd, &buf)) {
+            fprintf(stderr, "Failed to receive response: %s\n",
+                    strerror(errno));
+            return nullptr;
+        }
+
+        ctx->latencies.push_back(now_ns() - sent[n_received % ctx->depth]);
+        ++n_received;
+
+        if (!check_response(buf)) {
+            return nullptr;
+        }
+    }
+
+    ctx->ok = true;
+    return nullptr;
+}
+
+static bool build_request(v2::RequestType type, std::vector<uint8_t> *out)
+{
+    fb::FlatBufferBuilder builder;
+    fb::Offset<v2::Request> request;
+
+    switch (type) {
+    case v2::RequestType_GET_VERSION:
+        request = v2::CreateRequest(builder, type,
+                v2::CreateGetVersionRequest(builder));
+        break;
+    case v2::RequestType_GET_BUILTIN_ROM_IDS:
+        request = v2::CreateRequest(builder, type, 0, 0,
+                v2::CreateGetBuiltinRomIdsRequest(builder));
+        break;
+    case v2::RequestType_GET_CURRENT_ROM:
+        request = v2::CreateRequest(builder, type, 0, 0, 0,
+                v2::CreateGetCurrentRomRequest(builder));
+        break;
+    case v2::RequestType_GET_ROMS_LIST:
+        request = v2::CreateRequest(builder, type, 0,
+                v2::CreateGetRomsListRequest(builder));
+        break;
+    default:
+        return false;
+    }
+
+    builder.Finish(request);
+    out->assign(builder.GetBufferPointer(),
+                builder.GetBufferPointer() + builder.GetSize());
+    return true;
+}
+
+static double percentile_ms(const std::vector<uint64_t> &sorted, double p)
+{
+    size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[index] / 1000000.0;
+}
+
+static void daemonbench_usage(int error)
+{
+    FILE *stream = error ? stderr : stdout;
+
+    fprintf(stream,
+            "Usage: daemonbench [OPTION]...\n\n"
+            "Options:\n"
+            "  -c, --clients <count>   Concurrent connections (default: 4)\n"
+            "  -n, --requests <count>  Requests per connection (default: 10000)\n"
+            "  -p, --pipeline <depth>  Requests in flight per connection\n"
+            "                          (default: 16, max: %d)\n"
+            "  -t, --type <request>    Request to send (default: get-version)\n"
+            "  -h, --help              Display this help message\n"
+            "\n"
+            "Requests:\n",
+            MAX_PIPELINE_DEPTH);
+
+    for (auto it = request_types; it->name; ++it) {
+        fprintf(stream, "  %s\n", it->name);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    unsigned int clients = 4;
+    unsigned int requests = 10000;
+    unsigned int depth = 16;
+    const RequestInfo *info = &request_types[0];
+
+    static struct option long_options[] = {
+        {"clients",  required_argument, 0, 'c'},
+        {"requests", required_argument, 0, 'n'},
+        {"pipeline", required_argument, 0, 'p'},
+        {"type",     required_argument, 0, 't'},
+        {"help",     no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "c:n:p:t:h",
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'c':
+            clients = strtoul(optarg, nullptr, 10);
+            break;
+
+        case 'n':
+            requests = strtoul(optarg, nullptr, 10);
+            break;
+
+        case 'p':
+            depth = strtoul(optarg, nullptr, 10);
+            break;
+
+        case 't':
+            for (info = request_types; info->name; ++info) {
+                if (strcmp(info->name, optarg) == 0) {
+                    break;
+                }
+            }
+            if (!info->name) {
+                fprintf(stderr, "Unknown request: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+
+        case 'h':
+            daemonbench_usage(0);
+            return EXIT_SUCCESS;
+
+        default:
+            daemonbench_usage(1);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 0 || clients == 0 || requests == 0 || depth == 0
+            || depth > MAX_PIPELINE_DEPTH) {
+        daemonbench_usage(1);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<uint8_t> request;
+    if (!build_request(info->type, &request)) {
+        return EXIT_FAILURE;
+    }
+
+    std::vector<ClientCtx> ctxs(clients);
+    for (ClientCtx &ctx : ctxs) {
+        ctx.request = &request;
+        ctx.requests = requests;
+        ctx.depth = depth;
+    }
+
+    uint64_t start = now_ns();
+
+    unsigned int started = 0;
+    for (; started < clients; ++started) {
+        if (pthread_create(&ctxs[started].thread, nullptr,
+                           &client_thread, &ctxs[started]) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            break;
+        }
+    }
+
+    bool ok = started == clients;
+    std::vector<uint64_t> latencies;
+
+    for (unsigned int i = 0; i < started; ++i) {
+        pthread_join(ctxs[i].thread, nullptr);
+        ok = ok && ctxs[i].ok;
+        latencies.insert(latencies.end(), ctxs[i].latencies.begin(),
+                         ctxs[i].latencies.end());
+    }
+
+    uint64_t elapsed = now_ns() - start;
+
+    if (!ok || latencies.empty()) {
+        return EXIT_FAILURE;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("Request:     %s\n", info->name);
+    printf("Clients:     %u\n", clients);
+    printf("Pipeline:    %u\n", depth);
+    printf("Requests:    %zu\n", latencies.size());
+    printf("Elapsed:     %.1f ms\n", elapsed / 1000000.0);
+    printf("Throughput:  %.0f requests/s\n",
+           latencies.size() / (elapsed / 1000000000.0));
+    printf("Latency:     p50 %.3f ms  p90 %.3f ms  p99 %.3f ms  max %.3f ms\n",
+           percentile_ms(latencies, 0.50), percentile_ms(latencies, 0.90),
+           percentile_ms(latencies, 0.99), latencies.back() / 1000000.0);
+
+    return EXIT_SUCCESS;
+}
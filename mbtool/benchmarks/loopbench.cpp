@@ -0,0 +1,429 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Compares buffered and direct I/O loop mounts of an image. For each mode,
+// the image's cached pages are dropped, the image is attached and mounted
+// read-only, and every file in it is read sequentially. The read throughput
+// and the amount of page cache used by the backing file are printed. With
+// buffered I/O, the data is cached twice: once for the loop device and once
+// for the image file. With direct I/O, only the former remains.
+//
+// Must be run as root.
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util/ext4image.h"
+#include "util/finally.h"
+#include "util/fts.h"
+#include "util/loopdev.h"
+
+#define READ_BUF_SIZE           (1024 * 1024)
+// Size of each file written by --create
+#define CREATE_FILE_SIZE        (64 * 1024 * 1024)
+// Size of the image windows mapped to check residency
+#define MINCORE_WINDOW          (256 * 1024 * 1024)
+
+using namespace mb;
+
+struct RunResult
+{
+    uint64_t bytes;
+    double seconds;
+    // Whether the kernel actually enabled direct I/O on the loop device
+    bool dio;
+    // Image pages in the page cache after the read
+    uint64_t image_cached;
+};
+
+static double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*!
+ * \brief Evict the image's pages from the page cache
+ */
+static bool drop_image_cache(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    return fdatasync(fd) == 0
+            && posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED) == 0;
+}
+
+/*!
+ * \brief Count the bytes of the image that are in the page cache
+ */
+static bool image_cached_bytes(const std::string &path, uint64_t *result)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        return false;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    std::vector<unsigned char> vec(MINCORE_WINDOW / page_size);
+    uint64_t cached = 0;
+
+    // Map the image in windows so this works for large images on 32-bit
+    // devices
+    for (off_t offset = 0; offset < sb.st_size; offset += MINCORE_WINDOW) {
+        size_t len = std::min<off_t>(MINCORE_WINDOW, sb.st_size - offset);
+
+        void *map = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, offset);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+
+        int ret = mincore(map, len, vec.data());
+        munmap(map, len);
+        if (ret < 0) {
+            return false;
+        }
+
+        for (size_t i = 0; i < (len + page_size - 1) / page_size; ++i) {
+            if (vec[i] & 1) {
+                cached += page_size;
+            }
+        }
+    }
+
+    *result = cached;
+    return true;
+}
+
+static bool loopdev_dio_enabled(const std::string &loopdev)
+{
+    std::string name = loopdev.substr(loopdev.rfind('/') + 1);
+    std::string path = "/sys/block/" + name + "/loop/dio";
+
+    char c = '0';
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        if (read(fd, &c, 1) != 1) {
+            c = '0';
+        }
+        close(fd);
+    }
+    return c == '1';
+}
+
+/*!
+ * \brief Read every regular file in a tree
+ */
+class TreeReader : public util::FTSWrapper
+{
+public:
+    uint64_t bytes = 0;
+
+    TreeReader(std::string path)
+        : FTSWrapper(std::move(path), 0), _buf(READ_BUF_SIZE)
+    {
+    }
+
+    virtual int on_reached_file() override
+    {
+        int fd = open(_curr->fts_accpath, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            _error_msg = std::string(_curr->fts_path) + ": Failed to open: "
+                    + strerror(errno);
+            return Action::FTS_Fail;
+        }
+
+        ssize_t n;
+        while ((n = read(fd, _buf.data(), _buf.size())) > 0) {
+            bytes += n;
+        }
+
+        int saved_errno = errno;
+        close(fd);
+
+        if (n < 0) {
+            _error_msg = std::string(_curr->fts_path) + ": Failed to read: "
+                    + strerror(saved_errno);
+            return Action::FTS_Fail;
+        }
+
+        return Action::FTS_OK;
+    }
+
+private:
+    std::vector<char> _buf;
+};
+
+static bool write_file(const std::string &path, uint64_t size)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = util::finally([&]{
+        close(fd);
+    });
+
+    std::vector<uint32_t> buf(READ_BUF_SIZE / sizeof(uint32_t));
+    uint32_t state = 0x12345678;
+
+    for (uint64_t written = 0; written < size; written += READ_BUF_SIZE) {
+        for (uint32_t &word : buf) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            word = state;
+        }
+
+        size_t len = std::min<uint64_t>(READ_BUF_SIZE, size - written);
+        if (write(fd, buf.data(), len) != static_cast<ssize_t>(len)) {
+            return false;
+        }
+    }
+
+    return fsync(fd) == 0;
+}
+
+/*!
+ * \brief Create an ext4 image and fill 90% of it with files
+ */
+static bool create_image(const std::string &image,
+                         const std::string &mount_point, uint64_t size)
+{
+    if (!util::ext4_image_create(image, size)) {
+        fprintf(stderr, "%s: Failed to create image\n", image.c_str());
+        return false;
+    }
+
+    std::string loopdev = util::loopdev_attach(image, 0, 0);
+    if (loopdev.empty()) {
+        fprintf(stderr, "%s: Failed to attach image: %s\n",
+                image.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto detach = util::finally([&]{
+        util::loopdev_remove_device(loopdev);
+    });
+
+    if (mount(loopdev.c_str(), mount_point.c_str(), "ext4", 0, "") < 0) {
+        fprintf(stderr, "%s: Failed to mount: %s\n",
+                loopdev.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto unmount = util::finally([&]{
+        umount(mount_point.c_str());
+    });
+
+    uint64_t remaining = size / 10 * 9;
+    for (unsigned int i = 0; remaining > 0; ++i) {
+        uint64_t file_size = std::min<uint64_t>(CREATE_FILE_SIZE, remaining);
+        std::string path = mount_point + "/file" + std::to_string(i);
+
+        if (!write_file(path, file_size)) {
+            fprintf(stderr, "%s: Failed to write file: %s\n",
+                    path.c_str(), strerror(errno));
+            return false;
+        }
+
+        remaining -= file_size;
+    }
+
+    return true;
+}
+
+static bool run(const std::string &image, const std::string &mount_point,
+                const char *fstype, bool direct_io, RunResult *result)
+{
+    if (!drop_image_cache(image)) {
+        fprintf(stderr, "%s: Failed to drop cached pages: %s\n",
+                image.c_str(), strerror(errno));
+        return false;
+    }
+
+    int flags = util::LOOPDEV_READ_ONLY;
+    if (direct_io) {
+        flags |= util::LOOPDEV_DIRECT_IO;
+    }
+
+    std::string loopdev = util::loopdev_attach(image, 0, flags);
+    if (loopdev.empty()) {
+        fprintf(stderr, "%s: Failed to attach image: %s\n",
+                image.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto detach = util::finally([&]{
+        util::loopdev_remove_device(loopdev);
+    });
+
+    result->dio = loopdev_dio_enabled(loopdev);
+
+    if (mount(loopdev.c_str(), mount_point.c_str(), fstype,
+              MS_RDONLY, "") < 0) {
+        fprintf(stderr, "%s: Failed to mount: %s\n",
+                loopdev.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto unmount = util::finally([&]{
+        umount(mount_point.c_str());
+    });
+
+    TreeReader reader(mount_point);
+
+    double start = now_s();
+    bool ret = reader.run();
+    result->seconds = now_s() - start;
+    result->bytes = reader.bytes;
+
+    if (!ret) {
+        fprintf(stderr, "%s\n", reader.error().c_str());
+        return false;
+    }
+
+    if (!image_cached_bytes(image, &result->image_cached)) {
+        fprintf(stderr, "%s: Failed to check cached pages: %s\n",
+                image.c_str(), strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static void loopbench_usage(int error)
+{
+    FILE *stream = error ? stderr : stdout;
+
+    fprintf(stream,
+            "Usage: loopbench [OPTION]... <image> <mount point>\n\n"
+            "Options:\n"
+            "  -c, --create <MiB>  Create an ext4 image of this size and fill\n"
+            "                      it with files first\n"
+            "  -t, --type <fstype> Filesystem type (default: ext4)\n"
+            "  -i, --iterations <count>\n"
+            "                      Runs per mode (default: 3)\n"
+            "  -h, --help          Display this help message\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    uint64_t create_size = 0;
+    const char *fstype = "ext4";
+    unsigned int iterations = 3;
+
+    static struct option long_options[] = {
+        {"create",     required_argument, 0, 'c'},
+        {"type",       required_argument, 0, 't'},
+        {"iterations", required_argument, 0, 'i'},
+        {"help",       no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int long_index = 0;
+
+    while ((opt = getopt_long(argc, argv, "c:t:i:h",
+                              long_options, &long_index)) != -1) {
+        switch (opt) {
+        case 'c':
+            create_size = strtoull(optarg, nullptr, 10) * 1024 * 1024;
+            break;
+
+        case 't':
+            fstype = optarg;
+            break;
+
+        case 'i':
+            iterations = strtoul(optarg, nullptr, 10);
+            break;
+
+        case 'h':
+            loopbench_usage(0);
+            return EXIT_SUCCESS;
+
+        default:
+            loopbench_usage(1);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc - optind != 2 || iterations == 0) {
+        loopbench_usage(1);
+        return EXIT_FAILURE;
+    }
+
+    std::string image = argv[optind];
+    std::string mount_point = argv[optind + 1];
+
+    if (create_size > 0 && !create_image(image, mount_point, create_size)) {
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned int i = 0; i < iterations; ++i) {
+        for (bool direct_io : { false, true }) {
+            RunResult result;
+            if (!run(image, mount_point, fstype, direct_io, &result)) {
+                return EXIT_FAILURE;
+            }
+
+            printf("%-9s (dio=%d): %8.1f MiB in %7.2f s  %8.1f MiB/s"
+                   "  image cached: %8.1f MiB\n",
+                   direct_io ? "direct" : "buffered", result.dio,
+                   result.bytes / 1048576.0, result.seconds,
+                   result.bytes / 1048576.0 / result.seconds,
+                   result.image_cached / 1048576.0);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,621 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "checksums.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "roms.h"
+#include "util/directory.h"
+#include "util/file.h"
+#include "util/finally.h"
+#include "util/logging.h"
+#include "util/path.h"
+#include "util/properties.h"
+#include "util/string.h"
+
+#define CHECKSUMS_PATH "/data/multiboot/checksums.bin"
+// Old text format. Migrated to CHECKSUMS_PATH when found.
+#define LEGACY_CHECKSUMS_PATH "/data/multiboot/checksums.prop"
+
+#define CHECKSUMS_MAGIC         "MBCKSUMS"
+#define CHECKSUMS_MAGIC_SIZE    8
+#define CHECKSUMS_VERSION       1
+
+#define ENTRY_FLAG_HAS_STAT     0x1
+#define ENTRY_FLAG_MALFORMED    0x2
+
+namespace mb
+{
+
+/*
+ * File format (all integers are little endian):
+ *
+ *   char[8]   magic ("MBCKSUMS")
+ *   uint32    version
+ *   uint32    number of entries
+ *   entries:
+ *     uint16    key length
+ *     char[]    key ("[ROM ID]/[image]")
+ *     uint8     flags
+ *     uint8[64] SHA512 digest
+ *     uint64    st_dev, st_ino, st_size
+ *     int64     mtime seconds
+ *     uint32    mtime nanoseconds
+ *     int64     ctime seconds
+ *     uint32    ctime nanoseconds
+ *   uint8[20] SHA1 digest of everything above
+ */
+
+class Writer
+{
+public:
+    std::vector<unsigned char> data;
+
+    void put_bytes(const void *ptr, std::size_t size)
+    {
+        auto p = static_cast<const unsigned char *>(ptr);
+        data.insert(data.end(), p, p + size);
+    }
+
+    void put_uint(uint64_t value, std::size_t size)
+    {
+        for (std::size_t i = 0; i < size; ++i) {
+            data.push_back((value >> (i * 8)) & 0xff);
+        }
+    }
+};
+
+class Reader
+{
+public:
+    Reader(const unsigned char *data, std::size_t size)
+        : _data(data), _size(size)
+    {
+    }
+
+    bool get_bytes(void *ptr, std::size_t size)
+    {
+        if (_size - _pos < size) {
+            return false;
+        }
+        memcpy(ptr, _data + _pos, size);
+        _pos += size;
+        return true;
+    }
+
+    bool get_uint(uint64_t *value, std::size_t size)
+    {
+        if (_size - _pos < size) {
+            return false;
+        }
+        *value = 0;
+        for (std::size_t i = 0; i < size; ++i) {
+            *value |= static_cast<uint64_t>(_data[_pos + i]) << (i * 8);
+        }
+        _pos += size;
+        return true;
+    }
+
+    bool at_end() const
+    {
+        return _pos == _size;
+    }
+
+private:
+    const unsigned char *_data;
+    std::size_t _size;
+    std::size_t _pos = 0;
+};
+
+static std::string make_key(const std::string &rom_id, const std::string &image)
+{
+    std::string key(rom_id);
+    key += "/";
+    key += image;
+    return key;
+}
+
+static bool hex_to_bytes(const std::string &hex, unsigned char *out,
+                         std::size_t size)
+{
+    if (hex.size() != size * 2) {
+        return false;
+    }
+
+    for (std::size_t i = 0; i < size; ++i) {
+        unsigned int byte;
+        if (!isxdigit(hex[2 * i]) || !isxdigit(hex[2 * i + 1])
+                || sscanf(hex.c_str() + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        out[i] = byte;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Check a checksum entry
+ *
+ * \param checksums Pointer to checksums map
+ * \param rom_id ROM ID
+ * \param image Image filename (without directory)
+ * \param sha512_out SHA512 hex digest output
+ *
+ * \return ChecksumsGetResult::FOUND if the hash was successfully retrieved,
+ *         ChecksumsGetResult::NOT_FOUND if the hash does not exist in the map,
+ *         ChecksumsGetResult::MALFORMED if the entry was migrated from an
+ *         invalid property
+ */
+ChecksumsGetResult checksums_get(Checksums *checksums,
+                                 const std::string &rom_id,
+                                 const std::string &image,
+                                 std::string *sha512_out)
+{
+    auto it = checksums->find(make_key(rom_id, image));
+    if (it == checksums->end()) {
+        return ChecksumsGetResult::NOT_FOUND;
+    }
+
+    if (it->second.sha512.empty()) {
+        LOGE("%s: Invalid checksum for %s",
+             CHECKSUMS_PATH, it->first.c_str());
+        return ChecksumsGetResult::MALFORMED;
+    }
+
+    *sha512_out = it->second.sha512;
+    return ChecksumsGetResult::FOUND;
+}
+
+/*!
+ * \brief Update a checksum entry
+ *
+ * The cached file identity is cleared. Use checksums_update_stat() to set it
+ * once the image is in its final state.
+ *
+ * \param checksums Pointer to checksums map
+ * \param rom_id ROM ID
+ * \param image Image filename (without directory)
+ * \param sha512 SHA512 hex digest
+ */
+void checksums_update(Checksums *checksums,
+                      const std::string &rom_id,
+                      const std::string &image,
+                      const std::string &sha512)
+{
+    ChecksumEntry &entry = (*checksums)[make_key(rom_id, image)];
+    entry = ChecksumEntry();
+    entry.sha512 = sha512;
+}
+
+/*!
+ * \brief Check if an image's identity can be trusted in place of its hash
+ *
+ * Only images in directories that mbtool owns qualify. Anything in
+ * user-writable locations, such as /data/media or external storage, can be
+ * replaced by apps, and the filesystems there (eg. FUSE, sdcardfs, vfat) don't
+ * guarantee that a replaced file gets a new identity. Those images are always
+ * rehashed.
+ */
+static bool is_trusted_image(const std::string &path, const struct stat &sb)
+{
+    static const char *trusted_dirs[] = {
+        "/data/multiboot/",
+        nullptr
+    };
+
+    if (path.find("/..") != std::string::npos) {
+        return false;
+    }
+
+    bool in_trusted_dir = false;
+    for (auto it = trusted_dirs; *it; ++it) {
+        if (util::starts_with(path, *it)) {
+            in_trusted_dir = true;
+            break;
+        }
+    }
+
+    // The file itself must also be writable by root only
+    return in_trusted_dir
+            && S_ISREG(sb.st_mode)
+            && sb.st_uid == 0
+            && !(sb.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/*!
+ * \brief Remember the identity of an image whose checksum was verified
+ *
+ * If the image's device, inode, size, mtime, and ctime are unchanged later,
+ * checksums_stat_matches() returns true and the image doesn't need to be
+ * rehashed. The ctime can't be set from userspace, so rewriting the file and
+ * restoring the mtime will still be detected.
+ *
+ * \a sb must come from fstat() on the file descriptor that the hashed data was
+ * read from. Stat'ing the path again afterwards could describe a different
+ * file or a later version of it.
+ *
+ * The identity is not recorded for images outside of mbtool-owned directories
+ * (see is_trusted_image()).
+ *
+ * \param checksums Pointer to checksums map
+ * \param rom_id ROM ID
+ * \param path Full path to the image
+ * \param sb Result of fstat() on the image
+ *
+ * \return True if the entry exists and the image's identity can be trusted
+ */
+bool checksums_update_stat(Checksums *checksums,
+                           const std::string &rom_id,
+                           const std::string &path,
+                           const struct stat &sb)
+{
+    auto it = checksums->find(make_key(rom_id, util::base_name(path)));
+    if (it == checksums->end() || it->second.sha512.empty()) {
+        return false;
+    }
+
+    ChecksumEntry &entry = it->second;
+
+    if (!is_trusted_image(path, sb)) {
+        entry.has_stat = false;
+        return false;
+    }
+
+    entry.has_stat = true;
+    entry.dev = sb.st_dev;
+    entry.ino = sb.st_ino;
+    entry.size = sb.st_size;
+    entry.mtime_sec = sb.st_mtim.tv_sec;
+    entry.mtime_nsec = sb.st_mtim.tv_nsec;
+    entry.ctime_sec = sb.st_ctim.tv_sec;
+    entry.ctime_nsec = sb.st_ctim.tv_nsec;
+
+    return true;
+}
+
+/*!
+ * \brief Check if an image is unchanged since its checksum was verified
+ *
+ * Always returns false for images outside of mbtool-owned directories, so
+ * those are hashed every time.
+ *
+ * \param checksums Checksums map
+ * \param rom_id ROM ID
+ * \param path Full path to the image
+ * \param sb Result of fstat() on the image
+ */
+bool checksums_stat_matches(const Checksums &checksums,
+                            const std::string &rom_id,
+                            const std::string &path,
+                            const struct stat &sb)
+{
+    if (!is_trusted_image(path, sb)) {
+        return false;
+    }
+
+    auto it = checksums.find(make_key(rom_id, util::base_name(path)));
+    if (it == checksums.end()) {
+        return false;
+    }
+
+    const ChecksumEntry &entry = it->second;
+
+    return entry.has_stat
+            && !entry.sha512.empty()
+            && entry.dev == static_cast<uint64_t>(sb.st_dev)
+            && entry.ino == static_cast<uint64_t>(sb.st_ino)
+            && entry.size == static_cast<uint64_t>(sb.st_size)
+            && entry.mtime_sec == sb.st_mtim.tv_sec
+            && entry.mtime_nsec == static_cast<uint32_t>(sb.st_mtim.tv_nsec)
+            && entry.ctime_sec == sb.st_ctim.tv_sec
+            && entry.ctime_nsec == static_cast<uint32_t>(sb.st_ctim.tv_nsec);
+}
+
+static bool checksums_parse(const std::vector<unsigned char> &data,
+                            Checksums *checksums)
+{
+    if (data.size() < SHA_DIGEST_LENGTH) {
+        return false;
+    }
+
+    std::size_t body_size = data.size() - SHA_DIGEST_LENGTH;
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1(data.data(), body_size, digest);
+    if (memcmp(digest, data.data() + body_size, SHA_DIGEST_LENGTH) != 0) {
+        return false;
+    }
+
+    Reader reader(data.data(), body_size);
+
+    char magic[CHECKSUMS_MAGIC_SIZE];
+    uint64_t version;
+    uint64_t count;
+
+    if (!reader.get_bytes(magic, sizeof(magic))
+            || memcmp(magic, CHECKSUMS_MAGIC, CHECKSUMS_MAGIC_SIZE) != 0
+            || !reader.get_uint(&version, 4)
+            || version != CHECKSUMS_VERSION
+            || !reader.get_uint(&count, 4)) {
+        return false;
+    }
+
+    Checksums result;
+
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t key_size;
+        uint64_t flags;
+        unsigned char sha512[SHA512_DIGEST_LENGTH];
+        uint64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+        ChecksumEntry entry;
+
+        if (!reader.get_uint(&key_size, 2)) {
+            return false;
+        }
+
+        std::string key(key_size, '\0');
+        if (!reader.get_bytes(&key[0], key_size)
+                || !reader.get_uint(&flags, 1)
+                || !reader.get_bytes(sha512, sizeof(sha512))
+                || !reader.get_uint(&entry.dev, 8)
+                || !reader.get_uint(&entry.ino, 8)
+                || !reader.get_uint(&entry.size, 8)
+                || !reader.get_uint(&mtime_sec, 8)
+                || !reader.get_uint(&mtime_nsec, 4)
+                || !reader.get_uint(&ctime_sec, 8)
+                || !reader.get_uint(&ctime_nsec, 4)) {
+            return false;
+        }
+
+        if (!(flags & ENTRY_FLAG_MALFORMED)) {
+            entry.sha512 = util::hex_string(sha512, sizeof(sha512));
+        }
+        entry.has_stat = flags & ENTRY_FLAG_HAS_STAT;
+        entry.mtime_sec = static_cast<int64_t>(mtime_sec);
+        entry.mtime_nsec = mtime_nsec;
+        entry.ctime_sec = static_cast<int64_t>(ctime_sec);
+        entry.ctime_nsec = ctime_nsec;
+
+        result[std::move(key)] = std::move(entry);
+    }
+
+    if (!reader.at_end()) {
+        return false;
+    }
+
+    checksums->swap(result);
+    return true;
+}
+
+/*!
+ * \brief Read checksums from a legacy checksums.prop file
+ *
+ * Properties are in the form "[ROM ID]/[image]=sha512:[hex digest]". Invalid
+ * values are kept as malformed entries so that checksums_get() still reports
+ * them.
+ */
+static bool checksums_read_legacy(const std::string &path,
+                                  Checksums *checksums)
+{
+    std::unordered_map<std::string, std::string> props;
+    if (!util::file_get_all_properties(path, &props)) {
+        return false;
+    }
+
+    Checksums result;
+    unsigned char sha512[SHA512_DIGEST_LENGTH];
+
+    for (auto const &pair : props) {
+        ChecksumEntry &entry = result[pair.first];
+
+        const std::string &value = pair.second;
+        if (util::starts_with(value, "sha512:")
+                && hex_to_bytes(value.substr(7), sha512, sizeof(sha512))) {
+            entry.sha512 = util::hex_string(sha512, sizeof(sha512));
+        } else {
+            LOGE("%s: Invalid checksum property: %s=%s",
+                 path.c_str(), pair.first.c_str(), value.c_str());
+        }
+    }
+
+    checksums->swap(result);
+    return true;
+}
+
+/*!
+ * \brief Read checksums from \a /data/multiboot/checksums.bin
+ *
+ * If the file doesn't exist, but \a /data/multiboot/checksums.prop does, the
+ * old properties are migrated to the new file and the old file is removed.
+ *
+ * \param checksums Pointer to checksums map
+ *
+ * \return True if the file was successfully read or if there are no
+ *         checksums yet. Otherwise, false.
+ */
+bool checksums_read(Checksums *checksums)
+{
+    std::string checksums_path = get_raw_path(CHECKSUMS_PATH);
+    std::string legacy_path = get_raw_path(LEGACY_CHECKSUMS_PATH);
+
+    checksums->clear();
+
+    std::vector<unsigned char> data;
+    if (util::file_read_all(checksums_path, &data)) {
+        if (!checksums_parse(data, checksums)) {
+            LOGE("%s: Checksums file is corrupt", checksums_path.c_str());
+            return false;
+        }
+        return true;
+    } else if (errno != ENOENT) {
+        LOGE("%s: Failed to read: %s", checksums_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    struct stat sb;
+    if (stat(legacy_path.c_str(), &sb) < 0) {
+        // Nothing to migrate
+        return true;
+    }
+
+    LOGD("Migrating %s to %s", legacy_path.c_str(), checksums_path.c_str());
+
+    if (!checksums_read_legacy(legacy_path, checksums)) {
+        LOGE("%s: Failed to load properties", legacy_path.c_str());
+        return false;
+    }
+
+    if (checksums_write(*checksums) && remove(legacy_path.c_str()) < 0) {
+        LOGW("%s: Failed to remove file: %s",
+             legacy_path.c_str(), strerror(errno));
+    }
+
+    return true;
+}
+
+static bool write_full(int fd, const unsigned char *data, std::size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+/*!
+ * \brief Write checksums to \a /data/multiboot/checksums.bin
+ *
+ * The checksums are written to a temporary file, which is synced and then
+ * renamed over the old file. The directory is synced afterwards. If this is
+ * interrupted at any point, either the old or the new file will be intact.
+ *
+ * \param checksums Checksums map
+ *
+ * \return True if successfully written. Otherwise, false.
+ */
+bool checksums_write(const Checksums &checksums)
+{
+    std::string checksums_path = get_raw_path(CHECKSUMS_PATH);
+    std::string checksums_dir = util::dir_name(checksums_path);
+
+    Writer writer;
+    writer.put_bytes(CHECKSUMS_MAGIC, CHECKSUMS_MAGIC_SIZE);
+    writer.put_uint(CHECKSUMS_VERSION, 4);
+    writer.put_uint(checksums.size(), 4);
+
+    for (auto const &pair : checksums) {
+        const ChecksumEntry &entry = pair.second;
+        unsigned char sha512[SHA512_DIGEST_LENGTH] = {};
+        uint8_t flags = 0;
+
+        if (entry.sha512.empty()
+                || !hex_to_bytes(entry.sha512, sha512, sizeof(sha512))) {
+            flags |= ENTRY_FLAG_MALFORMED;
+        }
+        if (entry.has_stat) {
+            flags |= ENTRY_FLAG_HAS_STAT;
+        }
+
+        writer.put_uint(pair.first.size(), 2);
+        writer.put_bytes(pair.first.data(), pair.first.size());
+        writer.put_uint(flags, 1);
+        writer.put_bytes(sha512, sizeof(sha512));
+        writer.put_uint(entry.dev, 8);
+        writer.put_uint(entry.ino, 8);
+        writer.put_uint(entry.size, 8);
+        writer.put_uint(static_cast<uint64_t>(entry.mtime_sec), 8);
+        writer.put_uint(entry.mtime_nsec, 4);
+        writer.put_uint(static_cast<uint64_t>(entry.ctime_sec), 8);
+        writer.put_uint(entry.ctime_nsec, 4);
+    }
+
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1(writer.data.data(), writer.data.size(), digest);
+    writer.put_bytes(digest, sizeof(digest));
+
+    util::mkdir_recursive(checksums_dir, 0755);
+
+    std::string temp_path(checksums_path);
+    temp_path += ".XXXXXX";
+    std::vector<char> temp_buf(temp_path.begin(), temp_path.end());
+    temp_buf.push_back('\0');
+
+    // Created with mode 0600 and owned by root
+    int fd = mkstemp(temp_buf.data());
+    if (fd < 0) {
+        LOGE("%s: Failed to create temporary file: %s",
+             temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    temp_path = temp_buf.data();
+
+    auto remove_temp = util::finally([&]{
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!temp_path.empty()) {
+            unlink(temp_path.c_str());
+        }
+    });
+
+    if (!write_full(fd, writer.data.data(), writer.data.size())
+            || fsync(fd) < 0) {
+        LOGE("%s: Failed to write: %s", temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (close(fd) < 0) {
+        fd = -1;
+        LOGE("%s: Failed to close: %s", temp_path.c_str(), strerror(errno));
+        return false;
+    }
+    fd = -1;
+
+    if (rename(temp_path.c_str(), checksums_path.c_str()) < 0) {
+        LOGE("%s: Failed to rename to %s: %s", temp_path.c_str(),
+             checksums_path.c_str(), strerror(errno));
+        return false;
+    }
+    temp_path.clear();
+
+    // Make sure the rename itself is durable
+    int dir_fd = open(checksums_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    return true;
+}
+
+}
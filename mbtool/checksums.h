@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+#include <cstdint>
+
+#include <sys/stat.h>
+
+namespace mb
+{
+
+enum class ChecksumsGetResult
+{
+    FOUND,
+    NOT_FOUND,
+    MALFORMED
+};
+
+struct ChecksumEntry
+{
+    // SHA512 hex digest (empty if the migrated entry was malformed)
+    std::string sha512;
+
+    // Identity of the image when the digest was last verified
+    bool has_stat = false;
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+    uint64_t size = 0;
+    int64_t mtime_sec = 0;
+    uint32_t mtime_nsec = 0;
+    int64_t ctime_sec = 0;
+    uint32_t ctime_nsec = 0;
+};
+
+// Keyed by "[ROM ID]/[image filename]"
+typedef std::unordered_map<std::string, ChecksumEntry> Checksums;
+
+ChecksumsGetResult checksums_get(Checksums *checksums,
+                                 const std::string &rom_id,
+                                 const std::string &image,
+                                 std::string *sha512_out);
+void checksums_update(Checksums *checksums,
+                      const std::string &rom_id,
+                      const std::string &image,
+                      const std::string &sha512);
+bool checksums_update_stat(Checksums *checksums,
+                           const std::string &rom_id,
+                           const std::string &path,
+                           const struct stat &sb);
+bool checksums_stat_matches(const Checksums &checksums,
+                            const std::string &rom_id,
+                            const std::string &path,
+                            const struct stat &sb);
+bool checksums_read(Checksums *checksums);
+bool checksums_write(const Checksums &checksums);
+
+}
@@ -19,12 +19,21 @@
 
 #include "daemon.h"
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mount.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -40,6 +49,7 @@
 #include "roms.h"
 #include "sepolpatch.h"
 #include "switcher.h"
+#include "transfer.h"
 #include "validcerts.h"
 #include "version.h"
 #include "wipe.h"
@@ -52,6 +62,7 @@
 #include "util/properties.h"
 #include "util/selinux.h"
 #include "util/socket.h"
+#include "util/threadpool.h"
 
 // flatbuffers
 #include "protocol/get_version_generated.h"
@@ -65,6 +76,7 @@
 #include "protocol/copy_generated.h"
 #include "protocol/chmod_generated.h"
 #include "protocol/wipe_rom_generated.h"
+#include "protocol/transfer_generated.h"
 #include "protocol/request_generated.h"
 #include "protocol/response_generated.h"
 
@@ -75,6 +87,21 @@
 
 #define LOG_FILE "/data/media/0/MultiBoot/daemon.log"
 
+// Largest request the daemon will buffer
+#define MAX_REQUEST_SIZE (4 * 1024 * 1024)
+// Number of requests that may wait for a worker thread
+#define MAX_QUEUED_JOBS 64
+// Time after which a response to an unresponsive client is abandoned
+#define CLIENT_SEND_TIMEOUT 60
+// Maximum number of pending connections
+#define LISTEN_BACKLOG 16
+// Maximum number of events handled per epoll_wait() call
+#define MAX_EVENTS 16
+// Minimum free space in a client's receive buffer before reading
+#define RECV_CHUNK_SIZE 4096
+// Initial size of the per-thread response builders
+#define RESPONSE_BUILDER_SIZE 4096
+
 
 namespace mb
 {
@@ -82,29 +109,113 @@ namespace mb
 namespace v2 = mbtool::daemon::v2;
 namespace fb = flatbuffers;
 
-static bool v2_send_response(int fd, const fb::FlatBufferBuilder &builder)
+/*!
+ * \brief State of the request being handled
+ *
+ * Passed explicitly to every handler so that nothing about the current request
+ * is kept in thread-local state.
+ */
+struct HandlerContext
+{
+    // Client socket
+    int fd;
+    // If set, responses are appended to this output queue instead of being
+    // written to the socket. Used for requests handled on the event loop
+    // thread so that it never blocks on a client that isn't reading.
+    std::vector<uint8_t> *output;
+    // Set when the client disconnects. Null for requests that run on the event
+    // loop thread, which can't be cancelled.
+    const std::atomic_bool *cancelled;
+};
+
+/*!
+ * \brief Check if the client of a request has disconnected
+ *
+ * Long-running handlers should check this between steps that are safe to stop
+ * at. The response of a cancelled request is never received, so a handler may
+ * simply skip the remaining work.
+ */
+static bool request_cancelled(const HandlerContext &ctx)
+{
+    return ctx.cancelled && ctx.cancelled->load();
+}
+
+static void queue_bytes(std::vector<uint8_t> *out,
+                        const void *data, size_t size)
 {
+    int32_t size32 = size;
+    auto p = reinterpret_cast<const uint8_t *>(&size32);
+    out->insert(out->end(), p, p + sizeof(size32));
+    p = static_cast<const uint8_t *>(data);
+    out->insert(out->end(), p, p + size);
+}
+
+static pthread_key_t builder_key;
+static pthread_once_t builder_key_once = PTHREAD_ONCE_INIT;
+
+static void delete_builder(void *builder)
+{
+    delete static_cast<fb::FlatBufferBuilder *>(builder);
+}
+
+static void create_builder_key()
+{
+    pthread_key_create(&builder_key, &delete_builder);
+}
+
+/*!
+ * \brief Get the current thread's response builder
+ *
+ * Each thread keeps one builder and clears it for every response, so its
+ * buffer is only reallocated when a response is larger than all previous
+ * ones.
+ */
+static fb::FlatBufferBuilder & response_builder()
+{
+    pthread_once(&builder_key_once, &create_builder_key);
+
+    auto builder = static_cast<fb::FlatBufferBuilder *>(
+            pthread_getspecific(builder_key));
+    if (!builder) {
+        builder = new fb::FlatBufferBuilder(RESPONSE_BUILDER_SIZE);
+        pthread_setspecific(builder_key, builder);
+    }
+
+    builder->Clear();
+    return *builder;
+}
+
+static bool v2_send_response(const HandlerContext &ctx,
+                             const fb::FlatBufferBuilder &builder)
+{
+    if (ctx.output) {
+        queue_bytes(ctx.output, builder.GetBufferPointer(), builder.GetSize());
+        return true;
+    }
+
     return util::socket_write_bytes(
-            fd, builder.GetBufferPointer(), builder.GetSize());
+            ctx.fd, builder.GetBufferPointer(), builder.GetSize());
 }
 
-static bool v2_send_generic_response(int fd, v2::ResponseType type)
+static bool v2_send_generic_response(const HandlerContext &ctx,
+                                     v2::ResponseType type)
 {
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
     v2::ResponseBuilder rb(builder);
     rb.add_type(type);
     builder.Finish(rb.Finish());
-    return v2_send_response(fd, builder);
+    return v2_send_response(ctx, builder);
 }
 
-static bool v2_get_version(int fd, const v2::Request *msg)
+static bool v2_get_version(const HandlerContext &ctx,
+                           const v2::Request *msg)
 {
     auto request = msg->get_version_request();
     if (!request) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
 
     // Get version
     auto version = builder.CreateString(MBP_VERSION);
@@ -116,17 +227,18 @@ static bool v2_get_version(int fd, const v2::Request *msg)
     rb.add_get_version_response(response);
     builder.Finish(rb.Finish());
 
-    return v2_send_response(fd, builder);
+    return v2_send_response(ctx, builder);
 }
 
-static bool v2_get_roms_list(int fd, const v2::Request *msg)
+static bool v2_get_roms_list(const HandlerContext &ctx,
+                             const v2::Request *msg)
 {
     auto request = msg->get_roms_list_request();
     if (!request) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
 
     Roms roms;
     roms.add_installed();
@@ -145,11 +257,8 @@ static bool v2_get_roms_list(int fd, const v2::Request *msg)
         fb::Offset<fb::String> fb_version;
         fb::Offset<fb::String> fb_build;
 
-        std::string build_prop(system_path);
-        build_prop += "/build.prop";
-
         std::unordered_map<std::string, std::string> properties;
-        util::file_get_all_properties(build_prop, &properties);
+        Roms::get_build_properties(r, &properties);
 
         if (properties.find("ro.build.version.release") != properties.end()) {
             const std::string &version = properties["ro.build.version.release"];
@@ -180,17 +289,18 @@ static bool v2_get_roms_list(int fd, const v2::Request *msg)
     rb.add_get_roms_list_response(response);
     builder.Finish(rb.Finish());
 
-    return v2_send_response(fd, builder);
+    return v2_send_response(ctx, builder);
 }
 
-static bool v2_get_builtin_rom_ids(int fd, const v2::Request *msg)
+static bool v2_get_builtin_rom_ids(const HandlerContext &ctx,
+                                   const v2::Request *msg)
 {
     auto request = msg->get_builtin_rom_ids_request();
     if (!request) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
 
     std::vector<fb::Offset<fb::String>> ids;
 
@@ -210,17 +320,18 @@ static bool v2_get_builtin_rom_ids(int fd, const v2::Request *msg)
     rb.add_get_builtin_rom_ids_response(response);
     builder.Finish(rb.Finish());
 
-    return v2_send_response(fd, builder);
+    return v2_send_response(ctx, builder);
 }
 
-static bool v2_get_current_rom(int fd, const v2::Request *msg)
+static bool v2_get_current_rom(const HandlerContext &ctx,
+                               const v2::Request *msg)
 {
     auto request = msg->get_current_rom_request();
     if (!request) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
 
     fb::Offset<fb::String> id;
     auto rom = Roms::get_current_rom();
@@ -237,14 +348,15 @@ static bool v2_get_current_rom(int fd, const v2::Request *msg)
     rb.add_get_current_rom_response(response);
     builder.Finish(rb.Finish());
 
-    return v2_send_response(fd, builder);
+    return v2_send_response(ctx, builder);
 }
 
-static bool v2_switch_rom(int fd, const v2::Request *msg)
+static bool v2_switch_rom(const HandlerContext &ctx,
+                          const v2::Request *msg)
 {
     auto request = msg->switch_rom_request();
     if (!request || !request->rom_id() || !request->boot_blockdev()) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
     std::vector<std::string> block_dev_dirs;
@@ -257,7 +369,7 @@ static bool v2_switch_rom(int fd, const v2::Request *msg)
 
     bool force_update_checksums = request->force_update_checksums();
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
 
     SwitchRomResult ret = switch_rom(request->rom_id()->c_str(),
                                      request->boot_blockdev()->c_str(),
@@ -290,17 +402,18 @@ static bool v2_switch_rom(int fd, const v2::Request *msg)
     rb.add_switch_rom_response(response);
     builder.Finish(rb.Finish());
 
-    return v2_send_response(fd, builder);
+    return v2_send_response(ctx, builder);
 }
 
-static bool v2_set_kernel(int fd, const v2::Request *msg)
+static bool v2_set_kernel(const HandlerContext &ctx,
+                          const v2::Request *msg)
 {
     auto request = msg->set_kernel_request();
     if (!request || !request->rom_id() || !request->boot_blockdev()) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
 
     bool success = set_kernel(request->rom_id()->c_str(),
                               request->boot_blockdev()->c_str());
@@ -314,17 +427,18 @@ static bool v2_set_kernel(int fd, const v2::Request *msg)
     rb.add_set_kernel_response(response);
     builder.Finish(rb.Finish());
 
-    return v2_send_response(fd, builder);
+    return v2_send_response(ctx, builder);
 }
 
-static bool v2_reboot(int fd, const v2::Request *msg)
+static bool v2_reboot(const HandlerContext &ctx,
+                      const v2::Request *msg)
 {
     auto request = msg->reboot_request();
     if (!request) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
 
     std::string reboot_arg;
     if (request->arg()) {
@@ -344,14 +458,15 @@ static bool v2_reboot(int fd, const v2::Request *msg)
     rb.add_reboot_response(response);
     builder.Finish(rb.Finish());
 
-    return v2_send_response(fd, builder);
+    return v2_send_response(ctx, builder);
 }
 
-static bool v2_open(int fd, const v2::Request *msg)
+static bool v2_open(const HandlerContext &ctx,
+                    const v2::Request *msg)
 {
     auto request = msg->open_request();
     if (!request || !request->path()) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
     int flags = 0;
@@ -374,7 +489,7 @@ static bool v2_open(int fd, const v2::Request *msg)
         }
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
 
     int ffd = open(request->path()->c_str(), flags, 0666);
     if (ffd < 0) {
@@ -388,7 +503,7 @@ static bool v2_open(int fd, const v2::Request *msg)
         rb.add_open_response(response);
         builder.Finish(rb.Finish());
 
-        return v2_send_response(fd, builder);
+        return v2_send_response(ctx, builder);
     }
 
     auto close_ffd = util::finally([&]{
@@ -404,21 +519,22 @@ static bool v2_open(int fd, const v2::Request *msg)
     rb.add_open_response(response);
     builder.Finish(rb.Finish());
 
-    if (!v2_send_response(fd, builder)) {
+    if (!v2_send_response(ctx, builder)) {
         return false;
     }
 
-    return util::socket_send_fds(fd, { ffd });
+    return util::socket_send_fds(ctx.fd, { ffd });
 }
 
-static bool v2_copy(int fd, const v2::Request *msg)
+static bool v2_copy(const HandlerContext &ctx,
+                    const v2::Request *msg)
 {
     auto request = msg->copy_request();
     if (!request || !request->source() || !request->target()) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
 
     fb::Offset<v2::CopyResponse> response;
 
@@ -436,24 +552,25 @@ static bool v2_copy(int fd, const v2::Request *msg)
     rb.add_copy_response(response);
     builder.Finish(rb.Finish());
 
-    return v2_send_response(fd, builder);
+    return v2_send_response(ctx, builder);
 }
 
-static bool v2_chmod(int fd, const v2::Request *msg)
+static bool v2_chmod(const HandlerContext &ctx,
+                     const v2::Request *msg)
 {
     auto request = msg->chmod_request();
     if (!request || !request->path()) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
     // Don't allow setting setuid or setgid permissions
     uint32_t mode = request->mode();
     uint32_t masked = mode & (S_IRWXU | S_IRWXG | S_IRWXO);
     if (masked != mode) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
 
     fb::Offset<v2::ChmodResponse> response;
 
@@ -470,14 +587,15 @@ static bool v2_chmod(int fd, const v2::Request *msg)
     rb.add_chmod_response(response);
     builder.Finish(rb.Finish());
 
-    return v2_send_response(fd, builder);
+    return v2_send_response(ctx, builder);
 }
 
-static bool v2_wipe_rom(int fd, const v2::Request *msg)
+static bool v2_wipe_rom(const HandlerContext &ctx,
+                        const v2::Request *msg)
 {
     auto request = msg->wipe_rom_request();
     if (!request || !request->rom_id()) {
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
     // Find and verify ROM is installed
@@ -488,14 +606,14 @@ static bool v2_wipe_rom(int fd, const v2::Request *msg)
     if (!rom) {
         LOGE("Tried to wipe non-installed or invalid ROM ID: %s",
              request->rom_id()->c_str());
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
     // The GUI should check this, but we'll enforce it here
     auto current_rom = Roms::get_current_rom();
     if (current_rom && current_rom->id == rom->id) {
         LOGE("Cannot wipe currently booted ROM: %s", rom->id.c_str());
-        return v2_send_generic_response(fd, v2::ResponseType_INVALID);
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
     // Wipe the selected targets
@@ -512,16 +630,19 @@ static bool v2_wipe_rom(int fd, const v2::Request *msg)
         for (short target : *request->targets()) {
             bool success = false;
 
-            if (target == v2::WipeTarget_SYSTEM) {
-                success = wipe_system(rom);
+            if (request_cancelled(ctx)) {
+                // Don't start wiping anything else once the client is gone
+                LOGW("Request cancelled; skipping wipe target %d", target);
+            } else if (target == v2::WipeTarget_SYSTEM) {
+                success = wipe_system(rom, true);
             } else if (target == v2::WipeTarget_CACHE) {
-                success = wipe_cache(rom);
+                success = wipe_cache(rom, true);
             } else if (target == v2::WipeTarget_DATA) {
-                success = wipe_data(rom);
+                success = wipe_data(rom, true);
             } else if (target == v2::WipeTarget_DALVIK_CACHE) {
-                success = wipe_dalvik_cache(rom);
+                success = wipe_dalvik_cache(rom, true);
             } else if (target == v2::WipeTarget_MULTIBOOT) {
-                success = wipe_multiboot(rom);
+                success = wipe_multiboot(rom, true);
             } else {
                 LOGE("Unknown wipe target %d", target);
             }
@@ -534,7 +655,7 @@ static bool v2_wipe_rom(int fd, const v2::Request *msg)
         }
     }
 
-    fb::FlatBufferBuilder builder;
+    fb::FlatBufferBuilder &builder = response_builder();
 
     // Create response
     auto fb_succeeded = builder.CreateVector(succeeded);
@@ -547,66 +668,222 @@ static bool v2_wipe_rom(int fd, const v2::Request *msg)
     rb.add_wipe_rom_response(response);
     builder.Finish(rb.Finish());
 
-    return v2_send_response(fd, builder);
+    return v2_send_response(ctx, builder);
 }
 
-static bool connection_version_2(int fd)
+// Running transfers by ID so that they can be cancelled from any connection
+static pthread_mutex_t transfers_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::unordered_map<uint32_t, Transfer *> transfers;
+static uint32_t next_transfer_id = 1;
+
+struct TransferContext
 {
-    std::string command;
+    const HandlerContext *handler;
+    uint32_t id;
+};
 
-    while (1) {
-        std::vector<uint8_t> data;
-        if (!util::socket_read_bytes(fd, &data)) {
-            return false;
-        }
+static fb::Offset<v2::TransferProgress>
+v2_create_transfer_progress(fb::FlatBufferBuilder &builder,
+                            const Transfer::Stats &stats)
+{
+    return v2::CreateTransferProgress(builder, stats.bytes, stats.total_bytes,
+                                      stats.files, stats.total_files,
+                                      stats.bytes_per_second);
+}
 
-        auto verifier = fb::Verifier(data.data(), data.size());
-        if (!v2::VerifyRequestBuffer(verifier)) {
-            LOGE("Received invalid buffer");
-            return false;
-        }
+static bool v2_transfer_progress(const Transfer::Stats &stats, void *userdata)
+{
+    auto tctx = static_cast<TransferContext *>(userdata);
 
-        const v2::Request *request = v2::GetRequest(data.data());
-
-        // NOTE: A false return value indicates a connection error, not a
-        //       command failure!
-        bool ret = true;
-
-        if (request->type() == v2::RequestType_GET_VERSION) {
-            ret = v2_get_version(fd, request);
-        } else if (request->type() == v2::RequestType_GET_ROMS_LIST) {
-            ret = v2_get_roms_list(fd, request);
-        } else if (request->type() == v2::RequestType_GET_BUILTIN_ROM_IDS) {
-            ret = v2_get_builtin_rom_ids(fd, request);
-        } else if (request->type() == v2::RequestType_GET_CURRENT_ROM) {
-            ret = v2_get_current_rom(fd, request);
-        } else if (request->type() == v2::RequestType_SWITCH_ROM) {
-            ret = v2_switch_rom(fd, request);
-        } else if (request->type() == v2::RequestType_SET_KERNEL) {
-            ret = v2_set_kernel(fd, request);
-        } else if (request->type() == v2::RequestType_REBOOT) {
-            ret = v2_reboot(fd, request);
-        } else if (request->type() == v2::RequestType_OPEN) {
-            ret = v2_open(fd, request);
-        } else if (request->type() == v2::RequestType_COPY) {
-            ret = v2_copy(fd, request);
-        } else if (request->type() == v2::RequestType_CHMOD) {
-            ret = v2_chmod(fd, request);
-        } else if (request->type() == v2::RequestType_WIPE_ROM) {
-            ret = v2_wipe_rom(fd, request);
-        } else {
-            // Invalid command; allow further commands
-            ret = v2_send_generic_response(fd, v2::ResponseType_UNSUPPORTED);
-        }
+    // Nobody is listening anymore
+    if (request_cancelled(*tctx->handler)) {
+        return false;
+    }
 
-        if (!ret) {
-            return false;
-        }
+    fb::FlatBufferBuilder &builder = response_builder();
+
+    auto progress = v2_create_transfer_progress(builder, stats);
+    auto response = v2::CreateTransferResponse(
+            builder, tctx->id, false, false, false, 0, progress);
+
+    // Wrap response
+    v2::ResponseBuilder rb(builder);
+    rb.add_type(v2::ResponseType_TRANSFER);
+    rb.add_transfer_response(response);
+    builder.Finish(rb.Finish());
+
+    return v2_send_response(*tctx->handler, builder);
+}
+
+/*!
+ * \brief Copy, hash, or archive multiple files and directories
+ *
+ * Unlike other requests, a transfer is answered with a stream of responses.
+ * Progress responses are sent at the requested interval while the transfer
+ * runs and the last response has finished set to true. The transfer is
+ * cancelled if the client disconnects or if a CANCEL_TRANSFER request with
+ * the transfer's ID is received on another connection.
+ */
+static bool v2_transfer(const HandlerContext &ctx,
+                        const v2::Request *msg)
+{
+    auto request = msg->transfer_request();
+    if (!request || !request->sources()) {
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
     }
 
-    return true;
+    Transfer::Operation op;
+
+    switch (request->operation()) {
+    case v2::TransferOperation_COPY:
+        op = Transfer::Operation::Copy;
+        break;
+    case v2::TransferOperation_HASH:
+        op = Transfer::Operation::Hash;
+        break;
+    case v2::TransferOperation_ARCHIVE:
+        op = Transfer::Operation::Archive;
+        break;
+    default:
+        LOGE("Unknown transfer operation %d", request->operation());
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
+    }
+
+    std::vector<std::string> sources;
+    for (auto const *source : *request->sources()) {
+        sources.push_back(source->c_str());
+    }
+
+    std::string target;
+    if (request->target()) {
+        target = request->target()->c_str();
+    }
+
+    Transfer transfer(op, std::move(sources), std::move(target));
+
+    TransferContext tctx;
+    tctx.handler = &ctx;
+
+    pthread_mutex_lock(&transfers_lock);
+    do {
+        tctx.id = next_transfer_id++;
+    } while (tctx.id == 0 || transfers.find(tctx.id) != transfers.end());
+    transfers[tctx.id] = &transfer;
+    pthread_mutex_unlock(&transfers_lock);
+
+    auto unregister = util::finally([&] {
+        pthread_mutex_lock(&transfers_lock);
+        transfers.erase(tctx.id);
+        pthread_mutex_unlock(&transfers_lock);
+    });
+
+    bool success = transfer.run(request->progress_interval_ms(),
+                                &v2_transfer_progress, &tctx);
+
+    fb::FlatBufferBuilder &builder = response_builder();
+
+    std::vector<fb::Offset<v2::FileHash>> fb_hashes;
+    for (const Transfer::FileHash &hash : transfer.hashes()) {
+        auto fb_path = builder.CreateString(hash.path);
+        auto fb_sha512 = builder.CreateString(hash.sha512);
+        fb_hashes.push_back(v2::CreateFileHash(builder, fb_path, fb_sha512));
+    }
+
+    fb::Offset<fb::String> fb_error;
+    if (!success) {
+        fb_error = builder.CreateString(transfer.error());
+    }
+
+    auto fb_hashes_vec = builder.CreateVector(fb_hashes);
+    auto progress = v2_create_transfer_progress(builder, transfer.stats());
+    auto response = v2::CreateTransferResponse(
+            builder, tctx.id, true, success, transfer.cancelled(), fb_error,
+            progress, fb_hashes_vec);
+
+    // Wrap response
+    v2::ResponseBuilder rb(builder);
+    rb.add_type(v2::ResponseType_TRANSFER);
+    rb.add_transfer_response(response);
+    builder.Finish(rb.Finish());
+
+    return v2_send_response(ctx, builder);
+}
+
+static bool v2_cancel_transfer(const HandlerContext &ctx,
+                               const v2::Request *msg)
+{
+    auto request = msg->cancel_transfer_request();
+    if (!request) {
+        return v2_send_generic_response(ctx, v2::ResponseType_INVALID);
+    }
+
+    bool found = false;
+
+    pthread_mutex_lock(&transfers_lock);
+    auto it = transfers.find(request->id());
+    if (it != transfers.end()) {
+        it->second->cancel();
+        found = true;
+    }
+    pthread_mutex_unlock(&transfers_lock);
+
+    if (!found) {
+        LOGW("Tried to cancel non-existent transfer %u", request->id());
+    }
+
+    fb::FlatBufferBuilder &builder = response_builder();
+
+    auto response = v2::CreateCancelTransferResponse(builder, found);
+
+    // Wrap response
+    v2::ResponseBuilder rb(builder);
+    rb.add_type(v2::ResponseType_CANCEL_TRANSFER);
+    rb.add_cancel_transfer_response(response);
+    builder.Finish(rb.Finish());
+
+    return v2_send_response(ctx, builder);
+}
+
+struct RequestHandler
+{
+    v2::RequestType type;
+    bool (*fn)(const HandlerContext &ctx, const v2::Request *msg);
+    // Whether the request may block and must run on a worker thread
+    bool blocking;
+    // Whether the request modifies ROMs or the boot partition and must not
+    // run concurrently with another such request
+    bool exclusive;
+};
+
+static RequestHandler request_handlers[] = {
+    { v2::RequestType_GET_VERSION,         v2_get_version,         false, false },
+    { v2::RequestType_GET_ROMS_LIST,       v2_get_roms_list,       true,  false },
+    { v2::RequestType_GET_BUILTIN_ROM_IDS, v2_get_builtin_rom_ids, false, false },
+    { v2::RequestType_GET_CURRENT_ROM,     v2_get_current_rom,     false, false },
+    { v2::RequestType_SWITCH_ROM,          v2_switch_rom,          true,  true  },
+    { v2::RequestType_SET_KERNEL,          v2_set_kernel,          true,  true  },
+    { v2::RequestType_REBOOT,              v2_reboot,              true,  false },
+    { v2::RequestType_OPEN,                v2_open,                true,  false },
+    { v2::RequestType_COPY,                v2_copy,                true,  false },
+    { v2::RequestType_CHMOD,               v2_chmod,               true,  false },
+    { v2::RequestType_WIPE_ROM,            v2_wipe_rom,            true,  true  },
+    { v2::RequestType_TRANSFER,            v2_transfer,            true,  false },
+    { v2::RequestType_CANCEL_TRANSFER,     v2_cancel_transfer,     false, false },
+};
+
+static const RequestHandler * find_request_handler(v2::RequestType type)
+{
+    for (const RequestHandler &handler : request_handlers) {
+        if (handler.type == type) {
+            return &handler;
+        }
+    }
+    return nullptr;
 }
 
+// Serializes requests that modify ROMs or the boot partition
+static pthread_mutex_t exclusive_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static bool verify_credentials(uid_t uid)
 {
     // Rely on the OS for signature checking and simply compare strings in
@@ -648,71 +925,630 @@ static bool verify_credentials(uid_t uid)
     return false;
 }
 
-static bool client_connection(int fd)
+enum class ClientState
 {
-    bool ret = true;
-    auto fail = util::finally([&] {
-        if (!ret) {
-            LOGE("Killing connection");
-        }
-    });
+    // Credentials are being verified on a worker thread
+    VERIFYING,
+    // Waiting for the interface version
+    AWAITING_VERSION,
+    // Waiting for the next request
+    READY,
+    // A request is running on a worker thread
+    BUSY
+};
+
+struct Client
+{
+    int fd;
+    ClientState state;
+    // Receive buffer, which is reused for the lifetime of the connection.
+    // Bytes in [buf_begin, buf_end) have not been parsed yet.
+    std::vector<uint8_t> buf;
+    size_t buf_begin;
+    size_t buf_end;
+    // Responses produced on the event loop thread that have not been sent.
+    // Bytes in [out_begin, out.size()) are pending. Workers write directly to
+    // the socket, but only while this is empty, so responses stay in order.
+    std::vector<uint8_t> out;
+    size_t out_begin;
+    // Set if the client disconnects while a job is running
+    std::atomic_bool cancelled;
+    // Whether the socket is in the epoll set
+    bool watched;
+
+    Client(int fd_)
+        : fd(fd_), state(ClientState::VERIFYING), buf_begin(0), buf_end(0),
+          out_begin(0), cancelled(false), watched(false)
+    {
+    }
 
-    LOGD("Accepted connection from %d", fd);
+    bool has_output() const
+    {
+        return out_begin < out.size();
+    }
+};
 
+typedef std::shared_ptr<Client> ClientPtr;
+
+static bool client_verify(int fd)
+{
     struct ucred cred;
     socklen_t cred_len = sizeof(struct ucred);
 
     if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0) {
         LOGE("Failed to get socket credentials: %s", strerror(errno));
-        return ret = false;
+        return false;
     }
 
     LOGD("Client PID: %u", cred.pid);
     LOGD("Client UID: %u", cred.uid);
     LOGD("Client GID: %u", cred.gid);
 
-    if (verify_credentials(cred.uid)) {
-        if (!util::socket_write_string(fd, RESPONSE_ALLOW)) {
-            LOGE("Failed to send credentials allowed message");
-            return ret = false;
-        }
-    } else {
+    if (!verify_credentials(cred.uid)) {
         if (!util::socket_write_string(fd, RESPONSE_DENY)) {
             LOGE("Failed to send credentials denied message");
         }
-        return ret = false;
+        return false;
+    }
+
+    if (!util::socket_write_string(fd, RESPONSE_ALLOW)) {
+        LOGE("Failed to send credentials allowed message");
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Serves all clients from a single event loop
+ *
+ * Connections are multiplexed with epoll. The handshake and the FlatBuffers
+ * framing are parsed on the event loop thread and requests that may block are
+ * run on a thread pool. Each connection still handles one request at a time,
+ * so the protocol is unchanged. If a client disconnects while its request is
+ * queued or running, the request is cancelled.
+ *
+ * Clients may pipeline requests by sending several of them before reading
+ * the responses. They are handled in order and the responses are sent in the
+ * same order. Requests are parsed in place in the connection's receive
+ * buffer, which isn't touched while a request is running.
+ *
+ * The event loop thread never blocks on a client. Responses produced on it
+ * (the handshake and requests that don't block) are queued and sent as the
+ * socket becomes writable. No further requests are parsed while a client has
+ * queued output, so a client that doesn't read its responses stops being
+ * served instead of growing the queue.
+ */
+class DaemonServer
+{
+public:
+    DaemonServer(int listen_fd);
+    ~DaemonServer();
+
+    bool run();
+
+private:
+    struct Completion
+    {
+        ClientPtr client;
+        bool ret;
+    };
+
+    int _listen_fd;
+    int _epoll_fd = -1;
+    // Signalled by the workers when a job finishes
+    int _event_fd = -1;
+    std::unordered_map<int, ClientPtr> _clients;
+
+    pthread_mutex_t _mutex;
+    // Finished jobs (protected by _mutex)
+    std::vector<Completion> _completed;
+
+    // Declared last so the workers stop before anything else is destroyed
+    util::ThreadPool _pool;
+
+    bool watch(const ClientPtr &client, uint32_t events);
+    void unwatch(const ClientPtr &client);
+    void close_client(const ClientPtr &client);
+
+    void accept_clients();
+    void handle_client(const ClientPtr &client, uint32_t events);
+    bool read_client(const ClientPtr &client, bool *eof);
+    bool flush_output(const ClientPtr &client);
+    bool process_input(const ClientPtr &client);
+    bool dispatch_request(const ClientPtr &client,
+                          const uint8_t *data, size_t size);
+    bool submit_job(const ClientPtr &client, std::function<bool()> fn);
+    void finish_jobs();
+
+    DaemonServer(const DaemonServer &) = delete;
+    DaemonServer & operator=(const DaemonServer &) = delete;
+};
+
+DaemonServer::DaemonServer(int listen_fd)
+    : _listen_fd(listen_fd), _pool(0, MAX_QUEUED_JOBS)
+{
+    pthread_mutex_init(&_mutex, nullptr);
+}
+
+DaemonServer::~DaemonServer()
+{
+    // Unblock workers that are talking to clients and let them finish
+    for (auto const &pair : _clients) {
+        pair.second->cancelled = true;
+        shutdown(pair.first, SHUT_RDWR);
+    }
+
+    _pool.wait();
+
+    for (auto const &pair : _clients) {
+        close(pair.first);
+    }
+    if (_event_fd >= 0) {
+        close(_event_fd);
     }
+    if (_epoll_fd >= 0) {
+        close(_epoll_fd);
+    }
+
+    pthread_mutex_destroy(&_mutex);
+}
 
-    int32_t version;
-    if (!util::socket_read_int32(fd, &version)) {
-        LOGE("Failed to get interface version");
-        return ret = false;
+bool DaemonServer::run()
+{
+    _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (_epoll_fd < 0) {
+        LOGE("Failed to create epoll instance: %s", strerror(errno));
+        return false;
     }
 
-    if (version == 2) {
-        if (!util::socket_write_string(fd, RESPONSE_OK)) {
+    _event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (_event_fd < 0) {
+        LOGE("Failed to create eventfd: %s", strerror(errno));
+        return false;
+    }
+
+    for (int fd : { _listen_fd, _event_fd }) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+
+        if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            LOGE("Failed to add fd %d to epoll set: %s", fd, strerror(errno));
             return false;
         }
+    }
+
+    LOGD("Serving clients with %u worker threads", _pool.threads());
 
-        if (!connection_version_2(fd)) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (true) {
+        int n = epoll_wait(_epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Failed to wait for events: %s", strerror(errno));
+            return false;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            int fd = events[i].data.fd;
+
+            if (fd == _listen_fd) {
+                accept_clients();
+            } else if (fd == _event_fd) {
+                finish_jobs();
+            } else {
+                auto it = _clients.find(fd);
+                if (it != _clients.end()) {
+                    // Keep a reference in case the client is closed
+                    ClientPtr client = it->second;
+                    handle_client(client, events[i].events);
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+bool DaemonServer::watch(const ClientPtr &client, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = client->fd;
+
+    int op = client->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(_epoll_fd, op, client->fd, &ev) < 0) {
+        LOGE("Failed to watch client %d: %s", client->fd, strerror(errno));
+        return false;
+    }
+
+    client->watched = true;
+    return true;
+}
+
+void DaemonServer::unwatch(const ClientPtr &client)
+{
+    if (client->watched) {
+        epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, client->fd, nullptr);
+        client->watched = false;
+    }
+}
+
+void DaemonServer::close_client(const ClientPtr &client)
+{
+    LOGD("Closing connection from %d", client->fd);
+
+    unwatch(client);
+    close(client->fd);
+    _clients.erase(client->fd);
+}
+
+void DaemonServer::accept_clients()
+{
+    while (true) {
+        int fd = accept4(_listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGE("Failed to accept connection on socket: %s",
+                     strerror(errno));
+            }
+            return;
+        }
+
+        LOGD("Accepted connection from %d", fd);
+
+        // Don't let a client that stops reading tie up a worker forever. The
+        // event loop itself only ever writes with MSG_DONTWAIT.
+        struct timeval tv;
+        tv.tv_sec = CLIENT_SEND_TIMEOUT;
+        tv.tv_usec = 0;
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+            LOGW("Failed to set send timeout: %s", strerror(errno));
+        }
+
+        ClientPtr client = std::make_shared<Client>(fd);
+        _clients[fd] = client;
+
+        // Loading packages.xml is slow, so verify the client on a worker
+        if (!submit_job(client, [fd]{ return client_verify(fd); })) {
+            close_client(client);
+        }
+    }
+}
+
+void DaemonServer::handle_client(const ClientPtr &client, uint32_t events)
+{
+    if (events & (EPOLLHUP | EPOLLERR)) {
+        // The client closed the connection, so nobody will read the
+        // responses. A running job is cancelled and the connection is closed
+        // once the job notices and finishes.
+        if (client->state == ClientState::VERIFYING
+                || client->state == ClientState::BUSY) {
+            LOGD("Client %d disconnected; cancelling request", client->fd);
+            client->cancelled = true;
+            unwatch(client);
+        } else {
+            close_client(client);
+        }
+        return;
+    } else if (client->state == ClientState::VERIFYING
+            || client->state == ClientState::BUSY) {
+        return;
+    }
+
+    bool eof = false;
+
+    if (((events & EPOLLIN) && !read_client(client, &eof))
+            || !process_input(client)) {
+        close_client(client);
+    } else if (eof && client->state != ClientState::BUSY
+            && !client->has_output()) {
+        // The client shut down its end after sending its last request. Once
+        // that request finishes and its response is sent, the socket reports
+        // EOF again.
+        close_client(client);
+    }
+}
+
+bool DaemonServer::read_client(const ClientPtr &client, bool *eof)
+{
+    auto &buf = client->buf;
+
+    while (true) {
+        if (client->buf_begin == client->buf_end) {
+            client->buf_begin = client->buf_end = 0;
+        }
+
+        if (buf.size() - client->buf_end < RECV_CHUNK_SIZE) {
+            // Move the unparsed data to the front before growing the buffer
+            if (client->buf_begin > 0) {
+                memmove(buf.data(), buf.data() + client->buf_begin,
+                        client->buf_end - client->buf_begin);
+                client->buf_end -= client->buf_begin;
+                client->buf_begin = 0;
+            }
+            if (buf.size() - client->buf_end < RECV_CHUNK_SIZE) {
+                buf.resize(std::max(buf.size() * 2,
+                                    client->buf_end + RECV_CHUNK_SIZE));
+            }
+        }
+
+        ssize_t n = recv(client->fd, buf.data() + client->buf_end,
+                         buf.size() - client->buf_end, MSG_DONTWAIT);
+        if (n > 0) {
+            client->buf_end += n;
+            if (client->buf_end - client->buf_begin
+                    > sizeof(int32_t) + MAX_REQUEST_SIZE) {
+                // More than a request's worth of data is only possible if
+                // the client pipelines requests. Parse what we have first.
+                return true;
+            }
+        } else if (n == 0) {
+            *eof = true;
+            return true;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        } else {
+            LOGE("Failed to read from client %d: %s",
+                 client->fd, strerror(errno));
+            return false;
+        }
+    }
+}
+
+/*!
+ * \brief Send as much of the client's queued output as possible
+ *
+ * \return False if the connection failed
+ */
+bool DaemonServer::flush_output(const ClientPtr &client)
+{
+    while (client->has_output()) {
+        ssize_t n = send(client->fd, client->out.data() + client->out_begin,
+                         client->out.size() - client->out_begin,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n >= 0) {
+            client->out_begin += n;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return true;
+        } else {
+            LOGE("Failed to write to client %d: %s",
+                 client->fd, strerror(errno));
+            return false;
+        }
+    }
+
+    client->out.clear();
+    client->out_begin = 0;
+    return true;
+}
+
+/*!
+ * \brief Parse and dispatch the received requests
+ *
+ * Unless a request is now running on a worker thread, the socket is watched
+ * for whatever lets the client make progress: writability if responses are
+ * queued or readability otherwise.
+ *
+ * \return False if the connection should be closed
+ */
+bool DaemonServer::process_input(const ClientPtr &client)
+{
+    while (client->state == ClientState::AWAITING_VERSION
+            || client->state == ClientState::READY) {
+        // Nothing else runs until the earlier responses have been sent
+        if (!flush_output(client)) {
+            return false;
+        } else if (client->has_output()) {
+            break;
+        }
+
+        const uint8_t *data = client->buf.data() + client->buf_begin;
+        size_t avail = client->buf_end - client->buf_begin;
+
+        int32_t value;
+        if (avail < sizeof(value)) {
+            return true;
+        }
+        memcpy(&value, data, sizeof(value));
+
+        if (client->state == ClientState::AWAITING_VERSION) {
+            client->buf_begin += sizeof(value);
+
+            if (value != 2) {
+                LOGE("Unsupported interface version: %d", value);
+                // Best effort since the connection is closed anyway
+                queue_bytes(&client->out, RESPONSE_UNSUPPORTED,
+                            strlen(RESPONSE_UNSUPPORTED));
+                flush_output(client);
+                return false;
+            }
+
+            queue_bytes(&client->out, RESPONSE_OK, strlen(RESPONSE_OK));
+
+            client->state = ClientState::READY;
+            continue;
+        }
+
+        // Requests are prefixed with their size
+        if (value < 0 || value > MAX_REQUEST_SIZE) {
+            LOGE("[Version 2] Invalid request size: %d", value);
+            return false;
+        }
+        if (avail - sizeof(value) < static_cast<size_t>(value)) {
+            return true;
+        }
+
+        // The request stays valid until the buffer is read into again, which
+        // doesn't happen until the request finishes
+        client->buf_begin += sizeof(value) + value;
+
+        if (!dispatch_request(client, data + sizeof(value), value)) {
             LOGE("[Version 2] Communication error");
+            return false;
         }
-        return true;
-    } else {
-        LOGE("Unsupported interface version: %d", version);
-        util::socket_write_string(fd, RESPONSE_UNSUPPORTED);
-        return ret = false;
+    }
+
+    if (client->state == ClientState::AWAITING_VERSION
+            || client->state == ClientState::READY) {
+        return watch(client, client->has_output() ? EPOLLOUT : EPOLLIN);
     }
 
     return true;
 }
 
+bool DaemonServer::dispatch_request(const ClientPtr &client,
+                                    const uint8_t *data, size_t size)
+{
+    auto verifier = fb::Verifier(data, size);
+    if (!v2::VerifyRequestBuffer(verifier)) {
+        LOGE("Received invalid buffer");
+        return false;
+    }
+
+    const v2::Request *request = v2::GetRequest(data);
+    const RequestHandler *handler = find_request_handler(request->type());
+
+    // NOTE: A false return value indicates a connection error, not a command
+    //       failure!
+
+    if (!handler || !handler->blocking) {
+        HandlerContext ctx;
+        ctx.fd = client->fd;
+        ctx.output = &client->out;
+        ctx.cancelled = nullptr;
+
+        if (!handler) {
+            // Invalid command; allow further commands
+            return v2_send_generic_response(
+                    ctx, v2::ResponseType_UNSUPPORTED);
+        }
+
+        return handler->fn(ctx, request);
+    }
+
+    HandlerContext ctx;
+    ctx.fd = client->fd;
+    ctx.output = nullptr;
+    // The job holds a reference to the client, so this outlives the handler
+    ctx.cancelled = &client->cancelled;
+
+    client->state = ClientState::BUSY;
+
+    return submit_job(client, [ctx, handler, request]{
+        if (!handler->exclusive) {
+            return handler->fn(ctx, request);
+        }
+
+        pthread_mutex_lock(&exclusive_lock);
+        auto unlock = util::finally([]{
+            pthread_mutex_unlock(&exclusive_lock);
+        });
+
+        // The client may have gone away while waiting for another request
+        if (request_cancelled(ctx)) {
+            return false;
+        }
+
+        return handler->fn(ctx, request);
+    });
+}
+
+/*!
+ * \brief Run \a fn on a worker thread
+ *
+ * Only hangups (which are always reported) are watched until the job
+ * finishes. \a fn is skipped if the client disconnects before the job
+ * starts.
+ *
+ * \return Whether the job was queued
+ */
+bool DaemonServer::submit_job(const ClientPtr &client, std::function<bool()> fn)
+{
+    if (!watch(client, 0)) {
+        return false;
+    }
+
+    bool queued = _pool.try_submit([this, client, fn]{
+        bool ret = false;
+
+        if (!client->cancelled) {
+            ret = fn();
+        }
+
+        pthread_mutex_lock(&_mutex);
+        _completed.push_back({ client, ret });
+        pthread_mutex_unlock(&_mutex);
+
+        uint64_t value = 1;
+        if (write(_event_fd, &value, sizeof(value)) < 0) {
+            LOGE("Failed to signal event loop: %s", strerror(errno));
+        }
+    });
+
+    if (!queued) {
+        LOGE("Too many pending requests; dropping client %d", client->fd);
+    }
+
+    return queued;
+}
+
+void DaemonServer::finish_jobs()
+{
+    uint64_t value;
+    if (read(_event_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        LOGW("Failed to read eventfd: %s", strerror(errno));
+    }
+
+    std::vector<Completion> completed;
+
+    pthread_mutex_lock(&_mutex);
+    completed.swap(_completed);
+    pthread_mutex_unlock(&_mutex);
+
+    for (const Completion &c : completed) {
+        const ClientPtr &client = c.client;
+
+        if (client->cancelled) {
+            close_client(client);
+            continue;
+        } else if (!c.ret) {
+            LOGE("Killing connection");
+            close_client(client);
+            continue;
+        }
+
+        if (client->state == ClientState::VERIFYING) {
+            client->state = ClientState::AWAITING_VERSION;
+        } else {
+            client->state = ClientState::READY;
+        }
+
+        // Handle anything that was received while the job was running
+        if (!process_input(client)) {
+            close_client(client);
+        }
+    }
+}
+
 static bool run_daemon(void)
 {
     int fd;
     struct sockaddr_un addr;
 
-    fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+    fd = socket(AF_LOCAL, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (fd < 0) {
         LOGE("Failed to create socket: %s", strerror(errno));
         return false;
@@ -739,15 +1575,16 @@ static bool run_daemon(void)
         return false;
     }
 
-    if (listen(fd, 3) < 0) {
+    if (listen(fd, LISTEN_BACKLOG) < 0) {
         LOGE("Failed to listen on socket: %s", strerror(errno));
         return false;
     }
 
-    // Eat zombies!
-    // SIG_IGN reaps zombie processes (it's not just a dummy function)
+    // Whoever forks a process waits for it. Don't ignore SIGCHLD because that
+    // makes waitpid() in one worker thread block until the children of all
+    // other threads have exited.
     struct sigaction sa;
-    sa.sa_handler = SIG_IGN;
+    sa.sa_handler = SIG_DFL;
     sigemptyset(&sa.sa_mask);
     sa.sa_flags = 0;
     if (sigaction(SIGCHLD, &sa, 0) < 0) {
@@ -755,27 +1592,17 @@ static bool run_daemon(void)
         return false;
     }
 
-    LOGD("Socket ready, waiting for connections");
-
-    int client_fd;
-    while ((client_fd = accept(fd, nullptr, nullptr)) >= 0) {
-        pid_t child_pid = fork();
-        if (child_pid < 0) {
-            LOGE("Failed to fork: %s", strerror(errno));
-        } else if (child_pid == 0) {
-            bool ret = client_connection(client_fd);
-            close(client_fd);
-            _exit(ret ? EXIT_SUCCESS : EXIT_FAILURE);
-        }
-        close(client_fd);
-    }
-
-    if (client_fd < 0) {
-        LOGE("Failed to accept connection on socket: %s", strerror(errno));
+    // A client disconnecting must not kill the whole daemon
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sa, 0) < 0) {
+        LOGE("Failed to set SIGPIPE handler: %s", strerror(errno));
         return false;
     }
 
-    return true;
+    LOGD("Socket ready, waiting for connections");
+
+    DaemonServer server(fd);
+    return server.run();
 }
 
 __attribute__((noreturn))
@@ -41,6 +41,7 @@
 #include "util/finally.h"
 #include "util/logging.h"
 #include "util/string.h"
+#include "util/time.h"
 
 namespace mb
 {
@@ -448,6 +449,8 @@ int init_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    uint64_t start = util::monotonic_time_ms();
+
     umask(0);
 
     mkdir("/dev", 0755);
@@ -464,7 +467,10 @@ int init_main(int argc, char *argv[])
     open_devnull_stdio();
     util::log_set_logger(std::make_shared<util::KmsgLogger>());
 
-    // Start probing for devices
+    LOGI("Started %" PRIu64 " ms after boot", start);
+
+    // Start probing for devices. Block devices are created first and
+    // mount_fstab() waits for the ones it needs.
     device_init();
 
     std::string fstab = find_fstab();
@@ -488,6 +494,8 @@ int init_main(int argc, char *argv[])
     }
 
     LOGE("Successfully mounted fstab");
+    LOGI("Mounting took %" PRIu64 " ms (%" PRIu64 " ms since boot)",
+         util::monotonic_time_ms() - start, util::monotonic_time_ms());
 
     fix_file_contexts();
     add_mbtool_services();
@@ -17,6 +17,11 @@
 
 #include "initwrapper/devices.h"
 
+#include <atomic>
+#include <unordered_set>
+
+#include <cerrno>
+#include <climits>
 #include <cstdlib>
 #include <cstring>
 
@@ -31,6 +36,8 @@
 #include "initwrapper/util.h"
 #include "util/directory.h"
 #include "util/string.h"
+#include "util/threadpool.h"
+#include "util/time.h"
 
 #define UNUSED __attribute__((__unused__))
 
@@ -45,9 +52,16 @@
 #endif
 
 static int device_fd = -1;
-static volatile bool run_thread = true;
+static std::atomic<bool> run_thread{true};
 static pthread_t thread;
 
+// Serializes uevent handling and protects device_map and platform_names
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+// Signalled after every handled uevent and when block_coldboot_done changes
+static pthread_cond_t device_cond;
+// Whether the block devices that existed at boot have been created
+static bool block_coldboot_done = true;
+
 struct uevent {
     const char *action;
     const char *path;
@@ -682,6 +696,9 @@ void handle_device_fd()
 {
     char msg[UEVENT_MSG_LEN + 2];
     int n;
+
+    pthread_mutex_lock(&device_lock);
+
     while ((n = uevent_kernel_multicast_recv(device_fd, msg, UEVENT_MSG_LEN)) > 0) {
         if (n >= UEVENT_MSG_LEN) {
             // overflow -- discard
@@ -695,7 +712,11 @@ void handle_device_fd()
         parse_event(msg, &uevent);
 
         handle_device_event(&uevent);
+
+        pthread_cond_broadcast(&device_cond);
     }
+
+    pthread_mutex_unlock(&device_lock);
 }
 
 /*
@@ -722,7 +743,7 @@ static void do_coldboot(DIR *d)
         handle_device_fd();
     }
 
-    while ((de = readdir(d))) {
+    while (run_thread && (de = readdir(d))) {
         DIR *d2;
 
         if (de->d_type != DT_DIR || de->d_name[0] == '.') {
@@ -753,12 +774,199 @@ static void coldboot(const char *path)
     }
 }
 
+/*
+ * Block coldboot only pokes the block devices and the platform devices they
+ * hang off of (needed for the /dev/block/platform/<device>/by-name symlinks)
+ * so that the fstab devices can be mounted before the rest of /sys has been
+ * walked. Each disk and its partitions are triggered on a worker thread.
+ * handle_device_fd() serializes the draining, so the socket is still drained
+ * after every poke.
+ */
+
+static bool trigger_uevent(const std::string &path)
+{
+    std::string uevent_path(path);
+    uevent_path += "/uevent";
+
+    int fd = open(uevent_path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    write(fd, "add\n", 4);
+    close(fd);
+    handle_device_fd();
+    return true;
+}
+
+static bool is_platform_device(const std::string &path)
+{
+    std::string subsystem_path(path);
+    subsystem_path += "/subsystem";
+
+    char buf[PATH_MAX];
+    ssize_t n = readlink(subsystem_path.c_str(), buf, sizeof(buf) - 1);
+    if (n < 0) {
+        return false;
+    }
+    buf[n] = '\0';
+
+    const char *name = strrchr(buf, '/');
+    return strcmp(name ? name + 1 : buf, "platform") == 0;
+}
+
+/*
+ * Trigger the platform devices in the path of a block device from the top
+ * down, just like the /sys/devices walk would. add_platform_device() relies
+ * on parents being added before their children.
+ */
+static unsigned int coldboot_platform_parents(const std::string &path,
+                                              std::unordered_set<std::string> *seen)
+{
+    static const std::size_t prefix_len = strlen(SYSFS_PREFIX "/devices");
+    unsigned int count = 0;
+
+    if (path.compare(0, prefix_len, SYSFS_PREFIX "/devices") != 0) {
+        return 0;
+    }
+
+    std::size_t pos = prefix_len;
+    while ((pos = path.find('/', pos + 1)) != std::string::npos) {
+        std::string parent = path.substr(0, pos);
+        if (seen->insert(parent).second && is_platform_device(parent)
+                && trigger_uevent(parent)) {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+static unsigned int coldboot_disk(const std::string &path)
+{
+    unsigned int count = 0;
+
+    if (trigger_uevent(path)) {
+        ++count;
+    }
+
+    DIR *d = opendir(path.c_str());
+    if (!d) {
+        return count;
+    }
+
+    int dfd = dirfd(d);
+    struct dirent *de;
+
+    while (run_thread && (de = readdir(d))) {
+        if (de->d_type != DT_DIR || de->d_name[0] == '.') {
+            continue;
+        }
+
+        // Partitions are the subdirectories with a "partition" attribute
+        std::string partition_attr(de->d_name);
+        partition_attr += "/partition";
+        if (faccessat(dfd, partition_attr.c_str(), F_OK, 0) < 0) {
+            continue;
+        }
+
+        std::string partition_path(path);
+        partition_path += "/";
+        partition_path += de->d_name;
+        if (trigger_uevent(partition_path)) {
+            ++count;
+        }
+    }
+
+    closedir(d);
+
+    return count;
+}
+
+static void block_coldboot()
+{
+    uint64_t start = mb::util::monotonic_time_ms();
+
+    std::vector<std::string> disks;
+
+    DIR *d = opendir(SYSFS_PREFIX "/block");
+    if (d) {
+        struct dirent *de;
+        while ((de = readdir(d))) {
+            if (de->d_name[0] == '.') {
+                continue;
+            }
+
+            std::string link(SYSFS_PREFIX "/block/");
+            link += de->d_name;
+
+            char *path = realpath(link.c_str(), nullptr);
+            if (path) {
+                disks.push_back(path);
+                free(path);
+            }
+        }
+        closedir(d);
+    }
+
+    // Platform devices must be added in order and before the block devices
+    std::unordered_set<std::string> seen;
+    unsigned int platform_count = 0;
+    for (const std::string &disk : disks) {
+        platform_count += coldboot_platform_parents(disk, &seen);
+    }
+
+    std::atomic<unsigned int> block_count(0);
+    {
+        mb::util::ThreadPool pool(mb::util::ThreadPool::default_threads(),
+                                  disks.size() + 1);
+        for (const std::string &disk : disks) {
+            pool.submit([&disk, &block_count]{
+                if (run_thread) {
+                    block_count += coldboot_disk(disk);
+                }
+            });
+        }
+        pool.wait();
+    }
+
+    pthread_mutex_lock(&device_lock);
+    block_coldboot_done = true;
+    pthread_cond_broadcast(&device_cond);
+    pthread_mutex_unlock(&device_lock);
+
+#if UEVENT_LOGGING
+    LOGI("Block coldboot triggered %u block devices and %u platform devices"
+         " in %" PRIu64 " ms", block_count.load(), platform_count,
+         mb::util::monotonic_time_ms() - start);
+#endif
+}
+
 void * device_thread(void *)
 {
     struct pollfd ufd;
     ufd.events = POLLIN;
     ufd.fd = get_device_fd();
 
+    block_coldboot();
+
+    // The block devices are already taken care of, so the rest of the
+    // coldboot can happen while the fstab partitions are being mounted
+    uint64_t start = mb::util::monotonic_time_ms();
+
+    coldboot("/sys/class");
+    coldboot("/sys/block");
+    coldboot("/sys/devices");
+
+#if UEVENT_LOGGING
+    if (run_thread) {
+        LOGI("Coldboot finished in %" PRIu64 " ms",
+             mb::util::monotonic_time_ms() - start);
+    } else {
+        LOGI("Coldboot interrupted after %" PRIu64 " ms",
+             mb::util::monotonic_time_ms() - start);
+    }
+#endif
+
     while (run_thread) {
         ufd.revents = 0;
         if (poll(&ufd, 1, -1) <= 0) {
@@ -783,16 +991,36 @@ void device_init()
     fcntl(device_fd, F_SETFD, FD_CLOEXEC);
     fcntl(device_fd, F_SETFL, O_NONBLOCK);
 
-    coldboot("/sys/class");
-    coldboot("/sys/block");
-    coldboot("/sys/devices");
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&device_cond, &attr);
+    pthread_condattr_destroy(&attr);
 
+    // Coldboot happens on the device thread so that the caller can go on
+    // and wait for only the devices it needs with wait_for_device()
     run_thread = true;
-    pthread_create(&thread, nullptr, &device_thread, nullptr);
+    block_coldboot_done = false;
+
+    int ret = pthread_create(&thread, nullptr, &device_thread, nullptr);
+    if (ret != 0) {
+#if UEVENT_LOGGING
+        LOGE("Failed to create device thread: %s", strerror(ret));
+#endif
+        block_coldboot_done = true;
+        close(device_fd);
+        device_fd = -1;
+    }
 }
 
 void device_close()
 {
+    if (device_fd < 0) {
+        return;
+    }
+
+    // This also stops the coldboot if it hasn't finished yet. The real init
+    // will do its own coldboot anyway.
     run_thread = false;
     pthread_join(thread, nullptr);
 
@@ -805,7 +1033,63 @@ int get_device_fd()
     return device_fd;
 }
 
-const std::unordered_map<std::string, std::string> * get_devices_map()
+/*
+ * Wait for a device node or symlink to appear. If the block coldboot is still
+ * running, this waits until it has finished. Afterwards, it waits up to
+ * timeout_ms milliseconds for devices that show up late.
+ */
+bool wait_for_device(const char *path, unsigned int timeout_ms)
+{
+    if (device_fd < 0) {
+        return access(path, F_OK) == 0;
+    }
+
+    // The timeout starts once the block coldboot has finished
+    bool have_deadline = false;
+    struct timespec ts;
+
+    bool found;
+
+    pthread_mutex_lock(&device_lock);
+
+    while (!(found = access(path, F_OK) == 0)) {
+        if (!block_coldboot_done) {
+            pthread_cond_wait(&device_cond, &device_lock);
+            continue;
+        }
+
+        if (!have_deadline) {
+            uint64_t deadline = mb::util::monotonic_time_ms() + timeout_ms;
+            ts.tv_sec = deadline / 1000;
+            ts.tv_nsec = (deadline % 1000) * 1000000;
+            have_deadline = true;
+        }
+
+        if (pthread_cond_timedwait(
+                &device_cond, &device_lock, &ts) == ETIMEDOUT) {
+            found = access(path, F_OK) == 0;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&device_lock);
+
+    return found;
+}
+
+void wait_for_block_coldboot()
+{
+    pthread_mutex_lock(&device_lock);
+    while (!block_coldboot_done) {
+        pthread_cond_wait(&device_cond, &device_lock);
+    }
+    pthread_mutex_unlock(&device_lock);
+}
+
+std::unordered_map<std::string, std::string> get_devices_map()
 {
-    return &device_map;
+    pthread_mutex_lock(&device_lock);
+    std::unordered_map<std::string, std::string> map(device_map);
+    pthread_mutex_unlock(&device_lock);
+    return map;
 }
@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <string>
 #include <unordered_map>
 
 #include <sys/stat.h>
@@ -26,4 +27,7 @@ void device_init();
 void device_close();
 int get_device_fd();
 
-const std::unordered_map<std::string, std::string> * get_devices_map();
+bool wait_for_device(const char *path, unsigned int timeout_ms);
+void wait_for_block_coldboot();
+
+std::unordered_map<std::string, std::string> get_devices_map();
@@ -52,14 +52,17 @@
 #include "util/copy.h"
 #include "util/delete.h"
 #include "util/directory.h"
+#include "util/ext4image.h"
 #include "util/file.h"
 #include "util/finally.h"
 #include "util/logging.h"
 #include "util/loopdev.h"
 #include "util/mount.h"
+#include "util/overlay.h"
 #include "util/properties.h"
 #include "util/selinux.h"
 #include "util/string.h"
+#include "util/tee.h"
 
 
 // Set to 1 to spawn a shell after installation
@@ -88,6 +91,10 @@ const std::string Installer::UPDATE_BINARY =
 const std::string Installer::MULTIBOOT_BBWRAPPER = "multiboot/bb-wrapper.sh";
 const std::string Installer::MULTIBOOT_INFO_PROP = "multiboot/info.prop";
 const std::string Installer::TEMP_SYSTEM_IMAGE = "/data/.system.img.tmp";
+// wipe_directory() never deletes /data/multiboot, so the upper directory
+// survives zips that wipe /data
+const std::string Installer::TEMP_SYSTEM_OVERLAY =
+        "/data/multiboot/.system.overlay.tmp";
 const std::string Installer::CANCELLED = "cancelled";
 
 typedef std::unique_ptr<std::FILE, int (*)(std::FILE *)> file_ptr;
@@ -99,7 +106,10 @@ Installer::Installer(std::string zip_file, std::string chroot_dir,
     _chroot(std::move(chroot_dir)),
     _temp(std::move(temp_dir)),
     _interface(interface),
-    _output_fd(output_fd)
+    _output_fd(output_fd),
+    _system_is_overlay(false),
+    _overlay_upper_dev(0),
+    _overlay_upper_ino(0)
 {
     _passthrough = _output_fd >= 0;
 
@@ -288,7 +298,8 @@ bool Installer::create_chroot()
     if (!log_copy_dir("/sbin", in_chroot("/sbin"),
                       util::COPY_ATTRIBUTES
                     | util::COPY_XATTRS
-                    | util::COPY_EXCLUDE_TOP_LEVEL)) {
+                    | util::COPY_EXCLUDE_TOP_LEVEL
+                    | util::COPY_PARALLEL)) {
         return false;
     }
 
@@ -439,12 +450,10 @@ bool Installer::create_image(const std::string &path, uint64_t size)
             LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
             return false;
         } else {
-            std::string size_str = util::format("%" PRIu64, size);
-
-            LOGD("%s: Creating new %s ext4 image", path.c_str(), size_str.c_str());
+            LOGD("%s: Creating new %" PRIu64 " ext4 image", path.c_str(), size);
 
             // Create new image
-            if (run_command({ "make_ext4fs", "-l", size_str, path }) != 0) {
+            if (!util::ext4_image_create(path, size)) {
                 LOGE("%s: Failed to create image", path.c_str());
                 return false;
             }
@@ -492,15 +501,10 @@ bool Installer::system_image_copy(const std::string &source,
         return false;
     }
 
-    loopdev = util::loopdev_find_unused();
+    loopdev = util::loopdev_attach(image, 0, util::LOOPDEV_DIRECT_IO);
     if (loopdev.empty()) {
-        LOGE("Failed to find unused loop device: %s", strerror(errno));
-        return false;
-    }
-
-    if (!util::loopdev_set_up_device(loopdev, image, 0, 0)) {
-        LOGE("Failed to set up loop device %s: %s",
-             loopdev.c_str(), strerror(errno));
+        LOGE("Failed to set up loop device for %s: %s",
+             image.c_str(), strerror(errno));
         return false;
     }
 
@@ -537,6 +541,112 @@ bool Installer::system_image_copy(const std::string &source,
     return true;
 }
 
+/*!
+ * \brief Mount an overlay of the system directory at /system in the chroot
+ *
+ * The system directory is the read-only lower layer and the updater's changes
+ * are written to an upper directory in /data/multiboot. Unlike the temporary
+ * image, this doesn't require copying /system before and after the
+ * installation.
+ *
+ * \return Whether the overlay was mounted. If not, nothing needs to be cleaned
+ *         up and the temporary image should be used instead.
+ */
+bool Installer::mount_system_overlay()
+{
+    if (!util::overlay_supported()) {
+        LOGV("Kernel does not support overlayfs");
+        return false;
+    }
+
+    // A successful commit below clears this
+    if (util::overlay_commit_interrupted(_system_path)) {
+        display_msg(util::format("Warning: A previous installation was "
+                                 "interrupted while committing changes to %s. "
+                                 "The system may be incomplete.",
+                                 _system_path.c_str()));
+    }
+
+    std::string upper(TEMP_SYSTEM_OVERLAY + "/upper");
+    std::string work(TEMP_SYSTEM_OVERLAY + "/work");
+
+    util::delete_recursive(TEMP_SYSTEM_OVERLAY);
+
+    if (!util::mkdir_recursive(upper, 0755)
+            || !util::mkdir_recursive(work, 0755)) {
+        LOGE("%s: Failed to create overlay directories: %s",
+             TEMP_SYSTEM_OVERLAY.c_str(), strerror(errno));
+        util::delete_recursive(TEMP_SYSTEM_OVERLAY);
+        return false;
+    }
+
+    struct stat sb;
+    if (lstat(upper.c_str(), &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", upper.c_str(), strerror(errno));
+        util::delete_recursive(TEMP_SYSTEM_OVERLAY);
+        return false;
+    }
+
+    _overlay_upper_dev = sb.st_dev;
+    _overlay_upper_ino = sb.st_ino;
+
+    if (!util::overlay_mount(_system_path, upper, work, in_chroot("/system"))) {
+        util::delete_recursive(TEMP_SYSTEM_OVERLAY);
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Unmount the system overlay and apply the changes to the system
+ *        directory
+ */
+bool Installer::commit_system_overlay()
+{
+    display_msg("Committing changes to system");
+
+    if (umount(in_chroot("/system").c_str()) < 0) {
+        display_msg(util::format("Failed to unmount %s: %s",
+                                 in_chroot("/system").c_str(),
+                                 strerror(errno)));
+        return false;
+    }
+
+    // If the upper directory was deleted or replaced during the installation
+    // (eg. by something that wiped /data), it no longer holds the changes and
+    // committing it would apply a partial or unrelated set of changes
+    std::string upper(TEMP_SYSTEM_OVERLAY + "/upper");
+    struct stat sb;
+    if (lstat(upper.c_str(), &sb) < 0 || !S_ISDIR(sb.st_mode)
+            || sb.st_dev != _overlay_upper_dev
+            || sb.st_ino != _overlay_upper_ino) {
+        display_msg(util::format("%s was removed or replaced during the "
+                                 "installation", upper.c_str()));
+        return false;
+    }
+
+    util::OverlayCommitStats stats;
+    util::OverlayCommitResult result =
+            util::overlay_commit(upper, _system_path, &stats);
+    if (result == util::OverlayCommitResult::INCOMPLETE) {
+        display_msg(util::format("Changes were only partially committed to "
+                                 "%s. The system is incomplete and the ROM "
+                                 "must be reinstalled.",
+                                 _system_path.c_str()));
+        return false;
+    } else if (result != util::OverlayCommitResult::SUCCEEDED) {
+        display_msg(util::format("Failed to commit changes to %s",
+                                 _system_path.c_str()));
+        return false;
+    }
+
+    display_msg(util::format("- Updated %" PRIu64 " paths, removed %" PRIu64
+                             " paths", stats.committed, stats.deleted));
+
+    return true;
+}
+
 /*!
  * \brief Run real update-binary in the chroot
  */
@@ -1104,21 +1214,34 @@ Installer::ProceedState Installer::install_stage_set_up_chroot()
 {
     LOGD("[Installer] Chroot set up stage");
 
-    // Calculate SHA1 hash of the boot partition
-    if (!util::sha1_hash(_boot_block_dev, _boot_hash)) {
-        display_msg("Failed to compute sha1sum of boot partition");
+    // Calculate SHA1 hash of the boot partition and save a copy of the boot
+    // image that we'll restore if the installation fails. Both are done while
+    // reading the partition once.
+    std::string boot_backup(_temp + "/boot.orig");
+    int fd_boot_backup = open(boot_backup.c_str(),
+                              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd_boot_backup < 0) {
+        LOGE("%s: Failed to open: %s", boot_backup.c_str(), strerror(errno));
+        display_msg("Failed to backup boot partition");
         return ProceedState::Fail;
     }
 
-    std::string digest = util::hex_string(_boot_hash, SHA_DIGEST_LENGTH);
-    LOGD("Boot partition SHA1sum: %s", digest.c_str());
+    auto close_fd_boot_backup = util::finally([&] { close(fd_boot_backup); });
+
+    util::Tee boot_tee;
+    boot_tee.add_sha1(_boot_hash);
+    boot_tee.add_fd(fd_boot_backup);
 
-    // Save a copy of the boot image that we'll restore if the installation fails
-    if (!util::copy_contents(_boot_block_dev, _temp + "/boot.orig")) {
+    if (!boot_tee.run_file(_boot_block_dev)) {
+        LOGE("%s: Failed to read: %s",
+             _boot_block_dev.c_str(), strerror(errno));
         display_msg("Failed to backup boot partition");
         return ProceedState::Fail;
     }
 
+    std::string digest = util::hex_string(_boot_hash, SHA_DIGEST_LENGTH);
+    LOGD("Boot partition SHA1sum: %s", digest.c_str());
+
     // Wrap busybox to disable some applets
     if (!set_up_busybox_wrapper()) {
         display_msg("Failed to extract busybox wrapper");
@@ -1226,7 +1349,6 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
 
             display_msg(util::format("Creating initial extsd image (%.1f MiB)",
                                      (double) system_size / 1024 / 1024));
-            display_msg("This may take a while");
 
             if (!util::mkdir_parent(_system_path, 0755)) {
                 display_msg(util::format("Failed to create parent directory of %s",
@@ -1258,6 +1380,11 @@ Installer::ProceedState Installer::install_stage_mount_filesystems()
                                          in_chroot("/system").c_str()));
                 return ProceedState::Fail;
             }
+        } else if (!_has_block_image && mount_system_overlay()) {
+            // Changes go to an overlay upper directory in /data/multiboot and
+            // are committed to the real system directory after the
+            // installation succeeds
+            _system_is_overlay = true;
         } else {
             display_msg("Copying system to temporary image");
 
@@ -1357,12 +1484,16 @@ Installer::ProceedState Installer::install_stage_unmount_filesystems()
         if (ret < 0 || (WEXITSTATUS(ret) != 0 && WEXITSTATUS(ret) != 1)) {
             display_msg("Failed to run e2fsck on image");
         }
+    } else if (_system_is_overlay) {
+        if (!commit_system_overlay()) {
+            return ProceedState::Fail;
+        }
     } else {
         if (_has_block_image || _rom->id == "primary") {
             display_msg("Copying temporary image to system");
 
             // Format system directory
-            if (!wipe_directory(_system_path, true)) {
+            if (!wipe_directory(_system_path, true, false)) {
                 display_msg(util::format("Failed to wipe %s",
                                          _system_path.c_str()));
                 return ProceedState::Fail;
@@ -1386,9 +1517,18 @@ Installer::ProceedState Installer::install_stage_finish()
 {
     LOGD("[Installer] Finalization stage");
 
-    // Calculate SHA1 hash of the boot partition after installation
+    // Calculate SHA1 hash of the boot partition after installation. The image
+    // is kept in memory so it doesn't need to be read again if it changed.
     unsigned char new_hash[SHA_DIGEST_LENGTH];
-    if (!util::sha1_hash(_boot_block_dev, new_hash)) {
+    std::vector<unsigned char> boot_data;
+
+    util::Tee boot_tee;
+    boot_tee.add_sha1(new_hash);
+    boot_tee.add_buffer(&boot_data);
+
+    if (!boot_tee.run_file(_boot_block_dev)) {
+        LOGE("%s: Failed to read: %s",
+             _boot_block_dev.c_str(), strerror(errno));
         display_msg("Failed to compute sha1sum of boot partition");
         return ProceedState::Fail;
     }
@@ -1403,13 +1543,18 @@ Installer::ProceedState Installer::install_stage_finish()
         display_msg("Boot partition was modified. Setting kernel");
 
         mbp::BootImage bi;
-        if (!bi.loadFile(_boot_block_dev)) {
+        if (!bi.load(boot_data)) {
             display_msg("Failed to load boot partition image");
             return ProceedState::Fail;
         }
 
+        // Read the ramdisk straight from the mapped boot image
+        const unsigned char *ramdiskData;
+        std::size_t ramdiskSize;
+        bi.ramdiskImageC(&ramdiskData, &ramdiskSize);
+
         mbp::CpioFile cpio;
-        if (!cpio.load(bi.ramdiskImage())) {
+        if (!cpio.load(ramdiskData, ramdiskSize)) {
             LOGE("Failed to read ramdisk image for adding /romid");
             display_msg("Failed to read ramdisk image");
             return ProceedState::Fail;
@@ -1458,18 +1603,13 @@ Installer::ProceedState Installer::install_stage_finish()
             bi.setTargetType(mbp::BootImage::Type::Loki);
         }
 
-        std::vector<unsigned char> bootimg;
-        bi.create(&bootimg);
         std::string temp_boot_img(_temp);
         temp_boot_img += "/boot.img";
 
         // Backup kernel
 
-        if (!util::file_write_data(temp_boot_img,
-                                   reinterpret_cast<char *>(bootimg.data()),
-                                   bootimg.size())) {
-            LOGE("Failed to write %s: %s",
-                 temp_boot_img.c_str(), strerror(errno));
+        if (!bi.createFile(temp_boot_img)) {
+            LOGE("Failed to write %s", temp_boot_img.c_str());
             display_msg(util::format("Failed to write %s",
                                      temp_boot_img.c_str()));
             return ProceedState::Fail;
@@ -1512,19 +1652,24 @@ Installer::ProceedState Installer::install_stage_finish()
 
         auto close_fd_backup = util::finally([&] { close(fd_backup); });
 
-        if (!util::copy_data_fd(fd_source, fd_boot)) {
-            LOGE("Failed to write %s: %s",
-                 _boot_block_dev.c_str(), strerror(errno));
-            return ProceedState::Fail;
-        }
+        // Write the boot partition and the backup and compute the checksum
+        // while reading the new image once
+        unsigned char digest[SHA512_DIGEST_LENGTH];
 
-        lseek(fd_source, 0, SEEK_SET);
+        util::Tee bootimg_tee;
+        bootimg_tee.add_fd(fd_boot);
+        bootimg_tee.add_fd(fd_backup);
+        bootimg_tee.add_sha512(digest);
 
-        if (!util::copy_data_fd(fd_source, fd_backup)) {
-            LOGE("Failed to write %s: %s", path.c_str(), strerror(errno));
+        if (!bootimg_tee.run(fd_source)) {
+            LOGE("Failed to write %s and %s: %s", _boot_block_dev.c_str(),
+                 path.c_str(), strerror(errno));
             return ProceedState::Fail;
         }
 
+        LOGD("Wrote %" PRIu64 " bytes to %s and %s", bootimg_tee.bytes(),
+             _boot_block_dev.c_str(), path.c_str());
+
         if (fchmod(fd_backup, 0775) < 0) {
             // Non-fatal
             LOGE("%s: Failed to chmod: %s", path.c_str(), strerror(errno));
@@ -1536,14 +1681,12 @@ Installer::ProceedState Installer::install_stage_finish()
         }
 
         // Update checksums
-        unsigned char digest[SHA512_DIGEST_LENGTH];
-        SHA512(bootimg.data(), bootimg.size(), digest);
         std::string hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
 
-        std::unordered_map<std::string, std::string> props;
-        checksums_read(&props);
-        checksums_update(&props, _rom->id, "boot.img", hash);
-        checksums_write(props);
+        Checksums checksums;
+        checksums_read(&checksums);
+        checksums_update(&checksums, _rom->id, "boot.img", hash);
+        checksums_write(checksums);
     }
 
     if (!util::chmod_recursive(MULTIBOOT_DIR, 0775)) {
@@ -1591,6 +1734,10 @@ void Installer::install_stage_cleanup(Installer::ProceedState ret)
                     "reboot into recovery again to avoid flashing issues.");
     }
 
+    // Whatever is left in the upper directory was never committed (the overlay
+    // is unmounted by destroy_chroot())
+    util::delete_recursive(TEMP_SYSTEM_OVERLAY);
+
     on_cleanup(ret);
 
     LOGV("Finished cleanup");
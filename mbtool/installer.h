@@ -23,6 +23,8 @@
 #include <string>
 #include <unordered_map>
 
+#include <sys/types.h>
+
 #include "roms.h"
 #include "util/hash.h"
 
@@ -44,6 +46,7 @@ protected:
     static const std::string MULTIBOOT_BBWRAPPER;
     static const std::string MULTIBOOT_INFO_PROP;
     static const std::string TEMP_SYSTEM_IMAGE;
+    static const std::string TEMP_SYSTEM_OVERLAY;
     static const std::string CANCELLED;
 
     enum class ProceedState {
@@ -87,6 +90,10 @@ protected:
     std::unordered_map<std::string, std::string> _prop;
 
     bool _has_block_image;
+    bool _system_is_overlay;
+    // Identity of the overlay's upper directory when it was mounted
+    dev_t _overlay_upper_dev;
+    ino_t _overlay_upper_ino;
     bool _is_aroma;
 
     std::string in_chroot(const std::string &path) const;
@@ -108,6 +115,8 @@ private:
     bool create_image(const std::string &path, uint64_t size);
     bool system_image_copy(const std::string &source,
                            const std::string &image, bool reverse);
+    bool mount_system_overlay();
+    bool commit_system_overlay();
     bool run_real_updater();
 
     ProceedState install_stage_initialize();
@@ -38,6 +38,7 @@
 #endif
 #include "version.h"
 
+#include "util/delete.h"
 #include "util/logging.h"
 
 
@@ -72,6 +73,7 @@ struct tool tools[] = {
     { "mount_fstab", mb::mount_fstab_main },
     { "sepolpatch", mb::sepolpatch_main },
 #endif
+    { "wipe-trash", mb::util::wipe_trash_main },
     { nullptr, nullptr }
 };
 
@@ -34,6 +34,7 @@
 #include <signal.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -46,18 +47,28 @@
 #include "util/command.h"
 #include "util/copy.h"
 #include "util/directory.h"
+#include "util/ext4image.h"
 #include "util/file.h"
 #include "util/finally.h"
+#include "util/fsprobe.h"
 #include "util/fstab.h"
 #include "util/logging.h"
 #include "util/mount.h"
 #include "util/path.h"
 #include "util/properties.h"
 #include "util/string.h"
+#include "util/time.h"
 
 
 #define EXTSD_MOUNT_POINT "/raw/extsd"
 
+// Same as fs_mgr's timeout for fstab entries with the "wait" flag
+#define DEVICE_WAIT_TIMEOUT_MS 20000
+
+// Writable images with less free space than this are grown at boot
+#define IMAGE_GROW_THRESHOLD_PERCENT 10
+#define IMAGE_GROW_STEP ((uint64_t) 1024 * 1024 * 1024)
+
 
 namespace mb
 {
@@ -86,6 +97,16 @@ static std::shared_ptr<Rom> determine_rom()
     return rom;
 }
 
+static bool has_wait_flag(const util::fstab_rec *rec)
+{
+    for (const std::string &flag : util::tokenize(rec->vold_args, ",")) {
+        if (flag == "wait") {
+            return true;
+        }
+    }
+    return false;
+}
+
 /*!
  * \brief Try mounting each entry in a list of fstab entry until one works.
  *
@@ -134,6 +155,13 @@ static bool create_dir_and_mount(const std::vector<util::fstab_rec *> &recs,
         LOGD("Attempting to mount %s (%s) at %s",
              rec->blk_device.c_str(), rec->fs_type.c_str(), mount_point.c_str());
 
+        // The devices are still being created in the background
+        if (!wait_for_device(rec->blk_device.c_str(),
+                             has_wait_flag(rec) ? DEVICE_WAIT_TIMEOUT_MS : 0)) {
+            LOGE("Block device %s does not exist", rec->blk_device.c_str());
+            continue;
+        }
+
         // Try mounting
         int ret = mount(rec->blk_device.c_str(),
                         mount_point.c_str(),
@@ -265,6 +293,8 @@ static bool mount_fstab_entries(const std::vector<util::fstab_rec *> &system_rec
         LOGE("Failed to mount /raw/system");
         return false;
     }
+    LOGI("Time to first mount: %" PRIu64 " ms since boot",
+         util::monotonic_time_ms());
     if (!create_dir_and_mount(cache_recs, "/raw/cache")) {
         LOGE("Failed to mount /raw/cache");
         return false;
@@ -294,6 +324,20 @@ static void dump(const std::string &line, void *data)
     LOGD("Command output: %s", line.c_str());
 }
 
+static void fsck_exfat(const std::string &source)
+{
+    int ret = util::run_command_cb({
+        "/sbin/fsck.exfat",
+        source
+    }, &dump, nullptr);
+
+    if (ret < 0) {
+        LOGE("Failed to launch /sbin/fsck.exfat: %s", strerror(errno));
+    } else {
+        LOGD("fsck.exfat returned: %d", WEXITSTATUS(ret));
+    }
+}
+
 static bool mount_exfat_fuse(const std::string &source,
                              const std::string &target)
 {
@@ -305,12 +349,6 @@ static bool mount_exfat_fuse(const std::string &source,
         uid = pw->pw_uid;
     }
 
-    // Run filesystem checks
-    util::run_command_cb({
-        "/sbin/fsck.exfat",
-        source
-    }, &dump, nullptr);
-
     // Mount exfat, matching vold options as much as possible
     int ret = util::run_command_cb({
         "/sbin/mount.exfat",
@@ -341,77 +379,77 @@ static bool mount_exfat_fuse(const std::string &source,
     }
 }
 
-static bool mount_exfat_kernel(const std::string &source,
-                               const std::string &target)
+static bool mount_kernel(const std::string &source, const std::string &target,
+                         const char *fs_type)
 {
-    int ret = mount(source.c_str(), target.c_str(), "exfat", 0, "");
+    int ret = mount(source.c_str(), target.c_str(), fs_type, 0, "");
     if (ret < 0) {
         LOGE("Failed to mount %s (%s) at %s: %s",
-             source.c_str(), "exfat", target.c_str(), strerror(errno));
+             source.c_str(), fs_type, target.c_str(), strerror(errno));
         return false;
     } else {
         LOGE("Successfully mounted %s (%s) at %s",
-             source.c_str(), "exfat", target.c_str());
+             source.c_str(), fs_type, target.c_str());
         return true;
     }
 }
 
-static bool mount_vfat(const std::string &source, const std::string &target)
+static bool use_fuse_exfat()
 {
-    int ret = mount(source.c_str(), target.c_str(), "vfat", 0, "");
-    if (ret < 0) {
-        LOGE("Failed to mount %s (%s) at %s: %s",
-             source.c_str(), "vfat", target.c_str(), strerror(errno));
-        return false;
-    } else {
-        LOGE("Successfully mounted %s (%s) at %s",
-             source.c_str(), "vfat", target.c_str());
-        return true;
+    // Ugly hack: CM's vold uses fuse-exfat regardless if the exfat kernel
+    // module is available. CM's init binary has the "exfat" and "EXFAT   "
+    // due to the linking of libblkid. We'll use that fact to determine whether
+    // we're on CM or not.
+    static int result = -1;
+    if (result < 0) {
+        result = util::file_find_one_of("/init.orig", { "EXFAT   ", "exfat" });
     }
+    return result;
 }
 
-static bool mount_ext4(const std::string &source, const std::string &target)
+static bool try_extsd_mount(const std::string &block_dev)
 {
-    int ret = mount(source.c_str(), target.c_str(), "ext4", 0, "");
-    if (ret < 0) {
-        LOGE("Failed to mount %s (%s) at %s: %s",
-             source.c_str(), "ext4", target.c_str(), strerror(errno));
+    // Vold ignores the fstab fstype field and uses blkid to determine the
+    // filesystem. We don't link in blkid, but reading the superblock is
+    // enough for the filesystems that vold supports.
+    util::FsInfo info;
+    if (!util::probe_filesystem(block_dev, &info)) {
         return false;
-    } else {
-        LOGE("Successfully mounted %s (%s) at %s",
-             source.c_str(), "ext4", target.c_str());
-        return true;
     }
-}
 
-static bool try_extsd_mount(const std::string &block_dev)
-{
-    // Vold ignores the fstab fstype field and uses blkid to determine the
-    // filesystem. We don't link in blkid, so we'll use a trial and error
-    // approach.
+    LOGD("%s: Found %s filesystem%s", block_dev.c_str(),
+         util::fs_type_name(info.type), info.dirty ? " (dirty)" : "");
 
-    // Ugly hack: CM's vold uses fuse-exfat regardless if the exfat kernel
-    // module is available. CM's init binary has the "exfat" and "EXFAT   "
-    // due to the linking of libblkid. We'll use that fact to determine whether
-    // we're on CM or not.
-    if (util::file_find_one_of("/init.orig", { "EXFAT   ", "exfat" })) {
-        if (mount_exfat_fuse(block_dev, EXTSD_MOUNT_POINT)) {
-            return true;
-        }
-    } else {
-        if (mount_exfat_kernel(block_dev, EXTSD_MOUNT_POINT)) {
-            return true;
-        }
+    // The ramdisk only has a checker for exfat. Vold will check the others
+    // when it remounts the SD card.
+    if (info.dirty && info.type != util::FsType::Exfat) {
+        LOGW("%s: Mounting without running fsck", block_dev.c_str());
     }
 
-    if (mount_vfat(block_dev, EXTSD_MOUNT_POINT)) {
-        return true;
-    }
-    if (mount_ext4(block_dev, EXTSD_MOUNT_POINT)) {
-        return true;
+    switch (info.type) {
+    case util::FsType::Exfat:
+        if (info.dirty) {
+            fsck_exfat(block_dev);
+        }
+        if (use_fuse_exfat()) {
+            return mount_exfat_fuse(block_dev, EXTSD_MOUNT_POINT);
+        } else {
+            return mount_kernel(block_dev, EXTSD_MOUNT_POINT, "exfat");
+        }
+    case util::FsType::Vfat:
+        return mount_kernel(block_dev, EXTSD_MOUNT_POINT, "vfat");
+    case util::FsType::Ext2:
+    case util::FsType::Ext3:
+    case util::FsType::Ext4:
+        // The ext4 driver handles ext2 and ext3 too
+        return mount_kernel(block_dev, EXTSD_MOUNT_POINT, "ext4");
+    case util::FsType::F2fs:
+        return mount_kernel(block_dev, EXTSD_MOUNT_POINT, "f2fs");
+    case util::FsType::Unknown:
+    default:
+        LOGE("%s: Unsupported filesystem", block_dev.c_str());
+        return false;
     }
-
-    return false;
 }
 
 /*!
@@ -432,13 +470,15 @@ static bool mount_extsd_fstab_entries(const std::vector<util::fstab_rec *> &exts
         return false;
     }
 
-    auto const *devices_map = get_devices_map();
+    // The patterns can match any block device, so all of them must exist
+    wait_for_block_coldboot();
+    auto const devices_map = get_devices_map();
 
     for (const util::fstab_rec *rec : extsd_recs) {
         const std::string &pattern = rec->blk_device;
         bool matched = false;
 
-        for (auto const &pair : *devices_map) {
+        for (auto const &pair : devices_map) {
             if (path_matches(pair.first.c_str(), pattern.c_str())) {
                 matched = true;
                 const std::string &block_dev = pair.second;
@@ -479,6 +519,52 @@ static bool mount_image(const std::string &image,
     return true;
 }
 
+/*!
+ * \brief Grow a writable image if it is almost full
+ *
+ * The image is sparse, so the backing filesystem only needs enough free
+ * space for the new size to be completely filled. Failures aren't fatal.
+ */
+static void grow_image_if_full(const std::string &image,
+                               const std::string &mount_point)
+{
+    struct statvfs sv;
+    if (statvfs(mount_point.c_str(), &sv) < 0 || sv.f_blocks == 0) {
+        return;
+    }
+
+    if (sv.f_bavail * 100 / sv.f_blocks >= IMAGE_GROW_THRESHOLD_PERCENT) {
+        return;
+    }
+
+    struct stat sb;
+    struct statvfs host_sv;
+    if (stat(image.c_str(), &sb) < 0
+            || statvfs(util::dir_name(image).c_str(), &host_sv) < 0) {
+        LOGW("%s: Failed to get image size: %s",
+             image.c_str(), strerror(errno));
+        return;
+    }
+
+    uint64_t new_size = sb.st_size + IMAGE_GROW_STEP;
+    uint64_t needed = new_size - static_cast<uint64_t>(sb.st_blocks) * 512;
+    uint64_t available = static_cast<uint64_t>(host_sv.f_bavail)
+            * host_sv.f_frsize;
+
+    if (available < needed) {
+        LOGW("%s: Image is almost full, but there is not enough space to"
+             " grow it", image.c_str());
+        return;
+    }
+
+    LOGI("%s: Growing almost full image to %" PRIu64 " bytes",
+         image.c_str(), new_size);
+
+    if (!util::ext4_image_grow(image, mount_point, new_size)) {
+        LOGW("%s: Failed to grow image", image.c_str());
+    }
+}
+
 static bool mount_rom(const std::shared_ptr<Rom> &rom)
 {
     std::string target_system = rom->full_system_path();
@@ -506,6 +592,7 @@ static bool mount_rom(const std::shared_ptr<Rom> &rom)
         if (!mount_image(target_cache, "/cache", 0771)) {
             return false;
         }
+        grow_image_if_full(target_cache, "/cache");
     } else {
         if (!util::bind_mount(target_cache, 0771, "/cache", 0771)) {
             return false;
@@ -515,6 +602,7 @@ static bool mount_rom(const std::shared_ptr<Rom> &rom)
         if (!mount_image(target_data, "/data", 0771)) {
             return false;
         }
+        grow_image_if_full(target_data, "/data");
     } else {
         if (!util::bind_mount(target_data, 0771, "/data", 0771)) {
             return false;
@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 
 #include "util/copy.h"
+#include "util/delete.h"
 #include "util/fts.h"
 #include "util/logging.h"
 #include "util/string.h"
@@ -32,79 +33,31 @@
 namespace mb
 {
 
-class WipeDirectory : public util::FTSWrapper {
-public:
-    WipeDirectory(std::string path, bool wipe_media)
-        : FTSWrapper(path, FTS_GroupSpecialFiles),
-        _wipe_media(wipe_media)
-    {
-    }
-
-    virtual int on_changed_path()
-    {
-        // Don't wipe 'multiboot' and 'media' directories on the first level
-        if (_curr->fts_level == 1) {
-            if (strcmp(_curr->fts_name, "multiboot") == 0
-                    || (!_wipe_media && strcmp(_curr->fts_name, "media") == 0)) {
-                return Action::FTS_Skip;
-            }
-        }
-
-        return Action::FTS_OK;
-    }
-
-    virtual int on_reached_directory_pre() override
-    {
-        // Do nothing. Need depth-first search, so directories are deleted
-        // in FTS_DP
-        return Action::FTS_OK;
-    }
-
-    virtual int on_reached_directory_post() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_file() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_symlink() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-    virtual int on_reached_special_file() override
-    {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
-
-private:
-    bool _wipe_media;
-
-    bool delete_path()
-    {
-        if (_curr->fts_level >= 1 && remove(_curr->fts_accpath) < 0) {
-            _error_msg = util::format("%s: Failed to remove: %s",
-                                      _curr->fts_path, strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return false;
-        }
-        return true;
+/*!
+ * \brief Delete the contents of a mountpoint
+ *
+ * The first-level "multiboot" directory is always kept. The first-level
+ * "media" directory is kept unless \a wipe_media is true.
+ *
+ * \param mountpoint Directory to wipe
+ * \param wipe_media Whether to delete the "media" directory
+ * \param background Whether to move the contents into the trash and delete
+ *                   them in the background
+ */
+bool wipe_directory(const std::string &mountpoint, bool wipe_media,
+                    bool background)
+{
+    std::vector<std::string> excludes{ "multiboot" };
+    if (!wipe_media) {
+        excludes.push_back("media");
     }
-};
 
-bool wipe_directory(const std::string &mountpoint, bool wipe_media)
-{
-    struct stat sb;
-    if (stat(mountpoint.c_str(), &sb) < 0 && errno == ENOENT) {
-        // Don't fail if directory does not exist
-        return true;
+    int flags = util::DELETE_CONTENTS_ONLY | util::DELETE_PARALLEL;
+    if (background) {
+        flags |= util::DELETE_IN_BACKGROUND;
     }
 
-    WipeDirectory wd(mountpoint, wipe_media);
-    return wd.run();
+    return util::delete_recursive(mountpoint, flags, excludes, nullptr);
 }
 
 
@@ -150,7 +103,8 @@ public:
         // _target is the correct parameter here (or pathbuf and
         // COPY_EXCLUDE_TOP_LEVEL flag)
         if (!util::copy_dir(_curr->fts_accpath, _target,
-                            util::COPY_ATTRIBUTES | util::COPY_XATTRS)) {
+                            util::COPY_ATTRIBUTES | util::COPY_XATTRS
+                          | util::COPY_PARALLEL)) {
             _error_msg = util::format("%s: Failed to copy directory: %s",
                                       _curr->fts_path, strerror(errno));
             LOGW("%s", _error_msg.c_str());
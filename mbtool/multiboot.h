@@ -24,7 +24,8 @@
 namespace mb
 {
 
-bool wipe_directory(const std::string &mountpoint, bool wipe_media);
+bool wipe_directory(const std::string &mountpoint, bool wipe_media,
+                    bool background);
 bool copy_system(const std::string &source, const std::string &target);
 
 }
\ No newline at end of file
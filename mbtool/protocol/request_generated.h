@@ -102,6 +102,18 @@ struct WipeRomResponse;
 }  // namespace v2
 }  // namespace daemon
 }  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct TransferRequest;
+struct TransferProgress;
+struct FileHash;
+struct TransferResponse;
+struct CancelTransferRequest;
+struct CancelTransferResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
 
 namespace mbtool {
 namespace daemon {
@@ -121,11 +133,13 @@ enum RequestType {
   RequestType_COPY = 8,
   RequestType_CHMOD = 9,
   RequestType_LOKI_PATCH = 10,
-  RequestType_WIPE_ROM = 11
+  RequestType_WIPE_ROM = 11,
+  RequestType_TRANSFER = 12,
+  RequestType_CANCEL_TRANSFER = 13
 };
 
 inline const char **EnumNamesRequestType() {
-  static const char *names[] = { "GET_VERSION", "GET_ROMS_LIST", "GET_BUILTIN_ROM_IDS", "GET_CURRENT_ROM", "SWITCH_ROM", "SET_KERNEL", "REBOOT", "OPEN", "COPY", "CHMOD", "LOKI_PATCH", "WIPE_ROM", nullptr };
+  static const char *names[] = { "GET_VERSION", "GET_ROMS_LIST", "GET_BUILTIN_ROM_IDS", "GET_CURRENT_ROM", "SWITCH_ROM", "SET_KERNEL", "REBOOT", "OPEN", "COPY", "CHMOD", "LOKI_PATCH", "WIPE_ROM", "TRANSFER", "CANCEL_TRANSFER", nullptr };
   return names;
 }
 
@@ -144,6 +158,8 @@ struct Request FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
   const mbtool::daemon::v2::CopyRequest *copy_request() const { return GetPointer<const mbtool::daemon::v2::CopyRequest *>(22); }
   const mbtool::daemon::v2::ChmodRequest *chmod_request() const { return GetPointer<const mbtool::daemon::v2::ChmodRequest *>(24); }
   const mbtool::daemon::v2::WipeRomRequest *wipe_rom_request() const { return GetPointer<const mbtool::daemon::v2::WipeRomRequest *>(28); }
+  const mbtool::daemon::v2::TransferRequest *transfer_request() const { return GetPointer<const mbtool::daemon::v2::TransferRequest *>(30); }
+  const mbtool::daemon::v2::CancelTransferRequest *cancel_transfer_request() const { return GetPointer<const mbtool::daemon::v2::CancelTransferRequest *>(32); }
   bool Verify(flatbuffers::Verifier &verifier) const {
     return VerifyTableStart(verifier) &&
            VerifyField<int16_t>(verifier, 4 /* type */) &&
@@ -169,6 +185,10 @@ struct Request FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
            verifier.VerifyTable(chmod_request()) &&
            VerifyField<flatbuffers::uoffset_t>(verifier, 28 /* wipe_rom_request */) &&
            verifier.VerifyTable(wipe_rom_request()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, 30 /* transfer_request */) &&
+           verifier.VerifyTable(transfer_request()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, 32 /* cancel_transfer_request */) &&
+           verifier.VerifyTable(cancel_transfer_request()) &&
            verifier.EndTable();
   }
 };
@@ -188,10 +208,12 @@ struct RequestBuilder {
   void add_copy_request(flatbuffers::Offset<mbtool::daemon::v2::CopyRequest> copy_request) { fbb_.AddOffset(22, copy_request); }
   void add_chmod_request(flatbuffers::Offset<mbtool::daemon::v2::ChmodRequest> chmod_request) { fbb_.AddOffset(24, chmod_request); }
   void add_wipe_rom_request(flatbuffers::Offset<mbtool::daemon::v2::WipeRomRequest> wipe_rom_request) { fbb_.AddOffset(28, wipe_rom_request); }
+  void add_transfer_request(flatbuffers::Offset<mbtool::daemon::v2::TransferRequest> transfer_request) { fbb_.AddOffset(30, transfer_request); }
+  void add_cancel_transfer_request(flatbuffers::Offset<mbtool::daemon::v2::CancelTransferRequest> cancel_transfer_request) { fbb_.AddOffset(32, cancel_transfer_request); }
   RequestBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
   RequestBuilder &operator=(const RequestBuilder &);
   flatbuffers::Offset<Request> Finish() {
-    auto o = flatbuffers::Offset<Request>(fbb_.EndTable(start_, 13));
+    auto o = flatbuffers::Offset<Request>(fbb_.EndTable(start_, 15));
     return o;
   }
 };
@@ -208,8 +230,12 @@ inline flatbuffers::Offset<Request> CreateRequest(flatbuffers::FlatBufferBuilder
    flatbuffers::Offset<mbtool::daemon::v2::OpenRequest> open_request = 0,
    flatbuffers::Offset<mbtool::daemon::v2::CopyRequest> copy_request = 0,
    flatbuffers::Offset<mbtool::daemon::v2::ChmodRequest> chmod_request = 0,
-   flatbuffers::Offset<mbtool::daemon::v2::WipeRomRequest> wipe_rom_request = 0) {
+   flatbuffers::Offset<mbtool::daemon::v2::WipeRomRequest> wipe_rom_request = 0,
+   flatbuffers::Offset<mbtool::daemon::v2::TransferRequest> transfer_request = 0,
+   flatbuffers::Offset<mbtool::daemon::v2::CancelTransferRequest> cancel_transfer_request = 0) {
   RequestBuilder builder_(_fbb);
+  builder_.add_cancel_transfer_request(cancel_transfer_request);
+  builder_.add_transfer_request(transfer_request);
   builder_.add_wipe_rom_request(wipe_rom_request);
   builder_.add_chmod_request(chmod_request);
   builder_.add_copy_request(copy_request);
@@ -0,0 +1,381 @@
+// automatically generated by the FlatBuffers compiler, do not modify
+
+#ifndef FLATBUFFERS_GENERATED_TRANSFER_MBTOOL_DAEMON_V2_H_
+#define FLATBUFFERS_GENERATED_TRANSFER_MBTOOL_DAEMON_V2_H_
+
+#include "flatbuffers/flatbuffers.h"
+
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct GetVersionRequest;
+struct GetVersionResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct Rom;
+struct GetRomsListRequest;
+struct GetRomsListResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct GetBuiltinRomIdsRequest;
+struct GetBuiltinRomIdsResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct GetCurrentRomRequest;
+struct GetCurrentRomResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct SwitchRomRequest;
+struct SwitchRomResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct SetKernelRequest;
+struct SetKernelResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct RebootRequest;
+struct RebootResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct OpenRequest;
+struct OpenResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct CopyRequest;
+struct CopyResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct ChmodRequest;
+struct ChmodResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct LokiPatchRequest;
+struct LokiPatchResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+struct WipeRomRequest;
+struct WipeRomResponse;
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+
+namespace mbtool {
+namespace daemon {
+namespace v2 {
+
+struct TransferRequest;
+struct TransferProgress;
+struct FileHash;
+struct TransferResponse;
+struct CancelTransferRequest;
+struct CancelTransferResponse;
+
+enum TransferOperation {
+  TransferOperation_COPY = 0,
+  TransferOperation_HASH = 1,
+  TransferOperation_ARCHIVE = 2
+};
+
+inline const char **EnumNamesTransferOperation() {
+  static const char *names[] = { "COPY", "HASH", "ARCHIVE", nullptr };
+  return names;
+}
+
+inline const char *EnumNameTransferOperation(TransferOperation e) { return EnumNamesTransferOperation()[e]; }
+
+struct TransferRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  TransferOperation operation() const { return static_cast<TransferOperation>(GetField<int16_t>(4, 0)); }
+  const flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>> *sources() const { return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>> *>(6); }
+  const flatbuffers::String *target() const { return GetPointer<const flatbuffers::String *>(8); }
+  uint32_t progress_interval_ms() const { return GetField<uint32_t>(10, 0); }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<int16_t>(verifier, 4 /* operation */) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, 6 /* sources */) &&
+           verifier.Verify(sources()) &&
+           verifier.VerifyVectorOfStrings(sources()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, 8 /* target */) &&
+           verifier.Verify(target()) &&
+           VerifyField<uint32_t>(verifier, 10 /* progress_interval_ms */) &&
+           verifier.EndTable();
+  }
+};
+
+struct TransferRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_operation(TransferOperation operation) { fbb_.AddElement<int16_t>(4, static_cast<int16_t>(operation), 0); }
+  void add_sources(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>>> sources) { fbb_.AddOffset(6, sources); }
+  void add_target(flatbuffers::Offset<flatbuffers::String> target) { fbb_.AddOffset(8, target); }
+  void add_progress_interval_ms(uint32_t progress_interval_ms) { fbb_.AddElement<uint32_t>(10, progress_interval_ms, 0); }
+  TransferRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
+  TransferRequestBuilder &operator=(const TransferRequestBuilder &);
+  flatbuffers::Offset<TransferRequest> Finish() {
+    auto o = flatbuffers::Offset<TransferRequest>(fbb_.EndTable(start_, 4));
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<TransferRequest> CreateTransferRequest(flatbuffers::FlatBufferBuilder &_fbb,
+   TransferOperation operation = TransferOperation_COPY,
+   flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<flatbuffers::String>>> sources = 0,
+   flatbuffers::Offset<flatbuffers::String> target = 0,
+   uint32_t progress_interval_ms = 0) {
+  TransferRequestBuilder builder_(_fbb);
+  builder_.add_progress_interval_ms(progress_interval_ms);
+  builder_.add_target(target);
+  builder_.add_sources(sources);
+  builder_.add_operation(operation);
+  return builder_.Finish();
+}
+
+struct TransferProgress FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  uint64_t bytes() const { return GetField<uint64_t>(4, 0); }
+  uint64_t total_bytes() const { return GetField<uint64_t>(6, 0); }
+  uint64_t files() const { return GetField<uint64_t>(8, 0); }
+  uint64_t total_files() const { return GetField<uint64_t>(10, 0); }
+  uint64_t bytes_per_second() const { return GetField<uint64_t>(12, 0); }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint64_t>(verifier, 4 /* bytes */) &&
+           VerifyField<uint64_t>(verifier, 6 /* total_bytes */) &&
+           VerifyField<uint64_t>(verifier, 8 /* files */) &&
+           VerifyField<uint64_t>(verifier, 10 /* total_files */) &&
+           VerifyField<uint64_t>(verifier, 12 /* bytes_per_second */) &&
+           verifier.EndTable();
+  }
+};
+
+struct TransferProgressBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_bytes(uint64_t bytes) { fbb_.AddElement<uint64_t>(4, bytes, 0); }
+  void add_total_bytes(uint64_t total_bytes) { fbb_.AddElement<uint64_t>(6, total_bytes, 0); }
+  void add_files(uint64_t files) { fbb_.AddElement<uint64_t>(8, files, 0); }
+  void add_total_files(uint64_t total_files) { fbb_.AddElement<uint64_t>(10, total_files, 0); }
+  void add_bytes_per_second(uint64_t bytes_per_second) { fbb_.AddElement<uint64_t>(12, bytes_per_second, 0); }
+  TransferProgressBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
+  TransferProgressBuilder &operator=(const TransferProgressBuilder &);
+  flatbuffers::Offset<TransferProgress> Finish() {
+    auto o = flatbuffers::Offset<TransferProgress>(fbb_.EndTable(start_, 5));
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<TransferProgress> CreateTransferProgress(flatbuffers::FlatBufferBuilder &_fbb,
+   uint64_t bytes = 0,
+   uint64_t total_bytes = 0,
+   uint64_t files = 0,
+   uint64_t total_files = 0,
+   uint64_t bytes_per_second = 0) {
+  TransferProgressBuilder builder_(_fbb);
+  builder_.add_bytes_per_second(bytes_per_second);
+  builder_.add_total_files(total_files);
+  builder_.add_files(files);
+  builder_.add_total_bytes(total_bytes);
+  builder_.add_bytes(bytes);
+  return builder_.Finish();
+}
+
+struct FileHash FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  const flatbuffers::String *path() const { return GetPointer<const flatbuffers::String *>(4); }
+  const flatbuffers::String *sha512() const { return GetPointer<const flatbuffers::String *>(6); }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, 4 /* path */) &&
+           verifier.Verify(path()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, 6 /* sha512 */) &&
+           verifier.Verify(sha512()) &&
+           verifier.EndTable();
+  }
+};
+
+struct FileHashBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_path(flatbuffers::Offset<flatbuffers::String> path) { fbb_.AddOffset(4, path); }
+  void add_sha512(flatbuffers::Offset<flatbuffers::String> sha512) { fbb_.AddOffset(6, sha512); }
+  FileHashBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
+  FileHashBuilder &operator=(const FileHashBuilder &);
+  flatbuffers::Offset<FileHash> Finish() {
+    auto o = flatbuffers::Offset<FileHash>(fbb_.EndTable(start_, 2));
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<FileHash> CreateFileHash(flatbuffers::FlatBufferBuilder &_fbb,
+   flatbuffers::Offset<flatbuffers::String> path = 0,
+   flatbuffers::Offset<flatbuffers::String> sha512 = 0) {
+  FileHashBuilder builder_(_fbb);
+  builder_.add_sha512(sha512);
+  builder_.add_path(path);
+  return builder_.Finish();
+}
+
+struct TransferResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  uint32_t id() const { return GetField<uint32_t>(4, 0); }
+  uint8_t finished() const { return GetField<uint8_t>(6, 0); }
+  uint8_t success() const { return GetField<uint8_t>(8, 0); }
+  uint8_t cancelled() const { return GetField<uint8_t>(10, 0); }
+  const flatbuffers::String *error_msg() const { return GetPointer<const flatbuffers::String *>(12); }
+  const TransferProgress *progress() const { return GetPointer<const TransferProgress *>(14); }
+  const flatbuffers::Vector<flatbuffers::Offset<FileHash>> *hashes() const { return GetPointer<const flatbuffers::Vector<flatbuffers::Offset<FileHash>> *>(16); }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint32_t>(verifier, 4 /* id */) &&
+           VerifyField<uint8_t>(verifier, 6 /* finished */) &&
+           VerifyField<uint8_t>(verifier, 8 /* success */) &&
+           VerifyField<uint8_t>(verifier, 10 /* cancelled */) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, 12 /* error_msg */) &&
+           verifier.Verify(error_msg()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, 14 /* progress */) &&
+           verifier.VerifyTable(progress()) &&
+           VerifyField<flatbuffers::uoffset_t>(verifier, 16 /* hashes */) &&
+           verifier.Verify(hashes()) &&
+           verifier.VerifyVectorOfTables(hashes()) &&
+           verifier.EndTable();
+  }
+};
+
+struct TransferResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_id(uint32_t id) { fbb_.AddElement<uint32_t>(4, id, 0); }
+  void add_finished(uint8_t finished) { fbb_.AddElement<uint8_t>(6, finished, 0); }
+  void add_success(uint8_t success) { fbb_.AddElement<uint8_t>(8, success, 0); }
+  void add_cancelled(uint8_t cancelled) { fbb_.AddElement<uint8_t>(10, cancelled, 0); }
+  void add_error_msg(flatbuffers::Offset<flatbuffers::String> error_msg) { fbb_.AddOffset(12, error_msg); }
+  void add_progress(flatbuffers::Offset<TransferProgress> progress) { fbb_.AddOffset(14, progress); }
+  void add_hashes(flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<FileHash>>> hashes) { fbb_.AddOffset(16, hashes); }
+  TransferResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
+  TransferResponseBuilder &operator=(const TransferResponseBuilder &);
+  flatbuffers::Offset<TransferResponse> Finish() {
+    auto o = flatbuffers::Offset<TransferResponse>(fbb_.EndTable(start_, 7));
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<TransferResponse> CreateTransferResponse(flatbuffers::FlatBufferBuilder &_fbb,
+   uint32_t id = 0,
+   uint8_t finished = 0,
+   uint8_t success = 0,
+   uint8_t cancelled = 0,
+   flatbuffers::Offset<flatbuffers::String> error_msg = 0,
+   flatbuffers::Offset<TransferProgress> progress = 0,
+   flatbuffers::Offset<flatbuffers::Vector<flatbuffers::Offset<FileHash>>> hashes = 0) {
+  TransferResponseBuilder builder_(_fbb);
+  builder_.add_hashes(hashes);
+  builder_.add_progress(progress);
+  builder_.add_error_msg(error_msg);
+  builder_.add_id(id);
+  builder_.add_cancelled(cancelled);
+  builder_.add_success(success);
+  builder_.add_finished(finished);
+  return builder_.Finish();
+}
+
+struct CancelTransferRequest FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  uint32_t id() const { return GetField<uint32_t>(4, 0); }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint32_t>(verifier, 4 /* id */) &&
+           verifier.EndTable();
+  }
+};
+
+struct CancelTransferRequestBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_id(uint32_t id) { fbb_.AddElement<uint32_t>(4, id, 0); }
+  CancelTransferRequestBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
+  CancelTransferRequestBuilder &operator=(const CancelTransferRequestBuilder &);
+  flatbuffers::Offset<CancelTransferRequest> Finish() {
+    auto o = flatbuffers::Offset<CancelTransferRequest>(fbb_.EndTable(start_, 1));
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<CancelTransferRequest> CreateCancelTransferRequest(flatbuffers::FlatBufferBuilder &_fbb,
+   uint32_t id = 0) {
+  CancelTransferRequestBuilder builder_(_fbb);
+  builder_.add_id(id);
+  return builder_.Finish();
+}
+
+struct CancelTransferResponse FLATBUFFERS_FINAL_CLASS : private flatbuffers::Table {
+  uint8_t success() const { return GetField<uint8_t>(4, 0); }
+  bool Verify(flatbuffers::Verifier &verifier) const {
+    return VerifyTableStart(verifier) &&
+           VerifyField<uint8_t>(verifier, 4 /* success */) &&
+           verifier.EndTable();
+  }
+};
+
+struct CancelTransferResponseBuilder {
+  flatbuffers::FlatBufferBuilder &fbb_;
+  flatbuffers::uoffset_t start_;
+  void add_success(uint8_t success) { fbb_.AddElement<uint8_t>(4, success, 0); }
+  CancelTransferResponseBuilder(flatbuffers::FlatBufferBuilder &_fbb) : fbb_(_fbb) { start_ = fbb_.StartTable(); }
+  CancelTransferResponseBuilder &operator=(const CancelTransferResponseBuilder &);
+  flatbuffers::Offset<CancelTransferResponse> Finish() {
+    auto o = flatbuffers::Offset<CancelTransferResponse>(fbb_.EndTable(start_, 1));
+    return o;
+  }
+};
+
+inline flatbuffers::Offset<CancelTransferResponse> CreateCancelTransferResponse(flatbuffers::FlatBufferBuilder &_fbb,
+   uint8_t success = 0) {
+  CancelTransferResponseBuilder builder_(_fbb);
+  builder_.add_success(success);
+  return builder_.Finish();
+}
+
+}  // namespace v2
+}  // namespace daemon
+}  // namespace mbtool
+
+#endif  // FLATBUFFERS_GENERATED_TRANSFER_MBTOOL_DAEMON_V2_H_
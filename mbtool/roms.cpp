@@ -19,18 +19,30 @@
 
 #include "roms.h"
 
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "util/finally.h"
 #include "util/logging.h"
+#include "util/path.h"
 #include "util/properties.h"
 #include "util/string.h"
 
 #define BUILD_PROP "build.prop"
 
+// Changes that may add, remove, or modify a ROM
+#define INVENTORY_WATCH_MASK \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE \
+    | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
 static std::vector<std::string> extsd_mount_points{
     "/raw/extsd",
     "/external_sd",
@@ -228,7 +240,7 @@ void Roms::add_extsd_roms()
     }
 }
 
-void Roms::add_installed()
+void Roms::scan_installed()
 {
     Roms all_roms;
     all_roms.add_builtin();
@@ -257,6 +269,271 @@ void Roms::add_installed()
     }
 }
 
+/*!
+ * \brief Cache of the installed ROMs and their build.prop files
+ *
+ * The cache is invalidated when inotify reports a change in any directory
+ * that determines whether a ROM is installed or when the mount table changes
+ * (eg. when an external SD card is mounted). Watches are placed on the
+ * deepest existing ancestor of each path, so creating a missing directory
+ * also invalidates the cache.
+ *
+ * If inotify is unavailable, every query rescans.
+ */
+class RomInventory
+{
+public:
+    RomInventory();
+    ~RomInventory();
+
+    std::vector<std::shared_ptr<Rom>> installed();
+    bool build_properties(const std::shared_ptr<Rom> &rom,
+                          std::unordered_map<std::string, std::string> *props);
+
+    static RomInventory * instance();
+
+private:
+    pthread_mutex_t _mutex;
+    int _inotify_fd = -1;
+    int _mounts_fd = -1;
+    bool _valid = false;
+    std::vector<std::shared_ptr<Rom>> _roms;
+    std::unordered_map<std::string,
+            std::unordered_map<std::string, std::string>> _props;
+
+    bool is_valid();
+    void refresh();
+    void reset_watches();
+    void watch(std::string path);
+
+    RomInventory(const RomInventory &) = delete;
+    RomInventory & operator=(const RomInventory &) = delete;
+};
+
+RomInventory::RomInventory()
+{
+    pthread_mutex_init(&_mutex, nullptr);
+}
+
+RomInventory::~RomInventory()
+{
+    if (_inotify_fd >= 0) {
+        close(_inotify_fd);
+    }
+    if (_mounts_fd >= 0) {
+        close(_mounts_fd);
+    }
+    pthread_mutex_destroy(&_mutex);
+}
+
+RomInventory * RomInventory::instance()
+{
+    // Never destroyed so that it is safe to use from other threads at exit
+    static RomInventory *inventory = new RomInventory();
+    return inventory;
+}
+
+/*!
+ * \brief Check if the cache is still valid
+ *
+ * This only drains the inotify queue and polls the mount table, so it does
+ * not block.
+ */
+bool RomInventory::is_valid()
+{
+    if (!_valid || _inotify_fd < 0) {
+        return false;
+    }
+
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n = read(_inotify_fd, buf, sizeof(buf));
+    if (n > 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        return false;
+    }
+
+    if (_mounts_fd >= 0) {
+        struct pollfd pfd;
+        pfd.fd = _mounts_fd;
+        pfd.events = POLLPRI;
+        pfd.revents = 0;
+
+        // The mount table is readable at any time. POLLPRI and POLLERR are
+        // reported once it changes.
+        if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void RomInventory::watch(std::string path)
+{
+    while (!path.empty()) {
+        if (inotify_add_watch(_inotify_fd, path.c_str(),
+                              INVENTORY_WATCH_MASK) >= 0) {
+            return;
+        } else if (errno != ENOENT && errno != ENOTDIR) {
+            LOGW("%s: Failed to add inotify watch: %s",
+                 path.c_str(), strerror(errno));
+            return;
+        }
+
+        std::string parent = util::dir_name(path);
+        if (parent == path) {
+            return;
+        }
+        path.swap(parent);
+    }
+}
+
+void RomInventory::reset_watches()
+{
+    // Closing the fds drops the old watches and any queued events
+    if (_inotify_fd >= 0) {
+        close(_inotify_fd);
+    }
+    if (_mounts_fd >= 0) {
+        close(_mounts_fd);
+    }
+
+    _inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (_inotify_fd < 0) {
+        LOGW("Failed to initialize inotify: %s", strerror(errno));
+    }
+
+    _mounts_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    if (_mounts_fd < 0) {
+        LOGW("Failed to open mount table: %s", strerror(errno));
+    }
+}
+
+void RomInventory::refresh()
+{
+    reset_watches();
+
+    _roms.clear();
+    _props.clear();
+
+    // Watch the places where slots are created before scanning for them
+    if (_inotify_fd >= 0) {
+        watch(get_raw_path("/data/multiboot"));
+        for (const std::string &mount_point : extsd_mount_points) {
+            watch(mount_point + "/multiboot");
+        }
+    }
+
+    Roms candidates;
+    candidates.add_builtin();
+    candidates.add_data_roms();
+    candidates.add_extsd_roms();
+
+    // A ROM is installed if its build.prop or system image exists, so watch
+    // the directory containing it
+    if (_inotify_fd >= 0) {
+        for (auto const &rom : candidates.roms) {
+            std::string system_path = rom->full_system_path();
+            if (system_path.empty()) {
+                continue;
+            }
+
+            if (rom->system_is_image) {
+                watch(util::dir_name(system_path));
+            } else {
+                watch(system_path);
+            }
+        }
+    }
+
+    Roms roms;
+    roms.scan_installed();
+    _roms.swap(roms.roms);
+
+    _valid = true;
+}
+
+std::vector<std::shared_ptr<Rom>> RomInventory::installed()
+{
+    pthread_mutex_lock(&_mutex);
+    auto unlock = util::finally([&]{
+        pthread_mutex_unlock(&_mutex);
+    });
+
+    if (!is_valid()) {
+        refresh();
+    }
+
+    // Callers get their own copies so they can't modify the cache
+    std::vector<std::shared_ptr<Rom>> result;
+    result.reserve(_roms.size());
+    for (auto const &rom : _roms) {
+        result.push_back(std::make_shared<Rom>(*rom));
+    }
+
+    return result;
+}
+
+bool RomInventory::build_properties(
+        const std::shared_ptr<Rom> &rom,
+        std::unordered_map<std::string, std::string> *props)
+{
+    pthread_mutex_lock(&_mutex);
+    auto unlock = util::finally([&]{
+        pthread_mutex_unlock(&_mutex);
+    });
+
+    if (!is_valid()) {
+        refresh();
+    }
+
+    auto it = _props.find(rom->id);
+    if (it != _props.end()) {
+        *props = it->second;
+        return true;
+    }
+
+    std::string build_prop(rom->full_system_path());
+    build_prop += "/" BUILD_PROP;
+
+    std::unordered_map<std::string, std::string> result;
+    if (!util::file_get_all_properties(build_prop, &result)) {
+        return false;
+    }
+
+    // Only ROMs that are being watched may be cached
+    bool installed = false;
+    for (auto const &r : _roms) {
+        if (r->id == rom->id) {
+            installed = true;
+            break;
+        }
+    }
+    if (installed && _inotify_fd >= 0) {
+        _props[rom->id] = result;
+    }
+
+    *props = std::move(result);
+    return true;
+}
+
+void Roms::add_installed()
+{
+    auto installed = RomInventory::instance()->installed();
+    roms.insert(roms.end(), installed.begin(), installed.end());
+}
+
+/*!
+ * \brief Read the build.prop of an installed ROM
+ *
+ * The result is cached until the ROM's system directory changes.
+ */
+bool Roms::get_build_properties(
+        const std::shared_ptr<Rom> &rom,
+        std::unordered_map<std::string, std::string> *properties)
+{
+    return RomInventory::instance()->build_properties(rom, properties);
+}
+
 std::shared_ptr<Rom> Roms::find_by_id(const std::string &id) const
 {
     for (auto r : roms) {
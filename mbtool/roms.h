@@ -21,6 +21,7 @@
 
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace mb
@@ -72,8 +73,14 @@ private:
     void add_builtin();
     void add_data_roms();
     void add_extsd_roms();
+    void scan_installed();
+
+    friend class RomInventory;
 public:
     void add_installed();
+    static bool get_build_properties(
+            const std::shared_ptr<Rom> &rom,
+            std::unordered_map<std::string, std::string> *properties);
 
     std::shared_ptr<Rom> find_by_id(const std::string &id) const;
 
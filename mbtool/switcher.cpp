@@ -19,10 +19,17 @@
 
 #include "switcher.h"
 
+#include <algorithm>
+#include <vector>
+
 #include <cstdio>
 #include <cstdlib>
 #include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <openssl/sha.h>
 
@@ -35,150 +42,242 @@
 #include "util/finally.h"
 #include "util/logging.h"
 #include "util/path.h"
-#include "util/properties.h"
 #include "util/selinux.h"
 #include "util/string.h"
+#include "util/tee.h"
 
 #define MULTIBOOT_DIR "/data/media/0/MultiBoot"
-#define CHECKSUMS_PATH "/data/multiboot/checksums.prop"
+// Root-only directory for private copies of the images being flashed
+#define FLASH_TEMP_DIR "/data/multiboot/.flash"
+
+#define FLASH_BUFFER_SIZE       (1024 * 1024)
+#define FLASH_BUFFER_ALIGNMENT  4096
 
 namespace mb
 {
 
+struct Flashable
+{
+    std::string image;
+    std::string block_dev;
+    std::string expected_hash;
+    std::string hash;
+    // Private copy of the image that was hashed
+    int fd = -1;
+    uint64_t size = 0;
+    // Identity of the image while it was read (only set if it did not change)
+    bool has_stat = false;
+    struct stat sb;
+};
+
+/*!
+ * \brief Check if two stat results describe the same, unmodified file
+ */
+static bool same_file_state(const struct stat &a, const struct stat &b)
+{
+    return a.st_dev == b.st_dev
+            && a.st_ino == b.st_ino
+            && a.st_size == b.st_size
+            && a.st_mtim.tv_sec == b.st_mtim.tv_sec
+            && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec
+            && a.st_ctim.tv_sec == b.st_ctim.tv_sec
+            && a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
 /*!
- * \brief Check a checksum property
+ * \brief Create an anonymous file for a private copy of an image
  *
- * \param props Pointer to properties map
- * \param rom_id ROM ID
- * \param image Image filename (without directory)
- * \param sha512_out SHA512 hex digest output
+ * The file is created in a root-only directory and is never linked (or is
+ * unlinked immediately), so nothing other than the returned fd can be used to
+ * modify it.
  *
- * \return ChecksumsGetResult::FOUND if the hash was successfully retrieved,
- *         ChecksumsGetResult::NOT_FOUND if the hash does not exist in the map,
- *         ChecksumsGetResult::MALFORMED if the property has an invalid format
+ * \return File descriptor or -1 with errno set appropriately
  */
-ChecksumsGetResult checksums_get(std::unordered_map<std::string, std::string> *props,
-                                 const std::string &rom_id,
-                                 const std::string &image,
-                                 std::string *sha512_out)
+static int create_private_file()
 {
-    std::string checksums_path = get_raw_path(CHECKSUMS_PATH);
+    if (!util::mkdir_recursive(FLASH_TEMP_DIR, 0700)) {
+        return -1;
+    }
 
-    std::string key(rom_id);
-    key += "/";
-    key += image;
+    // Don't trust a directory that someone else could have planted
+    struct stat sb;
+    if (lstat(FLASH_TEMP_DIR, &sb) < 0) {
+        return -1;
+    }
+    if (!S_ISDIR(sb.st_mode) || sb.st_uid != 0
+            || (sb.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+        LOGE("%s: Not a root-only directory", FLASH_TEMP_DIR);
+        errno = EPERM;
+        return -1;
+    }
 
-    if (props->find(key) == props->end()) {
-        return ChecksumsGetResult::NOT_FOUND;
+#ifdef O_TMPFILE
+    int fd = open(FLASH_TEMP_DIR, O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        return fd;
     }
+#endif
 
-    const std::string &value = (*props)[key];
+    char path[] = FLASH_TEMP_DIR "/image.XXXXXX";
+    int fd_temp = mkstemp(path);
+    if (fd_temp < 0) {
+        return -1;
+    }
+    unlink(path);
+    fcntl(fd_temp, F_SETFD, FD_CLOEXEC);
 
-    std::size_t pos = value.find(":");
-    if (pos != std::string::npos) {
-        std::string algo = value.substr(0, pos);
-        std::string hash = value.substr(pos + 1);
-        if (algo != "sha512") {
-            LOGE("%s: Invalid hash algorithm: %s",
-                 checksums_path.c_str(), algo.c_str());
-            return ChecksumsGetResult::MALFORMED;
-        }
+    return fd_temp;
+}
 
-        *sha512_out = hash;
-        return ChecksumsGetResult::FOUND;
-    } else {
-        LOGE("%s: Invalid checksum property: %s=%s",
-             checksums_path.c_str(), key.c_str(), value.c_str());
-        return ChecksumsGetResult::MALFORMED;
+static bool read_full(int fd, void *buf, std::size_t size)
+{
+    char *ptr = static_cast<char *>(buf);
+    while (size > 0) {
+        ssize_t n = read(fd, ptr, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return false;
+        } else if (n == 0) {
+            errno = EIO;
+            return false;
+        }
+        ptr += n;
+        size -= n;
     }
+    return true;
 }
 
-/*!
- * \brief Update a checksum property
- *
- * \param props Pointer to properties map
- * \param rom_id ROM ID
- * \param image Image filename (without directory)
- * \param sha512 SHA512 hex digest
- */
-void checksums_update(std::unordered_map<std::string, std::string> *props,
-                      const std::string &rom_id,
-                      const std::string &image,
-                      const std::string &sha512)
+static bool pwrite_full(int fd, const void *buf, std::size_t size,
+                        uint64_t offset)
 {
-    std::string key(rom_id);
-    key += "/";
-    key += image;
-
-    (*props)[key] = "sha512:";
-    (*props)[key] += sha512;
+    const char *ptr = static_cast<const char *>(buf);
+    while (size > 0) {
+        ssize_t n = pwrite64(fd, ptr, size, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return false;
+        }
+        ptr += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
 }
 
 /*!
- * \brief Read checksums properties from \a /data/multiboot/checksums.prop
+ * \brief Write a verified image to its block device and read it back
  *
- * \param props Pointer to properties map
- *
- * \return True if the file was successfully read. Otherwise, false.
+ * The image is streamed from the private copy, so at most one buffer of it is
+ * in memory at a time. The block-aligned part of the image is written with
+ * O_DIRECT (if supported) and the remaining bytes are written normally. The
+ * block device is then synced, its cached pages are dropped, and the written
+ * region is read back and compared against the verified SHA512 digest.
  */
-bool checksums_read(std::unordered_map<std::string, std::string> *props)
+static bool flash_image(const Flashable &f)
 {
-    std::string checksums_path = get_raw_path(CHECKSUMS_PATH);
+    int fd_direct = open(f.block_dev.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+    int fd_out = open(f.block_dev.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd_out < 0) {
+        if (fd_direct >= 0) {
+            close(fd_direct);
+        }
+        return false;
+    }
+
+    auto close_fds = util::finally([&]{
+        if (fd_direct >= 0) {
+            close(fd_direct);
+        }
+        close(fd_out);
+    });
+
+    int block_size = 512;
+    if (ioctl(fd_out, BLKSSZGET, &block_size) < 0 || block_size <= 0) {
+        block_size = 512;
+    }
 
-    if (!util::file_get_all_properties(checksums_path, props)) {
-        LOGE("%s: Failed to load properties", checksums_path.c_str());
+    void *buf;
+    int ret = posix_memalign(&buf, FLASH_BUFFER_ALIGNMENT, FLASH_BUFFER_SIZE);
+    if (ret != 0) {
+        errno = ret;
         return false;
     }
-    return true;
-}
 
-/*!
- * \brief Write checksums properties to \a /data/multiboot/checksums.prop
- *
- * \param props Properties map
- *
- * \return True if successfully written. Otherwise, false.
- */
-bool checksums_write(const std::unordered_map<std::string, std::string> &props)
-{
-    std::string checksums_path = get_raw_path(CHECKSUMS_PATH);
+    auto free_buf = util::finally([&]{
+        free(buf);
+    });
+
+    if (lseek(f.fd, 0, SEEK_SET) < 0) {
+        return false;
+    }
 
-    if (remove(checksums_path.c_str()) < 0 && errno != ENOENT) {
-        LOGW("%s: Failed to remove file: %s",
-             checksums_path.c_str(), strerror(errno));
+    uint64_t direct_size = 0;
+    if (fd_direct >= 0) {
+        direct_size = f.size - f.size % block_size;
     }
 
-    util::mkdir_parent(checksums_path, 0755);
-    util::create_empty_file(checksums_path);
+    uint64_t offset = 0;
+    while (offset < f.size) {
+        std::size_t n = FLASH_BUFFER_SIZE;
+        int fd = fd_out;
+
+        if (offset < direct_size) {
+            n = std::min<uint64_t>(n, direct_size - offset);
+            fd = fd_direct;
+        } else {
+            n = std::min<uint64_t>(n, f.size - offset);
+        }
+
+        if (!read_full(f.fd, buf, n) || !pwrite_full(fd, buf, n, offset)) {
+            return false;
+        }
 
-    if (!util::chown(checksums_path, 0, 0, 0)) {
-        LOGW("%s: Failed to chown file: %s",
-             checksums_path.c_str(), strerror(errno));
+        offset += n;
     }
-    if (chmod(checksums_path.c_str(), 0700) < 0) {
-        LOGW("%s: Failed to chmod file: %s",
-             checksums_path.c_str(), strerror(errno));
+
+    if (fsync(fd_out) < 0) {
+        return false;
     }
 
-    if (!util::file_write_properties(checksums_path, props)) {
-        LOGW("%s: Failed to write new properties: %s",
-             checksums_path.c_str(), strerror(errno));
+    // Make sure the data is read back from the device and not from the page
+    // cache
+    posix_fadvise(fd_out, 0, 0, POSIX_FADV_DONTNEED);
+
+    SHA512_CTX ctx;
+    unsigned char digest[SHA512_DIGEST_LENGTH];
+
+    SHA512_Init(&ctx);
+
+    for (offset = 0; offset < f.size; ) {
+        std::size_t n = std::min<uint64_t>(FLASH_BUFFER_SIZE, f.size - offset);
+        ssize_t nread = pread64(fd_out, buf, n, offset);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        } else if (nread <= 0) {
+            if (nread == 0) {
+                errno = EIO;
+            }
+            return false;
+        }
+        SHA512_Update(&ctx, buf, nread);
+        offset += nread;
+    }
+
+    SHA512_Final(digest, &ctx);
+
+    std::string hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+    if (hash != f.hash) {
+        LOGE("%s: Checksum of written data (%s) does not match image (%s)",
+             f.block_dev.c_str(), hash.c_str(), f.hash.c_str());
+        errno = EIO;
         return false;
     }
 
     return true;
 }
 
-struct Flashable
-{
-    std::string image;
-    std::string block_dev;
-    std::string expected_hash;
-    std::string hash;
-    unsigned char *data = nullptr;
-    std::size_t size = 0;
-};
-
 /*!
  * \brief Perform non-recursive search for a block device
  *
@@ -359,14 +458,23 @@ SwitchRomResult switch_rom(const std::string &id, const std::string &boot_blockd
         return SwitchRomResult::FAILED;
     }
 
+    // Fix the permissions before the images are read. This changes their
+    // ctimes, so doing it afterwards would invalidate the identities recorded
+    // below.
+    if (!fix_permissions()) {
+        return SwitchRomResult::FAILED;
+    }
+
     // We'll read the files we want to flash into memory so a malicious app
     // can't change the file between the hash verification step and flashing
     // step.
 
     std::vector<Flashable> flashables;
-    auto free_flashables = util::finally([&]{
+    auto close_flashables = util::finally([&]{
         for (Flashable &f : flashables) {
-            free(f.data);
+            if (f.fd >= 0) {
+                close(f.fd);
+            }
         }
     });
 
@@ -378,31 +486,94 @@ SwitchRomResult switch_rom(const std::string &id, const std::string &boot_blockd
         LOGW("Failed to find extra images");
     }
 
-    std::unordered_map<std::string, std::string> props;
-    checksums_read(&props);
+    Checksums checksums;
+    checksums_read(&checksums);
 
     for (Flashable &f : flashables) {
-        // If memory becomes an issue, an alternative method is to create a
-        // temporary directory in /data/multiboot/ that's only writable by root
-        // and copy the images there.
-        if (!util::file_read_all(f.image, &f.data, &f.size)) {
-            LOGE("%s: Failed to read image: %s",
+        std::string image_name = util::base_name(f.image);
+
+        // We'll take a private copy of each image (that no other process can
+        // open) while computing its sha512sum, so a malicious app can't change
+        // the file between the hash verification step and flashing step. The
+        // copy is on disk, so the images don't need to fit in memory.
+        f.fd = create_private_file();
+        if (f.fd < 0) {
+            LOGE("%s: Failed to create private copy: %s",
+                 f.image.c_str(), strerror(errno));
+            return SwitchRomResult::FAILED;
+        }
+
+        int fd_image = open(f.image.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd_image < 0) {
+            LOGE("%s: Failed to open image: %s",
                  f.image.c_str(), strerror(errno));
             return SwitchRomResult::FAILED;
         }
 
-        // Get actual sha512sum
+        auto close_fd_image = util::finally([&]{
+            close(fd_image);
+        });
+
+        // If the image is provably unchanged since its checksum was last
+        // verified, the stored checksum can be used without rehashing. The
+        // identity is checked both before and after the copy is taken. This
+        // only applies to images in mbtool-owned directories. Images in
+        // user-writable locations, like /data/media, are always hashed.
+        struct stat sb;
+        bool have_stat = fstat(fd_image, &sb) == 0;
+        bool unchanged = !force_update_checksums && have_stat
+                && checksums_stat_matches(checksums, id, f.image, sb);
+
         unsigned char digest[SHA512_DIGEST_LENGTH];
-        SHA512(f.data, f.size, digest);
-        f.hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+
+        util::Tee tee;
+        if (!unchanged) {
+            tee.add_sha512(digest);
+        }
+        tee.add_fd(f.fd);
+
+        if (!tee.run(fd_image)) {
+            LOGE("%s: Failed to read image: %s",
+                 f.image.c_str(), strerror(errno));
+            return SwitchRomResult::FAILED;
+        }
+
+        f.size = tee.bytes();
+
+        // The identity can only be remembered if the file did not change
+        // while it was being read
+        f.has_stat = have_stat && fstat(fd_image, &f.sb) == 0
+                && same_file_state(sb, f.sb);
+
+        if (unchanged && f.has_stat) {
+            checksums_get(&checksums, id, image_name, &f.hash);
+            LOGD("%s: Unchanged since last verified", f.image.c_str());
+        } else {
+            if (unchanged) {
+                // Changed while copying. Hash the private copy instead.
+                util::Tee copy_tee;
+                copy_tee.add_sha512(digest);
+
+                if (lseek(f.fd, 0, SEEK_SET) < 0 || !copy_tee.run(f.fd)) {
+                    LOGE("%s: Failed to hash private copy: %s",
+                         f.image.c_str(), strerror(errno));
+                    return SwitchRomResult::FAILED;
+                }
+
+                f.size = copy_tee.bytes();
+                f.has_stat = false;
+            }
+
+            f.hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
+        }
 
         if (force_update_checksums) {
-            checksums_update(&props, id, util::base_name(f.image), f.hash);
+            checksums_update(&checksums, id, image_name, f.hash);
         }
 
         // Get expected sha512sum
         ChecksumsGetResult ret = checksums_get(
-                &props, id, util::base_name(f.image), &f.expected_hash);
+                &checksums, id, image_name, &f.expected_hash);
         if (ret == ChecksumsGetResult::MALFORMED) {
             return SwitchRomResult::CHECKSUM_INVALID;
         }
@@ -427,23 +598,23 @@ SwitchRomResult switch_rom(const std::string &id, const std::string &boot_blockd
 
     // Now we can flash the images
     for (Flashable &f : flashables) {
-        // Cast is okay. The data is just passed to fwrite (ie. no signed
-        // extension issues)
-        if (!util::file_write_data(f.block_dev, (char *) f.data, f.size)) {
+        if (!flash_image(f)) {
             LOGE("%s: Failed to write image: %s",
                  f.block_dev.c_str(), strerror(errno));
             return SwitchRomResult::FAILED;
         }
     }
 
-    if (force_update_checksums) {
-        LOGD("Updating checksums file");
-        checksums_write(props);
+    // Remember the identities of the files that were hashed so they don't need
+    // to be rehashed next time
+    for (Flashable &f : flashables) {
+        if (f.has_stat) {
+            checksums_update_stat(&checksums, id, f.image, f.sb);
+        }
     }
 
-    if (!fix_permissions()) {
-        return SwitchRomResult::FAILED;
-    }
+    LOGD("Updating checksums file");
+    checksums_write(checksums);
 
     return SwitchRomResult::SUCCEEDED;
 }
@@ -451,8 +622,9 @@ SwitchRomResult switch_rom(const std::string &id, const std::string &boot_blockd
 /*!
  * \brief Set the kernel for a ROM
  *
- * \note This will update the checksum for the image in
- *       \a /data/multiboot/checksums.prop.
+ * \note This will update the checksum for the image in the checksums store
+ *       (\a /data/multiboot/checksums.bin). The image's identity is not
+ *       recorded, so the next switch_rom() call rehashes it once.
  *
  * \param id ROM ID to set the kernel for
  * \param boot_blockdev Block device path of the boot partition
@@ -487,47 +659,94 @@ bool set_kernel(const std::string &id, const std::string &boot_blockdev)
         return false;
     }
 
-    unsigned char *data;
-    std::size_t size;
-
-    if (!util::file_read_all(boot_blockdev, &data, &size)) {
-        LOGE("%s: Failed to read block device: %s",
-             boot_blockdev.c_str(), strerror(errno));
+    // Write to a temporary file in the same directory and rename it over the
+    // old image once it is complete so the existing image is never truncated
+    // before the new one is known to be good
+    std::string temp_path(bootimg_path);
+    temp_path += ".XXXXXX";
+    std::vector<char> temp_buf(temp_path.begin(), temp_path.end());
+    temp_buf.push_back('\0');
+
+    // Created with mode 0600 and owned by root
+    int fd_bootimg = mkstemp(temp_buf.data());
+    if (fd_bootimg < 0) {
+        LOGE("%s: Failed to create temporary file: %s",
+             temp_path.c_str(), strerror(errno));
         return false;
     }
 
-    auto free_data = util::finally([&]{
-        free(data);
+    temp_path = temp_buf.data();
+
+    auto remove_temp = util::finally([&]{
+        if (fd_bootimg >= 0) {
+            close(fd_bootimg);
+        }
+        if (!temp_path.empty()) {
+            unlink(temp_path.c_str());
+        }
     });
 
-    // Get actual sha512sum
+    // Copy the boot partition to the image and get the actual sha512sum while
+    // reading the block device once
     unsigned char digest[SHA512_DIGEST_LENGTH];
-    SHA512(data, size, digest);
-    std::string hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
 
-    // Add to checksums.prop
-    std::unordered_map<std::string, std::string> props;
-    checksums_read(&props);
-    checksums_update(&props, id, "boot.img", hash);
+    util::Tee tee;
+    tee.add_sha512(digest);
+    tee.add_fd(fd_bootimg);
 
-    // NOTE: This function isn't responsible for updating the checksums for
-    //       any extra images. We don't want to mask any malicious changes.
+    if (!tee.run_file(boot_blockdev)) {
+        LOGE("%s: Failed to copy block device to %s: %s",
+             boot_blockdev.c_str(), temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fsync(fd_bootimg) < 0) {
+        LOGE("%s: Failed to sync: %s", temp_path.c_str(), strerror(errno));
+        return false;
+    }
 
-    // Cast is okay. The data is just passed to fwrite (ie. no signed
-    // extension issues)
-    if (!util::file_write_data(bootimg_path, (char *) data, size)) {
-        LOGE("%s: Failed to write image: %s",
+    int ret = close(fd_bootimg);
+    fd_bootimg = -1;
+    if (ret < 0) {
+        LOGE("%s: Failed to close: %s", temp_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (rename(temp_path.c_str(), bootimg_path.c_str()) < 0) {
+        LOGE("%s: Failed to rename to %s: %s", temp_path.c_str(),
              bootimg_path.c_str(), strerror(errno));
         return false;
     }
+    temp_path.clear();
+
+    // Make sure the rename itself is durable
+    int dir_fd = open(multiboot_path.c_str(),
+                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
 
-    LOGD("Updating checksums file");
-    checksums_write(props);
+    std::string hash = util::hex_string(digest, SHA512_DIGEST_LENGTH);
 
     if (!fix_permissions()) {
         return false;
     }
 
+    // Add to checksums
+    Checksums checksums;
+    checksums_read(&checksums);
+    // The identity is not recorded here. fix_permissions() and the rename
+    // change the image's ctime after it was written, and stat'ing the path
+    // again can't prove that the bytes are still the ones that were hashed.
+    checksums_update(&checksums, id, "boot.img", hash);
+
+    // NOTE: This function isn't responsible for updating the checksums for
+    //       any extra images. We don't want to mask any malicious changes.
+
+    LOGD("Updating checksums file");
+    checksums_write(checksums);
+
     return true;
 }
 
@@ -0,0 +1,454 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "transfer.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstring>
+#include <ctime>
+#include <sys/stat.h>
+
+#include "util/archive.h"
+#include "util/copy.h"
+#include "util/directory.h"
+#include "util/finally.h"
+#include "util/fts.h"
+#include "util/logging.h"
+#include "util/path.h"
+#include "util/string.h"
+#include "util/tee.h"
+#include "util/time.h"
+
+// Progress interval used if the caller does not specify one
+#define DEFAULT_PROGRESS_INTERVAL_MS    500
+// Progress is never reported more often than this
+#define MIN_PROGRESS_INTERVAL_MS        50
+
+namespace mb
+{
+
+/*!
+ * \brief Count the paths and bytes that a transfer will process
+ *
+ * The totals match what the copy, hash, and archive operations count as
+ * progress: the size of regular files and the number of non-directory paths
+ * (or only regular files when hashing). Sockets are never counted.
+ */
+class TransferScanner : public util::FTSWrapper {
+public:
+    TransferScanner(std::string path, bool regular_only,
+                    const util::Progress *progress)
+        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        _regular_only(regular_only), _progress(progress)
+    {
+    }
+
+    uint64_t bytes = 0;
+    uint64_t files = 0;
+
+    virtual int on_changed_path() override
+    {
+        return _progress->cancelled ? Action::FTS_Stop : Action::FTS_OK;
+    }
+
+    virtual int on_reached_file() override
+    {
+        bytes += _curr->fts_statp->st_size;
+        ++files;
+        return Action::FTS_OK;
+    }
+
+    virtual int on_reached_symlink() override
+    {
+        if (!_regular_only) {
+            ++files;
+        }
+        return Action::FTS_OK;
+    }
+
+    virtual int on_reached_special_file() override
+    {
+        if (!_regular_only && !S_ISSOCK(_curr->fts_statp->st_mode)) {
+            ++files;
+        }
+        return Action::FTS_OK;
+    }
+
+private:
+    bool _regular_only;
+    const util::Progress *_progress;
+};
+
+/*!
+ * \brief Compute the SHA512 digest of every regular file in a tree
+ */
+class TransferHasher : public util::FTSWrapper {
+public:
+    TransferHasher(std::string path, util::Progress *progress,
+                   std::vector<Transfer::FileHash> *hashes)
+        : FTSWrapper(path, FTS_GroupSpecialFiles),
+        _progress(progress), _hashes(hashes)
+    {
+    }
+
+    virtual int on_changed_path() override
+    {
+        if (_progress->cancelled) {
+            _error_msg = format_error("Hashing was cancelled");
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+        return Action::FTS_OK;
+    }
+
+    virtual int on_reached_file() override
+    {
+        unsigned char digest[SHA512_DIGEST_LENGTH];
+
+        util::Tee tee;
+        tee.add_sha512(digest);
+        tee.set_progress(_progress);
+
+        if (!tee.run_file(_curr->fts_accpath)) {
+            if (errno == ECANCELED) {
+                _error_msg = format_error("Hashing was cancelled");
+                return Action::FTS_Fail | Action::FTS_Stop;
+            }
+
+            // Keep going so that the other files are still hashed
+            _error_msg = util::format("%s: Failed to hash file: %s",
+                                      _curr->fts_path, strerror(errno));
+            LOGW("%s", _error_msg.c_str());
+            return Action::FTS_Fail;
+        }
+
+        _hashes->emplace_back();
+        _hashes->back().path = _curr->fts_path;
+        _hashes->back().sha512 = util::hex_string(digest, sizeof(digest));
+
+        ++_progress->files;
+
+        return Action::FTS_OK;
+    }
+
+private:
+    util::Progress *_progress;
+    std::vector<Transfer::FileHash> *_hashes;
+
+    std::string format_error(const char *msg)
+    {
+        return util::format("%s: %s", _path.c_str(), msg);
+    }
+};
+
+Transfer::Transfer(Operation op, std::vector<std::string> sources,
+                   std::string target)
+    : _op(op), _sources(std::move(sources)), _target(std::move(target)),
+    _total_bytes(0), _total_files(0)
+{
+    // Trailing slashes would otherwise end up in the names of the copied or
+    // archived paths
+    for (std::string &source : _sources) {
+        while (source.size() > 1 && source.back() == '/') {
+            source.pop_back();
+        }
+    }
+
+    pthread_mutex_init(&_mutex, nullptr);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&_cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+Transfer::~Transfer()
+{
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+/*!
+ * \brief Run the transfer and wait for it to finish
+ *
+ * The work is done on a helper thread. Meanwhile, \a cb is called on the
+ * calling thread once immediately and then every \a interval_ms milliseconds
+ * (or a default interval if 0) until the transfer finishes. If \a cb returns
+ * false, the transfer is cancelled. \a cb is not called for the final state;
+ * use stats() after run() returns.
+ *
+ * \return Whether the transfer succeeded. If false is returned, error()
+ *         contains a description of the first failure.
+ */
+bool Transfer::run(unsigned int interval_ms, ProgressCb cb, void *userdata)
+{
+    if (interval_ms == 0) {
+        interval_ms = DEFAULT_PROGRESS_INTERVAL_MS;
+    } else if (interval_ms < MIN_PROGRESS_INTERVAL_MS) {
+        interval_ms = MIN_PROGRESS_INTERVAL_MS;
+    }
+
+    if (_sources.empty()) {
+        _error_msg = "No sources specified";
+        return false;
+    }
+    if (_op != Operation::Hash && _target.empty()) {
+        _error_msg = "No target specified";
+        return false;
+    }
+
+    _start_ms = util::monotonic_time_ms();
+
+    pthread_t thread;
+    int ret = pthread_create(&thread, nullptr, &Transfer::thread_main, this);
+    if (ret != 0) {
+        _error_msg = util::format("Failed to create thread: %s",
+                                  strerror(ret));
+        LOGE("%s", _error_msg.c_str());
+        return false;
+    }
+
+    pthread_mutex_lock(&_mutex);
+
+    while (!_done) {
+        pthread_mutex_unlock(&_mutex);
+
+        if (cb && !cb(stats(), userdata)) {
+            cancel();
+        }
+
+        pthread_mutex_lock(&_mutex);
+
+        uint64_t deadline = util::monotonic_time_ms() + interval_ms;
+        struct timespec ts;
+        ts.tv_sec = deadline / 1000;
+        ts.tv_nsec = (deadline % 1000) * 1000000;
+
+        while (!_done && pthread_cond_timedwait(&_cond, &_mutex, &ts) == 0) {
+            // Spurious wakeup
+        }
+    }
+
+    pthread_mutex_unlock(&_mutex);
+
+    pthread_join(thread, nullptr);
+
+    LOGD("Transfer finished: success=%d, cancelled=%d, %" PRIu64 "/%" PRIu64
+         " bytes, %" PRIu64 "/%" PRIu64 " files in %" PRIu64 " ms",
+         _success, cancelled(), _progress.bytes.load(), _total_bytes.load(),
+         _progress.files.load(), _total_files.load(),
+         util::monotonic_time_ms() - _start_ms);
+
+    return _success;
+}
+
+/*!
+ * \brief Cancel the transfer
+ *
+ * This may be called from any thread. The paths that are being processed are
+ * interrupted and no further paths are started.
+ */
+void Transfer::cancel()
+{
+    _progress.cancelled = true;
+}
+
+bool Transfer::cancelled() const
+{
+    return _progress.cancelled;
+}
+
+/*!
+ * \brief Current progress
+ *
+ * The totals are 0 until the sources have been scanned.
+ */
+Transfer::Stats Transfer::stats() const
+{
+    Stats stats;
+    stats.bytes = _progress.bytes;
+    stats.total_bytes = _total_bytes;
+    stats.files = _progress.files;
+    stats.total_files = _total_files;
+
+    uint64_t elapsed = util::monotonic_time_ms() - _start_ms;
+    stats.bytes_per_second = elapsed > 0 ? stats.bytes * 1000 / elapsed : 0;
+
+    return stats;
+}
+
+/*!
+ * \brief Error message (only valid if run() returned false)
+ */
+const std::string & Transfer::error() const
+{
+    return _error_msg;
+}
+
+/*!
+ * \brief Digests of the hashed files (only valid for Operation::Hash)
+ */
+const std::vector<Transfer::FileHash> & Transfer::hashes() const
+{
+    return _hashes;
+}
+
+void * Transfer::thread_main(void *userdata)
+{
+    Transfer *transfer = static_cast<Transfer *>(userdata);
+
+    transfer->work();
+
+    pthread_mutex_lock(&transfer->_mutex);
+    transfer->_done = true;
+    pthread_cond_signal(&transfer->_cond);
+    pthread_mutex_unlock(&transfer->_mutex);
+
+    return nullptr;
+}
+
+void Transfer::work()
+{
+    if (!scan()) {
+        _success = false;
+    } else if (_op == Operation::Copy) {
+        _success = do_copy();
+    } else if (_op == Operation::Hash) {
+        _success = do_hash();
+    } else {
+        _success = do_archive();
+    }
+
+    if (!_success && cancelled()) {
+        _error_msg = "Transfer was cancelled";
+    }
+}
+
+bool Transfer::scan()
+{
+    uint64_t bytes = 0;
+    uint64_t files = 0;
+
+    for (const std::string &source : _sources) {
+        struct stat sb;
+        if (lstat(source.c_str(), &sb) < 0) {
+            _error_msg = util::format("%s: Failed to stat: %s",
+                                      source.c_str(), strerror(errno));
+            LOGE("%s", _error_msg.c_str());
+            return false;
+        }
+
+        TransferScanner scanner(source, _op == Operation::Hash, &_progress);
+        if (!scanner.run()) {
+            _error_msg = scanner.error();
+            LOGE("%s: Failed to scan: %s",
+                 source.c_str(), _error_msg.c_str());
+            return false;
+        }
+
+        bytes += scanner.bytes;
+        files += scanner.files;
+    }
+
+    _total_bytes = bytes;
+    _total_files = files;
+
+    return !cancelled();
+}
+
+bool Transfer::do_copy()
+{
+    if (!util::mkdir_recursive(_target, 0755)) {
+        _error_msg = util::format("%s: Failed to create directory: %s",
+                                  _target.c_str(), strerror(errno));
+        LOGE("%s", _error_msg.c_str());
+        return false;
+    }
+
+    for (const std::string &source : _sources) {
+        struct stat sb;
+        if (lstat(source.c_str(), &sb) < 0) {
+            _error_msg = util::format("%s: Failed to stat: %s",
+                                      source.c_str(), strerror(errno));
+            LOGE("%s", _error_msg.c_str());
+            return false;
+        }
+
+        bool ret;
+
+        if (S_ISDIR(sb.st_mode)) {
+            ret = util::copy_dir(source, _target,
+                                 util::COPY_ATTRIBUTES
+                                 | util::COPY_XATTRS
+                                 | util::COPY_PARALLEL,
+                                 &_progress);
+        } else {
+            std::string target(_target);
+            target += "/";
+            target += util::base_name(source);
+
+            ret = util::copy_file(source, target,
+                                  util::COPY_ATTRIBUTES | util::COPY_XATTRS,
+                                  &_progress);
+        }
+
+        if (!ret) {
+            // The details have already been logged by the copy functions
+            _error_msg = util::format("%s: Failed to copy to %s",
+                                      source.c_str(), _target.c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Transfer::do_hash()
+{
+    bool ret = true;
+
+    for (const std::string &source : _sources) {
+        TransferHasher hasher(source, &_progress, &_hashes);
+        if (!hasher.run()) {
+            if (ret) {
+                _error_msg = hasher.error();
+            }
+            ret = false;
+
+            if (cancelled()) {
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+bool Transfer::do_archive()
+{
+    if (!util::archive_create_tar(_target, _sources, &_progress)) {
+        _error_msg = util::format("%s: Failed to create archive",
+                                  _target.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include <pthread.h>
+
+#include "util/progress.h"
+
+namespace mb
+{
+
+// Bulk copy, hash, or archive job over multiple files and directory trees.
+// The work is done on a helper thread while the thread that called run()
+// reports the progress at a fixed interval.
+class Transfer
+{
+public:
+    enum class Operation
+    {
+        // Copy the sources into the target directory
+        Copy,
+        // Compute the SHA512 digest of every regular file in the sources
+        Hash,
+        // Write the sources to a tar archive at the target path
+        Archive
+    };
+
+    struct FileHash
+    {
+        std::string path;
+        std::string sha512;
+    };
+
+    struct Stats
+    {
+        uint64_t bytes;
+        uint64_t total_bytes;
+        uint64_t files;
+        uint64_t total_files;
+        // Average throughput since run() was called
+        uint64_t bytes_per_second;
+    };
+
+    // Returning false cancels the transfer
+    typedef bool (*ProgressCb)(const Stats &stats, void *userdata);
+
+    Transfer(Operation op, std::vector<std::string> sources,
+             std::string target);
+    ~Transfer();
+
+    bool run(unsigned int interval_ms, ProgressCb cb, void *userdata);
+    void cancel();
+
+    bool cancelled() const;
+    Stats stats() const;
+    const std::string & error() const;
+    const std::vector<FileHash> & hashes() const;
+
+private:
+    Operation _op;
+    std::vector<std::string> _sources;
+    std::string _target;
+
+    util::Progress _progress;
+    std::atomic<uint64_t> _total_bytes;
+    std::atomic<uint64_t> _total_files;
+    uint64_t _start_ms = 0;
+
+    // Set by the helper thread
+    bool _success = false;
+    std::string _error_msg;
+    std::vector<FileHash> _hashes;
+
+    pthread_mutex_t _mutex;
+    // Signalled when the helper thread finishes
+    pthread_cond_t _cond;
+    bool _done = false;
+
+    static void * thread_main(void *userdata);
+    void work();
+    bool scan();
+    bool do_copy();
+    bool do_hash();
+    bool do_archive();
+
+    Transfer(const Transfer &) = delete;
+    Transfer & operator=(const Transfer &) = delete;
+};
+
+}
@@ -23,11 +23,18 @@
 #include <memory>
 #include <cerrno>
 #include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "util/directory.h"
 #include "util/finally.h"
+#include "util/fts.h"
 #include "util/logging.h"
 #include "util/path.h"
+#include "util/string.h"
+
+#define TAR_BUFFER_SIZE         (1024 * 1024)
 
 namespace mb
 {
@@ -330,6 +337,214 @@ bool archive_exists(const std::string &filename,
 
     return true;
 }
+class TarWriter : public FTSWrapper {
+public:
+    TarWriter(std::string path, archive *a, std::vector<char> *buf,
+              Progress *progress)
+        : FTSWrapper(path, FTS_GroupSpecialFiles), _a(a), _buf(buf),
+        _progress(progress)
+    {
+    }
+
+    virtual int on_changed_path() override
+    {
+        if (_progress && _progress->cancelled) {
+            _error_msg = format("%s: Archiving was cancelled", _path.c_str());
+            LOGW("%s", _error_msg.c_str());
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+
+        // Entries are relative to the parent of the input path
+        _name = base_name(_path);
+        _name += _curr->fts_path + _path.size();
+
+        return Action::FTS_OK;
+    }
+
+    virtual int on_reached_directory_pre() override
+    {
+        return write_entry();
+    }
+
+    virtual int on_reached_file() override
+    {
+        return write_entry();
+    }
+
+    virtual int on_reached_symlink() override
+    {
+        return write_entry();
+    }
+
+    virtual int on_reached_special_file() override
+    {
+        if (S_ISSOCK(_curr->fts_statp->st_mode)) {
+            LOGD("%s: Skipping socket", _curr->fts_path);
+            return Action::FTS_Skip;
+        }
+
+        return write_entry();
+    }
+
+private:
+    archive *_a;
+    std::vector<char> *_buf;
+    Progress *_progress;
+    std::string _name;
+
+    int write_entry()
+    {
+        const struct stat *sb = _curr->fts_statp;
+        int fd = -1;
+
+        // Open the file before writing the header so that an unreadable file
+        // does not leave a truncated entry behind
+        if (S_ISREG(sb->st_mode)) {
+            fd = open(_curr->fts_accpath, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                _error_msg = format("%s: Failed to open: %s",
+                                    _curr->fts_path, strerror(errno));
+                LOGE("%s", _error_msg.c_str());
+                return Action::FTS_Fail | Action::FTS_Stop;
+            }
+        }
+
+        auto close_fd = finally([&] {
+            if (fd >= 0) {
+                close(fd);
+            }
+        });
+
+        std::unique_ptr<archive_entry, void (*)(archive_entry *)> entry(
+                archive_entry_new(), archive_entry_free);
+        if (!entry) {
+            _error_msg = "Out of memory";
+            LOGE("%s", _error_msg.c_str());
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+
+        archive_entry_set_pathname(entry.get(), _name.c_str());
+        archive_entry_copy_stat(entry.get(), sb);
+
+        if (S_ISLNK(sb->st_mode)) {
+            std::string target;
+            if (!read_link(_curr->fts_accpath, &target)) {
+                _error_msg = format("%s: Failed to read symlink path: %s",
+                                    _curr->fts_path, strerror(errno));
+                LOGE("%s", _error_msg.c_str());
+                return Action::FTS_Fail | Action::FTS_Stop;
+            }
+            archive_entry_set_symlink(entry.get(), target.c_str());
+        }
+
+        if (archive_write_header(_a, entry.get()) != ARCHIVE_OK) {
+            _error_msg = format("%s: Failed to write header: %s",
+                                _curr->fts_path, archive_error_string(_a));
+            LOGE("%s", _error_msg.c_str());
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+
+        if (fd >= 0 && !write_data(fd)) {
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+
+        if (_progress && !S_ISDIR(sb->st_mode)) {
+            ++_progress->files;
+        }
+
+        return Action::FTS_OK;
+    }
+
+    bool write_data(int fd)
+    {
+        while (true) {
+            ssize_t n = read(fd, _buf->data(), _buf->size());
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                _error_msg = format("%s: Failed to read: %s",
+                                    _curr->fts_path, strerror(errno));
+                LOGE("%s", _error_msg.c_str());
+                return false;
+            } else if (n == 0) {
+                return true;
+            }
+
+            if (archive_write_data(_a, _buf->data(), n) != n) {
+                _error_msg = format("%s: Failed to write data: %s",
+                                    _curr->fts_path, archive_error_string(_a));
+                LOGE("%s", _error_msg.c_str());
+                return false;
+            }
+
+            if (!progress_add_bytes(_progress, n)) {
+                _error_msg = format("%s: Archiving was cancelled",
+                                    _path.c_str());
+                LOGW("%s", _error_msg.c_str());
+                return false;
+            }
+        }
+    }
+};
+
+/*!
+ * \brief Write files and directory trees to a new tar archive
+ *
+ * Each path is stored relative to its parent directory, so archiving
+ * "/data/media/0/DCIM" produces entries named "DCIM/...". Directory trees do
+ * not cross mountpoint boundaries, sockets are skipped, and symlinks are
+ * stored as symlinks. The archive uses the restricted pax format, so long
+ * paths and large files are supported.
+ *
+ * \param filename Path of the archive to create
+ * \param paths Files and directories to add to the archive
+ * \param progress If not nullptr, the number of bytes and the number of
+ *                 non-directory paths that were archived are added to the
+ *                 counters. Setting the cancelled flag stops the operation.
+ *
+ * \return Whether all of the paths were archived. If false is returned, the
+ *         incomplete archive is left on disk.
+ */
+bool archive_create_tar(const std::string &filename,
+                        const std::vector<std::string> &paths,
+                        Progress *progress)
+{
+    archive_ptr out(archive_write_new(), archive_write_free);
+
+    if (!out) {
+        LOGE("Out of memory");
+        return false;
+    }
+
+    archive_write_set_format_pax_restricted(out.get());
+    archive_write_add_filter_none(out.get());
+
+    if (archive_write_open_filename(out.get(), filename.c_str())
+            != ARCHIVE_OK) {
+        LOGE("%s: Failed to open archive: %s",
+             filename.c_str(), archive_error_string(out.get()));
+        return false;
+    }
+
+    std::vector<char> buf(TAR_BUFFER_SIZE);
+
+    for (const std::string &path : paths) {
+        TarWriter writer(path, out.get(), &buf, progress);
+        if (!writer.run()) {
+            archive_write_fail(out.get());
+            return false;
+        }
+    }
+
+    if (archive_write_close(out.get()) != ARCHIVE_OK) {
+        LOGE("%s: Failed to close archive: %s",
+             filename.c_str(), archive_error_string(out.get()));
+        return false;
+    }
+
+    return true;
+}
 
 }
 }
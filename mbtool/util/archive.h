@@ -25,6 +25,8 @@
 #include <archive.h>
 #include <archive_entry.h>
 
+#include "util/progress.h"
+
 namespace mb
 {
 namespace util
@@ -50,6 +52,9 @@ bool extract_files2(const std::string &filename,
                     const std::vector<extract_info> &files);
 bool archive_exists(const std::string &filename,
                     std::vector<exists_info> &files);
+bool archive_create_tar(const std::string &filename,
+                        const std::vector<std::string> &paths,
+                        Progress *progress);
 
 }
 }
\ No newline at end of file
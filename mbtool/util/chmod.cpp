@@ -75,6 +75,11 @@ private:
 
     bool chmod_path()
     {
+        // Don't needlessly change the ctime
+        if ((_curr->fts_statp->st_mode & 07777) == _perms) {
+            return true;
+        }
+
         if (chmod(_curr->fts_accpath, _perms) < 0) {
             _error_msg = format("%s: Failed to chmod: %s",
                                 _curr->fts_path, strerror(errno));
@@ -22,6 +22,7 @@
 #include <cerrno>
 #include <grp.h>
 #include <pwd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -84,6 +85,13 @@ private:
 
     bool chown_path()
     {
+        // Don't needlessly change the ctime
+        const struct stat *sb = _curr->fts_statp;
+        if ((!_follow_symlinks || !S_ISLNK(sb->st_mode))
+                && sb->st_uid == _uid && sb->st_gid == _gid) {
+            return true;
+        }
+
         if (!chown_internal(_curr->fts_accpath, _uid, _gid, _follow_symlinks)) {
             _error_msg = format("%s: Failed to chown: %s",
                                 _curr->fts_path, strerror(errno));
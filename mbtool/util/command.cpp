@@ -21,6 +21,9 @@
 
 #include <cerrno>
 #include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <paths.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -32,8 +35,6 @@ namespace mb
 namespace util
 {
 
-typedef std::unique_ptr<std::FILE, int (*)(std::FILE *)> file_ptr;
-
 static std::string list2string(const std::vector<std::string> &list)
 {
     std::string output;
@@ -59,7 +60,7 @@ int run_shell_command(const std::string &command)
         pid_t pid;
         if ((pid = fork()) >= 0) {
             if (pid == 0) {
-                execlp("/sbin/sh", "sh", "-c", command.c_str(), nullptr);
+                execl("/sbin/sh", "sh", "-c", command.c_str(), nullptr);
                 _exit(127);
             } else {
                 pid = waitpid(pid, &status, 0);
@@ -96,6 +97,139 @@ int run_command_chroot_cb(const std::string &dir,
     return run_command2(argv, dir, cb, data);
 }
 
+/*!
+ * \brief Get the paths that execvp() would try for \a file
+ */
+static std::vector<std::string> exec_candidates(const std::string &file)
+{
+    std::vector<std::string> paths;
+
+    if (file.find('/') != std::string::npos) {
+        paths.push_back(file);
+        return paths;
+    }
+
+    const char *path_env = getenv("PATH");
+    if (!path_env) {
+        path_env = _PATH_DEFPATH;
+    }
+
+    const char *begin = path_env;
+    while (true) {
+        const char *end = strchr(begin, ':');
+        std::string dir = end ? std::string(begin, end) : std::string(begin);
+
+        // An empty entry means the current directory
+        if (dir.empty()) {
+            dir = ".";
+        }
+        paths.push_back(dir + "/" + file);
+
+        if (!end) {
+            break;
+        }
+        begin = end + 1;
+    }
+
+    return paths;
+}
+
+enum class ChildStep : int
+{
+    Chdir,
+    Chroot,
+    Dup2,
+    Exec,
+};
+
+struct ChildError
+{
+    ChildStep step;
+    int error;
+};
+
+static const char * child_step_name(ChildStep step)
+{
+    switch (step) {
+    case ChildStep::Chdir:
+        return "chdir";
+    case ChildStep::Chroot:
+        return "chroot";
+    case ChildStep::Dup2:
+        return "redirect output";
+    case ChildStep::Exec:
+        return "execute";
+    default:
+        return "???";
+    }
+}
+
+/*!
+ * \brief Report a failure to the parent and exit
+ *
+ * Async-signal-safe.
+ */
+static void child_fail(int err_fd, ChildStep step, int exit_status)
+{
+    ChildError err;
+    err.step = step;
+    err.error = errno;
+    if (write(err_fd, &err, sizeof(err)) < 0) {
+        // Nothing else can be done
+    }
+    _exit(exit_status);
+}
+
+/*!
+ * \brief Make \a target a copy of \a fd that is inherited across exec()
+ *
+ * Async-signal-safe.
+ */
+static bool child_redirect(int fd, int target)
+{
+    if (fd == target) {
+        return fcntl(fd, F_SETFD, 0) == 0;
+    }
+    return dup2(fd, target) == target;
+}
+
+/*!
+ * \brief Pass each chunk of \a fd's contents that ends in a newline to \a cb
+ *
+ * Lines longer than 1023 bytes are split, like they would be by fgets() with a
+ * 1024 byte buffer.
+ */
+static void read_output(int fd, OutputCb cb, void *data)
+{
+    static const std::size_t max_line = 1023;
+
+    char buf[1024];
+    std::string line;
+    ssize_t n;
+
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOGE("Failed to read command output: %s", strerror(errno));
+            break;
+        }
+
+        for (ssize_t i = 0; i < n; ++i) {
+            line += buf[i];
+            if (buf[i] == '\n' || line.size() == max_line) {
+                cb(line, data);
+                line.clear();
+            }
+        }
+    }
+
+    if (!line.empty()) {
+        cb(line, data);
+    }
+}
+
 int run_command2(const std::vector<std::string> &argv,
                  const std::string &chroot_dir,
                  OutputCb cb, void *data)
@@ -107,89 +241,121 @@ int run_command2(const std::vector<std::string> &argv,
 
     LOGD("Running command: [ %s ]", list2string(argv).c_str());
 
+    // The caller may be multithreaded (eg. a daemon worker thread), so the
+    // child may only call async-signal-safe functions before exec(). Another
+    // thread could have held a lock, such as the one in malloc() or the
+    // logger, when fork() was called. Everything the child needs is prepared
+    // here and failures are reported back through a pipe.
     std::vector<const char *> argv_c;
     for (const std::string &arg : argv) {
         argv_c.push_back(arg.c_str());
     }
     argv_c.push_back(nullptr);
 
-    int status;
-    pid_t pid;
-    int stdio_fds[2];
+    std::vector<std::string> paths = exec_candidates(argv[0]);
+    const char *chroot_c = chroot_dir.empty() ? nullptr : chroot_dir.c_str();
 
-    if (cb) {
-        pipe(stdio_fds);
+    // Closed by exec() on success, so the read returns EOF
+    int err_fds[2];
+    if (pipe2(err_fds, O_CLOEXEC) < 0) {
+        LOGE("Failed to create pipe: %s", strerror(errno));
+        return -1;
     }
 
-    if ((pid = fork()) >= 0) {
-        if (pid == 0) {
-            if (cb) {
-                close(stdio_fds[0]);
-            }
+    int stdio_fds[2] = { -1, -1 };
+    if (cb && pipe2(stdio_fds, O_CLOEXEC) < 0) {
+        int saved_errno = errno;
+        LOGE("Failed to create pipe: %s", strerror(errno));
+        close(err_fds[0]);
+        close(err_fds[1]);
+        errno = saved_errno;
+        return -1;
+    }
 
-            if (!chroot_dir.empty()) {
-                if (chdir(chroot_dir.c_str()) < 0) {
-                    LOGE("%s: Failed to chdir: %s",
-                         chroot_dir.c_str(), strerror(errno));
-                    _exit(EXIT_FAILURE);
-                }
-                if (chroot(chroot_dir.c_str()) < 0) {
-                    LOGE("%s: Failed to chroot: %s",
-                         chroot_dir.c_str(), strerror(errno));
-                    _exit(EXIT_FAILURE);
-                }
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (chroot_c) {
+            if (chdir(chroot_c) < 0) {
+                child_fail(err_fds[1], ChildStep::Chdir, EXIT_FAILURE);
             }
-
-            if (cb) {
-                dup2(stdio_fds[1], STDOUT_FILENO);
-                dup2(stdio_fds[1], STDERR_FILENO);
-                close(stdio_fds[1]);
+            if (chroot(chroot_c) < 0) {
+                child_fail(err_fds[1], ChildStep::Chroot, EXIT_FAILURE);
             }
+        }
 
-            execvp(argv_c[0], const_cast<char * const *>(argv_c.data()));
-            _exit(127);
-        } else {
-            if (cb) {
-                close(stdio_fds[1]);
-
-                int reader_status;
-                pid_t reader_pid = fork();
-
-                if (reader_pid < 0) {
-                    LOGE("Failed to fork reader process");
-                } else if (reader_pid == 0) {
-                    // Read program output in child process (stdout, stderr)
-                    char buf[1024];
-
-                    file_ptr fp(fdopen(stdio_fds[0], "rb"), fclose);
-
-                    while (fgets(buf, sizeof(buf), fp.get())) {
-                        cb(buf, data);
-                    }
-
-                    _exit(EXIT_SUCCESS);
-                } else {
-                    do {
-                        if (waitpid(reader_pid, &reader_status, 0) < 0) {
-                            LOGE("Failed to waitpid(): %s", strerror(errno));
-                            break;
-                        }
-                    } while (!WIFEXITED(reader_status)
-                            && !WIFSIGNALED(reader_status));
-                }
-
-                close(stdio_fds[0]);
+        if (cb && (!child_redirect(stdio_fds[1], STDOUT_FILENO)
+                || !child_redirect(stdio_fds[1], STDERR_FILENO))) {
+            child_fail(err_fds[1], ChildStep::Dup2, EXIT_FAILURE);
+        }
+
+        // Same search semantics as execvp(), which may allocate
+        bool eacces = false;
+        for (const std::string &path : paths) {
+            execve(path.c_str(), const_cast<char * const *>(argv_c.data()),
+                   environ);
+            if (errno == EACCES) {
+                eacces = true;
+            } else if (errno != ENOENT && errno != ENOTDIR) {
+                break;
             }
+        }
+        if (eacces) {
+            errno = EACCES;
+        }
+
+        child_fail(err_fds[1], ChildStep::Exec, 127);
+    }
+
+    int saved_errno = errno;
+
+    close(err_fds[1]);
+    if (cb) {
+        close(stdio_fds[1]);
+    }
+
+    if (pid < 0) {
+        LOGE("Failed to fork: %s", strerror(saved_errno));
+        close(err_fds[0]);
+        if (cb) {
+            close(stdio_fds[0]);
+        }
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (cb) {
+        read_output(stdio_fds[0], cb, data);
+        close(stdio_fds[0]);
+    }
 
-            do {
-                if (waitpid(pid, &status, 0) < 0) {
-                    return -1;
-                }
-            } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+    ChildError err;
+    ssize_t n;
+    do {
+        n = read(err_fds[0], &err, sizeof(err));
+    } while (n < 0 && errno == EINTR);
+    close(err_fds[0]);
+
+    if (n == sizeof(err)) {
+        if (err.step == ChildStep::Chdir || err.step == ChildStep::Chroot) {
+            LOGE("%s: Failed to %s: %s", chroot_dir.c_str(),
+                 child_step_name(err.step), strerror(err.error));
+        } else {
+            LOGE("%s: Failed to %s: %s", argv[0].c_str(),
+                 child_step_name(err.step), strerror(err.error));
         }
     }
 
-    return pid == -1 ? -1 : status;
+    int status;
+    do {
+        if (waitpid(pid, &status, 0) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+    } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+
+    return status;
 }
 
 }
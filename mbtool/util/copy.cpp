@@ -19,12 +19,21 @@
 
 #include "util/copy.h"
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+
 #include <cerrno>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
 #include <fts.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/xattr.h>
 #include <unistd.h>
 
@@ -33,6 +42,18 @@
 #include "util/logging.h"
 #include "util/path.h"
 #include "util/string.h"
+#include "util/threadpool.h"
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#endif
+#ifndef SEEK_HOLE
+#define SEEK_HOLE 4
+#endif
 
 // WARNING: Everything operates on paths, so it's subject to race conditions
 // Directory copy operations will not cross mountpoint boundaries
@@ -42,29 +63,451 @@ namespace mb
 namespace util
 {
 
-bool copy_data_fd(int fd_source, int fd_target)
+// Largest request passed to the kernel-side copy functions at a time
+#define MAX_KERNEL_CHUNK        (64 * 1024 * 1024)
+// Size of the buffer for the read()/write() fallback
+#define BUFFER_SIZE             (1024 * 1024)
+#define BUFFER_ALIGNMENT        4096
+// Maximum number of paths waiting to be copied in parallel mode
+#define MAX_QUEUED_COPIES       256
+
+enum class SegmentResult
 {
-    char buf[10240];
-    ssize_t nread;
+    // All of the data (or everything until EOF) was copied
+    Done,
+    // The strategy does not support these file descriptors
+    Unsupported,
+    // An I/O error occurred (errno is set)
+    Failed
+};
 
-    while ((nread = read(fd_source, buf, sizeof buf)) > 0) {
-        char *out_ptr = buf;
-        ssize_t nwritten;
+struct CopyState
+{
+    // Next strategy to try. Strategies are never retried once they have been
+    // reported as unsupported.
+    CopyStrategy next;
+    // Strategy that copied the most recent data
+    CopyStrategy used;
+    bool source_is_fifo;
+    bool target_is_fifo;
+    // Receives the number of bytes copied (may be nullptr)
+    Progress *progress;
+};
 
-        do {
-            if ((nwritten = write(fd_target, out_ptr, nread)) < 0) {
-                return false;
+const char * copy_strategy_name(CopyStrategy strategy)
+{
+    switch (strategy) {
+    case COPY_STRATEGY_NONE:
+        return "none";
+    case COPY_STRATEGY_REFLINK:
+        return "reflink";
+    case COPY_STRATEGY_COPY_FILE_RANGE:
+        return "copy_file_range";
+    case COPY_STRATEGY_SENDFILE:
+        return "sendfile";
+    case COPY_STRATEGY_SPLICE:
+        return "splice";
+    case COPY_STRATEGY_READ_WRITE:
+        return "read/write";
+    default:
+        return "unknown";
+    }
+}
+
+/*!
+ * \brief Whether an error means that a strategy cannot be used for the file
+ *        descriptors (as opposed to an actual I/O error)
+ */
+static bool is_unsupported_error(int error)
+{
+    return error == ENOSYS
+            || error == EINVAL
+            || error == EXDEV
+            || error == EOPNOTSUPP
+            || error == ENOTSUP
+            || error == ENOTTY
+            || error == EBADF;
+}
+
+static SegmentResult copy_segment_copy_file_range(int fd_source, int fd_target,
+                                                  uint64_t size,
+                                                  uint64_t *copied,
+                                                  Progress *progress)
+{
+#ifdef __NR_copy_file_range
+    while (*copied < size) {
+        size_t chunk = std::min<uint64_t>(size - *copied, MAX_KERNEL_CHUNK);
+
+        ssize_t n = syscall(__NR_copy_file_range, fd_source, nullptr,
+                            fd_target, nullptr, chunk, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            return is_unsupported_error(errno)
+                    ? SegmentResult::Unsupported : SegmentResult::Failed;
+        } else if (n == 0) {
+            // Some kernels return 0 for files that they cannot copy instead of
+            // failing (eg. procfs and sysfs files, which report a size of 0).
+            // Fall back if nothing could be copied. For an empty source, the
+            // next strategy also reaches EOF immediately.
+            return *copied == 0
+                    ? SegmentResult::Unsupported : SegmentResult::Done;
+        }
+
+        *copied += n;
+
+        if (!progress_add_bytes(progress, n)) {
+            return SegmentResult::Failed;
+        }
+    }
 
-            nread -= nwritten;
+    return SegmentResult::Done;
+#else
+    (void) fd_source;
+    (void) fd_target;
+    (void) size;
+    (void) copied;
+    (void) progress;
+    return SegmentResult::Unsupported;
+#endif
+}
+
+static SegmentResult copy_segment_sendfile(int fd_source, int fd_target,
+                                           uint64_t size, uint64_t *copied,
+                                           Progress *progress)
+{
+    while (*copied < size) {
+        size_t chunk = std::min<uint64_t>(size - *copied, MAX_KERNEL_CHUNK);
+
+        ssize_t n = sendfile(fd_target, fd_source, nullptr, chunk);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return is_unsupported_error(errno)
+                    ? SegmentResult::Unsupported : SegmentResult::Failed;
+        } else if (n == 0) {
+            break;
+        }
+
+        *copied += n;
+
+        if (!progress_add_bytes(progress, n)) {
+            return SegmentResult::Failed;
+        }
+    }
+
+    return SegmentResult::Done;
+}
+
+static SegmentResult copy_segment_splice(int fd_source, int fd_target,
+                                         uint64_t size, uint64_t *copied,
+                                         Progress *progress)
+{
+    while (*copied < size) {
+        size_t chunk = std::min<uint64_t>(size - *copied, MAX_KERNEL_CHUNK);
+
+        ssize_t n = splice(fd_source, nullptr, fd_target, nullptr, chunk,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return is_unsupported_error(errno)
+                    ? SegmentResult::Unsupported : SegmentResult::Failed;
+        } else if (n == 0) {
+            break;
+        }
+
+        *copied += n;
+
+        if (!progress_add_bytes(progress, n)) {
+            return SegmentResult::Failed;
+        }
+    }
+
+    return SegmentResult::Done;
+}
+
+static SegmentResult copy_segment_read_write(int fd_source, int fd_target,
+                                             uint64_t size, uint64_t *copied,
+                                             Progress *progress)
+{
+    void *buf;
+    int ret = posix_memalign(&buf, BUFFER_ALIGNMENT, BUFFER_SIZE);
+    if (ret != 0) {
+        errno = ret;
+        return SegmentResult::Failed;
+    }
+
+    auto free_buf = finally([&] {
+        free(buf);
+    });
+
+    while (*copied < size) {
+        size_t chunk = std::min<uint64_t>(size - *copied, BUFFER_SIZE);
+
+        ssize_t nread = read(fd_source, buf, chunk);
+        if (nread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return SegmentResult::Failed;
+        } else if (nread == 0) {
+            break;
+        }
+
+        char *out_ptr = static_cast<char *>(buf);
+        ssize_t remaining = nread;
+
+        while (remaining > 0) {
+            ssize_t nwritten = write(fd_target, out_ptr, remaining);
+            if (nwritten < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return SegmentResult::Failed;
+            }
+
+            remaining -= nwritten;
             out_ptr += nwritten;
-        } while (nread > 0);
+        }
+
+        *copied += nread;
+
+        if (!progress_add_bytes(progress, nread)) {
+            return SegmentResult::Failed;
+        }
     }
 
-    return nread == 0;
+    return SegmentResult::Done;
 }
 
-static bool copy_data(const std::string &source, const std::string &target)
+/*!
+ * \brief Copy \a size bytes (or until EOF if \a size is UINT64_MAX) from the
+ *        current offset of \a fd_source to the current offset of \a fd_target
+ *
+ * The strategies are tried in order of preference, continuing with the next
+ * one from where the previous one left off if it is unsupported.
+ */
+static bool copy_segment(int fd_source, int fd_target, uint64_t size,
+                         CopyState *state)
+{
+    uint64_t copied = 0;
+
+    while (true) {
+        SegmentResult result;
+
+        switch (state->next) {
+        case COPY_STRATEGY_NONE:
+        case COPY_STRATEGY_REFLINK:
+            // Reflinks only apply to whole files
+            state->next = COPY_STRATEGY_COPY_FILE_RANGE;
+            continue;
+        case COPY_STRATEGY_COPY_FILE_RANGE:
+            // Only supported between regular files
+            if (state->source_is_fifo || state->target_is_fifo) {
+                result = SegmentResult::Unsupported;
+            } else {
+                result = copy_segment_copy_file_range(
+                        fd_source, fd_target, size, &copied,
+                        state->progress);
+            }
+            break;
+        case COPY_STRATEGY_SENDFILE:
+            if (state->source_is_fifo) {
+                result = SegmentResult::Unsupported;
+            } else {
+                result = copy_segment_sendfile(
+                        fd_source, fd_target, size, &copied,
+                        state->progress);
+            }
+            break;
+        case COPY_STRATEGY_SPLICE:
+            // One end must be a pipe
+            if (!state->source_is_fifo && !state->target_is_fifo) {
+                result = SegmentResult::Unsupported;
+            } else {
+                result = copy_segment_splice(
+                        fd_source, fd_target, size, &copied,
+                        state->progress);
+            }
+            break;
+        case COPY_STRATEGY_READ_WRITE:
+        default:
+            result = copy_segment_read_write(
+                    fd_source, fd_target, size, &copied, state->progress);
+            break;
+        }
+
+        if (result == SegmentResult::Unsupported) {
+            state->next = static_cast<CopyStrategy>(state->next + 1);
+            continue;
+        } else if (result == SegmentResult::Failed) {
+            return false;
+        }
+
+        state->used = state->next;
+        return true;
+    }
+}
+
+/*!
+ * \brief Copy data between file descriptors
+ *
+ * Data is copied from the current offset of \a fd_source until EOF to the
+ * current offset of \a fd_target. The fastest available method is used:
+ *
+ * 1. If both are regular files and the whole source is being copied to an
+ *    empty target, the source is reflinked with FICLONE
+ * 2. copy_file_range()
+ * 3. sendfile() (or splice() if either end is a pipe)
+ * 4. read() and write() with a large aligned buffer
+ *
+ * If both are regular files and the target offset is at or past its end,
+ * holes in the source are found with SEEK_DATA/SEEK_HOLE and are not written
+ * to the target, which preserves sparseness.
+ *
+ * \param fd_source Source file descriptor
+ * \param fd_target Target file descriptor
+ * \param strategy If not nullptr, the strategy used to copy the data is
+ *                 written here. If multiple strategies were needed, the last
+ *                 one is reported. COPY_STRATEGY_NONE means that there was no
+ *                 data to copy.
+ * \param progress If not nullptr, the number of bytes copied (including holes
+ *                 that were skipped) is added to the counter as the copy
+ *                 proceeds. If the operation is cancelled, the copy stops and
+ *                 errno is set to ECANCELED.
+ *
+ * \return Whether the data was copied. errno is set on failure.
+ */
+bool copy_data_fd(int fd_source, int fd_target, CopyStrategy *strategy,
+                  Progress *progress)
+{
+    struct stat sb_source;
+    struct stat sb_target;
+
+    if (fstat(fd_source, &sb_source) < 0 || fstat(fd_target, &sb_target) < 0) {
+        return false;
+    }
+
+    CopyState state;
+    state.next = COPY_STRATEGY_REFLINK;
+    state.used = COPY_STRATEGY_NONE;
+    state.source_is_fifo = S_ISFIFO(sb_source.st_mode);
+    state.target_is_fifo = S_ISFIFO(sb_target.st_mode);
+    state.progress = progress;
+
+    auto report_strategy = finally([&] {
+        if (strategy) {
+            *strategy = state.used;
+        }
+    });
+
+    if (!S_ISREG(sb_source.st_mode) || !S_ISREG(sb_target.st_mode)) {
+        if (S_ISREG(sb_source.st_mode) || S_ISBLK(sb_source.st_mode)) {
+            posix_fadvise(fd_source, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        return copy_segment(fd_source, fd_target, UINT64_MAX, &state);
+    }
+
+    off_t source_offset = lseek(fd_source, 0, SEEK_CUR);
+    off_t target_offset = lseek(fd_target, 0, SEEK_CUR);
+    if (source_offset < 0 || target_offset < 0) {
+        return false;
+    }
+
+    off_t source_end = sb_source.st_size;
+    if (source_end == 0) {
+        // Pseudo-files, like those in procfs, report a size of 0. Empty files
+        // are cheap to copy, so just read until EOF.
+        state.next = COPY_STRATEGY_READ_WRITE;
+        return copy_segment(fd_source, fd_target, UINT64_MAX, &state);
+    } else if (source_offset >= source_end) {
+        return true;
+    }
+
+    // A reflink shares the extents of the entire file
+    if (source_offset == 0 && target_offset == 0 && sb_target.st_size == 0
+            && ioctl(fd_target, FICLONE, fd_source) == 0) {
+        lseek(fd_source, source_end, SEEK_SET);
+        lseek(fd_target, source_end, SEEK_SET);
+        state.used = COPY_STRATEGY_REFLINK;
+        return progress_add_bytes(progress, source_end);
+    }
+
+    posix_fadvise(fd_source, source_offset, source_end - source_offset,
+                  POSIX_FADV_SEQUENTIAL);
+
+    // Skipping holes is only safe if the skipped regions of the target will
+    // read back as zeros
+    if (target_offset < sb_target.st_size) {
+        return copy_segment(fd_source, fd_target, UINT64_MAX, &state);
+    }
+
+    off_t delta = target_offset - source_offset;
+    off_t pos = source_offset;
+
+    while (pos < source_end) {
+        off_t data = lseek(fd_source, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                // The rest of the file is a hole
+                if (!progress_add_bytes(progress, source_end - pos)) {
+                    return false;
+                }
+                break;
+            } else if (errno == EINVAL) {
+                // SEEK_DATA is not supported by the filesystem
+                if (lseek(fd_source, pos, SEEK_SET) < 0
+                        || lseek(fd_target, pos + delta, SEEK_SET) < 0) {
+                    return false;
+                }
+                return copy_segment(fd_source, fd_target, UINT64_MAX, &state);
+            }
+            return false;
+        }
+
+        off_t hole = lseek(fd_source, data, SEEK_HOLE);
+        if (hole < 0 || hole > source_end) {
+            hole = source_end;
+        }
+
+        if (lseek(fd_source, data, SEEK_SET) < 0
+                || lseek(fd_target, data + delta, SEEK_SET) < 0) {
+            return false;
+        }
+
+        // Skipped holes count towards the progress
+        if (!progress_add_bytes(progress, data - pos)
+                || !copy_segment(fd_source, fd_target, hole - data, &state)) {
+            return false;
+        }
+
+        pos = hole;
+    }
+
+    // Extend the target to cover a trailing hole
+    off_t target_end = source_end + delta;
+    if (lseek(fd_source, source_end, SEEK_SET) < 0
+            || lseek(fd_target, target_end, SEEK_SET) < 0) {
+        return false;
+    }
+    if (fstat(fd_target, &sb_target) < 0) {
+        return false;
+    }
+    if (sb_target.st_size < target_end
+            && ftruncate(fd_target, target_end) < 0) {
+        return false;
+    }
+
+    return true;
+}
+
+static bool copy_data(const std::string &source, const std::string &target,
+                      CopyStrategy *strategy = nullptr,
+                      Progress *progress = nullptr)
 {
     int fd_source = -1;
     int fd_target = -1;
@@ -87,7 +530,7 @@ static bool copy_data(const std::string &source, const std::string &target)
         close(fd_target);
     });
 
-    if (!copy_data_fd(fd_source, fd_target)) {
+    if (!copy_data_fd(fd_source, fd_target, strategy, progress)) {
         return false;
     }
 
@@ -218,6 +661,25 @@ bool copy_contents(const std::string &source, const std::string &target)
 
 bool copy_file(const std::string &source, const std::string &target, int flags)
 {
+    return copy_file(source, target, flags, nullptr);
+}
+
+/*!
+ * \brief Copy a single file, symlink, or special file
+ *
+ * \param progress If not nullptr, the number of bytes copied is added to the
+ *                 counter as the copy proceeds and the file counter is
+ *                 incremented once the copy succeeds. Setting the cancelled
+ *                 flag interrupts the copy.
+ */
+bool copy_file(const std::string &source, const std::string &target, int flags,
+               Progress *progress)
+{
+    if (progress && progress->cancelled) {
+        errno = ECANCELED;
+        return false;
+    }
+
     mode_t old_umask = umask(0);
 
     auto restore_umask = finally([&] {
@@ -284,7 +746,7 @@ bool copy_file(const std::string &source, const std::string &target, int flags)
         // Treat as file
 
     case S_IFREG:
-        if (!copy_data(source, target)) {
+        if (!copy_data(source, target, nullptr, progress)) {
             LOGE("%s: Failed to copy data: %s",
                  target.c_str(), strerror(errno));
             return false;
@@ -315,14 +777,26 @@ bool copy_file(const std::string &source, const std::string &target, int flags)
         return false;
     }
 
+    if (progress) {
+        ++progress->files;
+    }
+
     return true;
 }
 
 
 class RecursiveCopier : public FTSWrapper {
 public:
-    RecursiveCopier(std::string path, std::string target, int copyflags)
-        : FTSWrapper(path, 0), _copyflags(copyflags), _target(target) {
+    RecursiveCopier(std::string path, std::string target, int copyflags,
+                    Progress *progress)
+        : FTSWrapper(path, 0), _copyflags(copyflags), _target(target),
+        _progress(progress) {
+        pthread_mutex_init(&_mutex, nullptr);
+    }
+
+    virtual ~RecursiveCopier()
+    {
+        pthread_mutex_destroy(&_mutex);
     }
 
     virtual bool on_pre_execute() override
@@ -359,11 +833,64 @@ public:
             return false;
         }
 
+        if (_copyflags & COPY_PARALLEL) {
+            _pool.reset(new ThreadPool(0, MAX_QUEUED_COPIES));
+        }
+
         return true;
     }
 
+    virtual bool on_post_execute(bool success) override
+    {
+        (void) success;
+
+        bool ret = true;
+
+        if (_pool) {
+            _pool->wait();
+            _pool.reset();
+
+            // Only left over if the traversal was stopped early
+            for (DirNode *node : _dir_stack) {
+                delete node;
+            }
+            _dir_stack.clear();
+
+            if (_worker_failed) {
+                _error_msg = _worker_error;
+                ret = false;
+            }
+        }
+
+        std::string summary;
+
+        for (int i = COPY_STRATEGY_NONE; i < COPY_STRATEGY_COUNT; ++i) {
+            if (_strategy_counts[i] > 0) {
+                if (!summary.empty()) {
+                    summary += ", ";
+                }
+                summary += format("%s: %u",
+                                  copy_strategy_name(static_cast<CopyStrategy>(i)),
+                                  _strategy_counts[i].load());
+            }
+        }
+
+        if (!summary.empty()) {
+            LOGD("%s: Files copied by strategy: %s",
+                 _path.c_str(), summary.c_str());
+        }
+
+        return ret;
+    }
+
     virtual int on_changed_path() override
     {
+        if (is_cancelled()) {
+            _error_msg = format("%s: Copy was cancelled", _path.c_str());
+            LOGW("%s", _error_msg.c_str());
+            return Action::FTS_Fail | Action::FTS_Stop;
+        }
+
         // Make sure we aren't copying the target on top of itself
         if (sb_target.st_dev == _curr->fts_statp->st_dev
                 && sb_target.st_ino == _curr->fts_statp->st_ino) {
@@ -404,6 +931,9 @@ public:
 
         struct stat sb;
 
+        // Directories are always created on the traversal thread so that
+        // they exist before any of their children are copied
+
         // Create target directory if it doesn't exist
         if (mkdir(_curtgtpath.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) < 0
                 && errno != EEXIST) {
@@ -434,6 +964,13 @@ public:
             if (!cp_xattrs()) {
                 success = false;
             }
+        } else if (_pool) {
+            DirNode *parent = _dir_stack.empty() ? nullptr : _dir_stack.back();
+            if (parent) {
+                ++parent->pending;
+            }
+            _dir_stack.push_back(new DirNode(
+                    _curr->fts_accpath, _curtgtpath, parent));
         }
 
         return (skip ? Action::FTS_Skip : 0)
@@ -442,6 +979,21 @@ public:
 
     virtual int on_reached_directory_post() override
     {
+        if (_pool) {
+            // Directories skipped in on_reached_directory_pre() have no node
+            // and already have their attributes set
+            if (_dir_stack.empty() || _dir_stack.back()->target != _curtgtpath) {
+                return Action::FTS_OK;
+            }
+
+            // The attributes are applied once all of the children have been
+            // copied, which may be on a worker thread
+            DirNode *node = _dir_stack.back();
+            _dir_stack.pop_back();
+            finish_node(node);
+            return Action::FTS_OK;
+        }
+
         if (!cp_attrs()) {
             return Action::FTS_Fail;
         }
@@ -455,135 +1007,120 @@ public:
 
     virtual int on_reached_file() override
     {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
-
-        // Copy file contents
-        if (!copy_data(_curr->fts_accpath, _curtgtpath)) {
-            _error_msg = format("%s: Failed to copy data: %s",
-                                _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
+        return dispatch([this](const std::string &source,
+                               const std::string &target,
+                               std::string *error_msg) {
+            if (!remove_existing_file(target, error_msg)) {
+                return false;
+            }
 
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
+            // Copy file contents
+            CopyStrategy strategy;
+            if (!copy_data(source, target, &strategy, _progress)) {
+                *error_msg = format("%s: Failed to copy data: %s",
+                                    target.c_str(), strerror(errno));
+                LOGW("%s", error_msg->c_str());
+                return false;
+            }
 
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
+            ++_strategy_counts[strategy];
 
-        return Action::FTS_OK;
+            return copy_attributes(source, target, error_msg);
+        });
     }
 
     virtual int on_reached_symlink() override
     {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
-
-        // Find current symlink target
-        std::string symlink_path;
-        if (!read_link(_curr->fts_accpath, &symlink_path)) {
-            _error_msg = format("%s: Failed to read symlink path: %s",
-                                _curr->fts_accpath, strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
-
-        // Create new symlink
-        if (symlink(symlink_path.c_str(), _curtgtpath.c_str()) < 0) {
-            _error_msg = format("%s: Failed to create symlink: %s",
-                                _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
+        return dispatch([this](const std::string &source,
+                               const std::string &target,
+                               std::string *error_msg) {
+            if (!remove_existing_file(target, error_msg)) {
+                return false;
+            }
 
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
+            // Find current symlink target
+            std::string symlink_path;
+            if (!read_link(source, &symlink_path)) {
+                *error_msg = format("%s: Failed to read symlink path: %s",
+                                    source.c_str(), strerror(errno));
+                LOGW("%s", error_msg->c_str());
+                return false;
+            }
 
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
+            // Create new symlink
+            if (symlink(symlink_path.c_str(), target.c_str()) < 0) {
+                *error_msg = format("%s: Failed to create symlink: %s",
+                                    target.c_str(), strerror(errno));
+                LOGW("%s", error_msg->c_str());
+                return false;
+            }
 
-        return Action::FTS_OK;
+            return copy_attributes(source, target, error_msg);
+        });
     }
 
     virtual int on_reached_block_device() override
     {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
+        dev_t rdev = _curr->fts_statp->st_rdev;
 
-        if (mknod(_curtgtpath.c_str(), S_IFBLK | S_IRWXU,
-                _curr->fts_statp->st_rdev) < 0) {
-            _error_msg = format("%s: Failed to create block device: %s",
-                                _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
+        return dispatch([this, rdev](const std::string &source,
+                                     const std::string &target,
+                                     std::string *error_msg) {
+            if (!remove_existing_file(target, error_msg)) {
+                return false;
+            }
 
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
+            if (mknod(target.c_str(), S_IFBLK | S_IRWXU, rdev) < 0) {
+                *error_msg = format("%s: Failed to create block device: %s",
+                                    target.c_str(), strerror(errno));
+                LOGW("%s", error_msg->c_str());
+                return false;
+            }
 
-        return Action::FTS_OK;
+            return copy_attributes(source, target, error_msg);
+        });
     }
 
     virtual int on_reached_character_device() override
     {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
+        dev_t rdev = _curr->fts_statp->st_rdev;
 
-        if (mknod(_curtgtpath.c_str(), S_IFCHR | S_IRWXU,
-                _curr->fts_statp->st_rdev) < 0) {
-            _error_msg = format("%s: Failed to create character device: %s",
-                                _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
+        return dispatch([this, rdev](const std::string &source,
+                                     const std::string &target,
+                                     std::string *error_msg) {
+            if (!remove_existing_file(target, error_msg)) {
+                return false;
+            }
 
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
+            if (mknod(target.c_str(), S_IFCHR | S_IRWXU, rdev) < 0) {
+                *error_msg = format("%s: Failed to create character device: %s",
+                                    target.c_str(), strerror(errno));
+                LOGW("%s", error_msg->c_str());
+                return false;
+            }
 
-        return Action::FTS_OK;
+            return copy_attributes(source, target, error_msg);
+        });
     }
 
     virtual int on_reached_fifo() override
     {
-        if (!remove_existing_file()) {
-            return Action::FTS_Fail;
-        }
-
-        if (mkfifo(_curtgtpath.c_str(), S_IRWXU) < 0) {
-            _error_msg = format("%s: Failed to create FIFO pipe: %s",
-                                _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
-            return Action::FTS_Fail;
-        }
-
-        if (!cp_attrs()) {
-            return Action::FTS_Fail;
-        }
+        return dispatch([this](const std::string &source,
+                               const std::string &target,
+                               std::string *error_msg) {
+            if (!remove_existing_file(target, error_msg)) {
+                return false;
+            }
 
-        if (!cp_xattrs()) {
-            return Action::FTS_Fail;
-        }
+            if (mkfifo(target.c_str(), S_IRWXU) < 0) {
+                *error_msg = format("%s: Failed to create FIFO pipe: %s",
+                                    target.c_str(), strerror(errno));
+                LOGW("%s", error_msg->c_str());
+                return false;
+            }
 
-        return Action::FTS_OK;
+            return copy_attributes(source, target, error_msg);
+        });
     }
 
     virtual int on_reached_socket() override
@@ -593,18 +1130,147 @@ public:
     }
 
 private:
+    typedef std::function<bool(const std::string &source,
+                               const std::string &target,
+                               std::string *error_msg)> CopyFn;
+
+    // Directory whose attributes are applied once all of its children have
+    // been copied
+    struct DirNode
+    {
+        std::string source;
+        std::string target;
+        DirNode *parent;
+        // 1 until on_reached_directory_post() + 1 per unfinished child
+        std::atomic<unsigned int> pending;
+
+        DirNode(std::string source_, std::string target_, DirNode *parent_)
+            : source(std::move(source_)), target(std::move(target_)),
+            parent(parent_), pending(1)
+        {
+        }
+    };
+
     int _copyflags;
     std::string _target;
     struct stat sb_target;
     std::string _curtgtpath;
+    std::atomic<unsigned int> _strategy_counts[COPY_STRATEGY_COUNT] = {};
+    Progress *_progress;
+
+    // Parallel copies
+    std::unique_ptr<ThreadPool> _pool;
+    std::vector<DirNode *> _dir_stack;
+    std::atomic<bool> _worker_failed{false};
+    // Protects _worker_error
+    pthread_mutex_t _mutex;
+    std::string _worker_error;
+
+    /*!
+     * \brief Run a copy operation for the current path
+     *
+     * In parallel mode, the operation is queued on the thread pool and the
+     * parent directory's attributes are not applied until it finishes.
+     */
+    int dispatch(CopyFn fn)
+    {
+        if (!_pool) {
+            if (!fn(_curr->fts_accpath, _curtgtpath, &_error_msg)) {
+                return Action::FTS_Fail;
+            }
+            if (_progress) {
+                ++_progress->files;
+            }
+            return Action::FTS_OK;
+        }
+
+        DirNode *parent = _dir_stack.empty() ? nullptr : _dir_stack.back();
+        if (parent) {
+            ++parent->pending;
+        }
+
+        std::string source(_curr->fts_accpath);
+        std::string target(_curtgtpath);
+
+        _pool->submit([this, fn, source, target, parent] {
+            // Queued copies are dropped once the operation is cancelled, but
+            // the directory nodes still need to be released
+            if (!is_cancelled()) {
+                std::string error_msg;
+                if (!fn(source, target, &error_msg)) {
+                    set_worker_error(error_msg);
+                } else if (_progress) {
+                    ++_progress->files;
+                }
+            }
+            finish_node(parent);
+        });
+
+        return Action::FTS_OK;
+    }
+
+    /*!
+     * \brief Mark one child of a directory (or the directory's traversal) as
+     *        done and apply the attributes of every directory that is now
+     *        complete
+     */
+    void finish_node(DirNode *node)
+    {
+        while (node && --node->pending == 0) {
+            std::string error_msg;
+            if (!copy_attributes(node->source, node->target, &error_msg)) {
+                set_worker_error(error_msg);
+            }
+
+            DirNode *parent = node->parent;
+            delete node;
+            node = parent;
+        }
+    }
+
+    bool is_cancelled() const
+    {
+        return _progress && _progress->cancelled;
+    }
+
+    void set_worker_error(const std::string &error_msg)
+    {
+        pthread_mutex_lock(&_mutex);
+        if (!_worker_failed) {
+            _worker_error = error_msg;
+            _worker_failed = true;
+        }
+        pthread_mutex_unlock(&_mutex);
+    }
 
-    bool remove_existing_file()
+    bool remove_existing_file(const std::string &target,
+                              std::string *error_msg)
     {
         // Remove existing file
-        if (unlink(_curtgtpath.c_str()) < 0 && errno != ENOENT) {
-            _error_msg = format("%s: Failed to remove old path: %s",
-                                _curtgtpath.c_str(), strerror(errno));
-            LOGW("%s", _error_msg.c_str());
+        if (unlink(target.c_str()) < 0 && errno != ENOENT) {
+            *error_msg = format("%s: Failed to remove old path: %s",
+                                target.c_str(), strerror(errno));
+            LOGW("%s", error_msg->c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool copy_attributes(const std::string &source, const std::string &target,
+                         std::string *error_msg)
+    {
+        if ((_copyflags & COPY_ATTRIBUTES)
+                && !copy_stat(source, target)) {
+            *error_msg = format("%s: Failed to copy attributes: %s",
+                                target.c_str(), strerror(errno));
+            LOGW("%s", error_msg->c_str());
+            return false;
+        }
+        if ((_copyflags & COPY_XATTRS)
+                && !copy_xattrs(source, target)) {
+            *error_msg = format("%s: Failed to copy xattrs: %s",
+                                target.c_str(), strerror(errno));
+            LOGW("%s", error_msg->c_str());
             return false;
         }
         return true;
@@ -636,12 +1302,38 @@ private:
 };
 
 
-// Copy as much as possible
+/*!
+ * \brief Recursively copy a directory
+ *
+ * As much as possible is copied, even if some paths fail.
+ *
+ * If \a flags contains COPY_PARALLEL, the directory tree is created in order
+ * on the calling thread, while files, symlinks, and special files are copied
+ * (along with their attributes) on a pool of worker threads. A directory's
+ * attributes are applied only after all of its children have been copied.
+ */
 bool copy_dir(const std::string &source, const std::string &target, int flags)
+{
+    return copy_dir(source, target, flags, nullptr);
+}
+
+/*!
+ * \brief Recursively copy a directory and report the progress
+ *
+ * \param progress If not nullptr, the number of bytes copied and the number of
+ *                 non-directory paths copied are added to the counters as the
+ *                 copy proceeds. Once the cancelled flag is set, no new paths
+ *                 are copied, the file currently being copied is interrupted,
+ *                 and the function returns false.
+ *
+ * \sa copy_dir(const std::string &, const std::string &, int)
+ */
+bool copy_dir(const std::string &source, const std::string &target, int flags,
+              Progress *progress)
 {
     mode_t old_umask = umask(0);
 
-    RecursiveCopier copier(source, target, flags);
+    RecursiveCopier copier(source, target, flags, progress);
     bool ret = copier.run();
 
     umask(old_umask);
@@ -21,6 +21,8 @@
 
 #include <string>
 
+#include "util/progress.h"
+
 namespace mb
 {
 namespace util
@@ -31,15 +33,37 @@ enum CopyFlags : int
     COPY_ATTRIBUTES          = 0x1,
     COPY_XATTRS              = 0x2,
     COPY_EXCLUDE_TOP_LEVEL   = 0x4,
-    COPY_FOLLOW_SYMLINKS     = 0x8
+    COPY_FOLLOW_SYMLINKS     = 0x8,
+    // Only used by copy_dir()
+    COPY_PARALLEL            = 0x10
 };
 
-bool copy_data_fd(int fd_source, int fd_target);
+// Method used to transfer data, in order of preference
+enum CopyStrategy : int
+{
+    COPY_STRATEGY_NONE = 0,
+    COPY_STRATEGY_REFLINK,
+    COPY_STRATEGY_COPY_FILE_RANGE,
+    COPY_STRATEGY_SENDFILE,
+    COPY_STRATEGY_SPLICE,
+    COPY_STRATEGY_READ_WRITE,
+    COPY_STRATEGY_COUNT
+};
+
+const char * copy_strategy_name(CopyStrategy strategy);
+
+bool copy_data_fd(int fd_source, int fd_target,
+                  CopyStrategy *strategy = nullptr,
+                  Progress *progress = nullptr);
 bool copy_xattrs(const std::string &source, const std::string &target);
 bool copy_stat(const std::string &source, const std::string &target);
 bool copy_contents(const std::string &source, const std::string &target);
 bool copy_file(const std::string &source, const std::string &target, int flags);
+bool copy_file(const std::string &source, const std::string &target, int flags,
+               Progress *progress);
 bool copy_dir(const std::string &source, const std::string &target, int flags);
+bool copy_dir(const std::string &source, const std::string &target, int flags,
+              Progress *progress);
 
 }
 }
@@ -19,76 +19,593 @@
 
 #include "util/delete.h"
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
 #include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-#include "util/fts.h"
+#include "util/finally.h"
 #include "util/logging.h"
+#include "util/path.h"
 #include "util/string.h"
+#include "util/threadpool.h"
+#include "util/time.h"
+
+// Name of the trash directory at the root of each filesystem
+#define TRASH_DIR_NAME          ".mbtool-trash"
+// Maximum number of directories waiting to be deleted in parallel mode
+#define MAX_QUEUED_DELETES      256
 
 namespace mb
 {
 namespace util
 {
 
-class RecursiveDeleter : public FTSWrapper {
+class RecursiveDeleter
+{
 public:
-    RecursiveDeleter(std::string path)
-        : FTSWrapper(path, FTS_GroupSpecialFiles)
+    RecursiveDeleter(std::string path, int flags,
+                     const std::vector<std::string> &excludes)
+        : _path(std::move(path)), _flags(flags), _excludes(excludes)
     {
+        if (_flags & DELETE_CONTENTS_ONLY) {
+            _excludes.push_back(TRASH_DIR_NAME);
+        }
     }
 
-    virtual int on_reached_directory_pre() override
+    bool run()
     {
-        // Do nothing. Need depth-first search, so directories are deleted in
-        // on_reached_directory_post()
-        return Action::FTS_OK;
+        uint64_t start = current_time_ms();
+
+        if (_flags & DELETE_PARALLEL) {
+            _pool.reset(new ThreadPool(0, MAX_QUEUED_DELETES));
+        }
+
+        delete_dir(new Node(_path, nullptr));
+
+        if (_pool) {
+            _pool->wait();
+            _pool.reset();
+        }
+
+        _elapsed_ms = current_time_ms() - start;
+
+        return !_failed;
     }
 
-    virtual int on_reached_directory_post() override
+    void stats(DeleteStats *stats) const
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        stats->files = _files;
+        stats->directories = _directories;
+        stats->elapsed_ms = _elapsed_ms;
     }
 
-    virtual int on_reached_file() override
+private:
+    // Directory that is removed once all of its children have been deleted
+    struct Node
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
-    }
+        std::string path;
+        Node *parent;
+        // 1 until the directory has been read + 1 per unfinished subdirectory
+        std::atomic<unsigned int> pending;
+        // Whether the directory is on another filesystem and must be kept
+        bool mountpoint;
+
+        Node(std::string path_, Node *parent_)
+            : path(std::move(path_)), parent(parent_), pending(1),
+            mountpoint(false)
+        {
+        }
+    };
 
-    virtual int on_reached_symlink() override
+    std::string _path;
+    int _flags;
+    std::vector<std::string> _excludes;
+    std::unique_ptr<ThreadPool> _pool;
+    std::atomic<uint64_t> _files{0};
+    std::atomic<uint64_t> _directories{0};
+    std::atomic<bool> _failed{false};
+    uint64_t _elapsed_ms = 0;
+    // Device of the top level directory. Set before any subdirectory is read.
+    dev_t _dev = 0;
+
+    bool is_excluded(const char *name) const
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        return std::find(_excludes.begin(), _excludes.end(), name)
+                != _excludes.end();
     }
 
-    virtual int on_reached_special_file() override
+    /*!
+     * \brief Delete a directory's contents and then the directory itself
+     *
+     * Files are removed with unlinkat() relative to the open directory.
+     * Subdirectories are queued on the thread pool if there's room and are
+     * deleted on the current thread otherwise.
+     *
+     * Like FTS_XDEV in FTSWrapper, mountpoint boundaries are never crossed. A
+     * subdirectory on a different device than the top level directory is left
+     * untouched, along with everything mounted under it.
+     */
+    void delete_dir(Node *node)
     {
-        return delete_path() ? Action::FTS_OK : Action::FTS_Fail;
+        int fd = open(node->path.c_str(),
+                      O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno != ENOENT) {
+                LOGE("%s: Failed to open directory: %s",
+                     node->path.c_str(), strerror(errno));
+                _failed = true;
+            }
+            finish_node(node);
+            return;
+        }
+
+        struct stat sb;
+        if (fstat(fd, &sb) < 0) {
+            LOGE("%s: Failed to stat: %s",
+                 node->path.c_str(), strerror(errno));
+            _failed = true;
+            close(fd);
+            finish_node(node);
+            return;
+        }
+
+        if (!node->parent) {
+            _dev = sb.st_dev;
+        } else if (sb.st_dev != _dev) {
+            LOGW("%s: Skipping mountpoint", node->path.c_str());
+            node->mountpoint = true;
+            close(fd);
+            finish_node(node);
+            return;
+        }
+
+        DIR *dp = fdopendir(fd);
+        if (!dp) {
+            LOGE("%s: Failed to open directory: %s",
+                 node->path.c_str(), strerror(errno));
+            _failed = true;
+            close(fd);
+            finish_node(node);
+            return;
+        }
+
+        struct dirent *ent;
+        while ((ent = readdir(dp))) {
+            if (strcmp(ent->d_name, ".") == 0
+                    || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+
+            // Exclusions only apply to the top level
+            if (!node->parent && is_excluded(ent->d_name)) {
+                continue;
+            }
+
+            bool is_dir = ent->d_type == DT_DIR;
+
+            if (ent->d_type == DT_UNKNOWN) {
+                if (fstatat(fd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+                    if (errno != ENOENT) {
+                        LOGE("%s/%s: Failed to stat: %s", node->path.c_str(),
+                             ent->d_name, strerror(errno));
+                        _failed = true;
+                    }
+                    continue;
+                }
+                is_dir = S_ISDIR(sb.st_mode);
+            }
+
+            if (!is_dir) {
+                if (unlinkat(fd, ent->d_name, 0) == 0) {
+                    ++_files;
+                } else if (errno != ENOENT) {
+                    LOGE("%s/%s: Failed to remove: %s", node->path.c_str(),
+                         ent->d_name, strerror(errno));
+                    _failed = true;
+                }
+                continue;
+            }
+
+            std::string child_path(node->path);
+            child_path += "/";
+            child_path += ent->d_name;
+
+            Node *child = new Node(std::move(child_path), node);
+            ++node->pending;
+
+            if (!_pool || !_pool->try_submit([this, child] {
+                delete_dir(child);
+            })) {
+                delete_dir(child);
+            }
+        }
+
+        closedir(dp);
+
+        finish_node(node);
     }
 
-private:
-    bool delete_path()
+    /*!
+     * \brief Mark one child of a directory (or the reading of the directory)
+     *        as done and remove every directory that is now empty
+     */
+    void finish_node(Node *node)
     {
-        if (remove(_curr->fts_accpath) < 0) {
-            _error_msg = format("%s: Failed to remove: %s",
-                                _curr->fts_path, strerror(errno));
-            LOGE("%s", _error_msg.c_str());
-            return false;
+        while (node && --node->pending == 0) {
+            bool keep = node->mountpoint
+                    || (!node->parent && (_flags & DELETE_CONTENTS_ONLY));
+
+            if (!keep) {
+                if (rmdir(node->path.c_str()) == 0) {
+                    ++_directories;
+                } else if (errno != ENOENT) {
+                    LOGE("%s: Failed to remove: %s",
+                         node->path.c_str(), strerror(errno));
+                    _failed = true;
+                }
+            }
+
+            Node *parent = node->parent;
+            delete node;
+            node = parent;
         }
-        return true;
     }
 };
 
+static void log_stats(const std::string &path, const DeleteStats &stats)
+{
+    LOGD("%s: Deleted %" PRIu64 " files and %" PRIu64 " directories"
+         " in %" PRIu64 "ms (%.0f files/s)", path.c_str(), stats.files,
+         stats.directories, stats.elapsed_ms,
+         stats.elapsed_ms > 0 ? stats.files * 1000.0 / stats.elapsed_ms
+                 : static_cast<double>(stats.files));
+}
+
+/*!
+ * \brief Find the highest directory containing \a path on the same device
+ */
+static std::string find_filesystem_root(const std::string &path, dev_t dev)
+{
+    std::string root(path);
+    struct stat sb;
+
+    while (true) {
+        std::string parent = dir_name(root);
+        if (parent == root || lstat(parent.c_str(), &sb) < 0
+                || sb.st_dev != dev) {
+            break;
+        }
+        root = std::move(parent);
+    }
+
+    return root;
+}
+
+/*!
+ * \brief Close inherited sockets
+ *
+ * This keeps a background process from holding open the connection of the
+ * daemon client that started it.
+ */
+static void close_sockets()
+{
+    DIR *dp = opendir("/proc/self/fd");
+    if (!dp) {
+        return;
+    }
+
+    auto close_dp = finally([&]{
+        closedir(dp);
+    });
+
+    struct stat sb;
+
+    struct dirent *ent;
+    while ((ent = readdir(dp))) {
+        char *end;
+        long fd = strtol(ent->d_name, &end, 10);
+        if (*ent->d_name == '\0' || *end != '\0' || fd == dirfd(dp)) {
+            continue;
+        }
+
+        if (fstat(fd, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+            close(fd);
+        }
+    }
+}
+
+/*!
+ * \brief Delete the trash directory from a detached process
+ *
+ * The process is double forked so it is reparented to init and never becomes
+ * a zombie of the caller. Since the caller may be multithreaded (eg. a daemon
+ * worker thread), the forked processes only exec the wipe-trash tool and never
+ * run any code that may take a lock.
+ */
+static bool empty_trash_in_background(const std::string &trash_dir)
+{
+    // Reports exec() failures from the grandchild. On success, the write end
+    // is closed by exec() and the read returns EOF.
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        LOGE("Failed to create pipe: %s", strerror(errno));
+        return false;
+    }
+
+    auto close_read = finally([&]{
+        close(pipefd[0]);
+    });
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        LOGE("Failed to fork: %s", strerror(errno));
+        close(pipefd[1]);
+        return false;
+    } else if (pid == 0) {
+        pid = fork();
+        if (pid != 0) {
+            _exit(pid < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+
+        execl("/proc/self/exe", "mbtool", "wipe-trash", trash_dir.c_str(),
+              nullptr);
+
+        int saved_errno = errno;
+        if (write(pipefd[1], &saved_errno, sizeof(saved_errno)) < 0) {
+            // Nothing else can be done
+        }
+        _exit(127);
+    }
+
+    close(pipefd[1]);
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        // SIGCHLD may be ignored, in which case the child is reaped
+        // automatically
+        if (errno != ECHILD) {
+            LOGE("Failed to wait for process: %s", strerror(errno));
+            return false;
+        }
+    } else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        LOGE("Failed to start background deletion of %s", trash_dir.c_str());
+        return false;
+    }
+
+    int exec_errno;
+    ssize_t n;
+    do {
+        n = read(pipefd[0], &exec_errno, sizeof(exec_errno));
+    } while (n < 0 && errno == EINTR);
+
+    if (n == sizeof(exec_errno)) {
+        LOGE("Failed to execute wipe-trash: %s", strerror(exec_errno));
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Move \a path (or its contents) into a new directory in the trash
+ *
+ * This is only a series of renames, so it takes the same amount of time no
+ * matter how many files there are. Paths that can't be moved are left in
+ * place.
+ *
+ * \return Path to the trash directory or an empty string if nothing could be
+ *         moved
+ */
+static std::string move_to_trash(const std::string &path, dev_t dev, int flags,
+                                 const std::vector<std::string> &excludes)
+{
+    std::string trash_dir(find_filesystem_root(path, dev));
+    if (trash_dir.empty() || trash_dir.back() != '/') {
+        trash_dir += "/";
+    }
+    trash_dir += TRASH_DIR_NAME;
+
+    if (mkdir(trash_dir.c_str(), 0700) < 0 && errno != EEXIST) {
+        LOGW("%s: Failed to create directory: %s",
+             trash_dir.c_str(), strerror(errno));
+        return std::string();
+    }
+
+    std::string job_dir_template(trash_dir);
+    job_dir_template += "/XXXXXX";
+    std::vector<char> job_dir(job_dir_template.begin(),
+                              job_dir_template.end());
+    job_dir.push_back('\0');
+
+    if (!mkdtemp(job_dir.data())) {
+        LOGW("%s: Failed to create temporary directory: %s",
+             job_dir_template.c_str(), strerror(errno));
+        return std::string();
+    }
+
+    std::string target(job_dir.data());
+    target += "/";
+
+    if (!(flags & DELETE_CONTENTS_ONLY)) {
+        if (rename(path.c_str(), (target + base_name(path)).c_str()) < 0) {
+            LOGW("%s: Failed to move to trash: %s",
+                 path.c_str(), strerror(errno));
+            rmdir(job_dir.data());
+            return std::string();
+        }
+        return trash_dir;
+    }
+
+    DIR *dp = opendir(path.c_str());
+    if (!dp) {
+        LOGW("%s: Failed to open directory: %s",
+             path.c_str(), strerror(errno));
+        rmdir(job_dir.data());
+        return std::string();
+    }
+
+    auto close_dp = finally([&]{
+        closedir(dp);
+    });
+
+    struct dirent *ent;
+    while ((ent = readdir(dp))) {
+        if (strcmp(ent->d_name, ".") == 0
+                || strcmp(ent->d_name, "..") == 0
+                || strcmp(ent->d_name, TRASH_DIR_NAME) == 0
+                || std::find(excludes.begin(), excludes.end(), ent->d_name)
+                        != excludes.end()) {
+            continue;
+        }
+
+        std::string source(path);
+        source += "/";
+        source += ent->d_name;
+
+        if (renameat(dirfd(dp), ent->d_name, AT_FDCWD,
+                     (target + ent->d_name).c_str()) < 0) {
+            // Mountpoints and the like are deleted in place afterwards
+            LOGW("%s: Failed to move to trash: %s",
+                 source.c_str(), strerror(errno));
+        }
+    }
+
+    return trash_dir;
+}
+
 bool delete_recursive(const std::string &path)
 {
+    return delete_recursive(path, 0, {}, nullptr);
+}
+
+/*!
+ * \brief Recursively delete a path
+ *
+ * As much as possible is deleted, even if some paths fail.
+ *
+ * If \a flags contains DELETE_PARALLEL, subdirectories are deleted on a pool of
+ * worker threads.
+ *
+ * If \a flags contains DELETE_IN_BACKGROUND, the paths are renamed into a trash
+ * directory at the root of the filesystem and this function returns once a
+ * background process has been started to delete them. Anything that can't be
+ * moved is deleted before returning.
+ *
+ * \param path Path to delete. If it does not exist, this function succeeds.
+ * \param flags DeleteFlags
+ * \param excludes Names in the top level directory to keep. Only used with
+ *                 DELETE_CONTENTS_ONLY.
+ * \param stats Statistics for the paths deleted before returning (may be
+ *              nullptr)
+ */
+bool delete_recursive(const std::string &path, int flags,
+                      const std::vector<std::string> &excludes,
+                      DeleteStats *stats)
+{
+    if (stats) {
+        stats->files = 0;
+        stats->directories = 0;
+        stats->elapsed_ms = 0;
+    }
+
     struct stat sb;
-    if (stat(path.c_str(), &sb) < 0 && errno == ENOENT) {
-        // Don't fail if directory does not exist
+    if (lstat(path.c_str(), &sb) < 0) {
+        if (errno == ENOENT) {
+            // Don't fail if directory does not exist
+            return true;
+        }
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!S_ISDIR(sb.st_mode)) {
+        if (flags & DELETE_CONTENTS_ONLY) {
+            LOGE("%s: Not a directory", path.c_str());
+            return false;
+        }
+        if (unlink(path.c_str()) < 0 && errno != ENOENT) {
+            LOGE("%s: Failed to remove: %s", path.c_str(), strerror(errno));
+            return false;
+        }
+        if (stats) {
+            stats->files = 1;
+        }
         return true;
     }
 
-    RecursiveDeleter deleter(path);
-    return deleter.run();
+    if (flags & DELETE_IN_BACKGROUND) {
+        std::string trash_dir = move_to_trash(path, sb.st_dev, flags, excludes);
+        if (!trash_dir.empty() && !empty_trash_in_background(trash_dir)) {
+            // Fall back to deleting the trash now
+            RecursiveDeleter deleter(trash_dir, flags & DELETE_PARALLEL, {});
+            deleter.run();
+        }
+    }
+
+    // Delete anything that is left
+    RecursiveDeleter deleter(path, flags, excludes);
+    bool ret = deleter.run();
+
+    if (stats) {
+        deleter.stats(stats);
+    }
+
+    // The background process reports its own statistics
+    if ((flags & DELETE_PARALLEL) && !(flags & DELETE_IN_BACKGROUND)) {
+        DeleteStats s;
+        deleter.stats(&s);
+        log_stats(path, s);
+    }
+
+    return ret;
+}
+
+static void wipe_trash_usage(FILE *stream)
+{
+    fprintf(stream,
+            "Usage: wipe-trash <trash directory>\n\n"
+            "Deletes a trash directory created by a background deletion. This\n"
+            "is started automatically and is not meant to be run manually.\n");
+}
+
+int wipe_trash_main(int argc, char *argv[])
+{
+    if (argc == 2 && strcmp(argv[1], "--help") == 0) {
+        wipe_trash_usage(stdout);
+        return EXIT_SUCCESS;
+    } else if (argc != 2) {
+        wipe_trash_usage(stderr);
+        return EXIT_FAILURE;
+    }
+
+    // Don't hold open the connection of the daemon client that started us
+    close_sockets();
+
+    std::string trash_dir(argv[1]);
+    if (base_name(trash_dir) != TRASH_DIR_NAME) {
+        LOGE("%s: Not a trash directory", trash_dir.c_str());
+        return EXIT_FAILURE;
+    }
+
+    RecursiveDeleter deleter(trash_dir, DELETE_PARALLEL, {});
+    bool ret = deleter.run();
+
+    DeleteStats stats;
+    deleter.stats(&stats);
+    log_stats(trash_dir, stats);
+
+    return ret ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 }
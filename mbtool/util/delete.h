@@ -20,13 +20,41 @@
 #pragma once
 
 #include <string>
+#include <vector>
+
+#include <cstdint>
 
 namespace mb
 {
 namespace util
 {
 
+enum DeleteFlags : int
+{
+    // Delete the directory's contents, but keep the directory itself
+    DELETE_CONTENTS_ONLY     = 0x1,
+    // Delete subdirectories on a pool of worker threads
+    DELETE_PARALLEL          = 0x2,
+    // Move the paths into a trash directory on the same filesystem and delete
+    // it from a background process
+    DELETE_IN_BACKGROUND     = 0x4
+};
+
+struct DeleteStats
+{
+    // Number of non-directories deleted
+    uint64_t files;
+    // Number of directories deleted
+    uint64_t directories;
+    uint64_t elapsed_ms;
+};
+
 bool delete_recursive(const std::string &path);
+bool delete_recursive(const std::string &path, int flags,
+                      const std::vector<std::string> &excludes,
+                      DeleteStats *stats);
+
+int wipe_trash_main(int argc, char *argv[]);
 
 }
-}
\ No newline at end of file
+}
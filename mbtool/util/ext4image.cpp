@@ -0,0 +1,815 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "util/ext4image.h"
+
+#include <vector>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util/finally.h"
+#include "util/logging.h"
+#include "util/loopdev.h"
+#include "util/mount.h"
+
+// Only the superblock, group descriptors, a few bitmaps, the first inode
+// table block, the root and lost+found directories, and the journal
+// superblock are written. Everything else is a hole in the sparse file, so
+// the block and inode bitmaps of the other groups are left uninitialized
+// (uninit_bg) and all inode tables are marked as zeroed. The kernel then has
+// no reason to write to them either (no lazy itable init).
+
+#define BLOCK_SIZE              4096
+#define LOG_BLOCK_SIZE          2           // log2(BLOCK_SIZE) - 10
+#define BLOCKS_PER_GROUP        (8 * BLOCK_SIZE)
+#define INODE_SIZE              256
+#define INODES_PER_BLOCK        (BLOCK_SIZE / INODE_SIZE)
+#define BYTES_PER_INODE         16384
+#define DESC_SIZE               32
+#define DESCS_PER_BLOCK         (BLOCK_SIZE / DESC_SIZE)
+#define EXTRA_ISIZE             32
+// Same as make_ext4fs: 1/64th of the filesystem, clamped to 4-128 MiB
+#define MIN_JOURNAL_BLOCKS      1024
+#define MAX_JOURNAL_BLOCKS      32768
+// Don't bother with a journal for tiny filesystems
+#define JOURNAL_MIN_FS_BLOCKS   2048
+#define LOST_FOUND_BLOCKS       4
+// Same as mke2fs: the last group is dropped if it can't hold this many data
+// blocks
+#define MIN_LAST_GROUP_DATA     50
+
+#define EXT4_SUPER_MAGIC        0xef53
+#define EXT4_GOOD_OLD_FIRST_INO 11
+#define EXT4_ROOT_INO           2
+#define EXT4_JOURNAL_INO        8
+#define EXT4_LOST_FOUND_INO     11
+
+#define COMPAT_HAS_JOURNAL      0x0004
+#define COMPAT_EXT_ATTR         0x0008
+#define COMPAT_DIR_INDEX        0x0020
+#define INCOMPAT_FILETYPE       0x0002
+#define INCOMPAT_EXTENTS        0x0040
+#define RO_COMPAT_SPARSE_SUPER  0x0001
+#define RO_COMPAT_LARGE_FILE    0x0002
+#define RO_COMPAT_HUGE_FILE     0x0008
+#define RO_COMPAT_GDT_CSUM      0x0010
+#define RO_COMPAT_DIR_NLINK     0x0020
+#define RO_COMPAT_EXTRA_ISIZE   0x0040
+
+#define BG_INODE_UNINIT         0x0001
+#define BG_BLOCK_UNINIT         0x0002
+#define BG_INODE_ZEROED         0x0004
+
+#define EXT4_EXTENTS_FL         0x00080000
+#define EXT4_EXT_MAGIC          0xf30a
+#define EXT4_MAX_EXTENT_LEN     32768
+#define EXT4_INODE_EXTENTS      4
+
+#define EXT4_FT_DIR             2
+
+#define JBD2_MAGIC              0xc03b3998
+#define JBD2_SUPERBLOCK_V2      4
+
+#define EXT3_JNL_BACKUP_BLOCKS  1
+
+#define EXT2_FLAGS_SIGNED_HASH      0x0001
+#define EXT2_FLAGS_UNSIGNED_HASH    0x0002
+#define EXT2_HASH_HALF_MD4          1
+
+#ifndef EXT4_IOC_RESIZE_FS
+#define EXT4_IOC_RESIZE_FS      _IOW('f', 16, uint64_t)
+#endif
+
+namespace mb
+{
+namespace util
+{
+
+struct Extent
+{
+    uint32_t start;
+    uint32_t len;
+};
+
+struct Layout
+{
+    uint32_t blocks;
+    uint32_t groups;
+    uint32_t inodes_per_group;
+    uint32_t itable_blocks;
+    uint32_t gdt_blocks;
+    uint32_t journal_blocks;
+};
+
+static inline void put_le16(unsigned char *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static inline void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static inline void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// CRC16 with polynomial 0x8005 (bit reversed), like the kernel's crc16()
+static uint16_t crc16(uint16_t crc, const unsigned char *data, std::size_t len)
+{
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; ++i) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+static bool group_has_super(uint32_t group)
+{
+    if (group <= 1) {
+        return true;
+    }
+    for (uint32_t base : { 3, 5, 7 }) {
+        uint32_t n = base;
+        while (n < group) {
+            n *= base;
+        }
+        if (n == group) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t group_first_block(uint32_t group)
+{
+    return group * BLOCKS_PER_GROUP;
+}
+
+static uint32_t group_blocks(const Layout &l, uint32_t group)
+{
+    return group == l.groups - 1
+            ? l.blocks - group_first_block(group) : BLOCKS_PER_GROUP;
+}
+
+static uint32_t group_super_blocks(const Layout &l, uint32_t group)
+{
+    return group_has_super(group) ? 1 + l.gdt_blocks : 0;
+}
+
+// All of a group's metadata is at the beginning of the group
+static uint32_t group_meta_blocks(const Layout &l, uint32_t group)
+{
+    return group_super_blocks(l, group) + 2 + l.itable_blocks;
+}
+
+static bool compute_layout(uint64_t size, Layout *l)
+{
+    l->blocks = size / BLOCK_SIZE;
+    if (size / BLOCK_SIZE > UINT32_MAX) {
+        errno = EFBIG;
+        return false;
+    }
+
+    l->groups = (l->blocks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+
+    // Dropping the last group changes the number of inodes per group, so
+    // repeat until the layout no longer changes
+    while (l->groups > 0) {
+        uint64_t inodes = static_cast<uint64_t>(l->blocks) * BLOCK_SIZE
+                / BYTES_PER_INODE;
+        uint32_t ipg = (inodes + l->groups - 1) / l->groups;
+        ipg = (ipg + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK
+                * INODES_PER_BLOCK;
+        if (ipg < INODES_PER_BLOCK) {
+            ipg = INODES_PER_BLOCK;
+        } else if (ipg > BLOCKS_PER_GROUP) {
+            ipg = BLOCKS_PER_GROUP;
+        }
+
+        l->inodes_per_group = ipg;
+        l->itable_blocks = ipg / INODES_PER_BLOCK;
+        l->gdt_blocks = (l->groups + DESCS_PER_BLOCK - 1) / DESCS_PER_BLOCK;
+
+        uint32_t last = l->groups - 1;
+        if (group_blocks(*l, last)
+                >= group_meta_blocks(*l, last) + MIN_LAST_GROUP_DATA) {
+            break;
+        }
+
+        l->blocks = group_first_block(last);
+        --l->groups;
+    }
+
+    if (l->groups == 0) {
+        errno = EINVAL;
+        return false;
+    }
+
+    if (l->blocks < JOURNAL_MIN_FS_BLOCKS) {
+        l->journal_blocks = 0;
+    } else {
+        l->journal_blocks = l->blocks / 64;
+        if (l->journal_blocks < MIN_JOURNAL_BLOCKS) {
+            l->journal_blocks = MIN_JOURNAL_BLOCKS;
+        } else if (l->journal_blocks > MAX_JOURNAL_BLOCKS) {
+            l->journal_blocks = MAX_JOURNAL_BLOCKS;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Allocate data blocks, starting from the beginning of group 0
+ *
+ * \param used Number of data blocks used in each group
+ * \param extents Allocated ranges. Ranges never cross group boundaries.
+ */
+static bool alloc_blocks(const Layout &l, std::vector<uint32_t> *used,
+                         uint32_t count, std::vector<Extent> *extents)
+{
+    uint32_t g = 0;
+
+    while (g < l.groups && count > 0) {
+        uint32_t avail = group_blocks(l, g) - group_meta_blocks(l, g)
+                - (*used)[g];
+        if (avail == 0) {
+            ++g;
+            continue;
+        }
+
+        uint32_t n = count < avail ? count : avail;
+
+        Extent e;
+        e.start = group_first_block(g) + group_meta_blocks(l, g) + (*used)[g];
+        e.len = n;
+
+        // Merge with the previous range if it ends right before this one
+        if (!extents->empty()
+                && extents->back().start + extents->back().len == e.start) {
+            e.start = extents->back().start;
+            e.len += extents->back().len;
+            extents->pop_back();
+        }
+
+        // Split up ranges that are too long for a single extent
+        while (e.len > EXT4_MAX_EXTENT_LEN) {
+            extents->push_back({ e.start, EXT4_MAX_EXTENT_LEN });
+            e.start += EXT4_MAX_EXTENT_LEN;
+            e.len -= EXT4_MAX_EXTENT_LEN;
+        }
+        extents->push_back(e);
+
+        (*used)[g] += n;
+        count -= n;
+    }
+
+    if (count > 0) {
+        errno = ENOSPC;
+        return false;
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Fill in an inode that stores its data in the given extents
+ */
+static bool make_inode(unsigned char *inode, uint16_t mode, uint16_t links,
+                       uint64_t size, const std::vector<Extent> &extents,
+                       uint32_t now)
+{
+    if (extents.size() > EXT4_INODE_EXTENTS) {
+        errno = EFBIG;
+        return false;
+    }
+
+    uint64_t blocks = 0;
+    for (const Extent &e : extents) {
+        blocks += e.len;
+    }
+
+    memset(inode, 0, INODE_SIZE);
+    put_le16(inode + 0x00, mode);
+    put_le32(inode + 0x04, size);
+    put_le32(inode + 0x08, now);
+    put_le32(inode + 0x0c, now);
+    put_le32(inode + 0x10, now);
+    put_le16(inode + 0x1a, links);
+    put_le32(inode + 0x1c, blocks * (BLOCK_SIZE / 512));
+    put_le32(inode + 0x20, EXT4_EXTENTS_FL);
+    put_le32(inode + 0x6c, size >> 32);
+    put_le16(inode + 0x80, EXTRA_ISIZE);
+    put_le32(inode + 0x90, now);
+
+    // Extent header followed by up to 4 leaf extents
+    unsigned char *eh = inode + 0x28;
+    put_le16(eh + 0, EXT4_EXT_MAGIC);
+    put_le16(eh + 2, extents.size());
+    put_le16(eh + 4, EXT4_INODE_EXTENTS);
+    put_le16(eh + 6, 0);
+
+    uint32_t logical = 0;
+    for (std::size_t i = 0; i < extents.size(); ++i) {
+        unsigned char *ee = eh + 12 * (i + 1);
+        put_le32(ee + 0, logical);
+        put_le16(ee + 4, extents[i].len);
+        put_le16(ee + 6, 0);
+        put_le32(ee + 8, extents[i].start);
+        logical += extents[i].len;
+    }
+
+    return true;
+}
+
+static void add_dirent(unsigned char *block, std::size_t *offset,
+                       uint32_t ino, const char *name, bool last)
+{
+    std::size_t name_len = strlen(name);
+    std::size_t rec_len = last ? BLOCK_SIZE - *offset
+            : (8 + name_len + 3) & ~static_cast<std::size_t>(3);
+
+    unsigned char *de = block + *offset;
+    put_le32(de + 0, ino);
+    put_le16(de + 4, rec_len);
+    de[6] = name_len;
+    de[7] = EXT4_FT_DIR;
+    memcpy(de + 8, name, name_len);
+
+    *offset += rec_len;
+}
+
+static void set_bits(unsigned char *bitmap, uint32_t start, uint32_t end)
+{
+    for (uint32_t i = start; i < end; ++i) {
+        bitmap[i / 8] |= 1 << (i % 8);
+    }
+}
+
+static bool write_block(int fd, uint32_t block, const unsigned char *data,
+                        std::size_t size = BLOCK_SIZE, std::size_t offset = 0)
+{
+    off64_t pos = static_cast<off64_t>(block) * BLOCK_SIZE + offset;
+    const unsigned char *ptr = data;
+
+    while (size > 0) {
+        ssize_t n = pwrite64(fd, ptr, size, pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += n;
+        pos += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool get_random_bytes(unsigned char *buf, std::size_t size)
+{
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        close(fd);
+    });
+
+    while (size > 0) {
+        ssize_t n = read(fd, buf, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+static bool write_filesystem(int fd, const Layout &l)
+{
+    uint32_t now = time(nullptr);
+    uint32_t inodes_count = l.inodes_per_group * l.groups;
+
+    unsigned char uuid[16];
+    unsigned char hash_seed[16];
+    if (!get_random_bytes(uuid, sizeof(uuid))
+            || !get_random_bytes(hash_seed, sizeof(hash_seed))) {
+        return false;
+    }
+    // Version 4 (random) UUID
+    uuid[6] = (uuid[6] & 0x0f) | 0x40;
+    uuid[8] = (uuid[8] & 0x3f) | 0x80;
+
+    // Allocate the data blocks
+    std::vector<uint32_t> used(l.groups, 0);
+    std::vector<Extent> root_extents;
+    std::vector<Extent> lost_found_extents;
+    std::vector<Extent> journal_extents;
+
+    if (!alloc_blocks(l, &used, 1, &root_extents)
+            || !alloc_blocks(l, &used, LOST_FOUND_BLOCKS, &lost_found_extents)
+            || !alloc_blocks(l, &used, l.journal_blocks, &journal_extents)) {
+        return false;
+    }
+
+    std::vector<unsigned char> block(BLOCK_SIZE);
+
+    // Inodes (all in the first block of group 0's inode table)
+    unsigned char *root_inode = block.data()
+            + (EXT4_ROOT_INO - 1) * INODE_SIZE;
+    unsigned char *journal_inode = block.data()
+            + (EXT4_JOURNAL_INO - 1) * INODE_SIZE;
+    unsigned char *lost_found_inode = block.data()
+            + (EXT4_LOST_FOUND_INO - 1) * INODE_SIZE;
+
+    if (!make_inode(root_inode, S_IFDIR | 0755, 3, BLOCK_SIZE,
+                    root_extents, now)
+            || !make_inode(lost_found_inode, S_IFDIR | 0700, 2,
+                           LOST_FOUND_BLOCKS * BLOCK_SIZE,
+                           lost_found_extents, now)) {
+        return false;
+    }
+    if (l.journal_blocks > 0 && !make_inode(
+            journal_inode, S_IFREG | 0600, 1,
+            static_cast<uint64_t>(l.journal_blocks) * BLOCK_SIZE,
+            journal_extents, now)) {
+        return false;
+    }
+
+    // Superblock
+    uint64_t free_blocks = 0;
+    for (uint32_t g = 0; g < l.groups; ++g) {
+        free_blocks += group_blocks(l, g) - group_meta_blocks(l, g) - used[g];
+    }
+
+    unsigned char sb[1024];
+    memset(sb, 0, sizeof(sb));
+    put_le32(sb + 0x00, inodes_count);
+    put_le32(sb + 0x04, l.blocks);
+    put_le32(sb + 0x0c, free_blocks);
+    put_le32(sb + 0x10, inodes_count - EXT4_LOST_FOUND_INO);
+    put_le32(sb + 0x14, 0);
+    put_le32(sb + 0x18, LOG_BLOCK_SIZE);
+    put_le32(sb + 0x1c, LOG_BLOCK_SIZE);
+    put_le32(sb + 0x20, BLOCKS_PER_GROUP);
+    put_le32(sb + 0x24, BLOCKS_PER_GROUP);
+    put_le32(sb + 0x28, l.inodes_per_group);
+    put_le32(sb + 0x30, now);
+    put_le16(sb + 0x36, 0xffff);
+    put_le16(sb + 0x38, EXT4_SUPER_MAGIC);
+    put_le16(sb + 0x3a, 1);                     // Cleanly unmounted
+    put_le16(sb + 0x3c, 1);                     // Continue on errors
+    put_le32(sb + 0x40, now);
+    put_le32(sb + 0x4c, 1);                     // Dynamic revision
+    put_le32(sb + 0x54, EXT4_GOOD_OLD_FIRST_INO);
+    put_le16(sb + 0x58, INODE_SIZE);
+    put_le32(sb + 0x5c, COMPAT_EXT_ATTR | COMPAT_DIR_INDEX
+            | (l.journal_blocks > 0 ? COMPAT_HAS_JOURNAL : 0));
+    put_le32(sb + 0x60, INCOMPAT_FILETYPE | INCOMPAT_EXTENTS);
+    put_le32(sb + 0x64, RO_COMPAT_SPARSE_SUPER | RO_COMPAT_LARGE_FILE
+            | RO_COMPAT_HUGE_FILE | RO_COMPAT_GDT_CSUM | RO_COMPAT_DIR_NLINK
+            | RO_COMPAT_EXTRA_ISIZE);
+    memcpy(sb + 0x68, uuid, sizeof(uuid));
+    if (l.journal_blocks > 0) {
+        put_le32(sb + 0xe0, EXT4_JOURNAL_INO);
+    }
+    memcpy(sb + 0xec, hash_seed, sizeof(hash_seed));
+    sb[0xfc] = EXT2_HASH_HALF_MD4;
+    put_le32(sb + 0x108, now);
+    if (l.journal_blocks > 0) {
+        // Backup of the journal inode's block map and size
+        sb[0xfd] = EXT3_JNL_BACKUP_BLOCKS;
+        memcpy(sb + 0x10c, journal_inode + 0x28, 60);
+        put_le32(sb + 0x10c + 15 * 4, 0);
+        put_le32(sb + 0x10c + 16 * 4,
+                 static_cast<uint64_t>(l.journal_blocks) * BLOCK_SIZE);
+    }
+    put_le16(sb + 0x15c, EXTRA_ISIZE);
+    put_le16(sb + 0x15e, EXTRA_ISIZE);
+    // The hash depends on the signedness of char, which differs between
+    // architectures
+    put_le32(sb + 0x160, static_cast<char>(-1) < 0
+            ? EXT2_FLAGS_SIGNED_HASH : EXT2_FLAGS_UNSIGNED_HASH);
+
+    // Group descriptors
+    std::vector<unsigned char> gdt(l.gdt_blocks * BLOCK_SIZE, 0);
+
+    for (uint32_t g = 0; g < l.groups; ++g) {
+        unsigned char *desc = gdt.data() + g * DESC_SIZE;
+        uint32_t bitmap = group_first_block(g) + group_super_blocks(l, g);
+        uint32_t free = group_blocks(l, g) - group_meta_blocks(l, g) - used[g];
+        uint16_t flags = BG_INODE_ZEROED;
+
+        // mke2fs never leaves the last group's block bitmap uninitialized
+        if (used[g] == 0 && g != l.groups - 1) {
+            flags |= BG_BLOCK_UNINIT;
+        }
+        if (g != 0) {
+            flags |= BG_INODE_UNINIT;
+        }
+
+        put_le32(desc + 0x00, bitmap);
+        put_le32(desc + 0x04, bitmap + 1);
+        put_le32(desc + 0x08, bitmap + 2);
+        put_le16(desc + 0x0c, free);
+        put_le16(desc + 0x0e, g == 0 ? l.inodes_per_group - EXT4_LOST_FOUND_INO
+                                     : l.inodes_per_group);
+        put_le16(desc + 0x10, g == 0 ? 2 : 0);
+        put_le16(desc + 0x12, flags);
+        put_le16(desc + 0x1c, g == 0 ? l.inodes_per_group - EXT4_LOST_FOUND_INO
+                                     : l.inodes_per_group);
+
+        unsigned char le_group[4];
+        put_le32(le_group, g);
+        uint16_t crc = crc16(0xffff, uuid, sizeof(uuid));
+        crc = crc16(crc, le_group, sizeof(le_group));
+        crc = crc16(crc, desc, 0x1e);
+        put_le16(desc + 0x1e, crc);
+    }
+
+    // Superblock and group descriptor backups. The primary superblock is
+    // at byte 1024. The backups are at the beginning of their groups.
+    for (uint32_t g = 0; g < l.groups; ++g) {
+        if (!group_has_super(g)) {
+            continue;
+        }
+
+        put_le16(sb + 0x5a, g);
+        if (!write_block(fd, group_first_block(g), sb, sizeof(sb),
+                         g == 0 ? 1024 : 0)
+                || !write_block(fd, group_first_block(g) + 1, gdt.data(),
+                                gdt.size())) {
+            return false;
+        }
+    }
+
+    // Inode table
+    if (!write_block(fd, group_first_block(0) + group_super_blocks(l, 0) + 2,
+                     block.data())) {
+        return false;
+    }
+
+    // Bitmaps that can't be left uninitialized
+    for (uint32_t g = 0; g < l.groups; ++g) {
+        uint32_t bitmap = group_first_block(g) + group_super_blocks(l, g);
+
+        if (used[g] != 0 || g == l.groups - 1) {
+            memset(block.data(), 0, BLOCK_SIZE);
+            set_bits(block.data(), 0, group_meta_blocks(l, g) + used[g]);
+            set_bits(block.data(), group_blocks(l, g), BLOCKS_PER_GROUP);
+            if (!write_block(fd, bitmap, block.data())) {
+                return false;
+            }
+        }
+
+        if (g == 0) {
+            memset(block.data(), 0, BLOCK_SIZE);
+            set_bits(block.data(), 0, EXT4_LOST_FOUND_INO);
+            set_bits(block.data(), l.inodes_per_group, BLOCK_SIZE * 8);
+            if (!write_block(fd, bitmap + 1, block.data())) {
+                return false;
+            }
+        }
+    }
+
+    // Root directory
+    std::size_t offset = 0;
+    memset(block.data(), 0, BLOCK_SIZE);
+    add_dirent(block.data(), &offset, EXT4_ROOT_INO, ".", false);
+    add_dirent(block.data(), &offset, EXT4_ROOT_INO, "..", false);
+    add_dirent(block.data(), &offset, EXT4_LOST_FOUND_INO, "lost+found", true);
+    if (!write_block(fd, root_extents[0].start, block.data())) {
+        return false;
+    }
+
+    // lost+found has a few empty blocks so that e2fsck doesn't have to
+    // allocate any when reconnecting files
+    offset = 0;
+    memset(block.data(), 0, BLOCK_SIZE);
+    add_dirent(block.data(), &offset, EXT4_LOST_FOUND_INO, ".", false);
+    add_dirent(block.data(), &offset, EXT4_ROOT_INO, "..", true);
+    if (!write_block(fd, lost_found_extents[0].start, block.data())) {
+        return false;
+    }
+
+    memset(block.data(), 0, BLOCK_SIZE);
+    put_le16(block.data() + 4, BLOCK_SIZE);
+    for (uint32_t i = 1; i < LOST_FOUND_BLOCKS; ++i) {
+        if (!write_block(fd, lost_found_extents[0].start + i, block.data())) {
+            return false;
+        }
+    }
+
+    // Journal superblock. The rest of the journal is never read before it
+    // is written because the journal starts out empty.
+    if (l.journal_blocks > 0) {
+        memset(block.data(), 0, BLOCK_SIZE);
+        put_be32(block.data() + 0x00, JBD2_MAGIC);
+        put_be32(block.data() + 0x04, JBD2_SUPERBLOCK_V2);
+        put_be32(block.data() + 0x0c, BLOCK_SIZE);
+        put_be32(block.data() + 0x10, l.journal_blocks);
+        put_be32(block.data() + 0x14, 1);
+        put_be32(block.data() + 0x18, 1);
+        memcpy(block.data() + 0x30, uuid, sizeof(uuid));
+        put_be32(block.data() + 0x40, 1);
+        if (!write_block(fd, journal_extents[0].start, block.data())) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Create a sparse ext4 image
+ *
+ * This replaces make_ext4fs. Only about a hundred KiB of metadata is written
+ * regardless of \a size, so creating a multi-GiB image is nearly instant and
+ * doesn't use up any space until files are written to it.
+ *
+ * The filesystem uses 4 KiB blocks, one inode per 16 KiB, extents, and a
+ * journal (for images of 8 MiB or more). There is no resize inode. Online
+ * resizing (ext4_image_grow()) can use the unused descriptors in the last
+ * group descriptor block. If more are needed, the kernel (3.7 or newer)
+ * converts the filesystem to meta_bg.
+ *
+ * \param path Path of the new image. It must not already exist.
+ * \param size Image size in bytes (rounded down to the block size)
+ *
+ * \return Whether the image was created. errno is set on failure.
+ */
+bool ext4_image_create(const std::string &path, uint64_t size)
+{
+    Layout layout;
+    if (!compute_layout(size, &layout)) {
+        LOGE("%s: Invalid image size: %" PRIu64, path.c_str(), size);
+        return false;
+    }
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("%s: Failed to create: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ok = false;
+
+    auto close_fd = finally([&]{
+        int saved_errno = errno;
+        if (close(fd) < 0 && ok) {
+            LOGE("%s: Failed to close: %s", path.c_str(), strerror(errno));
+            ok = false;
+        }
+        if (!ok) {
+            unlink(path.c_str());
+        }
+        errno = saved_errno;
+    });
+
+    if (ftruncate64(fd, static_cast<off64_t>(layout.blocks) * BLOCK_SIZE) < 0) {
+        LOGE("%s: Failed to set size: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!write_filesystem(fd, layout)) {
+        LOGE("%s: Failed to write filesystem: %s",
+             path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (fsync(fd) < 0) {
+        LOGE("%s: Failed to sync: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    LOGD("%s: Created ext4 image with %u blocks, %u groups, %u inodes,"
+         " and %u journal blocks", path.c_str(), layout.blocks, layout.groups,
+         layout.inodes_per_group * layout.groups, layout.journal_blocks);
+
+    ok = true;
+    return true;
+}
+
+/*!
+ * \brief Grow a mounted ext4 image
+ *
+ * The image file is extended, the loop device it's attached to is told
+ * about the new size, and the kernel resizes the filesystem while it stays
+ * mounted (EXT4_IOC_RESIZE_FS, Linux 3.3 or newer).
+ *
+ * \param path Image file
+ * \param mount_point Where the image is mounted
+ * \param size New size in bytes (rounded down to the block size)
+ *
+ * \return Whether the filesystem was resized. errno is set on failure.
+ */
+bool ext4_image_grow(const std::string &path, const std::string &mount_point,
+                     uint64_t size)
+{
+    uint64_t blocks = size / BLOCK_SIZE;
+
+    std::string loopdev;
+    if (!get_mount_source(mount_point, &loopdev)) {
+        LOGE("%s: Failed to find the mounted device", mount_point.c_str());
+        return false;
+    }
+
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        close(fd);
+    });
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (blocks * BLOCK_SIZE < static_cast<uint64_t>(sb.st_size)) {
+        LOGE("%s: Shrinking is not supported", path.c_str());
+        errno = EINVAL;
+        return false;
+    }
+
+    if (ftruncate64(fd, blocks * BLOCK_SIZE) < 0) {
+        LOGE("%s: Failed to set size: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if (!loopdev_set_capacity(loopdev)) {
+        LOGE("%s: Failed to update size of %s: %s", path.c_str(),
+             loopdev.c_str(), strerror(errno));
+        return false;
+    }
+
+    int dfd = open(mount_point.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dfd < 0) {
+        LOGE("%s: Failed to open: %s", mount_point.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_dfd = finally([&]{
+        close(dfd);
+    });
+
+    if (ioctl(dfd, EXT4_IOC_RESIZE_FS, &blocks) < 0) {
+        LOGE("%s: Failed to resize filesystem to %" PRIu64 " blocks: %s",
+             mount_point.c_str(), blocks, strerror(errno));
+        return false;
+    }
+
+    LOGD("%s: Resized filesystem to %" PRIu64 " blocks",
+         mount_point.c_str(), blocks);
+
+    return true;
+}
+
+}
+}
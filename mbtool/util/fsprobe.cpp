@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "util/fsprobe.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "util/finally.h"
+#include "util/logging.h"
+
+// Everything needed is in the first 2 KiB: the FAT/exFAT boot sector at 0 and
+// the ext2/3/4 and F2FS superblocks at 1024
+#define PROBE_SIZE                      2048
+
+#define EXFAT_VOLUME_FLAGS_OFFSET       106
+#define EXFAT_VOLUME_DIRTY              0x0002
+
+#define FAT16_STATE_OFFSET              37
+#define FAT32_STATE_OFFSET              65
+#define FAT_STATE_DIRTY                 0x01
+
+#define EXT_SB_OFFSET                   1024
+#define EXT_MAGIC                       0xef53
+#define EXT_STATE_VALID                 0x0001
+#define EXT_STATE_ERROR                 0x0002
+#define EXT_COMPAT_HAS_JOURNAL          0x0004
+#define EXT_RO_COMPAT_HUGE_FILE         0x0008
+#define EXT_RO_COMPAT_GDT_CSUM          0x0010
+#define EXT_RO_COMPAT_DIR_NLINK         0x0020
+#define EXT_RO_COMPAT_EXTRA_ISIZE       0x0040
+#define EXT_RO_COMPAT_METADATA_CSUM     0x0400
+#define EXT_INCOMPAT_EXTENTS            0x0040
+#define EXT_INCOMPAT_64BIT              0x0080
+#define EXT_INCOMPAT_MMP                0x0100
+#define EXT_INCOMPAT_FLEX_BG            0x0200
+
+#define F2FS_SB_OFFSET                  1024
+#define F2FS_MAGIC                      0xf2f52010
+
+namespace mb
+{
+namespace util
+{
+
+static inline uint16_t read_le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t read_le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16)
+            | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline bool is_power_of_2(unsigned int n)
+{
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+static bool probe_exfat(const unsigned char *buf, FsInfo *info)
+{
+    if (memcmp(buf + 3, "EXFAT   ", 8) != 0) {
+        return false;
+    }
+
+    info->type = FsType::Exfat;
+    info->dirty = read_le16(buf + EXFAT_VOLUME_FLAGS_OFFSET)
+            & EXFAT_VOLUME_DIRTY;
+    return true;
+}
+
+static bool probe_vfat(const unsigned char *buf, FsInfo *info)
+{
+    // The "FATxx   " labels are informational only, so validate the BIOS
+    // parameter block instead
+    if (buf[510] != 0x55 || buf[511] != 0xaa) {
+        return false;
+    }
+    if (buf[0] != 0xeb && buf[0] != 0xe9) {
+        return false;
+    }
+
+    uint16_t bytes_per_sector = read_le16(buf + 11);
+    uint8_t sectors_per_cluster = buf[13];
+    uint16_t reserved_sectors = read_le16(buf + 14);
+    uint8_t num_fats = buf[16];
+    uint8_t media = buf[21];
+    uint16_t sectors_per_fat16 = read_le16(buf + 22);
+
+    if (bytes_per_sector < 512 || bytes_per_sector > 4096
+            || !is_power_of_2(bytes_per_sector)
+            || !is_power_of_2(sectors_per_cluster)
+            || reserved_sectors == 0
+            || (num_fats != 1 && num_fats != 2)
+            || (media != 0xf0 && media < 0xf8)) {
+        return false;
+    }
+
+    // FAT32 has no 16-bit FAT size and its extended BPB is further in
+    bool fat32 = sectors_per_fat16 == 0;
+
+    info->type = FsType::Vfat;
+    info->dirty = buf[fat32 ? FAT32_STATE_OFFSET : FAT16_STATE_OFFSET]
+            & FAT_STATE_DIRTY;
+    return true;
+}
+
+static bool probe_ext(const unsigned char *buf, FsInfo *info)
+{
+    const unsigned char *sb = buf + EXT_SB_OFFSET;
+
+    if (read_le16(sb + 0x38) != EXT_MAGIC) {
+        return false;
+    }
+
+    uint16_t state = read_le16(sb + 0x3a);
+    uint32_t compat = read_le32(sb + 0x5c);
+    uint32_t incompat = read_le32(sb + 0x60);
+    uint32_t ro_compat = read_le32(sb + 0x64);
+
+    // Same rules as blkid: anything ext3 can't handle makes it ext4
+    if ((incompat & (EXT_INCOMPAT_EXTENTS | EXT_INCOMPAT_64BIT
+            | EXT_INCOMPAT_MMP | EXT_INCOMPAT_FLEX_BG))
+            || (ro_compat & (EXT_RO_COMPAT_HUGE_FILE | EXT_RO_COMPAT_GDT_CSUM
+            | EXT_RO_COMPAT_DIR_NLINK | EXT_RO_COMPAT_EXTRA_ISIZE
+            | EXT_RO_COMPAT_METADATA_CSUM))) {
+        info->type = FsType::Ext4;
+    } else if (compat & EXT_COMPAT_HAS_JOURNAL) {
+        info->type = FsType::Ext3;
+    } else {
+        info->type = FsType::Ext2;
+    }
+
+    // Pending journal replays are left to the kernel
+    info->dirty = !(state & EXT_STATE_VALID) || (state & EXT_STATE_ERROR);
+    return true;
+}
+
+static bool probe_f2fs(const unsigned char *buf, FsInfo *info)
+{
+    if (read_le32(buf + F2FS_SB_OFFSET) != F2FS_MAGIC) {
+        return false;
+    }
+
+    // The unmount state is in the checkpoint, not the superblock. The kernel
+    // does roll-forward recovery on its own anyway.
+    info->type = FsType::F2fs;
+    info->dirty = false;
+    return true;
+}
+
+/*!
+ * \brief Determine the filesystem type of a block device or image
+ *
+ * Only the first 2 KiB are read. exFAT is checked before FAT because its boot
+ * sector has the same signature. Filesystems other than exFAT, FAT12/16/32,
+ * ext2/3/4, and F2FS are reported as FsType::Unknown.
+ *
+ * \return Whether the device could be read. \a info is only set if true is
+ *         returned.
+ */
+bool probe_filesystem(const std::string &path, FsInfo *info)
+{
+    unsigned char buf[PROBE_SIZE];
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        close(fd);
+    });
+
+    ssize_t n = pread(fd, buf, sizeof(buf), 0);
+    if (n < 0) {
+        LOGE("%s: Failed to read: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    // Zero out the rest of a short read so that leftover stack data never matches
+    if (n < PROBE_SIZE) {
+        memset(buf + n, 0, sizeof(buf) - n);
+    }
+
+    if (!probe_exfat(buf, info) && !probe_vfat(buf, info)
+            && !probe_ext(buf, info) && !probe_f2fs(buf, info)) {
+        info->type = FsType::Unknown;
+        info->dirty = false;
+    }
+
+    return true;
+}
+
+const char * fs_type_name(FsType type)
+{
+    switch (type) {
+    case FsType::Exfat:
+        return "exfat";
+    case FsType::Vfat:
+        return "vfat";
+    case FsType::Ext2:
+        return "ext2";
+    case FsType::Ext3:
+        return "ext3";
+    case FsType::Ext4:
+        return "ext4";
+    case FsType::F2fs:
+        return "f2fs";
+    case FsType::Unknown:
+    default:
+        return "unknown";
+    }
+}
+
+}
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+namespace mb
+{
+namespace util
+{
+
+enum class FsType
+{
+    Unknown,
+    Exfat,
+    Vfat,
+    Ext2,
+    Ext3,
+    Ext4,
+    F2fs
+};
+
+struct FsInfo
+{
+    FsType type;
+    // Whether the filesystem was not cleanly unmounted or has errors
+    bool dirty;
+};
+
+bool probe_filesystem(const std::string &path, FsInfo *info);
+const char * fs_type_name(FsType type);
+
+}
+}
@@ -19,18 +19,17 @@
 
 #include "util/hash.h"
 
-#include <memory>
-#include <cstdio>
+#include <cerrno>
+#include <cstring>
 
 #include "util/logging.h"
+#include "util/tee.h"
 
 namespace mb
 {
 namespace util
 {
 
-typedef std::unique_ptr<std::FILE, int (*)(std::FILE *)> file_ptr;
-
 /*!
  * \brief Compute SHA1 hash of a file
  *
@@ -42,39 +41,11 @@ typedef std::unique_ptr<std::FILE, int (*)(std::FILE *)> file_ptr;
  */
 bool sha1_hash(const std::string &path, unsigned char digest[SHA_DIGEST_LENGTH])
 {
-    file_ptr fp(std::fopen(path.c_str(), "rb"), std::fclose);
-    if (!fp) {
-        LOGE("%s: Failed to open: %s", path.c_str(), strerror(errno));
-        return false;
-    }
-
-    unsigned char buf[10240];
-    size_t n;
-
-    SHA_CTX ctx;
-    if (!SHA1_Init(&ctx)) {
-        LOGE("openssl: SHA1_Init() failed");
-        return false;
-    }
-
-    while ((n = fread(buf, 1, sizeof(buf), fp.get())) > 0) {
-        if (!SHA1_Update(&ctx, buf, n)) {
-            LOGE("openssl: SHA1_Update() failed");
-            return false;
-        }
-        if (n < sizeof(buf)) {
-            break;
-        }
-    }
-
-    if (ferror(fp.get())) {
-        LOGE("%s: Failed to read file", path.c_str());
-        errno = EIO;
-        return false;
-    }
+    Tee tee;
+    tee.add_sha1(digest);
 
-    if (!SHA1_Final(digest, &ctx)) {
-        LOGE("openssl: SHA1_Final() failed");
+    if (!tee.run_file(path)) {
+        LOGE("%s: Failed to read file: %s", path.c_str(), strerror(errno));
         return false;
     }
 
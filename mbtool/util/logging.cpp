@@ -76,6 +76,9 @@ void StdioLogger::log(LogLevel prio, const char *fmt, va_list ap)
         break;
     }
 
+    // Keep lines from different threads from being interleaved
+    flockfile(_stream);
+
     if (_show_timestamps) {
         struct timespec res;
         struct tm tm;
@@ -91,6 +94,8 @@ void StdioLogger::log(LogLevel prio, const char *fmt, va_list ap)
     vfprintf(_stream, fmt, ap);
     fprintf(_stream, "\n");
     fflush(_stream);
+
+    funlockfile(_stream);
 }
 
 
@@ -19,17 +19,23 @@
 
 #include "util/loopdev.h"
 
+#include <atomic>
 #include <vector>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <unistd.h>
 
 #include <linux/loop.h>
 
+#include "util/file.h"
 #include "util/finally.h"
+#include "util/logging.h"
 #include "util/string.h"
 
 
@@ -39,6 +45,38 @@
 #define LOOP_CONTROL    "/dev/loop-control"
 #define LOOP_FMT        "/dev/block/loop%d"
 
+// Number of times to retry if another process grabs the free loop device
+// before it can be set up
+#define ATTACH_RETRIES  5
+
+// ext2/3/4 superblock fields
+#define EXT_SUPERBLOCK_OFFSET       1024
+#define EXT_LOG_BLOCK_SIZE_OFFSET   0x18
+#define EXT_MAGIC_OFFSET            0x38
+#define EXT_MAGIC                   0xEF53
+
+// Older kernel headers don't have these. They're only used if the running
+// kernel supports them.
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO      16
+#endif
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO      0x4C08
+#endif
+#ifndef LOOP_SET_BLOCK_SIZE
+#define LOOP_SET_BLOCK_SIZE     0x4C09
+#endif
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE          0x4C0A
+struct loop_config
+{
+    __u32 fd;
+    __u32 block_size;
+    struct loop_info64 info;
+    __u64 __reserved[8];
+};
+#endif
+
 
 namespace mb
 {
@@ -65,15 +103,126 @@ std::string loopdev_find_unused(void)
     return format(LOOP_FMT, n);
 }
 
+/*!
+ * \brief Get the logical block size of the device backing a file
+ *
+ * Direct I/O requests from the loop device must be aligned to this size.
+ *
+ * \return Block size or 0 if it couldn't be determined
+ */
+static unsigned int backing_block_size(int fd)
+{
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        return 0;
+    }
+
+    unsigned int major_num = major(sb.st_dev);
+    unsigned int minor_num = minor(sb.st_dev);
+    std::string value;
+
+    // Partitions don't have a queue directory of their own
+    if (!file_first_line(format("/sys/dev/block/%u:%u/queue/logical_block_size",
+                                major_num, minor_num), &value)
+            && !file_first_line(format("/sys/dev/block/%u:%u/../queue/logical_block_size",
+                                       major_num, minor_num), &value)) {
+        return 0;
+    }
+
+    return strtoul(value.c_str(), nullptr, 10);
+}
+
+/*!
+ * \brief Get the block size of the ext2/3/4 filesystem in an image
+ *
+ * \return Block size or 0 if the image doesn't contain an ext filesystem
+ */
+static unsigned int image_fs_block_size(int fd, uint64_t offset)
+{
+    unsigned char sb[EXT_MAGIC_OFFSET + 2];
+    if (pread64(fd, sb, sizeof(sb), offset + EXT_SUPERBLOCK_OFFSET)
+            != static_cast<ssize_t>(sizeof(sb))) {
+        return 0;
+    }
+
+    // Both fields are little endian
+    unsigned int magic = sb[EXT_MAGIC_OFFSET]
+            | (sb[EXT_MAGIC_OFFSET + 1] << 8);
+    uint32_t log_block_size = sb[EXT_LOG_BLOCK_SIZE_OFFSET]
+            | (sb[EXT_LOG_BLOCK_SIZE_OFFSET + 1] << 8)
+            | (sb[EXT_LOG_BLOCK_SIZE_OFFSET + 2] << 16)
+            | (static_cast<uint32_t>(sb[EXT_LOG_BLOCK_SIZE_OFFSET + 3]) << 24);
+    if (magic != EXT_MAGIC || log_block_size > 6) {
+        return 0;
+    }
+
+    return 1024u << log_block_size;
+}
+
+static bool set_up_legacy(int lfd, int ffd, const struct loop_config *config)
+{
+    if (ioctl(lfd, LOOP_SET_FD, ffd) < 0) {
+        return false;
+    }
+
+    struct loop_info64 loopinfo = config->info;
+    loopinfo.lo_flags &= ~(LO_FLAGS_READ_ONLY | LO_FLAGS_DIRECT_IO);
+
+    if (ioctl(lfd, LOOP_SET_STATUS64, &loopinfo) < 0) {
+        int saved_errno = errno;
+        ioctl(lfd, LOOP_CLR_FD, 0);
+        errno = saved_errno;
+        return false;
+    }
+
+    // Both ioctls need Linux 4.4 or newer. Without them, the device just
+    // keeps using buffered I/O.
+    if (config->info.lo_flags & LO_FLAGS_DIRECT_IO) {
+        if (config->block_size != 0
+                && ioctl(lfd, LOOP_SET_BLOCK_SIZE, config->block_size) < 0) {
+            LOGD("Failed to set loop block size to %u: %s",
+                 config->block_size, strerror(errno));
+        }
+        if (ioctl(lfd, LOOP_SET_DIRECT_IO, 1UL) < 0) {
+            LOGD("Failed to enable direct I/O on loop device: %s",
+                 strerror(errno));
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Attach a file to a loop device
+ *
+ * LOOP_CONFIGURE is used if the kernel supports it, which sets up the device
+ * in a single step. Otherwise, LOOP_SET_FD and LOOP_SET_STATUS64 are used.
+ *
+ * If LOOPDEV_DIRECT_IO is passed, the block size of the loop device is set
+ * to the logical block size of the device backing \a file so that the
+ * kernel can actually use direct I/O. This is only done if \a file contains
+ * an ext filesystem whose block size is at least as large, since a filesystem
+ * can't be mounted on a device with larger blocks than its own. Otherwise,
+ * the kernel may silently fall back to buffered I/O.
+ *
+ * \param loopdev Loop device path
+ * \param file File to attach
+ * \param offset Offset of the data in \a file
+ * \param flags LoopdevFlags
+ *
+ * \return Whether the device was set up. errno is set on failure.
+ */
 bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
-                           uint64_t offset, bool ro)
+                           uint64_t offset, int flags)
 {
+    // Will be set to false if the kernel doesn't know about LOOP_CONFIGURE
+    static std::atomic<bool> have_loop_configure(true);
+
+    bool ro = flags & LOOPDEV_READ_ONLY;
     int ffd = -1;
     int lfd = -1;
 
-    struct loop_info64 loopinfo;
-
-    if ((ffd = open(file.c_str(), ro ? O_RDONLY : O_RDWR)) < 0) {
+    if ((ffd = open(file.c_str(), (ro ? O_RDONLY : O_RDWR) | O_CLOEXEC)) < 0) {
         return false;
     }
 
@@ -81,7 +230,7 @@ bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
         close(ffd);
     });
 
-    if ((lfd = open(loopdev.c_str(), ro ? O_RDONLY : O_RDWR)) < 0) {
+    if ((lfd = open(loopdev.c_str(), (ro ? O_RDONLY : O_RDWR) | O_CLOEXEC)) < 0) {
         return false;
     }
 
@@ -89,18 +238,138 @@ bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
         close(lfd);
     });
 
-    memset(&loopinfo, 0, sizeof(struct loop_info64));
-    loopinfo.lo_offset = offset;
+    struct loop_config config;
+    memset(&config, 0, sizeof(config));
+    config.fd = ffd;
+    config.info.lo_offset = offset;
+    if (ro) {
+        config.info.lo_flags |= LO_FLAGS_READ_ONLY;
+    }
+    if (flags & LOOPDEV_DIRECT_IO) {
+        config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
 
-    if (ioctl(lfd, LOOP_SET_FD, ffd) < 0) {
+        unsigned int block_size = backing_block_size(ffd);
+        unsigned int fs_block_size = image_fs_block_size(ffd, offset);
+        if (block_size != 0 && block_size <= fs_block_size) {
+            config.block_size = block_size;
+        }
+    }
+
+    if (have_loop_configure) {
+        if (ioctl(lfd, LOOP_CONFIGURE, &config) == 0) {
+            return true;
+        } else if (errno != EINVAL && errno != ENOTTY) {
+            return false;
+        }
+
+        // An unsupported block size also results in EINVAL, so only stop
+        // trying LOOP_CONFIGURE if it fails without one
+        if (config.block_size == 0) {
+            have_loop_configure = false;
+        }
+    }
+
+    return set_up_legacy(lfd, ffd, &config);
+}
+
+/*!
+ * \brief Attach a file to an unused loop device
+ *
+ * This retries with another device if some other process takes the free
+ * device first.
+ *
+ * \return Loop device path or an empty string if the file couldn't be
+ *         attached. errno is set on failure.
+ */
+std::string loopdev_attach(const std::string &file, uint64_t offset, int flags)
+{
+    for (int i = 0; i < ATTACH_RETRIES; ++i) {
+        std::string loopdev = loopdev_find_unused();
+        if (loopdev.empty()) {
+            return std::string();
+        }
+
+        if (loopdev_set_up_device(loopdev, file, offset, flags)) {
+            return loopdev;
+        } else if (errno != EBUSY) {
+            return std::string();
+        }
+    }
+
+    return std::string();
+}
+
+/*!
+ * \brief Detach the loop device automatically when it's no longer in use
+ *
+ * The kernel detaches the device when the last open reference is closed.
+ * This must be called after the device is mounted. Otherwise, the device is
+ * detached right away.
+ */
+bool loopdev_set_autoclear(const std::string &loopdev)
+{
+    int lfd;
+    if ((lfd = open(loopdev.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
         return false;
     }
 
-    if (ioctl(lfd, LOOP_SET_STATUS64, &loopinfo) < 0) {
-        ioctl(lfd, LOOP_CLR_FD, 0);
+    auto close_lfd = finally([&] {
+        close(lfd);
+    });
+
+    struct loop_info64 loopinfo;
+    if (ioctl(lfd, LOOP_GET_STATUS64, &loopinfo) < 0) {
+        return false;
+    }
+
+    loopinfo.lo_flags |= LO_FLAGS_AUTOCLEAR;
+
+    return ioctl(lfd, LOOP_SET_STATUS64, &loopinfo) == 0;
+}
+
+/*!
+ * \brief Make the loop device pick up the new size of its backing file
+ */
+bool loopdev_set_capacity(const std::string &loopdev)
+{
+    int lfd;
+    if ((lfd = open(loopdev.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
         return false;
     }
 
+    auto close_lfd = finally([&] {
+        close(lfd);
+    });
+
+    return ioctl(lfd, LOOP_SET_CAPACITY, 0) == 0;
+}
+
+/*!
+ * \brief Get the file attached to a loop device
+ *
+ * \return Whether a file is attached. errno is set to ENXIO if the device is
+ *         unused.
+ */
+bool loopdev_get_info(const std::string &loopdev, LoopdevInfo *info)
+{
+    int lfd;
+    if ((lfd = open(loopdev.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        return false;
+    }
+
+    auto close_lfd = finally([&] {
+        close(lfd);
+    });
+
+    struct loop_info64 loopinfo;
+    if (ioctl(lfd, LOOP_GET_STATUS64, &loopinfo) < 0) {
+        return false;
+    }
+
+    info->device = loopinfo.lo_device;
+    info->inode = loopinfo.lo_inode;
+    info->autoclear = loopinfo.lo_flags & LO_FLAGS_AUTOCLEAR;
+
     return true;
 }
 
@@ -111,8 +380,11 @@ bool loopdev_remove_device(const std::string &loopdev)
         return false;
     }
     int ret = ioctl(lfd, LOOP_CLR_FD, 0);
+    int saved_errno = errno;
     close(lfd);
-    return ret == 0;
+    errno = saved_errno;
+    // ENXIO means that the device was already detached (eg. by autoclear)
+    return ret == 0 || errno == ENXIO;
 }
 
 }
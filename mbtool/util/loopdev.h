@@ -21,14 +21,37 @@
 
 #include <string>
 
+#include <cstdint>
+
 namespace mb
 {
 namespace util
 {
 
+enum LoopdevFlags : int
+{
+    LOOPDEV_READ_ONLY        = 0x1,
+    // Bypass the page cache of the backing file. Falls back to buffered I/O
+    // if the kernel or the backing filesystem doesn't support it
+    LOOPDEV_DIRECT_IO        = 0x2
+};
+
+struct LoopdevInfo
+{
+    // Device and inode numbers of the attached file
+    uint64_t device;
+    uint64_t inode;
+    // Whether the kernel detaches the device when it's no longer in use
+    bool autoclear;
+};
+
 std::string loopdev_find_unused(void);
 bool loopdev_set_up_device(const std::string &loopdev, const std::string &file,
-                           uint64_t offset, bool ro);
+                           uint64_t offset, int flags);
+std::string loopdev_attach(const std::string &file, uint64_t offset, int flags);
+bool loopdev_set_autoclear(const std::string &loopdev);
+bool loopdev_set_capacity(const std::string &loopdev);
+bool loopdev_get_info(const std::string &loopdev, LoopdevInfo *info);
 bool loopdev_remove_device(const std::string &loopdev);
 
 }
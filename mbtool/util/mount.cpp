@@ -66,6 +66,36 @@ bool is_mounted(const std::string &mountpoint)
     return found;
 }
 
+/*!
+ * \brief Get the source of the topmost mount at a mount point
+ *
+ * \return Whether a mount was found. If false is returned, errno is set to
+ *         ENOENT if nothing is mounted at \a mountpoint.
+ */
+bool get_mount_source(const std::string &mountpoint, std::string *source)
+{
+    struct mntent ent;
+    bool found = false;
+
+    file_ptr fp(setmntent("/proc/mounts", "r"), endmntent);
+    if (!fp) {
+        return false;
+    }
+
+    char buf[1024];
+    while (getmntent_r(fp.get(), &ent, buf, sizeof(buf))) {
+        if (mountpoint == ent.mnt_dir) {
+            *source = ent.mnt_fsname;
+            found = true;
+        }
+    }
+
+    if (!found) {
+        errno = ENOENT;
+    }
+    return found;
+}
+
 bool unmount_all(const std::string &dir)
 {
     int failed;
@@ -164,7 +194,9 @@ bool bind_mount(const std::string &source, mode_t source_perms,
  *
  * If MS_BIND is not specified in \a mount_flags and \a source is not a block
  * device, then the file will be attached to a loop device and the the loop
- * device will be mounted at \a target.
+ * device will be mounted at \a target. The loop device uses direct I/O if
+ * possible so that the file's data isn't cached twice and it is detached
+ * automatically when the filesystem is unmounted.
  *
  * \param source See man mount(2)
  * \param target See man mount(2)
@@ -189,23 +221,32 @@ bool mount(const char *source, const char *target, const char *fstype,
     }
 
     if (need_loopdev) {
-        std::string loopdev = util::loopdev_find_unused();
-        if (loopdev.empty()) {
-            LOGE("Failed to find unused loop device: %s", strerror(errno));
-            return false;
+        int loop_flags = LOOPDEV_DIRECT_IO;
+        if (mount_flags & MS_RDONLY) {
+            loop_flags |= LOOPDEV_READ_ONLY;
         }
 
-        if (!util::loopdev_set_up_device(loopdev, source, 0, 0)) {
-            LOGE("Failed to set up loop device %s: %s",
-                 loopdev.c_str(), strerror(errno));
+        std::string loopdev = util::loopdev_attach(source, 0, loop_flags);
+        if (loopdev.empty()) {
+            LOGE("Failed to set up loop device for %s: %s",
+                 source, strerror(errno));
             return false;
         }
 
         if (::mount(loopdev.c_str(), target, fstype, mount_flags, data) < 0) {
+            int saved_errno = errno;
             util::loopdev_remove_device(loopdev);
+            errno = saved_errno;
             return false;
         }
 
+        // Don't leak the loop device if the filesystem is unmounted without
+        // util::umount()
+        if (!util::loopdev_set_autoclear(loopdev)) {
+            LOGW("Failed to enable autoclear on %s: %s",
+                 loopdev.c_str(), strerror(errno));
+        }
+
         return true;
     } else {
         return ::mount(source, target, fstype, mount_flags, data) == 0;
@@ -221,9 +262,11 @@ bool mount(const char *source, const char *target, const char *fstype,
  * This function will /proc/mounts for the mountpoint (using an exact string
  * compare). If the source path of the mountpoint is a block device and the
  * block device is a loop device, then it will be disassociated from the
- * previously attached file. Note that the return value of
- * loopdev_remove_device() is ignored and this function will always return true
- * if umount(2) is successful.
+ * previously attached file. Devices with autoclear enabled are left to the
+ * kernel, which detaches them when the unmount drops the last reference. An
+ * explicit detach could hit a device that another process attached in the
+ * meantime. Note that the return value of loopdev_remove_device() is ignored
+ * and this function will always return true if umount(2) is successful.
  *
  * \param target See man umount(2)
  *
@@ -231,30 +274,29 @@ bool mount(const char *source, const char *target, const char *fstype,
  */
 bool umount(const char *target)
 {
-    struct mntent ent;
     std::string source;
 
-    file_ptr fp(setmntent("/proc/mounts", "r"), endmntent);
-    if (fp) {
-        char buf[1024];
-        while (getmntent_r(fp.get(), &ent, buf, sizeof(buf))) {
-            if (strcmp(ent.mnt_dir, target) == 0) {
-                source = ent.mnt_fsname;
-            }
-        }
-    } else {
+    if (!get_mount_source(target, &source) && errno != ENOENT) {
         LOGW("Failed to read /proc/mounts: %s", strerror(errno));
     }
 
-    int ret = ::umount(target);
+    // Remember which file is attached before unmounting
+    struct stat sb;
+    LoopdevInfo info;
+    bool is_loopdev = !source.empty()
+            && stat(source.c_str(), &sb) == 0
+            && S_ISBLK(sb.st_mode) && major(sb.st_rdev) == 7
+            && loopdev_get_info(source, &info);
 
-    if (!source.empty()) {
-        struct stat sb;
+    int ret = ::umount(target);
 
-        if (stat(source.c_str(), &sb) == 0
-                && S_ISBLK(sb.st_mode) && major(sb.st_rdev) == 7) {
-            // If the source path is a loop block device, then disassociate it
-            // from the image
+    if (is_loopdev && !info.autoclear) {
+        // If the source path is a loop block device, then disassociate it
+        // from the image, but only if it's still attached to the same file
+        LoopdevInfo current;
+        if (loopdev_get_info(source, &current)
+                && current.device == info.device
+                && current.inode == info.inode) {
             loopdev_remove_device(source);
         }
     }
@@ -27,6 +27,7 @@ namespace util
 {
 
 bool is_mounted(const std::string &mountpoint);
+bool get_mount_source(const std::string &mountpoint, std::string *source);
 bool unmount_all(const std::string &dir);
 bool bind_mount(const std::string &source, mode_t source_perms,
                 const std::string &target, mode_t target_perms);
@@ -0,0 +1,547 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "util/overlay.h"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "util/copy.h"
+#include "util/delete.h"
+#include "util/finally.h"
+#include "util/fts.h"
+#include "util/logging.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#define OVERLAY_XATTR_PREFIX    "trusted.overlay."
+#define OVERLAY_XATTR_OPAQUE    OVERLAY_XATTR_PREFIX "opaque"
+#define OVERLAY_XATTR_REDIRECT  OVERLAY_XATTR_PREFIX "redirect"
+#define OVERLAY_XATTR_METACOPY  OVERLAY_XATTR_PREFIX "metacopy"
+
+// Exists in the lower directory while a commit is modifying it
+#define OVERLAY_COMMIT_MARKER   ".overlay-commit"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Check if the kernel supports overlayfs
+ */
+bool overlay_supported()
+{
+    std::unique_ptr<FILE, int (*)(FILE *)> fp(
+            std::fopen("/proc/filesystems", "r"), std::fclose);
+    if (!fp) {
+        LOGE("Failed to open /proc/filesystems: %s", strerror(errno));
+        return false;
+    }
+
+    char *line = nullptr;
+    size_t len = 0;
+    ssize_t read = 0;
+
+    auto free_line = finally([&]{
+        free(line);
+    });
+
+    while ((read = getline(&line, &len, fp.get())) >= 0) {
+        if (read > 0 && line[read - 1] == '\n') {
+            line[read - 1] = '\0';
+        }
+
+        // Lines are either "nodev\t<name>" or "\t<name>"
+        char *name = strchr(line, '\t');
+        if (name && strcmp(name + 1, "overlay") == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*!
+ * \brief Mount an overlayfs filesystem
+ *
+ * The upper directory only ever receives complete copies of files and
+ * directories. Redirected directory renames and metadata-only copy ups are
+ * turned off on kernels that support them so that overlay_commit() can apply
+ * the upper directory to the lower directory as a plain tree.
+ *
+ * \param lower Read-only lower directory
+ * \param upper Directory that receives the changes
+ * \param work Empty work directory on the same filesystem as \a upper
+ * \param target Mount point
+ */
+bool overlay_mount(const std::string &lower, const std::string &upper,
+                   const std::string &work, const std::string &target)
+{
+    std::string data = format("lowerdir=%s,upperdir=%s,workdir=%s",
+                              lower.c_str(), upper.c_str(), work.c_str());
+
+    // Older kernels reject options they don't know about
+    const char *extra_options[] = {
+        ",redirect_dir=off,metacopy=off",
+        ",redirect_dir=off",
+        "",
+    };
+
+    for (const char *extra : extra_options) {
+        std::string options(data);
+        options += extra;
+
+        if (mount("overlay", target.c_str(), "overlay", 0,
+                  options.c_str()) == 0) {
+            LOGD("Mounted overlay at %s with options %s",
+                 target.c_str(), options.c_str());
+            return true;
+        } else if (errno != EINVAL) {
+            break;
+        }
+    }
+
+    LOGE("%s: Failed to mount overlay: %s", target.c_str(), strerror(errno));
+    return false;
+}
+
+static bool is_whiteout(const struct stat &sb)
+{
+    return S_ISCHR(sb.st_mode) && sb.st_rdev == makedev(0, 0);
+}
+
+static bool has_xattr(const std::string &path, const char *name)
+{
+    return lgetxattr(path.c_str(), name, nullptr, 0) >= 0;
+}
+
+static bool is_opaque(const std::string &path)
+{
+    char value;
+    return lgetxattr(path.c_str(), OVERLAY_XATTR_OPAQUE, &value, 1) == 1
+            && value == 'y';
+}
+
+/*!
+ * \brief Remove overlayfs' private xattrs from a path (non-recursive)
+ */
+static void strip_overlay_xattrs(const std::string &path)
+{
+    ssize_t size = llistxattr(path.c_str(), nullptr, 0);
+    if (size <= 0) {
+        return;
+    }
+
+    std::vector<char> names(size);
+    size = llistxattr(path.c_str(), names.data(), names.size());
+    if (size <= 0) {
+        return;
+    }
+
+    for (const char *name = names.data(); name < names.data() + size;
+            name += strlen(name) + 1) {
+        if (starts_with(name, OVERLAY_XATTR_PREFIX)
+                && lremovexattr(path.c_str(), name) < 0) {
+            LOGW("%s: Failed to remove xattr %s: %s",
+                 path.c_str(), name, strerror(errno));
+        }
+    }
+}
+
+/*!
+ * \brief Remove overlayfs' private xattrs from a path and everything below it
+ *
+ * Directories copied up from the lower layer keep their origin and impure
+ * xattrs at every level, not just at the top of the tree being moved.
+ */
+class OverlayXattrStripper : public FTSWrapper
+{
+public:
+    OverlayXattrStripper(std::string path)
+        : FTSWrapper(std::move(path), 0)
+    {
+    }
+
+    virtual int on_changed_path() override
+    {
+        // Directories are visited again after their children
+        if (_curr->fts_info != FTS_DP) {
+            strip_overlay_xattrs(_curr->fts_accpath);
+        }
+        return Action::FTS_Next;
+    }
+};
+
+/*!
+ * \brief Move a path from the upper directory to the lower directory
+ *
+ * The path is renamed if both directories are on the same filesystem.
+ * Otherwise, it is copied along with its attributes.
+ */
+static bool move_path(const std::string &source, const std::string &target,
+                      const struct stat &sb)
+{
+    if (rename(source.c_str(), target.c_str()) == 0) {
+        OverlayXattrStripper(target).run();
+        return true;
+    } else if (errno != EXDEV) {
+        LOGE("%s: Failed to rename to %s: %s",
+             source.c_str(), target.c_str(), strerror(errno));
+        return false;
+    }
+
+    bool ret;
+
+    if (S_ISDIR(sb.st_mode)) {
+        ret = copy_dir(source, target, COPY_ATTRIBUTES
+                                     | COPY_XATTRS
+                                     | COPY_EXCLUDE_TOP_LEVEL
+                                     | COPY_PARALLEL);
+    } else {
+        ret = copy_file(source, target, COPY_ATTRIBUTES | COPY_XATTRS);
+    }
+
+    if (!ret) {
+        LOGE("%s: Failed to copy to %s", source.c_str(), target.c_str());
+        return false;
+    }
+
+    OverlayXattrStripper(target).run();
+    return true;
+}
+
+class OverlayCommitter
+{
+public:
+    OverlayCommitter(std::string marker)
+        : _marker(std::move(marker)), _committed(0), _deleted(0),
+        _modified(false)
+    {
+    }
+
+    bool commit_dir(const std::string &upper, const std::string &lower)
+    {
+        std::vector<std::pair<std::string, struct stat>> entries;
+
+        std::unique_ptr<DIR, int (*)(DIR *)> dp(
+                opendir(upper.c_str()), closedir);
+        if (!dp) {
+            LOGE("%s: Failed to open directory: %s",
+                 upper.c_str(), strerror(errno));
+            return false;
+        }
+
+        struct dirent *ent;
+        while ((ent = readdir(dp.get()))) {
+            if (strcmp(ent->d_name, ".") == 0
+                    || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+
+            std::string path(upper);
+            path += "/";
+            path += ent->d_name;
+
+            // Never let the changes touch the commit marker
+            if (lower + "/" + ent->d_name == _marker) {
+                continue;
+            }
+
+            struct stat sb;
+            if (lstat(path.c_str(), &sb) < 0) {
+                LOGE("%s: Failed to stat: %s", path.c_str(), strerror(errno));
+                return false;
+            }
+
+            // These would need the lower layer to reconstruct the file, so
+            // the upper directory can't be applied as is
+            if (has_xattr(path, OVERLAY_XATTR_REDIRECT)
+                    || has_xattr(path, OVERLAY_XATTR_METACOPY)) {
+                LOGE("%s: Redirected or metadata-only copy up is not supported",
+                     path.c_str());
+                return false;
+            }
+
+            entries.emplace_back(ent->d_name, sb);
+        }
+
+        dp.reset();
+
+        // Delete everything that will be replaced first so that the lower
+        // directory's filesystem never has to hold both the old and new
+        // versions of a path
+        for (auto &entry : entries) {
+            std::string upper_path(upper + "/" + entry.first);
+            std::string lower_path(lower + "/" + entry.first);
+            const struct stat &sb = entry.second;
+
+            struct stat sb_lower;
+            if (lstat(lower_path.c_str(), &sb_lower) < 0) {
+                if (errno == ENOENT) {
+                    continue;
+                }
+                LOGE("%s: Failed to stat: %s",
+                     lower_path.c_str(), strerror(errno));
+                return false;
+            }
+
+            // Merged directories are kept and committed recursively
+            if (S_ISDIR(sb.st_mode) && S_ISDIR(sb_lower.st_mode)
+                    && !is_opaque(upper_path)) {
+                continue;
+            }
+
+            _modified = true;
+            if (!delete_recursive(lower_path)) {
+                LOGE("%s: Failed to delete", lower_path.c_str());
+                return false;
+            }
+            ++_deleted;
+        }
+
+        for (auto &entry : entries) {
+            std::string upper_path(upper + "/" + entry.first);
+            std::string lower_path(lower + "/" + entry.first);
+            const struct stat &sb = entry.second;
+
+            if (is_whiteout(sb)) {
+                continue;
+            }
+
+            struct stat sb_lower;
+            if (S_ISDIR(sb.st_mode) && lstat(lower_path.c_str(), &sb_lower) == 0) {
+                if (!commit_dir(upper_path, lower_path)) {
+                    return false;
+                }
+
+                // The directory's attributes or SELinux label may have changed
+                _modified = true;
+                if (!copy_stat(upper_path, lower_path)
+                        || !copy_xattrs(upper_path, lower_path)) {
+                    LOGE("%s: Failed to copy attributes to %s: %s",
+                         upper_path.c_str(), lower_path.c_str(),
+                         strerror(errno));
+                    return false;
+                }
+                strip_overlay_xattrs(lower_path);
+            } else {
+                _modified = true;
+                if (!move_path(upper_path, lower_path, sb)) {
+                    return false;
+                }
+                ++_committed;
+            }
+        }
+
+        return true;
+    }
+
+    void stats(OverlayCommitStats *stats) const
+    {
+        stats->committed = _committed;
+        stats->deleted = _deleted;
+    }
+
+    /*!
+     * \brief Whether anything in the lower directory was changed
+     */
+    bool modified() const
+    {
+        return _modified;
+    }
+
+private:
+    std::string _marker;
+    uint64_t _committed;
+    uint64_t _deleted;
+    bool _modified;
+};
+
+static bool fsync_path(const std::string &path, int flags)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | flags);
+    if (fd < 0) {
+        return false;
+    }
+
+    int ret = fsync(fd);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+
+    return ret == 0;
+}
+
+/*!
+ * \brief Durably create the commit marker before the lower directory is
+ *        modified
+ *
+ * The marker holds the path of the upper directory being committed.
+ */
+static bool write_commit_marker(const std::string &marker,
+                                const std::string &lower,
+                                const std::string &upper)
+{
+    int fd = open(marker.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        LOGE("%s: Failed to create: %s", marker.c_str(), strerror(errno));
+        return false;
+    }
+
+    std::string contents(upper);
+    contents += "\n";
+
+    bool ret = write(fd, contents.data(), contents.size())
+                    == static_cast<ssize_t>(contents.size())
+            && fsync(fd) == 0;
+    int saved_errno = errno;
+    close(fd);
+
+    if (!ret) {
+        LOGE("%s: Failed to write: %s", marker.c_str(), strerror(saved_errno));
+        unlink(marker.c_str());
+        return false;
+    }
+
+    if (!fsync_path(lower, O_DIRECTORY)) {
+        LOGE("%s: Failed to sync: %s", lower.c_str(), strerror(errno));
+        unlink(marker.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+static void remove_commit_marker(const std::string &marker,
+                                 const std::string &lower)
+{
+    if (unlink(marker.c_str()) < 0 && errno != ENOENT) {
+        LOGW("%s: Failed to remove: %s", marker.c_str(), strerror(errno));
+    } else if (!fsync_path(lower, O_DIRECTORY)) {
+        LOGW("%s: Failed to sync: %s", lower.c_str(), strerror(errno));
+    }
+}
+
+/*!
+ * \brief Apply the changes in an overlayfs upper directory to its lower
+ *        directory
+ *
+ * Only the paths in the upper directory are touched, so the time this takes
+ * depends on the size of the changes rather than the size of the lower
+ * directory. Whiteouts delete the corresponding path, opaque directories
+ * replace the corresponding directory, and everything else is moved into
+ * place (or copied if the directories are on different filesystems). Paths in
+ * the lower directory are deleted before their replacements are written.
+ *
+ * Before anything in the lower directory is changed, a marker file is synced
+ * to it. The marker is removed once the commit succeeds or if it fails without
+ * changing anything. If the commit fails partway or the device loses power,
+ * the marker stays behind and overlay_commit_interrupted() returns true until
+ * a later commit to the same directory succeeds.
+ *
+ * The overlay must be unmounted before calling this function. The upper
+ * directory is consumed in the process and should be deleted afterwards.
+ *
+ * \param stats Statistics for the commit (may be nullptr)
+ *
+ * \return OverlayCommitResult::SUCCEEDED if all changes were applied,
+ *         OverlayCommitResult::FAILED if the lower directory was not changed,
+ *         OverlayCommitResult::INCOMPLETE if only some changes were applied
+ */
+OverlayCommitResult overlay_commit(const std::string &upper,
+                                   const std::string &lower,
+                                   OverlayCommitStats *stats)
+{
+    uint64_t start = monotonic_time_ms();
+
+    std::string marker(lower);
+    marker += "/" OVERLAY_COMMIT_MARKER;
+
+    if (overlay_commit_interrupted(lower)) {
+        LOGW("%s: A previous commit was interrupted", lower.c_str());
+    }
+
+    if (!write_commit_marker(marker, lower, upper)) {
+        return OverlayCommitResult::FAILED;
+    }
+
+    OverlayCommitter committer(marker);
+    bool ret = committer.commit_dir(upper, lower);
+
+    OverlayCommitStats s;
+    committer.stats(&s);
+    s.elapsed_ms = monotonic_time_ms() - start;
+
+    LOGD("%s: Committed %" PRIu64 " paths and deleted %" PRIu64 " paths"
+         " from %s in %" PRIu64 "ms", lower.c_str(), s.committed, s.deleted,
+         upper.c_str(), s.elapsed_ms);
+
+    if (stats) {
+        *stats = s;
+    }
+
+    if (ret) {
+        // The marker must not be removed before the changes are on disk
+        sync();
+        remove_commit_marker(marker, lower);
+        return OverlayCommitResult::SUCCEEDED;
+    } else if (!committer.modified()) {
+        remove_commit_marker(marker, lower);
+        return OverlayCommitResult::FAILED;
+    } else {
+        LOGE("%s: Commit failed after the directory was modified",
+             lower.c_str());
+        return OverlayCommitResult::INCOMPLETE;
+    }
+}
+
+/*!
+ * \brief Check if a commit to a lower directory did not finish
+ *
+ * \param lower Lower directory passed to overlay_commit()
+ *
+ * \return True if a previous overlay_commit() was interrupted after it began
+ *         modifying \a lower and no commit has succeeded since
+ */
+bool overlay_commit_interrupted(const std::string &lower)
+{
+    std::string marker(lower);
+    marker += "/" OVERLAY_COMMIT_MARKER;
+
+    struct stat sb;
+    return lstat(marker.c_str(), &sb) == 0;
+}
+
+}
+}
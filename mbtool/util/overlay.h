@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <inttypes.h>
+
+namespace mb
+{
+namespace util
+{
+
+enum class OverlayCommitResult
+{
+    SUCCEEDED,
+    // Nothing in the lower directory was changed
+    FAILED,
+    // The lower directory was partially updated
+    INCOMPLETE
+};
+
+struct OverlayCommitStats
+{
+    // Number of paths moved or copied from the upper directory
+    uint64_t committed;
+    // Number of paths deleted from the lower directory
+    uint64_t deleted;
+    uint64_t elapsed_ms;
+};
+
+bool overlay_supported();
+bool overlay_mount(const std::string &lower, const std::string &upper,
+                   const std::string &work, const std::string &target);
+OverlayCommitResult overlay_commit(const std::string &upper,
+                                   const std::string &lower,
+                                   OverlayCommitStats *stats);
+bool overlay_commit_interrupted(const std::string &lower);
+
+}
+}
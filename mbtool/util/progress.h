@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <atomic>
+
+#include <cerrno>
+#include <cstdint>
+
+namespace mb
+{
+namespace util
+{
+
+// Counters shared between a long-running operation and the thread observing
+// it. The operation only adds to the counters and checks the cancelled flag;
+// the observer may read the counters and set the flag at any time.
+struct Progress
+{
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> files;
+    std::atomic<bool> cancelled;
+
+    Progress() : bytes(0), files(0), cancelled(false)
+    {
+    }
+};
+
+/*!
+ * \brief Add \a n bytes to the progress counter (if \a progress is not
+ *        nullptr)
+ *
+ * \return False with errno set to ECANCELED if the operation was cancelled.
+ *         Otherwise, true.
+ */
+inline bool progress_add_bytes(Progress *progress, uint64_t n)
+{
+    if (progress) {
+        progress->bytes += n;
+        if (progress->cancelled) {
+            errno = ECANCELED;
+            return false;
+        }
+    }
+    return true;
+}
+
+}
+}
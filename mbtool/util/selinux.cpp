@@ -75,6 +75,20 @@ private:
 
     bool set_context()
     {
+        // Setting the same context again still changes the ctime
+        std::string context;
+        if (_follow_symlinks) {
+            if (selinux_get_context(_curr->fts_accpath, &context)
+                    && context == _context) {
+                return true;
+            }
+        } else {
+            if (selinux_lget_context(_curr->fts_accpath, &context)
+                    && context == _context) {
+                return true;
+            }
+        }
+
         if (_follow_symlinks) {
             return selinux_set_context(_curr->fts_accpath, _context);
         } else {
@@ -19,9 +19,11 @@
 
 #include "util/socket.h"
 
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 namespace mb
@@ -84,16 +86,48 @@ bool socket_read_bytes(int fd, std::vector<uint8_t> *result)
     return false;
 }
 
-bool socket_write_bytes(int fd, const uint8_t *data, size_t len)
+/*!
+ * \brief Write all of \a iov, retrying on partial writes
+ *
+ * \note The contents of \a iov are modified
+ */
+static bool socket_writev_all(int fd, struct iovec *iov, int iovcnt)
 {
-    if (!socket_write_int32(fd, len)) {
-        return false;
-    }
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
 
-    if (socket_write(fd, data, len) == (int64_t) len) {
-        return true;
+        // Skip over what was written
+        while (iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --iovcnt;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+            iov->iov_len -= n;
+        }
     }
-    return false;
+
+    return true;
+}
+
+bool socket_write_bytes(int fd, const uint8_t *data, size_t len)
+{
+    int32_t len32 = len;
+
+    // Send the size and the data with a single system call
+    struct iovec iov[2];
+    iov[0].iov_base = &len32;
+    iov[0].iov_len = sizeof(len32);
+    iov[1].iov_base = const_cast<uint8_t *>(data);
+    iov[1].iov_len = len;
+
+    return socket_writev_all(fd, iov, len > 0 ? 2 : 1);
 }
 
 #define read_int_type(TYPE) \
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "util/tee.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util/finally.h"
+#include "util/logging.h"
+
+#define TEE_BUFFER_SIZE         (1024 * 1024)
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Compute the SHA1 digest of the data
+ *
+ * \param digest Array that receives the digest when run() succeeds. It must
+ *               remain valid until then.
+ */
+void Tee::add_sha1(unsigned char digest[SHA_DIGEST_LENGTH])
+{
+    _sha1_sinks.emplace_back();
+    _sha1_sinks.back().digest = digest;
+}
+
+/*!
+ * \brief Compute the SHA512 digest of the data
+ *
+ * \param digest Array that receives the digest when run() succeeds. It must
+ *               remain valid until then.
+ */
+void Tee::add_sha512(unsigned char digest[SHA512_DIGEST_LENGTH])
+{
+    _sha512_sinks.emplace_back();
+    _sha512_sinks.back().digest = digest;
+}
+
+/*!
+ * \brief Write the data to a file descriptor
+ *
+ * The data is written at the fd's current offset. The fd is not closed.
+ */
+void Tee::add_fd(int fd)
+{
+    _fd_sinks.push_back(fd);
+}
+
+/*!
+ * \brief Append the data to a buffer
+ */
+void Tee::add_buffer(std::vector<unsigned char> *buf)
+{
+    _buffer_sinks.push_back(buf);
+}
+
+/*!
+ * \brief Report the number of bytes read to \a progress
+ *
+ * If the progress' cancelled flag is set, run() stops reading and fails with
+ * errno set to ECANCELED.
+ */
+void Tee::set_progress(Progress *progress)
+{
+    _progress = progress;
+}
+
+/*!
+ * \brief Read \a fd_source until EOF and pass the data to every sink
+ *
+ * \return True if all of the data was read and written to every sink.
+ *         Otherwise, false with errno set appropriately.
+ */
+bool Tee::run(int fd_source)
+{
+    _bytes = 0;
+
+    for (Sha1Sink &sink : _sha1_sinks) {
+        if (!SHA1_Init(&sink.ctx)) {
+            LOGE("openssl: SHA1_Init() failed");
+            errno = EINVAL;
+            return false;
+        }
+    }
+    for (Sha512Sink &sink : _sha512_sinks) {
+        if (!SHA512_Init(&sink.ctx)) {
+            LOGE("openssl: SHA512_Init() failed");
+            errno = EINVAL;
+            return false;
+        }
+    }
+
+    // Avoid reallocating the buffers if the size is known up front
+    if (!_buffer_sinks.empty()) {
+        struct stat sb;
+        uint64_t size = 0;
+
+        if (fstat(fd_source, &sb) == 0) {
+            if (S_ISREG(sb.st_mode)) {
+                size = sb.st_size;
+            } else if (S_ISBLK(sb.st_mode)) {
+                ioctl(fd_source, BLKGETSIZE64, &size);
+            }
+        }
+
+        for (std::vector<unsigned char> *buf : _buffer_sinks) {
+            buf->reserve(buf->size() + size);
+        }
+    }
+
+    std::vector<unsigned char> buf(TEE_BUFFER_SIZE);
+
+    while (true) {
+        ssize_t n = read(fd_source, buf.data(), buf.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        } else if (n == 0) {
+            break;
+        }
+
+        if (!write_sinks(buf.data(), n)) {
+            return false;
+        }
+
+        _bytes += n;
+
+        if (!progress_add_bytes(_progress, n)) {
+            return false;
+        }
+    }
+
+    for (Sha1Sink &sink : _sha1_sinks) {
+        if (!SHA1_Final(sink.digest, &sink.ctx)) {
+            LOGE("openssl: SHA1_Final() failed");
+            errno = EINVAL;
+            return false;
+        }
+    }
+    for (Sha512Sink &sink : _sha512_sinks) {
+        if (!SHA512_Final(sink.digest, &sink.ctx)) {
+            LOGE("openssl: SHA512_Final() failed");
+            errno = EINVAL;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*!
+ * \brief Read a file or block device and pass the data to every sink
+ *
+ * \sa run()
+ */
+bool Tee::run_file(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    auto close_fd = finally([&]{
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+    });
+
+    return run(fd);
+}
+
+/*!
+ * \brief Number of bytes read by the last call to run()
+ */
+uint64_t Tee::bytes() const
+{
+    return _bytes;
+}
+
+bool Tee::write_sinks(const unsigned char *data, std::size_t size)
+{
+    for (Sha1Sink &sink : _sha1_sinks) {
+        if (!SHA1_Update(&sink.ctx, data, size)) {
+            LOGE("openssl: SHA1_Update() failed");
+            errno = EINVAL;
+            return false;
+        }
+    }
+
+    for (Sha512Sink &sink : _sha512_sinks) {
+        if (!SHA512_Update(&sink.ctx, data, size)) {
+            LOGE("openssl: SHA512_Update() failed");
+            errno = EINVAL;
+            return false;
+        }
+    }
+
+    for (int fd : _fd_sinks) {
+        const unsigned char *ptr = data;
+        std::size_t remaining = size;
+
+        while (remaining > 0) {
+            ssize_t n = write(fd, ptr, remaining);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            ptr += n;
+            remaining -= n;
+        }
+    }
+
+    for (std::vector<unsigned char> *buf : _buffer_sinks) {
+        buf->insert(buf->end(), data, data + size);
+    }
+
+    return true;
+}
+
+}
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <cstdint>
+
+#include <openssl/sha.h>
+
+#include "util/progress.h"
+
+namespace mb
+{
+namespace util
+{
+
+// Reads a source once and passes the data to any number of sinks
+class Tee
+{
+public:
+    void add_sha1(unsigned char digest[SHA_DIGEST_LENGTH]);
+    void add_sha512(unsigned char digest[SHA512_DIGEST_LENGTH]);
+    void add_fd(int fd);
+    void add_buffer(std::vector<unsigned char> *buf);
+
+    void set_progress(Progress *progress);
+
+    bool run(int fd_source);
+    bool run_file(const std::string &path);
+
+    uint64_t bytes() const;
+
+private:
+    struct Sha1Sink
+    {
+        SHA_CTX ctx;
+        unsigned char *digest;
+    };
+
+    struct Sha512Sink
+    {
+        SHA512_CTX ctx;
+        unsigned char *digest;
+    };
+
+    std::vector<Sha1Sink> _sha1_sinks;
+    std::vector<Sha512Sink> _sha512_sinks;
+    std::vector<int> _fd_sinks;
+    std::vector<std::vector<unsigned char> *> _buffer_sinks;
+    uint64_t _bytes = 0;
+    Progress *_progress = nullptr;
+
+    bool write_sinks(const unsigned char *data, std::size_t size);
+};
+
+}
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "util/threadpool.h"
+
+#include <cstring>
+
+#include <unistd.h>
+
+#include "util/logging.h"
+
+namespace mb
+{
+namespace util
+{
+
+/*!
+ * \brief Start \a threads worker threads
+ *
+ * \param threads Number of threads (0 uses default_threads())
+ * \param max_queued Maximum number of tasks waiting to run. submit() blocks
+ *                   while the queue is full.
+ */
+ThreadPool::ThreadPool(unsigned int threads, std::size_t max_queued)
+    : _max_queued(max_queued == 0 ? 1 : max_queued)
+{
+    pthread_mutex_init(&_mutex, nullptr);
+    pthread_cond_init(&_cond_task, nullptr);
+    pthread_cond_init(&_cond_done, nullptr);
+
+    if (threads == 0) {
+        threads = default_threads();
+    }
+
+    _threads.reserve(threads);
+    for (unsigned int i = 0; i < threads; ++i) {
+        pthread_t thread;
+        int ret = pthread_create(&thread, nullptr, &thread_main, this);
+        if (ret != 0) {
+            LOGW("Failed to create worker thread: %s", strerror(ret));
+            break;
+        }
+        _threads.push_back(thread);
+    }
+}
+
+/*!
+ * \brief Run the remaining tasks and stop the worker threads
+ */
+ThreadPool::~ThreadPool()
+{
+    pthread_mutex_lock(&_mutex);
+    _stop = true;
+    pthread_cond_broadcast(&_cond_task);
+    pthread_mutex_unlock(&_mutex);
+
+    for (pthread_t thread : _threads) {
+        pthread_join(thread, nullptr);
+    }
+
+    pthread_cond_destroy(&_cond_done);
+    pthread_cond_destroy(&_cond_task);
+    pthread_mutex_destroy(&_mutex);
+}
+
+unsigned int ThreadPool::threads() const
+{
+    return _threads.size();
+}
+
+/*!
+ * \brief Queue a task
+ *
+ * If no worker threads could be started, the task is run immediately on the
+ * calling thread.
+ */
+void ThreadPool::submit(Task task)
+{
+    if (_threads.empty()) {
+        task();
+        return;
+    }
+
+    pthread_mutex_lock(&_mutex);
+    while (_queue.size() >= _max_queued) {
+        pthread_cond_wait(&_cond_done, &_mutex);
+    }
+    _queue.push_back(std::move(task));
+    ++_pending;
+    pthread_cond_signal(&_cond_task);
+    pthread_mutex_unlock(&_mutex);
+}
+
+/*!
+ * \brief Queue a task if there is room for it
+ *
+ * Unlike submit(), this never blocks, so it is safe to call from a task that
+ * is running on the pool.
+ *
+ * \return True if the task was queued. False if the queue is full or there are
+ *         no worker threads, in which case the caller should run the task
+ *         itself.
+ */
+bool ThreadPool::try_submit(Task task)
+{
+    if (_threads.empty()) {
+        return false;
+    }
+
+    pthread_mutex_lock(&_mutex);
+    bool queued = _queue.size() < _max_queued;
+    if (queued) {
+        _queue.push_back(std::move(task));
+        ++_pending;
+        pthread_cond_signal(&_cond_task);
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    return queued;
+}
+
+/*!
+ * \brief Wait for all queued and running tasks to finish
+ */
+void ThreadPool::wait()
+{
+    pthread_mutex_lock(&_mutex);
+    while (_pending > 0) {
+        pthread_cond_wait(&_cond_done, &_mutex);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+/*!
+ * \brief Number of threads to use for I/O bound work
+ *
+ * This is the number of online CPUs, limited to between 2 and 8.
+ */
+unsigned int ThreadPool::default_threads()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 2) {
+        return 2;
+    } else if (n > 8) {
+        return 8;
+    }
+    return n;
+}
+
+void * ThreadPool::thread_main(void *userdata)
+{
+    static_cast<ThreadPool *>(userdata)->run_tasks();
+    return nullptr;
+}
+
+void ThreadPool::run_tasks()
+{
+    pthread_mutex_lock(&_mutex);
+
+    while (true) {
+        while (_queue.empty() && !_stop) {
+            pthread_cond_wait(&_cond_task, &_mutex);
+        }
+        if (_queue.empty()) {
+            break;
+        }
+
+        Task task = std::move(_queue.front());
+        _queue.pop_front();
+        // Wake up submit() if it is waiting for space
+        pthread_cond_broadcast(&_cond_done);
+        pthread_mutex_unlock(&_mutex);
+
+        task();
+
+        pthread_mutex_lock(&_mutex);
+        --_pending;
+        pthread_cond_broadcast(&_cond_done);
+    }
+
+    pthread_mutex_unlock(&_mutex);
+}
+
+}
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2015  Andrew Gunnerson <andrewgunnerson@gmail.com>
+ *
+ * This file is part of MultiBootPatcher
+ *
+ * MultiBootPatcher is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * MultiBootPatcher is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MultiBootPatcher.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include <pthread.h>
+
+namespace mb
+{
+namespace util
+{
+
+// Fixed-size pool of worker threads with a bounded task queue
+class ThreadPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    ThreadPool(unsigned int threads, std::size_t max_queued);
+    ~ThreadPool();
+
+    unsigned int threads() const;
+
+    void submit(Task task);
+    bool try_submit(Task task);
+    void wait();
+
+    static unsigned int default_threads();
+
+private:
+    std::vector<pthread_t> _threads;
+    std::deque<Task> _queue;
+    std::size_t _max_queued;
+    // Number of tasks that are queued or running
+    std::size_t _pending = 0;
+    bool _stop = false;
+
+    pthread_mutex_t _mutex;
+    // Signalled when a task is queued or the pool is stopping
+    pthread_cond_t _cond_task;
+    // Signalled when a task is dequeued or finishes
+    pthread_cond_t _cond_done;
+
+    static void * thread_main(void *userdata);
+    void run_tasks();
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool & operator=(const ThreadPool &) = delete;
+};
+
+}
+}
@@ -33,5 +33,13 @@ uint64_t current_time_ms()
     return 1000u * res.tv_sec + res.tv_nsec / 1e6;
 }
 
+// Milliseconds since boot (not counting time spent suspended)
+uint64_t monotonic_time_ms()
+{
+    struct timespec res;
+    clock_gettime(CLOCK_MONOTONIC, &res);
+    return 1000u * res.tv_sec + res.tv_nsec / 1000000;
+}
+
 }
 }
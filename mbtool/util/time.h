@@ -27,6 +27,7 @@ namespace util
 {
 
 uint64_t current_time_ms();
+uint64_t monotonic_time_ms();
 
 }
 }
@@ -126,7 +126,7 @@ static bool utilities_wipe_system(const std::string &rom_id)
         return false;
     }
 
-    return wipe_system(rom);
+    return wipe_system(rom, false);
 }
 
 static bool utilities_wipe_cache(const std::string &rom_id)
@@ -136,7 +136,7 @@ static bool utilities_wipe_cache(const std::string &rom_id)
         return false;
     }
 
-    return wipe_cache(rom);
+    return wipe_cache(rom, false);
 }
 
 static bool utilities_wipe_data(const std::string &rom_id)
@@ -146,7 +146,7 @@ static bool utilities_wipe_data(const std::string &rom_id)
         return false;
     }
 
-    return wipe_data(rom);
+    return wipe_data(rom, false);
 }
 
 static bool utilities_wipe_dalvik_cache(const std::string &rom_id)
@@ -156,7 +156,7 @@ static bool utilities_wipe_dalvik_cache(const std::string &rom_id)
         return false;
     }
 
-    return wipe_dalvik_cache(rom);
+    return wipe_dalvik_cache(rom, false);
 }
 
 static bool utilities_wipe_multiboot(const std::string &rom_id)
@@ -166,7 +166,7 @@ static bool utilities_wipe_multiboot(const std::string &rom_id)
         return false;
     }
 
-    return wipe_multiboot(rom);
+    return wipe_multiboot(rom, false);
 }
 
 static void generate_aroma_config(std::vector<unsigned char> *data)
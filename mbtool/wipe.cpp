@@ -70,10 +70,12 @@ static bool log_wipe_file(const std::string &path)
  *
  * \param mountpoint Mountpoint root to wipe
  * \param wipe_media Whether the first-level "media" path should be deleted
+ * \param background Whether to finish the deletion in the background
  *
  * \return True if the path was wiped or doesn't exist. False, otherwise
  */
-static bool log_wipe_directory(const std::string &mountpoint, bool wipe_media)
+static bool log_wipe_directory(const std::string &mountpoint, bool wipe_media,
+                               bool background)
 {
     LOGV("Wiping directory %s%s", mountpoint.c_str(),
          wipe_media ? "" : " (excluding media directory)");
@@ -93,20 +95,26 @@ static bool log_wipe_directory(const std::string &mountpoint, bool wipe_media)
         return false;
     }
 
-    bool ret = wipe_directory(mountpoint, wipe_media);
+    bool ret = wipe_directory(mountpoint, wipe_media, background);
     LOGV("-> %s", ret ? "Succeeded" : "Failed");
     return ret;
 }
 
-static bool log_delete_recursive(const std::string &path)
+static bool log_delete_recursive(const std::string &path, bool background)
 {
     LOGV("Recursively deleting %s", path.c_str());
-    bool ret = util::delete_recursive(path);
+
+    int flags = util::DELETE_PARALLEL;
+    if (background) {
+        flags |= util::DELETE_IN_BACKGROUND;
+    }
+
+    bool ret = util::delete_recursive(path, flags, {}, nullptr);
     LOGV("-> %s", ret ? "Succeeded" : "Failed");
     return ret;
 }
 
-bool wipe_system(const std::shared_ptr<Rom> &rom)
+bool wipe_system(const std::shared_ptr<Rom> &rom, bool background)
 {
     std::string path = rom->full_system_path();
     if (path.empty()) {
@@ -118,14 +126,14 @@ bool wipe_system(const std::shared_ptr<Rom> &rom)
     if (rom->system_is_image) {
         ret = log_wipe_file(path);
     } else {
-        ret = log_wipe_directory(path, true);
+        ret = log_wipe_directory(path, true, background);
         // Try removing ROM's /system if it's empty
         remove(path.c_str());
     }
     return ret;
 }
 
-bool wipe_cache(const std::shared_ptr<Rom> &rom)
+bool wipe_cache(const std::shared_ptr<Rom> &rom, bool background)
 {
     std::string path = rom->full_cache_path();
     if (path.empty()) {
@@ -137,14 +145,14 @@ bool wipe_cache(const std::shared_ptr<Rom> &rom)
     if (rom->cache_is_image) {
         ret = log_wipe_file(path);
     } else {
-        ret = log_wipe_directory(path, true);
+        ret = log_wipe_directory(path, true, background);
         // Try removing ROM's /cache if it's empty
         remove(path.c_str());
     }
     return ret;
 }
 
-bool wipe_data(const std::shared_ptr<Rom> &rom)
+bool wipe_data(const std::shared_ptr<Rom> &rom, bool background)
 {
     std::string path = rom->full_data_path();
     if (path.empty()) {
@@ -156,7 +164,7 @@ bool wipe_data(const std::shared_ptr<Rom> &rom)
     if (rom->data_is_image) {
         ret = log_wipe_file(path);
     } else {
-        ret = log_wipe_directory(path, false);
+        ret = log_wipe_directory(path, false, background);
         // Try removing ROM's /data/media and /data if they're empty
         remove((path + "/media").c_str());
         remove(path.c_str());
@@ -164,7 +172,7 @@ bool wipe_data(const std::shared_ptr<Rom> &rom)
     return ret;
 }
 
-bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom)
+bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom, bool background)
 {
     if (rom->data_is_image || rom->cache_is_image) {
         LOGE("Wiping dalvik-cache for ROMs that use data or cache images is "
@@ -191,16 +199,16 @@ bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom)
     // util::delete_recursive() returns true if the path does not
     // exist (ie. returns false only on errors), which is exactly
     // what we want
-    return log_delete_recursive(data_path)
-            && log_delete_recursive(cache_path);
+    return log_delete_recursive(data_path, background)
+            && log_delete_recursive(cache_path, background);
 }
 
-bool wipe_multiboot(const std::shared_ptr<Rom> &rom)
+bool wipe_multiboot(const std::shared_ptr<Rom> &rom, bool background)
 {
     // Delete /data/media/0/MultiBoot/[ROM ID]
     std::string multiboot_path("/data/media/0/MultiBoot/");
     multiboot_path += rom->id;
-    return log_delete_recursive(multiboot_path);
+    return log_delete_recursive(multiboot_path, background);
 }
 
 }
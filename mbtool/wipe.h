@@ -24,10 +24,10 @@
 namespace mb
 {
 
-bool wipe_system(const std::shared_ptr<Rom> &rom);
-bool wipe_cache(const std::shared_ptr<Rom> &rom);
-bool wipe_data(const std::shared_ptr<Rom> &rom);
-bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom);
-bool wipe_multiboot(const std::shared_ptr<Rom> &rom);
+bool wipe_system(const std::shared_ptr<Rom> &rom, bool background);
+bool wipe_cache(const std::shared_ptr<Rom> &rom, bool background);
+bool wipe_data(const std::shared_ptr<Rom> &rom, bool background);
+bool wipe_dalvik_cache(const std::shared_ptr<Rom> &rom, bool background);
+bool wipe_multiboot(const std::shared_ptr<Rom> &rom, bool background);
 
 }
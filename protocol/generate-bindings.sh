@@ -15,6 +15,7 @@ files=(
     v2/chmod.fbs
     v2/loki_patch.fbs
     v2/wipe_rom.fbs
+    v2/transfer.fbs
     request.fbs
     response.fbs
 )